@@ -98,6 +98,20 @@ enum uvc_frame_format {
 #define UVC_COLOR_FORMAT_GRAY8 UVC_FRAME_FORMAT_GRAY8
 #define UVC_COLOR_FORMAT_GRAY16 UVC_FRAME_FORMAT_GRAY16
 
+/** Color matrix and quantization range for YUV to RGB conversion */
+enum uvc_colorimetry {
+  /** ITU-R BT.601 matrix, full range (JFIF style, the historic default) */
+  UVC_COLORIMETRY_BT601_FULL = 0,
+  /** ITU-R BT.601 matrix, limited range (Y 16..235, C 16..240) */
+  UVC_COLORIMETRY_BT601_LIMITED,
+  /** ITU-R BT.709 matrix, full range */
+  UVC_COLORIMETRY_BT709_FULL,
+  /** ITU-R BT.709 matrix, limited range (Y 16..235, C 16..240) */
+  UVC_COLORIMETRY_BT709_LIMITED,
+  /** Number of colorimetries understood */
+  UVC_COLORIMETRY_COUNT,
+};
+
 /** VideoStreaming interface descriptor subtype (A.6) */
 enum uvc_vs_desc_subtype {
   UVC_VS_UNDEFINED = 0x00,
@@ -191,6 +205,10 @@ typedef struct uvc_format_desc {
   uint8_t bmInterlaceFlags;
   uint8_t bCopyProtect;
   uint8_t bVariableSize;
+  /** Color matching descriptor (VS_COLORFORMAT), zero if absent */
+  uint8_t bColorPrimaries;
+  uint8_t bTransferCharacteristics;
+  uint8_t bMatrixCoefficients;
   /** Available frame specifications for this format */
   struct uvc_frame_desc *frame_descs;
 } uvc_format_desc_t;
@@ -322,6 +340,15 @@ typedef struct uvc_device_handle uvc_device_handle_t;
 struct uvc_stream_handle;
 typedef struct uvc_stream_handle uvc_stream_handle_t;
 
+/** Log file of raw stream payloads.
+ *
+ * Get one of these from uvc_payload_log_open(), attach it to a device
+ * with uvc_set_payload_log() and feed the file back through the frame
+ * assembly with uvc_replay_payloads().
+ */
+struct uvc_payload_log;
+typedef struct uvc_payload_log uvc_payload_log_t;
+
 /** Representation of the interface that brings data into the UVC device */
 typedef struct uvc_input_terminal {
   struct uvc_input_terminal *prev, *next;
@@ -422,6 +449,30 @@ typedef struct uvc_device_descriptor {
 /** An image frame received from the UVC device
  * @ingroup streaming
  */
+/** Result of the sanity check of an assembled frame
+ * @ingroup frame
+ */
+enum uvc_frame_status {
+  /** Frame looks complete */
+  UVC_FRAME_OK = 0,
+  /** Uncompressed frame with a size not matching width and height */
+  UVC_FRAME_BAD_SIZE,
+  /** MJPEG frame not starting with a start of image marker */
+  UVC_FRAME_NO_SOI,
+  /** MJPEG frame without a start of frame marker before the scan */
+  UVC_FRAME_NO_SOF,
+  /** MJPEG frame with lost data or ended by a FID flip, without end of
+   * image marker, i.e. truncated */
+  UVC_FRAME_NO_EOI,
+  /** MJPEG frame with broken marker segments before the scan */
+  UVC_FRAME_BAD_MARKER
+};
+
+/** Number of data gaps recorded per frame
+ * @ingroup frame
+ */
+#define UVC_FRAME_MAX_GAPS 16
+
 typedef struct uvc_frame {
   /** Image data for this frame */
   void *data;
@@ -439,6 +490,28 @@ typedef struct uvc_frame {
   uint32_t sequence;
   /** Estimate of system time when the device started capturing the image */
   struct timeval capture_time;
+  /** Presentation time stamp from the payload header (device clock), 0 if none */
+  uint32_t pts;
+  /** Source clock reference from the payload header (device clock), 0 if none */
+  uint32_t scr;
+  /** Host CLOCK_MONOTONIC time in nanoseconds matching capture_time */
+  int64_t capture_mono;
+  /** Non-zero when capture_time was derived from PTS by the clock model,
+   * zero when it is the arrival time of the first payload */
+  uint8_t clock_model;
+  /** Host CLOCK_MONOTONIC time in nanoseconds the first and the last payload
+   * of the frame arrived, only set on frames handed out by a stream */
+  int64_t sof_mono, eof_mono;
+  /** Sanity check of the frame's data, only set on frames handed out by
+   * a stream, which delivers corrupt frames, too */
+  enum uvc_frame_status status;
+  /** Number of places where payload data of the frame was lost (bad
+   * isochronous packets, payloads with error bit or bogus header), only
+   * set on frames handed out by a stream */
+  uint32_t num_gaps;
+  /** Offsets into data where the lost data belonged, for the first
+   * UVC_FRAME_MAX_GAPS gaps */
+  uint32_t gaps[UVC_FRAME_MAX_GAPS];
   /** Handle on the device that produced the image.
    * @warning You must not call any uvc_* functions during a callback. */
   uvc_device_handle_t *source;
@@ -456,6 +529,37 @@ typedef struct uvc_frame {
  */
 typedef void(uvc_frame_callback_t)(struct uvc_frame *frame, void *user_ptr);
 
+/** Transfer and payload counters of a stream, counted by the USB event
+ * thread while it holds the stream's callback lock anyway
+ * @ingroup streaming
+ */
+typedef struct uvc_stream_stats {
+  /** Transfers completed */
+  uint64_t transfers;
+  /** Transfers resubmitted after timeout, stall or overflow */
+  uint64_t retried;
+  /** Isochronous packets with bad status */
+  uint64_t bad_packets;
+  /** Payloads with the error bit set in the header */
+  uint64_t error_bit;
+  /** Payloads with a header length beyond the payload */
+  uint64_t bogus;
+  /** Frames ended by a FID flip without EOF */
+  uint64_t fid_no_eof;
+  /** Zero-length payloads */
+  uint64_t empty;
+  /** Frames assembled */
+  uint64_t frames;
+  /** Image data bytes received */
+  uint64_t bytes;
+  /** Assembled frames failing the sanity check, per uvc_frame_status */
+  uint64_t bad_size;
+  uint64_t no_soi;
+  uint64_t no_sof;
+  uint64_t no_eoi;
+  uint64_t bad_marker;
+} uvc_stream_stats_t;
+
 /** Streaming mode, includes all information needed to select stream
  * @ingroup streaming
  */
@@ -582,6 +686,18 @@ uvc_error_t uvc_stream_get_frame(
 );
 uvc_error_t uvc_stream_stop(uvc_stream_handle_t *strmh);
 void uvc_stream_close(uvc_stream_handle_t *strmh);
+uvc_error_t uvc_stream_get_stats(uvc_stream_handle_t *strmh,
+    uvc_stream_stats_t *stats);
+uvc_error_t uvc_get_stream_stats(uvc_device_handle_t *devh,
+    uvc_stream_stats_t *stats);
+uvc_error_t uvc_payload_log_open(const char *path, uvc_payload_log_t **logp);
+void uvc_payload_log_close(uvc_payload_log_t *log);
+uvc_error_t uvc_set_payload_log(uvc_device_handle_t *devh,
+    uvc_payload_log_t *log);
+uvc_error_t uvc_replay_payloads(const char *path,
+    uvc_frame_callback_t *cb,
+    void *user_ptr,
+    uvc_stream_stats_t *stats);
 
 int uvc_get_ctrl_len(uvc_device_handle_t *devh, uint8_t unit, uint8_t ctrl);
 int uvc_get_ctrl(uvc_device_handle_t *devh, uint8_t unit, uint8_t ctrl, void *data, int len, enum uvc_req_code req_code);
@@ -722,6 +838,16 @@ void uvc_free_frame(uvc_frame_t *frame);
 
 uvc_error_t uvc_duplicate_frame(uvc_frame_t *in, uvc_frame_t *out);
 
+enum uvc_colorimetry uvc_format_colorimetry(uvc_format_desc_t *format);
+
+uvc_error_t uvc_yuyv2rgb_ex(uvc_frame_t *in, uvc_frame_t *out, enum uvc_colorimetry cm);
+uvc_error_t uvc_uyvy2rgb_ex(uvc_frame_t *in, uvc_frame_t *out, enum uvc_colorimetry cm);
+uvc_error_t uvc_any2rgb_ex(uvc_frame_t *in, uvc_frame_t *out, enum uvc_colorimetry cm);
+
+uvc_error_t uvc_yuyv2bgr_ex(uvc_frame_t *in, uvc_frame_t *out, enum uvc_colorimetry cm);
+uvc_error_t uvc_uyvy2bgr_ex(uvc_frame_t *in, uvc_frame_t *out, enum uvc_colorimetry cm);
+uvc_error_t uvc_any2bgr_ex(uvc_frame_t *in, uvc_frame_t *out, enum uvc_colorimetry cm);
+
 uvc_error_t uvc_yuyv2rgb(uvc_frame_t *in, uvc_frame_t *out);
 uvc_error_t uvc_uyvy2rgb(uvc_frame_t *in, uvc_frame_t *out);
 uvc_error_t uvc_any2rgb(uvc_frame_t *in, uvc_frame_t *out);
@@ -737,7 +863,11 @@ uvc_error_t uvc_gray16to8(uvc_frame_t *in, uvc_frame_t *out, int shift);
 
 #ifdef LIBUVC_HAVE_JPEG
 uvc_error_t uvc_mjpeg2rgb(uvc_frame_t *in, uvc_frame_t *out);
+uvc_error_t uvc_mjpeg2gray_dc(uvc_frame_t *in, uvc_frame_t *out);
+uvc_error_t uvc_mjpeg2rgb_conceal(uvc_frame_t *in, uvc_frame_t *out,
+    const uvc_frame_t *prev, uint32_t *concealed);
 uvc_error_t uvc_rgb2mjpeg(uvc_frame_t *in, uvc_frame_t *out);
+uvc_error_t uvc_rgb2mjpeg_q(uvc_frame_t *in, uvc_frame_t *out, int quality);
 #endif
 
 #ifdef __cplusplus
@@ -217,6 +217,28 @@ typedef struct uvc_device_info {
 
 #define LIBUVC_XFER_BUF_SIZE	( 16 * 1024 * 1024 )
 
+/** Number of SCR samples kept for the device clock model */
+#define LIBUVC_CLOCK_SAMPLES 32
+
+/** Model of the device clock (SCR/PTS) against host CLOCK_MONOTONIC.
+ * One sample per frame pairs the first SCR of the frame with the host
+ * time its payload arrived.
+ */
+struct uvc_clock_model {
+  /** Device clock frequency in Hz, zero if unknown */
+  uint32_t freq;
+  /** Last raw STC, to unwrap the 32 bit counter */
+  uint32_t last_stc;
+  /** Unwrapped value of last_stc */
+  int64_t stc;
+  /** Number of samples and next ring position */
+  int n, pos;
+  /** Unwrapped STC of samples */
+  int64_t x[LIBUVC_CLOCK_SAMPLES];
+  /** Host time of samples in nanoseconds */
+  int64_t y[LIBUVC_CLOCK_SAMPLES];
+};
+
 struct uvc_stream_handle {
   struct uvc_device_handle *devh;
   struct uvc_stream_handle *prev, *next;
@@ -233,6 +255,22 @@ struct uvc_stream_handle {
   uint32_t seq, hold_seq;
   uint32_t pts, hold_pts;
   uint32_t last_scr, hold_last_scr;
+  /** Host time (ns) when the first payload of the frame arrived */
+  int64_t sof_mono, hold_sof_mono;
+  /** Host time (ns) when the frame was complete */
+  int64_t hold_eof_mono;
+  /** Sanity check of the held frame */
+  enum uvc_frame_status hold_status;
+  /** Offsets of lost payload data in the current and held frame */
+  uint32_t num_gaps, hold_num_gaps;
+  uint32_t gaps[UVC_FRAME_MAX_GAPS], hold_gaps[UVC_FRAME_MAX_GAPS];
+  /** Host time (ns) when the current payload arrived */
+  int64_t payload_mono;
+  /** SCR of the current frame already sampled */
+  uint8_t scr_sampled;
+  struct uvc_clock_model clock;
+  /** Counters, updated with cb_mutex held */
+  struct uvc_stream_stats stats;
   size_t got_bytes, hold_bytes;
   uint8_t *outbuf, *holdbuf;
   pthread_mutex_t cb_mutex;
@@ -246,6 +284,19 @@ struct uvc_stream_handle {
   uint8_t transfer_flags[LIBUVC_NUM_TRANSFER_BUFS];
   struct uvc_frame frame;
   enum uvc_frame_format frame_format;
+  uint16_t width, height;
+  /** Fed from a payload log by uvc_replay_payloads(), not from USB */
+  uint8_t replay;
+  /** Realtime minus monotonic clock (us) of the replayed capture */
+  int64_t replay_real;
+};
+
+/** Log of raw payloads, see uvc_payload_log_open() */
+struct uvc_payload_log {
+  FILE *fp;
+  pthread_mutex_t mutex;
+  /** Set on the first failed write, further records are dropped */
+  int error;
 };
 
 /** Handle on an open UVC device
@@ -271,6 +322,8 @@ struct uvc_device_handle {
   /** Whether the camera is an iSight that sends one header per frame */
   uint8_t is_isight;
   uint32_t claimed;
+  /** Payloads of all streams are logged here if set */
+  struct uvc_payload_log *payload_log;
 };
 
 /** Context within which we communicate with devices */
@@ -98,6 +98,9 @@ uvc_error_t uvc_parse_vs_frame_frame(uvc_streaming_interface_t *stream_if,
 uvc_error_t uvc_parse_vs_input_header(uvc_streaming_interface_t *stream_if,
 				      const unsigned char *block,
 				      size_t block_size);
+uvc_error_t uvc_parse_vs_color_format(uvc_streaming_interface_t *stream_if,
+				      const unsigned char *block,
+				      size_t block_size);
 
 void LIBUSB_CALL _uvc_status_callback(struct libusb_transfer *transfer);
 
@@ -1446,6 +1449,34 @@ uvc_error_t uvc_parse_vs_format_mjpeg(uvc_streaming_interface_t *stream_if,
   return UVC_SUCCESS;
 }
 
+/** @internal
+ * @brief Parse a VideoStreaming color matching block.
+ * @ingroup device
+ *
+ * The color matching descriptor applies to the format preceding it.
+ */
+uvc_error_t uvc_parse_vs_color_format(uvc_streaming_interface_t *stream_if,
+				      const unsigned char *block,
+				      size_t block_size) {
+  uvc_format_desc_t *format;
+
+  UVC_ENTER();
+
+  if (stream_if->format_descs == NULL || block_size < 6) {
+    UVC_DEBUG("ignoring stray or short VS_COLORFORMAT descriptor");
+    UVC_EXIT(UVC_SUCCESS);
+    return UVC_SUCCESS;
+  }
+
+  format = stream_if->format_descs->prev;
+  format->bColorPrimaries = block[3];
+  format->bTransferCharacteristics = block[4];
+  format->bMatrixCoefficients = block[5];
+
+  UVC_EXIT(UVC_SUCCESS);
+  return UVC_SUCCESS;
+}
+
 /** @internal
  * @brief Parse a VideoStreaming uncompressed frame block.
  * @ingroup device
@@ -1594,7 +1625,7 @@ uvc_error_t uvc_parse_vs(
     UVC_DEBUG("unsupported descriptor subtype VS_FORMAT_DV");
     break;
   case UVC_VS_COLORFORMAT:
-    UVC_DEBUG("unsupported descriptor subtype VS_COLORFORMAT");
+    ret = uvc_parse_vs_color_format(stream_if, block, block_size);
     break;
   case UVC_VS_FORMAT_FRAME_BASED:
     ret = uvc_parse_vs_frame_format(stream_if, block, block_size);
@@ -181,6 +181,10 @@ uvc_error_t uvc_mjpeg2rgb(uvc_frame_t *in, uvc_frame_t *out) {
   out->step = in->width * 3;
   out->sequence = in->sequence;
   out->capture_time = in->capture_time;
+  out->pts = in->pts;
+  out->scr = in->scr;
+  out->capture_mono = in->capture_mono;
+  out->clock_model = in->clock_model;
   out->source = in->source;
 
   dinfo.err = jpeg_std_error(&jerr.super);
@@ -224,6 +228,323 @@ fail:
   return UVC_ERROR_OTHER;
 }
 
+/** Geometry of a baseline JPEG as needed to locate restart intervals */
+struct _mjpeg_layout {
+  /** Offset of the entropy coded data of the (single) scan */
+  size_t scan;
+  unsigned int width, height;
+  /** Size of an MCU in pixels */
+  unsigned int mcu_w, mcu_h;
+  /** MCUs per restart interval, 0 without restart markers */
+  unsigned int restart;
+};
+
+/** @internal
+ * @brief Parse the marker segments of a baseline JPEG up to the scan
+ */
+static int _mjpeg_layout(const uint8_t *buf, size_t len, struct _mjpeg_layout *l) {
+  size_t pos = 2, seglen;
+  unsigned int i, nc, h, v;
+  uint8_t m;
+
+  memset(l, 0, sizeof(*l));
+  if (len < 4 || buf[0] != 0xff || buf[1] != 0xd8)
+    return -1;
+
+  while (pos + 4 <= len) {
+    if (buf[pos] != 0xff)
+      return -1;
+    m = buf[pos + 1];
+    if (m == 0xff) {
+      pos++;
+      continue;
+    }
+    seglen = (buf[pos + 2] << 8) | buf[pos + 3];
+    if (seglen < 2 || pos + 2 + seglen > len)
+      return -1;
+    switch (m) {
+    case 0xc0: case 0xc1:
+      nc = (seglen >= 8) ? buf[pos + 9] : 0;
+      if (nc == 0 || seglen < 8 + 3 * nc)
+        return -1;
+      l->height = (buf[pos + 5] << 8) | buf[pos + 6];
+      l->width = (buf[pos + 7] << 8) | buf[pos + 8];
+      l->mcu_w = l->mcu_h = 8;
+      for (i = 0; nc > 1 && i < nc; i++) {
+        h = buf[pos + 11 + 3 * i] >> 4;
+        v = buf[pos + 11 + 3 * i] & 0x0f;
+        if (8 * h > l->mcu_w)
+          l->mcu_w = 8 * h;
+        if (8 * v > l->mcu_h)
+          l->mcu_h = 8 * v;
+      }
+      break;
+    case 0xc2: case 0xc3: case 0xc5: case 0xc6: case 0xc7:
+    case 0xc9: case 0xca: case 0xcb: case 0xcd: case 0xce: case 0xcf:
+      return -1;  /* progressive, lossless, arithmetic */
+    case 0xdd:
+      if (seglen < 4)
+        return -1;
+      l->restart = (buf[pos + 4] << 8) | buf[pos + 5];
+      break;
+    case 0xda:
+      if (l->width == 0 || l->height == 0)
+        return -1;
+      l->scan = pos + 2 + seglen;
+      return 0;
+    }
+    pos += 2 + seglen;
+  }
+  return -1;
+}
+
+/** @brief Convert an MJPEG frame with lost data to RGB
+ * @ingroup frame
+ *
+ * Splits the scan of a JPEG with restart markers into its restart
+ * intervals. Intervals which are missing, truncated, merged with another
+ * interval, or hold one of the frame's data gaps are left out of the
+ * decode, and their MCUs are filled from the previous frame if one of the
+ * same size is given, otherwise they stay gray. Truncated frames without
+ * restart markers are decoded as by uvc_mjpeg2rgb().
+ *
+ * @param in MJPEG frame, usually with gaps or truncated
+ * @param out RGB frame
+ * @param prev Previous RGB frame to conceal damage with, or NULL
+ * @param[out] concealed Number of restart intervals concealed
+ * @return UVC_ERROR_NOT_SUPPORTED if the frame has gaps but no restart markers
+ */
+uvc_error_t uvc_mjpeg2rgb_conceal(uvc_frame_t *in, uvc_frame_t *out,
+    const uvc_frame_t *prev, uint32_t *concealed) {
+  const uint8_t *data = in->data;
+  size_t len = in->data_bytes, pos, start, n;
+  struct _mjpeg_layout l;
+  unsigned int mcu_cols, mcus, nint, k, j, skip, end, c0, c1, x0, x1, y, y1;
+  size_t *ist = NULL, *ien = NULL;
+  uint8_t *bad = NULL, *buf = NULL, m;
+  uint32_t g;
+  int ended = 0;
+  uvc_frame_t tmp;
+  uvc_error_t ret;
+
+  *concealed = 0;
+  if (in->frame_format != UVC_FRAME_FORMAT_MJPEG)
+    return UVC_ERROR_INVALID_PARAM;
+  if (_mjpeg_layout(data, len, &l) < 0)
+    return UVC_ERROR_INVALID_PARAM;
+  if (l.restart == 0) {
+    /* a gap shifts all following data, only a lost tail is harmless */
+    if (in->num_gaps > 0)
+      return UVC_ERROR_NOT_SUPPORTED;
+    return uvc_mjpeg2rgb(in, out);
+  }
+  if (l.width != in->width || l.height != in->height)
+    return UVC_ERROR_INVALID_PARAM;
+
+  mcu_cols = (l.width + l.mcu_w - 1) / l.mcu_w;
+  mcus = mcu_cols * ((l.height + l.mcu_h - 1) / l.mcu_h);
+  nint = (mcus + l.restart - 1) / l.restart;
+  bad = calloc(nint, 1);
+  ist = calloc(nint, sizeof(*ist));
+  ien = calloc(nint, sizeof(*ien));
+  buf = malloc(len + 2 * nint + 2);
+  if (!bad || !ist || !ien || !buf) {
+    ret = UVC_ERROR_NO_MEM;
+    goto done;
+  }
+
+  /* find the restart markers; a jump in their numbering means that
+   * data across a marker was lost, merging two intervals */
+  k = 0;
+  start = l.scan;
+  for (pos = l.scan; pos + 1 < len && k < nint; pos++) {
+    if (data[pos] != 0xff)
+      continue;
+    m = data[pos + 1];
+    if (m == 0x00 || m == 0xff)
+      continue;   /* stuffed byte, fill byte */
+    if (m < 0xd0 || m > 0xd7) {
+      ended = (m == 0xd9);
+      break;
+    }
+    ist[k] = start;
+    ien[k] = pos;
+    skip = ((m - 0xd0) - k) & 7;
+    for (j = 0; skip && j <= skip && k + j < nint; j++)
+      bad[k + j] = 1;
+    k += skip + 1;
+    start = pos + 2;
+    pos++;
+  }
+  if (k < nint) {
+    ist[k] = start;
+    ien[k] = ended ? pos : len;
+    /* truncated, or intervals missing at the end */
+    for (j = ended ? k + 1 : k; j < nint; j++)
+      bad[j] = 1;
+  }
+
+  /* intervals holding lost data */
+  for (g = 0; g < in->num_gaps && g < UVC_FRAME_MAX_GAPS; g++) {
+    for (k = 0; k < nint; k++) {
+      if (!bad[k] && ien[k] > 0 && in->gaps[g] >= ist[k] &&
+          in->gaps[g] < ien[k] + 2)
+        bad[k] = 1;
+    }
+  }
+  if (in->num_gaps > UVC_FRAME_MAX_GAPS) {
+    /* untracked gaps are somewhere after the last tracked one */
+    for (k = 0; k < nint; k++) {
+      if (ien[k] + 2 > in->gaps[UVC_FRAME_MAX_GAPS - 1])
+        bad[k] = 1;
+    }
+  }
+
+  /* reassemble with empty intervals in place of the damaged ones */
+  memcpy(buf, data, l.scan);
+  n = l.scan;
+  for (k = 0; k < nint; k++) {
+    if (!bad[k]) {
+      memcpy(buf + n, data + ist[k], ien[k] - ist[k]);
+      n += ien[k] - ist[k];
+    }
+    if (k < nint - 1) {
+      buf[n++] = 0xff;
+      buf[n++] = 0xd0 + (k & 7);
+    }
+  }
+  buf[n++] = 0xff;
+  buf[n++] = 0xd9;
+
+  tmp = *in;
+  tmp.data = buf;
+  tmp.data_bytes = n;
+  ret = uvc_mjpeg2rgb(&tmp, out);
+  if (ret != UVC_SUCCESS)
+    goto done;
+
+  for (k = 0; k < nint; k++) {
+    if (!bad[k])
+      continue;
+    (*concealed)++;
+    if (!prev || prev->frame_format != UVC_FRAME_FORMAT_RGB ||
+        prev->width != out->width || prev->height != out->height)
+      continue;
+    j = k * l.restart;
+    end = j + l.restart;
+    if (end > mcus)
+      end = mcus;
+    while (j < end) {
+      /* run of MCUs within one MCU row */
+      c0 = j % mcu_cols;
+      c1 = c0 + (end - j);
+      if (c1 > mcu_cols)
+        c1 = mcu_cols;
+      x0 = c0 * l.mcu_w;
+      x1 = c1 * l.mcu_w;
+      if (x1 > out->width)
+        x1 = out->width;
+      y = (j / mcu_cols) * l.mcu_h;
+      y1 = y + l.mcu_h;
+      if (y1 > out->height)
+        y1 = out->height;
+      for (; y < y1; y++)
+        memcpy((uint8_t *) out->data + y * out->step + x0 * 3,
+               (uint8_t *) prev->data + y * prev->step + x0 * 3,
+               (x1 - x0) * 3);
+      j += c1 - c0;
+    }
+  }
+
+done:
+  free(bad);
+  free(ist);
+  free(ien);
+  free(buf);
+  return ret;
+}
+
+/** @brief Decode the luma plane of an MJPEG frame at 1/8 scale
+ * @ingroup frame
+ *
+ * Only the DC coefficients are used, thus this is much cheaper
+ * than a full decode.
+ *
+ * @param in MJPEG frame
+ * @param out GRAY8 frame of ceil(width/8) by ceil(height/8) pixels
+ */
+uvc_error_t uvc_mjpeg2gray_dc(uvc_frame_t *in, uvc_frame_t *out) {
+  struct jpeg_decompress_struct dinfo;
+  struct error_mgr jerr;
+  size_t lines_read;
+
+  if (in->frame_format != UVC_FRAME_FORMAT_MJPEG)
+    return UVC_ERROR_INVALID_PARAM;
+
+  if (uvc_ensure_frame_size(out, ((in->width + 7) / 8) * ((in->height + 7) / 8)) < 0)
+    return UVC_ERROR_NO_MEM;
+
+  out->width = (in->width + 7) / 8;
+  out->height = (in->height + 7) / 8;
+  out->frame_format = UVC_FRAME_FORMAT_GRAY8;
+  out->step = out->width;
+  out->sequence = in->sequence;
+  out->capture_time = in->capture_time;
+  out->pts = in->pts;
+  out->scr = in->scr;
+  out->capture_mono = in->capture_mono;
+  out->clock_model = in->clock_model;
+  out->source = in->source;
+
+  dinfo.err = jpeg_std_error(&jerr.super);
+  jerr.super.output_message = _output_message;
+  jerr.super.format_message = _format_message;
+  jerr.super.error_exit = _error_exit;
+
+  if (setjmp(jerr.jmp)) {
+    goto fail;
+  }
+
+  jpeg_create_decompress(&dinfo);
+  jpeg_mem_src(&dinfo, in->data, in->data_bytes);
+  jpeg_read_header(&dinfo, TRUE);
+
+  if (dinfo.dc_huff_tbl_ptrs[0] == NULL) {
+    /* This frame is missing the Huffman tables: fill in the standard ones */
+    insert_huff_tables(&dinfo);
+  }
+
+  dinfo.out_color_space = JCS_GRAYSCALE;
+  dinfo.scale_num = 1;
+  dinfo.scale_denom = 8;
+  dinfo.dct_method = JDCT_IFAST;
+  dinfo.do_fancy_upsampling = FALSE;
+
+  jpeg_start_decompress(&dinfo);
+
+  if (dinfo.output_width != out->width || dinfo.output_height != out->height) {
+    jpeg_abort_decompress(&dinfo);
+    goto fail;
+  }
+
+  lines_read = 0;
+  while (dinfo.output_scanline < dinfo.output_height) {
+    unsigned char *buffer[1] = {(unsigned char *) out->data + lines_read * out->step };
+    int num_scanlines;
+
+    num_scanlines = jpeg_read_scanlines(&dinfo, buffer, 1);
+    lines_read += num_scanlines;
+  }
+
+  jpeg_finish_decompress(&dinfo);
+  jpeg_destroy_decompress(&dinfo);
+  return 0;
+
+fail:
+  jpeg_destroy_decompress(&dinfo);
+  return UVC_ERROR_OTHER;
+}
+
 /** @brief Convert an RGB (or GRAY8) frame to MJPEG
  * @ingroup frame
  *
@@ -231,6 +552,17 @@ fail:
  * @param out MJPEG frame
  */
 uvc_error_t uvc_rgb2mjpeg(uvc_frame_t *in, uvc_frame_t *out) {
+  return uvc_rgb2mjpeg_q(in, out, 0);
+}
+
+/** @brief Convert an RGB (or GRAY8) frame to MJPEG with given quality
+ * @ingroup frame
+ *
+ * @param in RGB frame
+ * @param out MJPEG frame
+ * @param quality JPEG quality 1..100, or 0 for the library default
+ */
+uvc_error_t uvc_rgb2mjpeg_q(uvc_frame_t *in, uvc_frame_t *out, int quality) {
   struct _compr cinfo;
   struct error_mgr jerr;
   int ncomp = 1;
@@ -252,6 +584,10 @@ uvc_error_t uvc_rgb2mjpeg(uvc_frame_t *in, uvc_frame_t *out) {
   out->step = in->width * ncomp;
   out->sequence = in->sequence;
   out->capture_time = in->capture_time;
+  out->pts = in->pts;
+  out->scr = in->scr;
+  out->capture_mono = in->capture_mono;
+  out->clock_model = in->clock_model;
   out->source = in->source;
 
   cinfo.out = out;
@@ -276,6 +612,8 @@ uvc_error_t uvc_rgb2mjpeg(uvc_frame_t *in, uvc_frame_t *out) {
   cinfo.cinfo.image_height = in->height;
   cinfo.cinfo.input_components = ncomp;
   jpeg_set_defaults(&cinfo.cinfo);
+  if (quality > 0)
+    jpeg_set_quality(&cinfo.cinfo, quality, TRUE);
   cinfo.cinfo.dest = &cinfo.dmgr;
   jpeg_start_compress(&cinfo.cinfo, TRUE);
 
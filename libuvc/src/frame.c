@@ -116,6 +116,10 @@ uvc_error_t uvc_duplicate_frame(uvc_frame_t *in, uvc_frame_t *out) {
   out->step = in->step;
   out->sequence = in->sequence;
   out->capture_time = in->capture_time;
+  out->pts = in->pts;
+  out->scr = in->scr;
+  out->capture_mono = in->capture_mono;
+  out->clock_model = in->clock_model;
   out->source = in->source;
 
   memcpy(out->data, in->data, in->data_bytes);
@@ -123,6 +127,85 @@ uvc_error_t uvc_duplicate_frame(uvc_frame_t *in, uvc_frame_t *out) {
   return UVC_SUCCESS;
 }
 
+/** @internal
+ * Per-colorimetry YUV to RGB lookup tables in Q6 fixed point. Range
+ * expansion and matrix coefficients are folded into the tables, so the
+ * kernels below cost the same whatever colorimetry is selected.
+ */
+struct yuv_table {
+  int16_t y[256];
+  int16_t rv[256];
+  int16_t gu[256];
+  int16_t gv[256];
+  int16_t bu[256];
+};
+
+static struct yuv_table yuv_tables[UVC_COLORIMETRY_COUNT];
+static pthread_once_t yuv_tables_once = PTHREAD_ONCE_INIT;
+
+static void _uvc_init_yuv_tables(void) {
+  int cm, i;
+
+  for (cm = 0; cm < UVC_COLORIMETRY_COUNT; cm++) {
+    struct yuv_table *t = &yuv_tables[cm];
+    int bt709 = (cm == UVC_COLORIMETRY_BT709_FULL ||
+                 cm == UVC_COLORIMETRY_BT709_LIMITED);
+    int limited = (cm == UVC_COLORIMETRY_BT601_LIMITED ||
+                   cm == UVC_COLORIMETRY_BT709_LIMITED);
+    double kr = bt709 ? 0.2126 : 0.299;
+    double kb = bt709 ? 0.0722 : 0.114;
+    double kg = 1.0 - kr - kb;
+    double ys = limited ? 255.0 / 219.0 : 1.0;
+    double cs = limited ? 255.0 / 224.0 : 1.0;
+
+    for (i = 0; i < 256; i++) {
+      double y = ((limited ? i - 16 : i) * ys) * 64.0;
+      double c = ((i - 128) * cs) * 64.0;
+
+      /* rounding bias for the final >> 6 is carried by the luma entry */
+      t->y[i] = (int16_t) (y + (y < 0 ? -0.5 : 0.5)) + 32;
+      t->rv[i] = (int16_t) (2.0 * (1.0 - kr) * c);
+      t->gu[i] = (int16_t) (-2.0 * kb * (1.0 - kb) / kg * c);
+      t->gv[i] = (int16_t) (-2.0 * kr * (1.0 - kr) / kg * c);
+      t->bu[i] = (int16_t) (2.0 * (1.0 - kb) * c);
+    }
+  }
+}
+
+static const struct yuv_table *_uvc_yuv_table(enum uvc_colorimetry cm) {
+  pthread_once(&yuv_tables_once, _uvc_init_yuv_tables);
+  if ((unsigned) cm >= UVC_COLORIMETRY_COUNT)
+    cm = UVC_COLORIMETRY_BT601_FULL;
+  return &yuv_tables[cm];
+}
+
+/** @brief Colorimetry of a format from its color matching descriptor
+ * @ingroup frame
+ *
+ * Formats without a VS_COLORFORMAT descriptor report the historic
+ * full range BT.601 conversion. When the descriptor is present the
+ * stream is assumed to use limited (video) range.
+ *
+ * @param format Format descriptor
+ * @return Colorimetry to use when converting frames of this format
+ */
+enum uvc_colorimetry uvc_format_colorimetry(uvc_format_desc_t *format) {
+  if (!format)
+    return UVC_COLORIMETRY_BT601_FULL;
+
+  switch (format->bMatrixCoefficients) {
+    case 1: /* BT.709 */
+    case 5: /* SMPTE 240M, closest to BT.709 */
+      return UVC_COLORIMETRY_BT709_LIMITED;
+    case 2: /* FCC */
+    case 3: /* BT.470-2 B,G */
+    case 4: /* SMPTE 170M */
+      return UVC_COLORIMETRY_BT601_LIMITED;
+    default:
+      return UVC_COLORIMETRY_BT601_FULL;
+  }
+}
+
 #define YUYV2RGB_2(pyuv, prgb) { \
     float r = 1.402f * ((pyuv)[3]-128); \
     float g = -0.34414f * ((pyuv)[1]-128) - 0.71414f * ((pyuv)[3]-128); \
@@ -134,28 +217,31 @@ uvc_error_t uvc_duplicate_frame(uvc_frame_t *in, uvc_frame_t *out) {
     (prgb)[4] = sat(pyuv[2] + g); \
     (prgb)[5] = sat(pyuv[2] + b); \
     }
-#define IYUYV2RGB_2(pyuv, prgb) { \
-    int r = (22987 * ((pyuv)[3] - 128)) >> 14; \
-    int g = (-5636 * ((pyuv)[1] - 128) - 11698 * ((pyuv)[3] - 128)) >> 14; \
-    int b = (29049 * ((pyuv)[1] - 128)) >> 14; \
-    (prgb)[0] = sat(*(pyuv) + r); \
-    (prgb)[1] = sat(*(pyuv) + g); \
-    (prgb)[2] = sat(*(pyuv) + b); \
-    (prgb)[3] = sat((pyuv)[2] + r); \
-    (prgb)[4] = sat((pyuv)[2] + g); \
-    (prgb)[5] = sat((pyuv)[2] + b); \
+#define IYUYV2RGB_2(t, pyuv, prgb) { \
+    int r = (t)->rv[(pyuv)[3]]; \
+    int g = (t)->gu[(pyuv)[1]] + (t)->gv[(pyuv)[3]]; \
+    int b = (t)->bu[(pyuv)[1]]; \
+    int y0 = (t)->y[(pyuv)[0]]; \
+    int y1 = (t)->y[(pyuv)[2]]; \
+    (prgb)[0] = sat((y0 + r) >> 6); \
+    (prgb)[1] = sat((y0 + g) >> 6); \
+    (prgb)[2] = sat((y0 + b) >> 6); \
+    (prgb)[3] = sat((y1 + r) >> 6); \
+    (prgb)[4] = sat((y1 + g) >> 6); \
+    (prgb)[5] = sat((y1 + b) >> 6); \
     }
-#define IYUYV2RGB_16(pyuv, prgb) IYUYV2RGB_8(pyuv, prgb); IYUYV2RGB_8(pyuv + 16, prgb + 24);
-#define IYUYV2RGB_8(pyuv, prgb) IYUYV2RGB_4(pyuv, prgb); IYUYV2RGB_4(pyuv + 8, prgb + 12);
-#define IYUYV2RGB_4(pyuv, prgb) IYUYV2RGB_2(pyuv, prgb); IYUYV2RGB_2(pyuv + 4, prgb + 6);
+#define IYUYV2RGB_16(t, pyuv, prgb) IYUYV2RGB_8(t, pyuv, prgb); IYUYV2RGB_8(t, pyuv + 16, prgb + 24);
+#define IYUYV2RGB_8(t, pyuv, prgb) IYUYV2RGB_4(t, pyuv, prgb); IYUYV2RGB_4(t, pyuv + 8, prgb + 12);
+#define IYUYV2RGB_4(t, pyuv, prgb) IYUYV2RGB_2(t, pyuv, prgb); IYUYV2RGB_2(t, pyuv + 4, prgb + 6);
 
-/** @brief Convert a frame from YUYV to RGB
+/** @brief Convert a frame from YUYV to RGB using the given colorimetry
  * @ingroup frame
  *
  * @param in YUYV frame
  * @param out RGB frame
+ * @param cm Colorimetry of the input frame
  */
-uvc_error_t uvc_yuyv2rgb(uvc_frame_t *in, uvc_frame_t *out) {
+uvc_error_t uvc_yuyv2rgb_ex(uvc_frame_t *in, uvc_frame_t *out, enum uvc_colorimetry cm) {
   if (in->frame_format != UVC_FRAME_FORMAT_YUYV)
     return UVC_ERROR_INVALID_PARAM;
 
@@ -171,14 +257,19 @@ uvc_error_t uvc_yuyv2rgb(uvc_frame_t *in, uvc_frame_t *out) {
   out->step = in->width * 3;
   out->sequence = in->sequence;
   out->capture_time = in->capture_time;
+  out->pts = in->pts;
+  out->scr = in->scr;
+  out->capture_mono = in->capture_mono;
+  out->clock_model = in->clock_model;
   out->source = in->source;
 
+  const struct yuv_table *t = _uvc_yuv_table(cm);
   uint8_t *pyuv = in->data;
   uint8_t *prgb = out->data;
   uint8_t *prgb_end = prgb + out->data_bytes;
 
   while (prgb < prgb_end) {
-    IYUYV2RGB_8(pyuv, prgb);
+    IYUYV2RGB_8(t, pyuv, prgb);
 
     prgb += 3 * 8;
     pyuv += 2 * 8;
@@ -187,28 +278,41 @@ uvc_error_t uvc_yuyv2rgb(uvc_frame_t *in, uvc_frame_t *out) {
   return UVC_SUCCESS;
 }
 
-#define IYUYV2BGR_2(pyuv, pbgr) { \
-    int r = (22987 * ((pyuv)[3] - 128)) >> 14; \
-    int g = (-5636 * ((pyuv)[1] - 128) - 11698 * ((pyuv)[3] - 128)) >> 14; \
-    int b = (29049 * ((pyuv)[1] - 128)) >> 14; \
-    (pbgr)[0] = sat(*(pyuv) + b); \
-    (pbgr)[1] = sat(*(pyuv) + g); \
-    (pbgr)[2] = sat(*(pyuv) + r); \
-    (pbgr)[3] = sat((pyuv)[2] + b); \
-    (pbgr)[4] = sat((pyuv)[2] + g); \
-    (pbgr)[5] = sat((pyuv)[2] + r); \
+/** @brief Convert a frame from YUYV to RGB
+ * @ingroup frame
+ *
+ * @param in YUYV frame
+ * @param out RGB frame
+ */
+uvc_error_t uvc_yuyv2rgb(uvc_frame_t *in, uvc_frame_t *out) {
+  return uvc_yuyv2rgb_ex(in, out, UVC_COLORIMETRY_BT601_FULL);
+}
+
+#define IYUYV2BGR_2(t, pyuv, pbgr) { \
+    int r = (t)->rv[(pyuv)[3]]; \
+    int g = (t)->gu[(pyuv)[1]] + (t)->gv[(pyuv)[3]]; \
+    int b = (t)->bu[(pyuv)[1]]; \
+    int y0 = (t)->y[(pyuv)[0]]; \
+    int y1 = (t)->y[(pyuv)[2]]; \
+    (pbgr)[0] = sat((y0 + b) >> 6); \
+    (pbgr)[1] = sat((y0 + g) >> 6); \
+    (pbgr)[2] = sat((y0 + r) >> 6); \
+    (pbgr)[3] = sat((y1 + b) >> 6); \
+    (pbgr)[4] = sat((y1 + g) >> 6); \
+    (pbgr)[5] = sat((y1 + r) >> 6); \
     }
-#define IYUYV2BGR_16(pyuv, pbgr) IYUYV2BGR_8(pyuv, pbgr); IYUYV2BGR_8(pyuv + 16, pbgr + 24);
-#define IYUYV2BGR_8(pyuv, pbgr) IYUYV2BGR_4(pyuv, pbgr); IYUYV2BGR_4(pyuv + 8, pbgr + 12);
-#define IYUYV2BGR_4(pyuv, pbgr) IYUYV2BGR_2(pyuv, pbgr); IYUYV2BGR_2(pyuv + 4, pbgr + 6);
+#define IYUYV2BGR_16(t, pyuv, pbgr) IYUYV2BGR_8(t, pyuv, pbgr); IYUYV2BGR_8(t, pyuv + 16, pbgr + 24);
+#define IYUYV2BGR_8(t, pyuv, pbgr) IYUYV2BGR_4(t, pyuv, pbgr); IYUYV2BGR_4(t, pyuv + 8, pbgr + 12);
+#define IYUYV2BGR_4(t, pyuv, pbgr) IYUYV2BGR_2(t, pyuv, pbgr); IYUYV2BGR_2(t, pyuv + 4, pbgr + 6);
 
-/** @brief Convert a frame from YUYV to BGR
+/** @brief Convert a frame from YUYV to BGR using the given colorimetry
  * @ingroup frame
  *
  * @param in YUYV frame
  * @param out BGR frame
+ * @param cm Colorimetry of the input frame
  */
-uvc_error_t uvc_yuyv2bgr(uvc_frame_t *in, uvc_frame_t *out) {
+uvc_error_t uvc_yuyv2bgr_ex(uvc_frame_t *in, uvc_frame_t *out, enum uvc_colorimetry cm) {
   if (in->frame_format != UVC_FRAME_FORMAT_YUYV)
     return UVC_ERROR_INVALID_PARAM;
 
@@ -224,14 +328,19 @@ uvc_error_t uvc_yuyv2bgr(uvc_frame_t *in, uvc_frame_t *out) {
   out->step = in->width * 3;
   out->sequence = in->sequence;
   out->capture_time = in->capture_time;
+  out->pts = in->pts;
+  out->scr = in->scr;
+  out->capture_mono = in->capture_mono;
+  out->clock_model = in->clock_model;
   out->source = in->source;
 
+  const struct yuv_table *t = _uvc_yuv_table(cm);
   uint8_t *pyuv = in->data;
   uint8_t *pbgr = out->data;
   uint8_t *pbgr_end = pbgr + out->data_bytes;
 
   while (pbgr < pbgr_end) {
-    IYUYV2BGR_8(pyuv, pbgr);
+    IYUYV2BGR_8(t, pyuv, pbgr);
 
     pbgr += 3 * 8;
     pyuv += 2 * 8;
@@ -240,6 +349,16 @@ uvc_error_t uvc_yuyv2bgr(uvc_frame_t *in, uvc_frame_t *out) {
   return UVC_SUCCESS;
 }
 
+/** @brief Convert a frame from YUYV to BGR
+ * @ingroup frame
+ *
+ * @param in YUYV frame
+ * @param out BGR frame
+ */
+uvc_error_t uvc_yuyv2bgr(uvc_frame_t *in, uvc_frame_t *out) {
+  return uvc_yuyv2bgr_ex(in, out, UVC_COLORIMETRY_BT601_FULL);
+}
+
 #define IYUYV2Y(pyuv, py) { \
     (py)[0] = (pyuv[0]); \
     }
@@ -266,6 +385,10 @@ uvc_error_t uvc_yuyv2y(uvc_frame_t *in, uvc_frame_t *out) {
   out->step = in->width;
   out->sequence = in->sequence;
   out->capture_time = in->capture_time;
+  out->pts = in->pts;
+  out->scr = in->scr;
+  out->capture_mono = in->capture_mono;
+  out->clock_model = in->clock_model;
   out->source = in->source;
 
   uint8_t *pyuv = in->data;
@@ -308,6 +431,10 @@ uvc_error_t uvc_yuyv2uv(uvc_frame_t *in, uvc_frame_t *out) {
   out->step = in->width;
   out->sequence = in->sequence;
   out->capture_time = in->capture_time;
+  out->pts = in->pts;
+  out->scr = in->scr;
+  out->capture_mono = in->capture_mono;
+  out->clock_model = in->clock_model;
   out->source = in->source;
 
   uint8_t *pyuv = in->data;
@@ -324,27 +451,30 @@ uvc_error_t uvc_yuyv2uv(uvc_frame_t *in, uvc_frame_t *out) {
   return UVC_SUCCESS;
 }
 
-#define IUYVY2RGB_2(pyuv, prgb) { \
-    int r = (22987 * ((pyuv)[2] - 128)) >> 14; \
-    int g = (-5636 * ((pyuv)[0] - 128) - 11698 * ((pyuv)[2] - 128)) >> 14; \
-    int b = (29049 * ((pyuv)[0] - 128)) >> 14; \
-    (prgb)[0] = sat((pyuv)[1] + r); \
-    (prgb)[1] = sat((pyuv)[1] + g); \
-    (prgb)[2] = sat((pyuv)[1] + b); \
-    (prgb)[3] = sat((pyuv)[3] + r); \
-    (prgb)[4] = sat((pyuv)[3] + g); \
-    (prgb)[5] = sat((pyuv)[3] + b); \
+#define IUYVY2RGB_2(t, pyuv, prgb) { \
+    int r = (t)->rv[(pyuv)[2]]; \
+    int g = (t)->gu[(pyuv)[0]] + (t)->gv[(pyuv)[2]]; \
+    int b = (t)->bu[(pyuv)[0]]; \
+    int y0 = (t)->y[(pyuv)[1]]; \
+    int y1 = (t)->y[(pyuv)[3]]; \
+    (prgb)[0] = sat((y0 + r) >> 6); \
+    (prgb)[1] = sat((y0 + g) >> 6); \
+    (prgb)[2] = sat((y0 + b) >> 6); \
+    (prgb)[3] = sat((y1 + r) >> 6); \
+    (prgb)[4] = sat((y1 + g) >> 6); \
+    (prgb)[5] = sat((y1 + b) >> 6); \
     }
-#define IUYVY2RGB_16(pyuv, prgb) IUYVY2RGB_8(pyuv, prgb); IUYVY2RGB_8(pyuv + 16, prgb + 24);
-#define IUYVY2RGB_8(pyuv, prgb) IUYVY2RGB_4(pyuv, prgb); IUYVY2RGB_4(pyuv + 8, prgb + 12);
-#define IUYVY2RGB_4(pyuv, prgb) IUYVY2RGB_2(pyuv, prgb); IUYVY2RGB_2(pyuv + 4, prgb + 6);
+#define IUYVY2RGB_16(t, pyuv, prgb) IUYVY2RGB_8(t, pyuv, prgb); IUYVY2RGB_8(t, pyuv + 16, prgb + 24);
+#define IUYVY2RGB_8(t, pyuv, prgb) IUYVY2RGB_4(t, pyuv, prgb); IUYVY2RGB_4(t, pyuv + 8, prgb + 12);
+#define IUYVY2RGB_4(t, pyuv, prgb) IUYVY2RGB_2(t, pyuv, prgb); IUYVY2RGB_2(t, pyuv + 4, prgb + 6);
 
-/** @brief Convert a frame from UYVY to RGB
+/** @brief Convert a frame from UYVY to RGB using the given colorimetry
  * @ingroup frame
  * @param ini UYVY frame
  * @param out RGB frame
+ * @param cm Colorimetry of the input frame
  */
-uvc_error_t uvc_uyvy2rgb(uvc_frame_t *in, uvc_frame_t *out) {
+uvc_error_t uvc_uyvy2rgb_ex(uvc_frame_t *in, uvc_frame_t *out, enum uvc_colorimetry cm) {
   if (in->frame_format != UVC_FRAME_FORMAT_UYVY)
     return UVC_ERROR_INVALID_PARAM;
 
@@ -360,14 +490,19 @@ uvc_error_t uvc_uyvy2rgb(uvc_frame_t *in, uvc_frame_t *out) {
   out->step = in->width * 3;
   out->sequence = in->sequence;
   out->capture_time = in->capture_time;
+  out->pts = in->pts;
+  out->scr = in->scr;
+  out->capture_mono = in->capture_mono;
+  out->clock_model = in->clock_model;
   out->source = in->source;
 
+  const struct yuv_table *t = _uvc_yuv_table(cm);
   uint8_t *pyuv = in->data;
   uint8_t *prgb = out->data;
   uint8_t *prgb_end = prgb + out->data_bytes;
 
   while (prgb < prgb_end) {
-    IUYVY2RGB_8(pyuv, prgb);
+    IUYVY2RGB_8(t, pyuv, prgb);
 
     prgb += 3 * 8;
     pyuv += 2 * 8;
@@ -376,27 +511,39 @@ uvc_error_t uvc_uyvy2rgb(uvc_frame_t *in, uvc_frame_t *out) {
   return UVC_SUCCESS;
 }
 
-#define IUYVY2BGR_2(pyuv, pbgr) { \
-    int r = (22987 * ((pyuv)[2] - 128)) >> 14; \
-    int g = (-5636 * ((pyuv)[0] - 128) - 11698 * ((pyuv)[2] - 128)) >> 14; \
-    int b = (29049 * ((pyuv)[0] - 128)) >> 14; \
-    (pbgr)[0] = sat((pyuv)[1] + b); \
-    (pbgr)[1] = sat((pyuv)[1] + g); \
-    (pbgr)[2] = sat((pyuv)[1] + r); \
-    (pbgr)[3] = sat((pyuv)[3] + b); \
-    (pbgr)[4] = sat((pyuv)[3] + g); \
-    (pbgr)[5] = sat((pyuv)[3] + r); \
+/** @brief Convert a frame from UYVY to RGB
+ * @ingroup frame
+ * @param ini UYVY frame
+ * @param out RGB frame
+ */
+uvc_error_t uvc_uyvy2rgb(uvc_frame_t *in, uvc_frame_t *out) {
+  return uvc_uyvy2rgb_ex(in, out, UVC_COLORIMETRY_BT601_FULL);
+}
+
+#define IUYVY2BGR_2(t, pyuv, pbgr) { \
+    int r = (t)->rv[(pyuv)[2]]; \
+    int g = (t)->gu[(pyuv)[0]] + (t)->gv[(pyuv)[2]]; \
+    int b = (t)->bu[(pyuv)[0]]; \
+    int y0 = (t)->y[(pyuv)[1]]; \
+    int y1 = (t)->y[(pyuv)[3]]; \
+    (pbgr)[0] = sat((y0 + b) >> 6); \
+    (pbgr)[1] = sat((y0 + g) >> 6); \
+    (pbgr)[2] = sat((y0 + r) >> 6); \
+    (pbgr)[3] = sat((y1 + b) >> 6); \
+    (pbgr)[4] = sat((y1 + g) >> 6); \
+    (pbgr)[5] = sat((y1 + r) >> 6); \
     }
-#define IUYVY2BGR_16(pyuv, pbgr) IUYVY2BGR_8(pyuv, pbgr); IUYVY2BGR_8(pyuv + 16, pbgr + 24);
-#define IUYVY2BGR_8(pyuv, pbgr) IUYVY2BGR_4(pyuv, pbgr); IUYVY2BGR_4(pyuv + 8, pbgr + 12);
-#define IUYVY2BGR_4(pyuv, pbgr) IUYVY2BGR_2(pyuv, pbgr); IUYVY2BGR_2(pyuv + 4, pbgr + 6);
+#define IUYVY2BGR_16(t, pyuv, pbgr) IUYVY2BGR_8(t, pyuv, pbgr); IUYVY2BGR_8(t, pyuv + 16, pbgr + 24);
+#define IUYVY2BGR_8(t, pyuv, pbgr) IUYVY2BGR_4(t, pyuv, pbgr); IUYVY2BGR_4(t, pyuv + 8, pbgr + 12);
+#define IUYVY2BGR_4(t, pyuv, pbgr) IUYVY2BGR_2(t, pyuv, pbgr); IUYVY2BGR_2(t, pyuv + 4, pbgr + 6);
 
-/** @brief Convert a frame from UYVY to BGR
+/** @brief Convert a frame from UYVY to BGR using the given colorimetry
  * @ingroup frame
  * @param ini UYVY frame
  * @param out BGR frame
+ * @param cm Colorimetry of the input frame
  */
-uvc_error_t uvc_uyvy2bgr(uvc_frame_t *in, uvc_frame_t *out) {
+uvc_error_t uvc_uyvy2bgr_ex(uvc_frame_t *in, uvc_frame_t *out, enum uvc_colorimetry cm) {
   if (in->frame_format != UVC_FRAME_FORMAT_UYVY)
     return UVC_ERROR_INVALID_PARAM;
 
@@ -412,14 +559,19 @@ uvc_error_t uvc_uyvy2bgr(uvc_frame_t *in, uvc_frame_t *out) {
   out->step = in->width * 3;
   out->sequence = in->sequence;
   out->capture_time = in->capture_time;
+  out->pts = in->pts;
+  out->scr = in->scr;
+  out->capture_mono = in->capture_mono;
+  out->clock_model = in->clock_model;
   out->source = in->source;
 
+  const struct yuv_table *t = _uvc_yuv_table(cm);
   uint8_t *pyuv = in->data;
   uint8_t *pbgr = out->data;
   uint8_t *pbgr_end = pbgr + out->data_bytes;
 
   while (pbgr < pbgr_end) {
-    IUYVY2BGR_8(pyuv, pbgr);
+    IUYVY2BGR_8(t, pyuv, pbgr);
 
     pbgr += 3 * 8;
     pyuv += 2 * 8;
@@ -428,18 +580,28 @@ uvc_error_t uvc_uyvy2bgr(uvc_frame_t *in, uvc_frame_t *out) {
   return UVC_SUCCESS;
 }
 
-/** @brief Convert a frame to RGB
+/** @brief Convert a frame from UYVY to BGR
+ * @ingroup frame
+ * @param ini UYVY frame
+ * @param out BGR frame
+ */
+uvc_error_t uvc_uyvy2bgr(uvc_frame_t *in, uvc_frame_t *out) {
+  return uvc_uyvy2bgr_ex(in, out, UVC_COLORIMETRY_BT601_FULL);
+}
+
+/** @brief Convert a frame to RGB using the given colorimetry
  * @ingroup frame
  *
  * @param in non-RGB frame
  * @param out RGB frame
+ * @param cm Colorimetry of YUV input frames
  */
-uvc_error_t uvc_any2rgb(uvc_frame_t *in, uvc_frame_t *out) {
+uvc_error_t uvc_any2rgb_ex(uvc_frame_t *in, uvc_frame_t *out, enum uvc_colorimetry cm) {
   switch (in->frame_format) {
     case UVC_FRAME_FORMAT_YUYV:
-      return uvc_yuyv2rgb(in, out);
+      return uvc_yuyv2rgb_ex(in, out, cm);
     case UVC_FRAME_FORMAT_UYVY:
-      return uvc_uyvy2rgb(in, out);
+      return uvc_uyvy2rgb_ex(in, out, cm);
     case UVC_FRAME_FORMAT_RGB:
       return uvc_duplicate_frame(in, out);
     default:
@@ -447,18 +609,29 @@ uvc_error_t uvc_any2rgb(uvc_frame_t *in, uvc_frame_t *out) {
   }
 }
 
-/** @brief Convert a frame to BGR
+/** @brief Convert a frame to RGB
+ * @ingroup frame
+ *
+ * @param in non-RGB frame
+ * @param out RGB frame
+ */
+uvc_error_t uvc_any2rgb(uvc_frame_t *in, uvc_frame_t *out) {
+  return uvc_any2rgb_ex(in, out, UVC_COLORIMETRY_BT601_FULL);
+}
+
+/** @brief Convert a frame to BGR using the given colorimetry
  * @ingroup frame
  *
  * @param in non-BGR frame
  * @param out BGR frame
+ * @param cm Colorimetry of YUV input frames
  */
-uvc_error_t uvc_any2bgr(uvc_frame_t *in, uvc_frame_t *out) {
+uvc_error_t uvc_any2bgr_ex(uvc_frame_t *in, uvc_frame_t *out, enum uvc_colorimetry cm) {
   switch (in->frame_format) {
     case UVC_FRAME_FORMAT_YUYV:
-      return uvc_yuyv2bgr(in, out);
+      return uvc_yuyv2bgr_ex(in, out, cm);
     case UVC_FRAME_FORMAT_UYVY:
-      return uvc_uyvy2bgr(in, out);
+      return uvc_uyvy2bgr_ex(in, out, cm);
     case UVC_FRAME_FORMAT_BGR:
       return uvc_duplicate_frame(in, out);
     default:
@@ -466,6 +639,16 @@ uvc_error_t uvc_any2bgr(uvc_frame_t *in, uvc_frame_t *out) {
   }
 }
 
+/** @brief Convert a frame to BGR
+ * @ingroup frame
+ *
+ * @param in non-BGR frame
+ * @param out BGR frame
+ */
+uvc_error_t uvc_any2bgr(uvc_frame_t *in, uvc_frame_t *out) {
+  return uvc_any2bgr_ex(in, out, UVC_COLORIMETRY_BT601_FULL);
+}
+
 /** @brief Convert a frame from GRAY16 to GRAY8
  * @ingroup frame
  *
@@ -488,6 +671,10 @@ uvc_error_t uvc_gray16to8(uvc_frame_t *in, uvc_frame_t *out, int shift) {
   out->step = in->width;
   out->sequence = in->sequence;
   out->capture_time = in->capture_time;
+  out->pts = in->pts;
+  out->scr = in->scr;
+  out->capture_mono = in->capture_mono;
+  out->clock_model = in->clock_model;
   out->source = in->source;
 
   uint16_t *py = in->data;
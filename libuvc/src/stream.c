@@ -468,10 +468,288 @@ uvc_error_t uvc_probe_stream_ctrl(
   return uvc_query_stream_ctrl(devh, ctrl, 1, UVC_GET_CUR);
 }
 
+/** @internal
+ * @brief Host CLOCK_MONOTONIC time in nanoseconds
+ */
+static int64_t _uvc_mono_ns(void) {
+#if _POSIX_TIMERS > 0
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (int64_t) tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+/** @internal
+ * @brief Unwrap a 32 bit device clock value near the last SCR
+ */
+static int64_t _uvc_clock_unwrap(struct uvc_clock_model *clock, uint32_t v) {
+  return clock->stc + (int32_t) (v - clock->last_stc);
+}
+
+/** @internal
+ * @brief Add an SCR sample taken at host time now to the clock model
+ */
+static void _uvc_clock_sample(struct uvc_clock_model *clock, uint32_t scr,
+                              int64_t now) {
+  if (clock->n == 0) {
+    clock->stc = scr;
+  } else {
+    clock->stc = _uvc_clock_unwrap(clock, scr);
+  }
+  clock->last_stc = scr;
+  if (clock->n > 0 &&
+      clock->stc <= clock->x[(clock->pos + LIBUVC_CLOCK_SAMPLES - 1) %
+                             LIBUVC_CLOCK_SAMPLES]) {
+    /* Device clock went back (restart), start over */
+    clock->n = clock->pos = 0;
+  }
+  clock->x[clock->pos] = clock->stc;
+  clock->y[clock->pos] = now;
+  clock->pos = (clock->pos + 1) % LIBUVC_CLOCK_SAMPLES;
+  if (clock->n < LIBUVC_CLOCK_SAMPLES)
+    clock->n++;
+}
+
+/** @internal
+ * @brief Map a device clock value (PTS) to host time using the clock model
+ *
+ * The rate is a least squares fit over the samples, the offset follows
+ * the samples with the lowest transfer delay, i.e. the smallest residual.
+ * @return 0 and the host time in *out, or -1 if the model isn't usable
+ */
+static int _uvc_clock_estimate(struct uvc_clock_model *clock, uint32_t v,
+                               int64_t *out) {
+  int i, last;
+  double xm = 0, ym = 0, sxx = 0, sxy = 0, dx, dy, rate, off = 0, r;
+
+  if (clock->n < 8)
+    return -1;
+  last = (clock->pos + LIBUVC_CLOCK_SAMPLES - 1) % LIBUVC_CLOCK_SAMPLES;
+  /* Relative to the last sample for precision */
+  for (i = 0; i < clock->n; i++) {
+    xm += clock->x[i] - clock->x[last];
+    ym += clock->y[i] - clock->y[last];
+  }
+  xm /= clock->n;
+  ym /= clock->n;
+  for (i = 0; i < clock->n; i++) {
+    dx = clock->x[i] - clock->x[last] - xm;
+    dy = clock->y[i] - clock->y[last] - ym;
+    sxx += dx * dx;
+    sxy += dx * dy;
+  }
+  if (sxx <= 0)
+    return -1;
+  rate = sxy / sxx;
+  if (clock->freq > 0) {
+    double nominal = 1e9 / clock->freq;
+
+    if (rate < nominal * 0.99 || rate > nominal * 1.01)
+      return -1;
+  } else if (rate <= 0) {
+    return -1;
+  }
+  for (i = 0; i < clock->n; i++) {
+    r = (clock->y[i] - clock->y[last]) - rate * (clock->x[i] - clock->x[last]);
+    if (i == 0 || r < off)
+      off = r;
+  }
+  *out = clock->y[last] + (int64_t) (off + rate *
+         (_uvc_clock_unwrap(clock, v) - clock->x[last]));
+  return 0;
+}
+
+/* Payload log file layout, all numbers little endian: the magic
+ * followed by records of a 32 bit payload length, the 64 bit host
+ * monotonic time (ns) when the payload arrived, and the payload with
+ * its header. A length of PLOG_FORMAT marks a record describing the
+ * stream that follows instead, written whenever a stream starts, and
+ * PLOG_LOST an isochronous packet with bad status, without data. */
+#define PLOG_MAGIC "UVCPLOG1"
+#define PLOG_FORMAT 0xffffffffU
+#define PLOG_LOST 0xfffffffeU
+#define PLOG_RECHDR 12
+#define PLOG_FMTLEN 24
+#define PLOG_ISIGHT 1
+
+/** @internal
+ * @brief Store a little endian number of n bytes
+ */
+static void _uvc_log_put(uint8_t *p, uint64_t v, int n) {
+  int i;
+
+  for (i = 0; i < n; i++, v >>= 8)
+    p[i] = v & 0xff;
+}
+
+/** @internal
+ * @brief Load a little endian number of n bytes
+ */
+static uint64_t _uvc_log_get(const uint8_t *p, int n) {
+  uint64_t v = 0;
+
+  while (n-- > 0)
+    v = (v << 8) | p[n];
+  return v;
+}
+
+/** @internal
+ * @brief Append a record to a payload log
+ */
+static void _uvc_log_write(struct uvc_payload_log *log, uint32_t len,
+                           int64_t mono, const uint8_t *data, size_t data_len) {
+  uint8_t hdr[PLOG_RECHDR];
+
+  _uvc_log_put(hdr, len, 4);
+  _uvc_log_put(hdr + 4, (uint64_t) mono, 8);
+  pthread_mutex_lock(&log->mutex);
+  if (!log->error &&
+      (fwrite(hdr, 1, sizeof(hdr), log->fp) != sizeof(hdr) ||
+       fwrite(data, 1, data_len, log->fp) != data_len))
+    log->error = 1;
+  pthread_mutex_unlock(&log->mutex);
+}
+
+/** @internal
+ * @brief Log a payload as handed to _uvc_process_payload()
+ */
+static void _uvc_log_payload(struct uvc_payload_log *log,
+                             const uint8_t *payload, size_t payload_len,
+                             int64_t mono) {
+  _uvc_log_write(log, payload_len, mono, payload, payload_len);
+}
+
+/** @internal
+ * @brief Log the format of a started stream
+ */
+static void _uvc_log_format(struct uvc_payload_log *log,
+                            uvc_stream_handle_t *strmh) {
+  uint8_t rec[PLOG_FMTLEN];
+  struct timeval tv;
+  int64_t mono = _uvc_mono_ns();
+
+  gettimeofday(&tv, NULL);
+  _uvc_log_put(rec, strmh->frame_format, 4);
+  _uvc_log_put(rec + 4, strmh->width, 2);
+  _uvc_log_put(rec + 6, strmh->height, 2);
+  _uvc_log_put(rec + 8, strmh->clock.freq, 4);
+  _uvc_log_put(rec + 12, strmh->devh->is_isight ? PLOG_ISIGHT : 0, 4);
+  _uvc_log_put(rec + 16, (uint64_t) ((int64_t) tv.tv_sec * 1000000 +
+                                     tv.tv_usec - mono / 1000), 8);
+  _uvc_log_write(log, PLOG_FORMAT, mono, rec, sizeof(rec));
+}
+
+/** @internal
+ * @brief Check the marker structure of an MJPEG frame
+ *
+ * Needs SOI and well formed marker segments including a SOF up to the
+ * scan. The entropy coded data is not looked at. Some cameras never send
+ * an EOI, which _uvc_populate_frame() appends, so a missing EOI only
+ * counts when the frame is known to be incomplete (@p need_eoi).
+ */
+static enum uvc_frame_status _uvc_check_mjpeg(const uint8_t *buf, size_t len,
+                                              int need_eoi) {
+  size_t pos, seglen;
+  uint8_t marker;
+  int have_sof = 0;
+
+  if (len < 4 || buf[0] != 0xff || buf[1] != 0xd8)
+    return UVC_FRAME_NO_SOI;
+
+  /* some cameras pad the frame after EOI */
+  while (len > 4 && buf[len - 1] == 0x00)
+    len--;
+  if (need_eoi && (buf[len - 2] != 0xff || buf[len - 1] != 0xd9))
+    return UVC_FRAME_NO_EOI;
+
+  pos = 2;
+  while (1) {
+    if (pos + 2 > len || buf[pos] != 0xff)
+      return UVC_FRAME_BAD_MARKER;
+    while (pos + 2 < len && buf[pos + 1] == 0xff)
+      pos++;          /* fill bytes */
+    marker = buf[pos + 1];
+    pos += 2;
+    if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7))
+      continue;       /* TEM, RSTn: no length */
+    if (marker == 0x00 || marker == 0xd8 || marker == 0xd9 || pos + 2 > len)
+      return UVC_FRAME_BAD_MARKER;
+    seglen = (buf[pos] << 8) | buf[pos + 1];
+    if (seglen < 2 || pos + seglen > len)
+      return UVC_FRAME_BAD_MARKER;
+    if (marker == 0xda)
+      return have_sof ? UVC_FRAME_OK : UVC_FRAME_NO_SOF;
+    if (marker >= 0xc0 && marker <= 0xcf &&
+        marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+      have_sof = 1;
+    pos += seglen;
+  }
+}
+
+/** @internal
+ * @brief Cheap sanity check of an assembled frame
+ *
+ * Uncompressed frames must have the size given by format and frame size,
+ * MJPEG frames a sound marker structure. An MJPEG frame must end with EOI
+ * if payload data was lost or the frame wasn't ended by the EOF bit.
+ */
+static enum uvc_frame_status _uvc_check_frame(uvc_stream_handle_t *strmh,
+                                              const uint8_t *buf, size_t len,
+                                              int eof) {
+  size_t bpp;
+
+  switch (strmh->frame_format) {
+  case UVC_FRAME_FORMAT_MJPEG:
+    return _uvc_check_mjpeg(buf, len, !eof || strmh->num_gaps > 0);
+  case UVC_FRAME_FORMAT_YUYV:
+  case UVC_FRAME_FORMAT_UYVY:
+  case UVC_FRAME_FORMAT_GRAY16:
+    bpp = 2;
+    break;
+  case UVC_FRAME_FORMAT_RGB:
+  case UVC_FRAME_FORMAT_BGR:
+    bpp = 3;
+    break;
+  case UVC_FRAME_FORMAT_GRAY8:
+  case UVC_FRAME_FORMAT_BY8:
+  case UVC_FRAME_FORMAT_BA81:
+  case UVC_FRAME_FORMAT_SGRBG8:
+  case UVC_FRAME_FORMAT_SGBRG8:
+  case UVC_FRAME_FORMAT_SRGGB8:
+  case UVC_FRAME_FORMAT_SBGGR8:
+    bpp = 1;
+    break;
+  default:
+    return UVC_FRAME_OK;
+  }
+  if (strmh->width == 0 || len == (size_t) strmh->width * strmh->height * bpp)
+    return UVC_FRAME_OK;
+  return UVC_FRAME_BAD_SIZE;
+}
+
+/** @internal
+ * @brief Note that payload data of the current frame was lost
+ */
+static void _uvc_mark_gap(uvc_stream_handle_t *strmh) {
+  if (strmh->got_bytes == 0)
+    return;  /* can't tell whether it belonged to this frame */
+  if (strmh->num_gaps < UVC_FRAME_MAX_GAPS)
+    strmh->gaps[strmh->num_gaps] = strmh->got_bytes;
+  strmh->num_gaps++;
+}
+
 /** @internal
  * @brief Swap the working buffer with the presented buffer and notify consumers
+ *
+ * @param eof Frame was ended by the EOF bit rather than a FID flip
  */
-void _uvc_swap_buffers(uvc_stream_handle_t *strmh) {
+void _uvc_swap_buffers(uvc_stream_handle_t *strmh, int eof) {
   uint8_t *tmp_buf;
 
   /* swap the buffers */
@@ -481,14 +759,51 @@ void _uvc_swap_buffers(uvc_stream_handle_t *strmh) {
   strmh->outbuf = tmp_buf;
   strmh->hold_last_scr = strmh->last_scr;
   strmh->hold_pts = strmh->pts;
+  strmh->hold_sof_mono = strmh->sof_mono;
+  strmh->hold_eof_mono = strmh->payload_mono;
   strmh->hold_seq = strmh->seq;
+  strmh->hold_num_gaps = strmh->num_gaps;
+  memcpy(strmh->hold_gaps, strmh->gaps, sizeof(strmh->gaps));
+  strmh->stats.frames++;
+
+  strmh->hold_status = _uvc_check_frame(strmh, strmh->holdbuf, strmh->hold_bytes,
+                                        eof);
+  switch (strmh->hold_status) {
+  case UVC_FRAME_OK:
+    break;
+  case UVC_FRAME_BAD_SIZE:
+    strmh->stats.bad_size++;
+    break;
+  case UVC_FRAME_NO_SOI:
+    strmh->stats.no_soi++;
+    break;
+  case UVC_FRAME_NO_SOF:
+    strmh->stats.no_sof++;
+    break;
+  case UVC_FRAME_NO_EOI:
+    strmh->stats.no_eoi++;
+    break;
+  case UVC_FRAME_BAD_MARKER:
+    strmh->stats.bad_marker++;
+    break;
+  }
 
-  pthread_cond_broadcast(&strmh->cb_cond);
+  if (strmh->replay) {
+    /* No caller thread, deliver synchronously */
+    _uvc_populate_frame(strmh);
+    if (strmh->user_cb)
+      strmh->user_cb(&strmh->frame, strmh->user_ptr);
+  } else {
+    pthread_cond_broadcast(&strmh->cb_cond);
+  }
 
   strmh->seq++;
   strmh->got_bytes = 0;
   strmh->last_scr = 0;
   strmh->pts = 0;
+  strmh->sof_mono = 0;
+  strmh->scr_sampled = 0;
+  strmh->num_gaps = 0;
 }
 
 /** @internal
@@ -512,9 +827,15 @@ void _uvc_process_payload(uvc_stream_handle_t *strmh, uint8_t *payload, size_t p
     0xde, 0xad, 0xbe, 0xef, 0xde, 0xad, 0xfa, 0xce
   };
 
+  if (strmh->devh->payload_log)
+    _uvc_log_payload(strmh->devh->payload_log, payload, payload_len,
+                     strmh->payload_mono);
+
   /* ignore empty payload transfers */
-  if (payload_len == 0)
+  if (payload_len == 0) {
+    strmh->stats.empty++;
     return;
+  }
 
   /* Certain iSight cameras have strange behavior: They send header
    * information in a packet with no image data, and then the following
@@ -535,6 +856,8 @@ void _uvc_process_payload(uvc_stream_handle_t *strmh, uint8_t *payload, size_t p
 
     if (header_len > payload_len) {
       UVC_DEBUG("bogus packet: actual_len=%zd, header_len=%zd\n", payload_len, header_len);
+      strmh->stats.bogus++;
+      _uvc_mark_gap(strmh);
       return;
     }
 
@@ -554,8 +877,11 @@ void _uvc_process_payload(uvc_stream_handle_t *strmh, uint8_t *payload, size_t p
 
     if (header_info & 0x40) {
       UVC_DEBUG("bad packet: error bit set");
-      libusb_clear_halt(strmh->devh->usb_devh,
-			strmh->stream_if->bEndpointAddress);
+      strmh->stats.error_bit++;
+      _uvc_mark_gap(strmh);
+      if (!strmh->replay)
+        libusb_clear_halt(strmh->devh->usb_devh,
+			  strmh->stream_if->bEndpointAddress);
       return;
     }
 
@@ -563,11 +889,15 @@ void _uvc_process_payload(uvc_stream_handle_t *strmh, uint8_t *payload, size_t p
       /* The frame ID bit was flipped, but we have image data sitting
 	 around from prior transfers. This means the camera didn't send
 	 an EOF for the last transfer of the previous frame. */
-      _uvc_swap_buffers(strmh);
+      strmh->stats.fid_no_eof++;
+      _uvc_swap_buffers(strmh, 0);
     }
 
     strmh->fid = header_info & 1;
 
+    if (strmh->sof_mono == 0)
+      strmh->sof_mono = strmh->payload_mono;
+
     if (header_info & (1 << 2)) {
       strmh->pts = DW_TO_INT(payload + variable_offset);
       variable_offset += 4;
@@ -577,16 +907,29 @@ void _uvc_process_payload(uvc_stream_handle_t *strmh, uint8_t *payload, size_t p
       /** @todo read the SOF token counter */
       strmh->last_scr = DW_TO_INT(payload + variable_offset);
       variable_offset += 6;
+      if (!strmh->scr_sampled) {
+        /* One sample per frame feeds the device clock model */
+        _uvc_clock_sample(&strmh->clock, strmh->last_scr, strmh->payload_mono);
+        strmh->scr_sampled = 1;
+      }
     }
   }
 
+  if (strmh->got_bytes + data_len > LIBUVC_XFER_BUF_SIZE) {
+    UVC_DEBUG("frame too large, dropping %zd bytes", data_len);
+    strmh->stats.bogus++;
+    _uvc_mark_gap(strmh);
+    data_len = 0;
+  }
+
   if (data_len > 0) {
     memcpy(strmh->outbuf + strmh->got_bytes, payload + header_len, data_len);
     strmh->got_bytes += data_len;
+    strmh->stats.bytes += data_len;
 
     if (header_info & (1 << 1)) {
       /* The EOF bit is set, so publish the complete frame */
-      _uvc_swap_buffers(strmh);
+      _uvc_swap_buffers(strmh, 1);
     }
   }
 }
@@ -610,6 +953,8 @@ void LIBUSB_CALL _uvc_stream_callback(struct libusb_transfer *transfer) {
     if (!strmh->running) {
       goto release_transfer;
     }
+    strmh->stats.transfers++;
+    strmh->payload_mono = _uvc_mono_ns();
     if (transfer->num_iso_packets == 0) {
       /* This is a bulk mode transfer, so it just has one payload transfer */
       _uvc_process_payload(strmh, transfer->buffer, transfer->actual_length);
@@ -622,11 +967,17 @@ void LIBUSB_CALL _uvc_stream_callback(struct libusb_transfer *transfer) {
 	pkt = transfer->iso_packet_desc + i;
 	if (pkt->status != 0) {
 	  UVC_DEBUG("bad packet (isochronous transfer); status: %d", pkt->status);
+	  strmh->stats.bad_packets++;
+	  if (strmh->devh->payload_log)
+	    _uvc_log_write(strmh->devh->payload_log, PLOG_LOST,
+			   strmh->payload_mono, NULL, 0);
+	  _uvc_mark_gap(strmh);
 	  libusb_clear_halt(strmh->devh->usb_devh,
 			    strmh->stream_if->bEndpointAddress);
 	  continue;
 	}
 	if (!pkt->actual_length) {
+	  strmh->stats.empty++;
 	  continue;
 	}
 	pktbuf = libusb_get_iso_packet_buffer_simple(transfer, i);
@@ -666,6 +1017,7 @@ void LIBUSB_CALL _uvc_stream_callback(struct libusb_transfer *transfer) {
       goto release_transfer;
 
     UVC_DEBUG("retrying transfer, status = %d", transfer->status);
+    strmh->stats.retried++;
     break;
   }
 
@@ -864,6 +1216,11 @@ uvc_error_t uvc_stream_start(
   strmh->fid = 0;
   strmh->pts = 0;
   strmh->last_scr = 0;
+  strmh->sof_mono = 0;
+  strmh->scr_sampled = 0;
+  strmh->num_gaps = 0;
+  memset(&strmh->clock, 0, sizeof(strmh->clock));
+  strmh->clock.freq = ctrl->dwClockFrequency;
 
   frame_desc = uvc_find_frame_desc_stream(strmh, ctrl->bFormatIndex, ctrl->bFrameIndex);
   if (!frame_desc) {
@@ -877,6 +1234,14 @@ uvc_error_t uvc_stream_start(
     ret = UVC_ERROR_NOT_SUPPORTED;
     goto fail;
   }
+  strmh->width = frame_desc->wWidth;
+  strmh->height = frame_desc->wHeight;
+
+  if (strmh->devh->payload_log) {
+    pthread_mutex_lock(&strmh->cb_mutex);
+    _uvc_log_format(strmh->devh->payload_log, strmh);
+    pthread_mutex_unlock(&strmh->cb_mutex);
+  }
 
   /* Get the interface that provides the chosen format and frame configuration */
   interface_id = strmh->stream_if->bInterfaceNumber;
@@ -1126,25 +1491,18 @@ void *_uvc_user_caller(void *arg) {
  */
 void _uvc_populate_frame(uvc_stream_handle_t *strmh) {
   uvc_frame_t *frame = &strmh->frame;
-  uvc_frame_desc_t *frame_desc;
 #if _POSIX_TIMERS > 0
   struct timespec ts;
 #endif
   struct timeval tv;
+  int64_t now, mono, est;
   int addsize = 0;
 
-  /** @todo this stuff that hits the main config cache should really happen
-   * in start() so that only one thread hits these data. all of this stuff
-   * is going to be reopen_on_change anyway
-   */
-
-  frame_desc = uvc_find_frame_desc(strmh->devh, strmh->cur_ctrl.bFormatIndex,
-				   strmh->cur_ctrl.bFrameIndex);
-
+  /* frame size was looked up in start() */
   frame->frame_format = strmh->frame_format;
 
-  frame->width = frame_desc->wWidth;
-  frame->height = frame_desc->wHeight;
+  frame->width = strmh->width;
+  frame->height = strmh->height;
 
   switch (frame->frame_format) {
   case UVC_FRAME_FORMAT_YUYV:
@@ -1160,6 +1518,11 @@ void _uvc_populate_frame(uvc_stream_handle_t *strmh) {
   }
 
   frame->sequence = strmh->hold_seq;
+  frame->status = strmh->hold_status;
+  frame->num_gaps = strmh->hold_num_gaps;
+  memcpy(frame->gaps, strmh->hold_gaps, sizeof(frame->gaps));
+  frame->pts = strmh->hold_pts;
+  frame->scr = strmh->hold_last_scr;
   /* set the frame time */
 #if _POSIX_TIMERS > 0
   clock_gettime(CLOCK_REALTIME, &ts);
@@ -1168,6 +1531,35 @@ void _uvc_populate_frame(uvc_stream_handle_t *strmh) {
 #else
   gettimeofday(&tv, NULL);
 #endif
+  now = _uvc_mono_ns();
+  if (strmh->replay) {
+    /* Times as recorded, the replay runs at its own pace */
+    now = strmh->hold_eof_mono;
+    mono = strmh->replay_real + now / 1000;
+    tv.tv_sec = mono / 1000000;
+    tv.tv_usec = mono % 1000000;
+  }
+  /* Prefer the device's capture time (PTS) mapped by the clock
+   * model, else the arrival of the first payload, which is still
+   * free of the latency of waking up this thread */
+  frame->clock_model = 0;
+  mono = strmh->hold_sof_mono;
+  if (mono <= 0 || mono > now) {
+    mono = now;
+  }
+  if (strmh->hold_pts != 0 &&
+      _uvc_clock_estimate(&strmh->clock, strmh->hold_pts, &est) == 0 &&
+      est <= now && est > now - 1000000000) {
+    mono = est;
+    frame->clock_model = 1;
+  }
+  frame->capture_mono = mono;
+  frame->sof_mono = strmh->hold_sof_mono;
+  frame->eof_mono = strmh->hold_eof_mono;
+  /* Same instant on the realtime clock */
+  mono = (int64_t) tv.tv_sec * 1000000 + tv.tv_usec - (now - mono) / 1000;
+  tv.tv_sec = mono / 1000000;
+  tv.tv_usec = mono % 1000000;
   frame->capture_time = tv;
 
   /* copy the image data from the hold buffer to the frame (unnecessary extra buf?) */
@@ -1379,6 +1771,251 @@ uvc_error_t uvc_stream_stop(uvc_stream_handle_t *strmh) {
   return UVC_SUCCESS;
 }
 
+/** @brief Get transfer and payload counters of a stream.
+ * @ingroup streaming
+ *
+ * The counters start at zero when the stream is opened.
+ *
+ * @param strmh UVC stream handle
+ * @param[out] stats Counters
+ */
+uvc_error_t uvc_stream_get_stats(uvc_stream_handle_t *strmh,
+    uvc_stream_stats_t *stats) {
+  pthread_mutex_lock(&strmh->cb_mutex);
+  *stats = strmh->stats;
+  pthread_mutex_unlock(&strmh->cb_mutex);
+
+  return UVC_SUCCESS;
+}
+
+/** @brief Get transfer and payload counters summed over open streams.
+ * @ingroup streaming
+ *
+ * @param devh UVC device
+ * @param[out] stats Counters
+ * @return UVC_ERROR_NOT_FOUND if the device has no open stream
+ */
+uvc_error_t uvc_get_stream_stats(uvc_device_handle_t *devh,
+    uvc_stream_stats_t *stats) {
+  uvc_stream_handle_t *strmh;
+  uvc_stream_stats_t one;
+
+  memset(stats, 0, sizeof(*stats));
+  if (devh->streams == NULL)
+    return UVC_ERROR_NOT_FOUND;
+
+  DL_FOREACH(devh->streams, strmh) {
+    uvc_stream_get_stats(strmh, &one);
+    stats->transfers += one.transfers;
+    stats->retried += one.retried;
+    stats->bad_packets += one.bad_packets;
+    stats->error_bit += one.error_bit;
+    stats->bogus += one.bogus;
+    stats->fid_no_eof += one.fid_no_eof;
+    stats->empty += one.empty;
+    stats->frames += one.frames;
+    stats->bytes += one.bytes;
+    stats->bad_size += one.bad_size;
+    stats->no_soi += one.no_soi;
+    stats->no_sof += one.no_sof;
+    stats->no_eoi += one.no_eoi;
+    stats->bad_marker += one.bad_marker;
+  }
+
+  return UVC_SUCCESS;
+}
+
+/** @brief Open a file for logging raw payloads.
+ * @ingroup streaming
+ *
+ * @param path File to create
+ * @param[out] logp Log handle, attach it with uvc_set_payload_log()
+ */
+uvc_error_t uvc_payload_log_open(const char *path, uvc_payload_log_t **logp) {
+  uvc_payload_log_t *log;
+
+  log = calloc(1, sizeof(*log));
+  if (!log)
+    return UVC_ERROR_NO_MEM;
+  log->fp = fopen(path, "wb");
+  if (!log->fp) {
+    free(log);
+    return UVC_ERROR_IO;
+  }
+  if (fwrite(PLOG_MAGIC, 1, 8, log->fp) != 8) {
+    fclose(log->fp);
+    free(log);
+    return UVC_ERROR_IO;
+  }
+  pthread_mutex_init(&log->mutex, NULL);
+  *logp = log;
+
+  return UVC_SUCCESS;
+}
+
+/** @brief Close a payload log.
+ * @ingroup streaming
+ *
+ * The log must have been detached from all devices.
+ *
+ * @param log Log handle
+ */
+void uvc_payload_log_close(uvc_payload_log_t *log) {
+  fclose(log->fp);
+  pthread_mutex_destroy(&log->mutex);
+  free(log);
+}
+
+/** @brief Log all payloads received by the device's streams.
+ * @ingroup streaming
+ *
+ * Each payload is logged with its arrival time as it is handed to the
+ * frame assembly, running streams also get their format logged. May
+ * be called while streaming.
+ *
+ * @param devh UVC device
+ * @param log Log handle, or NULL to stop logging
+ */
+uvc_error_t uvc_set_payload_log(uvc_device_handle_t *devh,
+    uvc_payload_log_t *log) {
+  uvc_stream_handle_t *strmh;
+
+  if (devh->streams == NULL) {
+    devh->payload_log = log;
+    return UVC_SUCCESS;
+  }
+
+  DL_FOREACH(devh->streams, strmh) {
+    pthread_mutex_lock(&strmh->cb_mutex);
+    devh->payload_log = log;
+    if (log && strmh->running)
+      _uvc_log_format(log, strmh);
+    pthread_mutex_unlock(&strmh->cb_mutex);
+  }
+
+  return UVC_SUCCESS;
+}
+
+/** @brief Feed a payload log through the frame assembly.
+ * @ingroup streaming
+ *
+ * Runs the payloads of a file written by a payload log through the same
+ * code as live USB transfers, without pacing, and calls the callback
+ * synchronously for each assembled frame. Frame times are those of the
+ * capture.
+ *
+ * @param path Log file
+ * @param cb User callback function, may be NULL
+ * @param user_ptr Passed to the callback
+ * @param[out] stats Counters of the frame assembly, may be NULL
+ * @return UVC_ERROR_IO if the file can't be read, UVC_ERROR_INVALID_PARAM
+ * if it is not a payload log, a payload precedes the first format, or a
+ * record is larger than any transfer
+ */
+uvc_error_t uvc_replay_payloads(const char *path,
+    uvc_frame_callback_t *cb,
+    void *user_ptr,
+    uvc_stream_stats_t *stats) {
+  struct uvc_device_handle devh;
+  uvc_stream_handle_t *strmh;
+  FILE *fp;
+  uint8_t hdr[PLOG_RECHDR], *buf = NULL;
+  size_t buf_size = 0;
+  uint32_t len;
+  uvc_error_t ret = UVC_SUCCESS;
+
+  fp = fopen(path, "rb");
+  if (!fp)
+    return UVC_ERROR_IO;
+  if (fread(hdr, 1, 8, fp) != 8 || memcmp(hdr, PLOG_MAGIC, 8)) {
+    fclose(fp);
+    return UVC_ERROR_INVALID_PARAM;
+  }
+
+  memset(&devh, 0, sizeof(devh));
+  strmh = calloc(1, sizeof(*strmh));
+  if (!strmh) {
+    fclose(fp);
+    return UVC_ERROR_NO_MEM;
+  }
+  strmh->devh = &devh;
+  strmh->frame.library_owns_data = 1;
+  strmh->replay = 1;
+  strmh->user_cb = cb;
+  strmh->user_ptr = user_ptr;
+  strmh->outbuf = malloc(LIBUVC_XFER_BUF_SIZE);
+  strmh->holdbuf = malloc(LIBUVC_XFER_BUF_SIZE);
+  if (!strmh->outbuf || !strmh->holdbuf) {
+    ret = UVC_ERROR_NO_MEM;
+    goto done;
+  }
+
+  while (fread(hdr, 1, sizeof(hdr), fp) == sizeof(hdr)) {
+    len = _uvc_log_get(hdr, 4);
+    strmh->payload_mono = (int64_t) _uvc_log_get(hdr + 4, 8);
+
+    if (len == PLOG_FORMAT) {
+      uint8_t rec[PLOG_FMTLEN];
+
+      if (fread(rec, 1, sizeof(rec), fp) != sizeof(rec))
+        break;
+      /* a new stream starts like in uvc_stream_start() */
+      strmh->frame_format = _uvc_log_get(rec, 4);
+      strmh->width = _uvc_log_get(rec + 4, 2);
+      strmh->height = _uvc_log_get(rec + 6, 2);
+      memset(&strmh->clock, 0, sizeof(strmh->clock));
+      strmh->clock.freq = _uvc_log_get(rec + 8, 4);
+      devh.is_isight = (_uvc_log_get(rec + 12, 4) & PLOG_ISIGHT) != 0;
+      strmh->replay_real = (int64_t) _uvc_log_get(rec + 16, 8);
+      strmh->running = 1;
+      strmh->fid = 0;
+      strmh->got_bytes = 0;
+      strmh->pts = 0;
+      strmh->last_scr = 0;
+      strmh->sof_mono = 0;
+      strmh->scr_sampled = 0;
+      strmh->num_gaps = 0;
+      continue;
+    }
+    if (len == PLOG_LOST) {
+      strmh->stats.bad_packets++;
+      _uvc_mark_gap(strmh);
+      continue;
+    }
+    if (!strmh->running || len > LIBUVC_XFER_BUF_SIZE) {
+      ret = UVC_ERROR_INVALID_PARAM;
+      break;
+    }
+    if (len > buf_size) {
+      uint8_t *nbuf = realloc(buf, len);
+
+      if (!nbuf) {
+        ret = UVC_ERROR_NO_MEM;
+        break;
+      }
+      buf = nbuf;
+      buf_size = len;
+    }
+    if (fread(buf, 1, len, fp) != len)
+      break;  /* log cut short by a crash, use what we have */
+    _uvc_process_payload(strmh, buf, len);
+  }
+  if (ret == UVC_SUCCESS && ferror(fp))
+    ret = UVC_ERROR_IO;
+
+done:
+  if (stats)
+    *stats = strmh->stats;
+  fclose(fp);
+  free(buf);
+  free(strmh->frame.data);
+  free(strmh->outbuf);
+  free(strmh->holdbuf);
+  free(strmh);
+
+  return ret;
+}
+
 /** @brief Close stream.
  * @ingroup streaming
  *
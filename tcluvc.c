@@ -10,6 +10,10 @@
  * this file, and for a DISCLAIMER OF ALL WARRANTIES.
  */
 
+#if defined(linux) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE	/* For sendmmsg(). */
+#endif
+
 #include <tk.h>
 #include <string.h>
 #include <fcntl.h>
@@ -20,6 +24,10 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <time.h>
 #include <dlfcn.h>
 #include <libusb-1.0/libusb.h>
 #include <libusb-1.0/libusb_dl.h>
@@ -108,6 +116,15 @@ PUT32LE(unsigned int *p, unsigned int v)
     memcpy(p, b, 4);
 }
 
+static unsigned int inline
+GET32LE(const unsigned int *p)
+{
+    unsigned char b[4];
+
+    memcpy(b, p, 4);
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned int) b[3] << 24);
+}
+
 struct RIFF_avih {
     unsigned int uspf;    /* us per frame. */
     unsigned int bps;     /* Data rate. */
@@ -214,6 +231,55 @@ struct AVI_IDX {
     unsigned int size;
 };
 
+/*
+ * OpenDML (AVI 2.0) indices: the super index "indx" is reserved
+ * in the stream header list and points to one standard index
+ * "ix00" per RIFF segment, which is written at the end of the
+ * segment's "movi" list. Checkpoints write interim copies of it
+ * the super index entry points to until the next one. 64 bit
+ * offsets are split in two words to keep the structures free
+ * of padding.
+ */
+
+#define AVI_SUPERIDX_MAX 1024
+
+struct AVI_SUPERIDX_ENTRY {
+    unsigned int offset_lo;	/* File position of "ix00" chunk. */
+    unsigned int offset_hi;
+    unsigned int size;		/* Size of "ix00" chunk. */
+    unsigned int duration;	/* Number of frames in segment. */
+};
+
+struct AVI_SUPERIDX {
+    unsigned char id[4];
+    unsigned int size;
+    unsigned short longs_per_entry;
+    unsigned char sub_type;
+    unsigned char type;
+    unsigned int entries;
+    unsigned char chunk_id[4];
+    unsigned int res[3];
+    struct AVI_SUPERIDX_ENTRY entry[AVI_SUPERIDX_MAX];
+};
+
+struct AVI_STDIDX {
+    unsigned char id[4];
+    unsigned int size;
+    unsigned short longs_per_entry;
+    unsigned char sub_type;
+    unsigned char type;
+    unsigned int entries;
+    unsigned char chunk_id[4];
+    unsigned int base_lo;	/* Start of segment's "movi" data. */
+    unsigned int base_hi;
+    unsigned int res;
+};
+
+struct AVI_STDIDX_ENTRY {
+    unsigned int offset;	/* Offset of chunk data from base. */
+    unsigned int size;		/* Chunk size, bit 31 set if no key frame. */
+};
+
 /*
  * Structure for UVC control item.
  */
@@ -246,6 +312,7 @@ typedef struct {
     int iscomp;			/* Compressed format. */
     int bpp;			/* Bits per pixel for uncompressed formats. */
     char fourcc[4];		/* Four character code for format. */
+    int cm;			/* Colorimetry from descriptor. */
     short fpsList[32];		/* List of supported frame rates. */
     Tcl_DString str;		/* Textual representation. */
 } UFMT;
@@ -261,20 +328,288 @@ typedef struct {
 #define REC_ERROR	5
 
 /*
- * Control structure for libuvc capture.
+ * Overflow policies of recording queue.
+ */
+#define RQ_DROPOLDEST	0
+#define RQ_DROPNEWEST	1
+#define RQ_BLOCK	2
+
+/*
+ * Maximum number of recording sinks per device.
+ */
+#define REC_MAXSINKS	8
+
+/*
+ * Recording container formats.
+ */
+#define RF_AVI		0
+#define RF_MKV		1
+#define RF_RAW		2
+#define RF_Y4M		3
+#define RF_RTP		4
+
+/*
+ * RTP/JPEG sender: maximum packet payload, packets per sendmmsg(),
+ * and space for the headers of one packet.
+ */
+#define RTP_MTU		1400
+#define RTP_BATCH	64
+#define RTP_HDRSIZE	160
+
+#if defined(HAVE_SENDMMSG) && defined(HAVE_STRUCT_MMSGHDR)
+#define RTP_HAVE_MMSG	1
+#endif
+
+/*
+ * Motion detection works on a luma plane downscaled by MD_SCALE
+ * in both directions, which is what an MJPEG DC-only decode yields.
+ */
+#define MD_SCALE	8
+#define MD_MAXZONES	16
+
+/*
+ * MJPEG HTTP server: multipart boundary, limit of request header.
+ */
+#define SRV_BOUNDARY	"tcluvcframe"
+#define SRV_MAXREQ	8192
+
+/*
+ * MJPEG HTTP server: quality tiers of software encoded streams, each
+ * encoded once per frame for all clients at that tier. Clients move
+ * down a tier when the drain rate of their socket falls below
+ * SRV_MINFPS frames per second, and up again after SRV_CALM seconds
+ * without backlog.
+ */
+#define SRV_NTIERS	4
+#define SRV_MINFPS	5
+#define SRV_CALM	3
+
+#ifdef LIBUVC_HAVE_JPEG
+static const struct {
+    int scale;			/* Downscale factor. */
+    int quality;		/* JPEG quality, 0 is default. */
+} serveTiers[SRV_NTIERS] = {
+    { 1, 0 }, { 1, 50 }, { 2, 50 }, { 4, 35 }
+};
+#endif
+
+#if TCL_MAJOR_VERSION > 8
+#define SRV_CONST	const
+#else
+#define SRV_CONST
+#endif
+
+/*
+ * Recording sink: output channel with its own format, frame rate,
+ * and error state. A device feeds its frames to one or more sinks.
+ */
+
+typedef struct TSINK {
+    struct TUVC *tuvc;		/* Device feeding this sink. */
+    int id;			/* Sink identifier. */
+    int error;			/* Write error, no further output. */
+    int jpeg;			/* Frames are (transcoded to) JPEG. */
+    Tcl_Channel rchan;		/* Recording channel or NULL. */
+    int rfd;			/* OS handle of rchan for writev() or -1. */
+    Tcl_DString rbdStr;		/* Frame boundary string. */
+    int rfmt;			/* Container format, see RF_* above. */
+    struct timeval rrate;	/* Recording frame rate. */
+    struct timeval rtv;		/* Target time for next frame. */
+    struct timeval ltv;		/* Time of last frame read. */
+    struct {
+	Tcl_WideInt nframes;
+	Tcl_WideInt nframes0;
+	Tcl_WideInt totsize;
+	Tcl_WideInt segsize;
+	Tcl_WideInt segsize0;
+	Tcl_WideInt segstart;
+	int hdrsize;
+	Tcl_WideInt pos0;
+	struct timeval rate;
+	struct AVI_HDR avi_hdr;
+	struct AVI_HDR_VIDEO avi_hdrv;
+	struct AVI_HDR_ODML avi_hdro;
+	struct AVI_DATA avi_data;
+	int idx1size;
+	int curr_idx, num_idx;
+	struct AVI_IDX *idx;
+	Tcl_WideInt movistart;
+	int curr_sidx, num_sidx;
+	struct AVI_STDIDX_ENTRY *sidx;
+	int nsuper;
+	struct AVI_SUPERIDX superidx;
+	int ckpt;		/* Checkpoint interval in seconds or 0. */
+	struct timeval ckptv;	/* Time of next checkpoint. */
+    } avi;			/* AVI file writer. */
+    struct {
+	int width, height;	/* Frame size. */
+	char fourcc[4];		/* Pixel format of uncompressed frames. */
+	Tcl_WideInt dur;	/* Frame duration in ns. */
+	Tcl_WideInt start;	/* Time of first frame in ms. */
+	Tcl_WideInt cluster;	/* Time of current cluster or -1. */
+	Tcl_WideInt nframes;	/* Number of frames written. */
+    } mkv;			/* Matroska stream writer. */
+    struct {
+	int uspf;		/* Frame duration in us. */
+	int header;		/* Stream header has been written. */
+	unsigned char *buf;	/* Planar frame for packed YUV input. */
+	int bufsize;		/* Size of planar frame buffer. */
+    } y4m;			/* YUV4MPEG2 stream writer. */
+    struct {
+	int secs;		/* Rotate after seconds or 0. */
+	Tcl_WideInt bytes;	/* Rotate after bytes or 0. */
+	Tcl_DString pattern;	/* strftime() pattern for file names. */
+	Tcl_Channel next;	/* Pre-opened next file or NULL. */
+	int nextfd;		/* OS handle of next file or -1. */
+	Tcl_DString nextName;	/* Native name of next file. */
+	int pending;		/* Pre-open of next file requested. */
+	time_t retry;		/* Don't request pre-open before. */
+	int ndone;		/* Number of finished files. */
+	struct TSINK *done[8];	/* Finished files to be finalized, see
+				 * RotateFinish(). */
+	struct timeval start;	/* Time of first frame in file. */
+    } rot;			/* Recording file rotation. */
+    struct {
+	int fd;			/* Connected UDP socket or -1. */
+	unsigned short seq;	/* RTP sequence number. */
+	unsigned int ssrc;	/* RTP synchronization source. */
+	unsigned int ts0;	/* RTP timestamp offset. */
+	unsigned char *hdrs;	/* Packet headers of a frame. */
+	int nhdrs;		/* Number of packet headers allocated. */
+	Tcl_WideInt packets;	/* Packets sent. */
+	Tcl_WideInt skipped;	/* Frames not suitable for RFC 2435. */
+    } rtp;			/* RTP/JPEG sender. */
+} TSINK;
+
+/*
+ * MJPEG HTTP server: an encoded frame is shared by reference among
+ * all clients. A client still busy with its current frame gets its
+ * pending frame replaced, thus slow clients drop stale frames
+ * instead of stalling others.
+ */
+
+typedef struct TSBUF {
+    int refcnt;			/* Number of clients using the frame. */
+    uvc_frame_t *frame;		/* JPEG frame. */
+} TSBUF;
+
+typedef struct TSCLIENT {
+    struct TUVC *tuvc;		/* Device served. */
+    struct TSCLIENT *next;	/* Next client of device. */
+    int id;			/* Client identifier. */
+    Tcl_Channel chan;		/* Client socket. */
+    char host[64];		/* Peer address. */
+    int port;			/* Peer port. */
+    int streaming;		/* Request was read, frames are sent. */
+    int mask;			/* Current channel handler mask. */
+    Tcl_DString req;		/* Request received so far. */
+    TSBUF *cur;			/* Frame being sent or NULL. */
+    TSBUF *pend;		/* Next frame to send or NULL. */
+    char part[128];		/* MIME part header of current frame. */
+    int partlen;		/* Length of part header. */
+    Tcl_WideInt off;		/* Bytes of current part sent. */
+    Tcl_WideInt sent;		/* Frames sent. */
+    Tcl_WideInt dropped;	/* Frames replaced before being sent. */
+    Tcl_WideInt skipped;	/* Frames left out by rate adaption. */
+    Tcl_WideInt bytes;		/* Bytes sent. */
+    int fd;			/* OS handle of socket or -1. */
+    int tier;			/* Quality tier, see serveTiers. */
+    Tcl_WideInt backlog;	/* Bytes not yet drained at last sample. */
+    Tcl_WideInt added;		/* Bytes queued since last sample. */
+    struct timeval sampled;	/* Time of last sample. */
+    double drain;		/* Drain rate in bytes per second or 0. */
+    double ival;		/* Frame interval in seconds. */
+    struct timeval due;		/* Earliest time of next frame. */
+    struct timeval changed;	/* Time of last tier change. */
+    struct timeval busy;	/* Time backlog was last seen. */
+} TSCLIENT;
+
+/*
+ * Host side timing of a frame, kept along with the frame for
+ * "uvc image -meta". Times are on the monotonic clock in microseconds.
+ */
+
+typedef struct {
+    Tcl_WideInt entry;		/* FrameCallback() entered. */
+    Tcl_WideInt converted;	/* Conversion finished or 0. */
+    Tcl_WideInt inbytes;	/* Size as delivered by device. */
+} TFINFO;
+
+/*
+ * Pipeline statistics: histograms of durations in microseconds with
+ * power of two buckets, bucket k counting durations below 2^k, the
+ * last one the rest. Each thread involved updates its own shard of
+ * TPSTATS without locking, readers sum the shards.
+ */
+
+#define ST_NBUCKETS	24	/* Up to 2^23 us (~8 s). */
+
+typedef struct {
+    Tcl_WideInt count;		/* Number of samples. */
+    Tcl_WideInt sum;		/* Sum of samples. */
+    Tcl_WideInt max;		/* Largest sample. */
+    Tcl_WideInt buckets[ST_NBUCKETS];	/* Histogram. */
+} THIST;
+
+typedef struct {
+    THIST convert;		/* Conversion to RGB or grey. */
+    THIST jpeg;			/* JPEG encoding. */
+    THIST write;		/* Writing a frame to recording sinks. */
+    THIST queue;		/* Delay of frame events in Tcl queue. */
+} TPSTATS;
+
+#define PS_CALLBACK	0	/* Shard of libuvc callback thread. */
+#define PS_INTERP	1	/* Shard of interpreter thread. */
+#define PS_WRITER	2	/* Shard of recording writer thread. */
+#define PS_NSHARDS	3
+
+/*
+ * Tracing of pipeline stages into a Chrome trace file. Each device
+ * has one ring of complete events per thread role (see PS_* above)
+ * allocated when tracing starts, thus every ring has one producer.
+ * A flusher thread drains the rings of the trace to the file.
  */
 
+#define TR_RING		4096	/* Events per ring. */
+
 typedef struct {
+    const char *name;		/* Stage name, static string. */
+    Tcl_WideInt ts;		/* Begin, monotonic microseconds. */
+    Tcl_WideInt dur;		/* Duration in microseconds. */
+    int tid;			/* Thread id in trace. */
+    unsigned int seq;		/* Frame sequence number. */
+} TTEV;
+
+typedef struct TTRING {
+    struct TTRING *next;	/* Next ring of trace, traceMutex. */
+    Tcl_Mutex mutex;		/* Protects the following fields. */
+    char dev[32];		/* Device id. */
+    int head;			/* Index of oldest event. */
+    int count;			/* Number of events in ring. */
+    Tcl_WideInt lost;		/* Events lost due to full ring. */
+    TTEV ev[TR_RING];		/* Events. */
+} TTRING;
+
+/*
+ * Control structure for libuvc capture.
+ */
+
+typedef struct TUVC {
     int running;		/* Greater than zero when acquiring. */
     uvc_context_t *ctx;		/* libuvc context. */
     uvc_device_t *dev;		/* UVC device. */
     uvc_device_handle_t *devh;	/* UVC device handle. */
     uvc_frame_t *frame;		/* Last captured frame or NULL. */
+    uvc_frame_t *jframe;	/* MJPEG original of converted frame
+				 * or NULL. */
+    TFINFO finfo;		/* Timing of last frame, uvcMutex. */
+    Tcl_WideInt lastseq;	/* Sequence of last retrieved frame. */
     Tcl_Interp *interp;		/* Interpreter for this object. */
     Tcl_ThreadId tid;		/* Thread identifier of interp. */
     Tcl_HashTable evts;		/* Events in flight. */
     int numev;			/* Number events queued. */
     int idle;			/* FrameReady() in do-when-idle. */
+    int replay;			/* Frames come from "uvc replay". */
     int mirror;			/* Image mirror flags. */
     int rotate;			/* Image rotation in degrees. */
     int width;			/* Requested width. */
@@ -284,6 +619,8 @@ typedef struct {
     int usefmt;			/* Current UVC format index. */
     int iscomp;			/* Compressed format. */
     int greyshift;		/* For GRAY16 to GRAY8 conversion. */
+    int colorimetry;		/* Requested colorimetry or -1 (auto). */
+    int cm;			/* Colorimetry for YUV conversions. */
     Tcl_HashTable ctrl;		/* UVC controls. */
     Tcl_HashTable fmts;		/* UVC formats. */
     char devId[32];		/* Device id. */
@@ -291,43 +628,140 @@ typedef struct {
     int cbCmdLen;		/* Initial length of callback command. */
     Tcl_DString cbCmd;		/* Callback command prefix. */
     Tcl_WideInt counters[3];	/* Statistic counters. */
+    TPSTATS pstats[PS_NSHARDS];	/* Pipeline statistics per thread. */
+    int trace;			/* Trace pipeline stages. */
+    int ttid;			/* Base of thread ids in trace. */
+    TTRING *trings[PS_NSHARDS];	/* Trace rings per thread role. */
+    uvc_stream_stats_t usb;	/* USB counters of stopped capture. */
+    uvc_payload_log_t *plog;	/* Log of raw payloads or NULL. */
+    uvc_frame_t *lastgood;	/* Last decoded MJPEG frame for concealing
+				 * lost data, kept after first damage. */
+    struct {
+	Tcl_WideInt frames;	/* Damaged frames partially decoded. */
+	Tcl_WideInt intervals;	/* Restart intervals concealed. */
+	Tcl_WideInt failed;	/* Damaged frames not decodable. */
+    } conceal;
+    Tcl_Obj *plogName;		/* File name of payload log. */
+    struct TGRP *grp;		/* Capture group or NULL, uvcMutex. */
+    int grpIdx;			/* Index in capture group. */
 
     /* Info for recording to channel (file or socket) follows. */
 
     int rstate;			/* Recording state. */
     int ruser;			/* True, when user writes frames. */
-    Tcl_Channel rchan;		/* Recording channel or NULL. */
-    Tcl_DString rbdStr;		/* Frame boundary string. */
-    struct timeval rrate;	/* Recording frame rate. */
-    struct timeval rtv;		/* Target time for next frame. */
-    struct timeval ltv;		/* Time of last frame read. */
     Tcl_Mutex rmutex;		/* Recording mutex. */
+    int nsinks;			/* Number of recording sinks. */
+    int sinkid;			/* Source of sink identifiers. */
+    TSINK *sinks[REC_MAXSINKS];	/* Recording sinks. */
     struct {
-	Tcl_WideInt nframes;
-	Tcl_WideInt nframes0;
-	Tcl_WideInt totsize;
-	Tcl_WideInt segsize;
-	Tcl_WideInt segsize0;
-	Tcl_WideInt segstart;
-	int hdrsize;
-	Tcl_WideInt pos0;
-	struct timeval rate;
-	struct AVI_HDR avi_hdr;
-	struct AVI_HDR_VIDEO avi_hdrv;
-	struct AVI_HDR_ODML avi_hdro;
-	struct AVI_DATA avi_data;
-	int idx_off;
-	int curr_idx, num_idx;
-	struct AVI_IDX *idx;
-    } avi;			/* AVI file writer. */
+	Tcl_ThreadId tid;	/* Writer thread or NULL. */
+	Tcl_Mutex mutex;	/* Protects the following fields. */
+	Tcl_Condition cond;	/* Signals changes of queue state. */
+	int run;		/* Writer thread keeps running when true. */
+	int policy;		/* Overflow policy, see RQ_* above. */
+	int size;		/* Number of slots in queue. */
+	int head;		/* Index of oldest frame in queue. */
+	int count;		/* Number of frames in queue. */
+	int highwater;		/* Maximum number of frames in queue. */
+	Tcl_WideInt dropped;	/* Frames dropped due to overflow. */
+	uvc_frame_t **frames;	/* Ring buffer of queued frames. */
+    } rq;			/* Recording queue. */
+    struct {
+	double secs;		/* Length of pre-event buffer. */
+	Tcl_WideInt maxbytes;	/* Memory limit of buffer. */
+	int armed;		/* Frames go to buffer, not to channel. */
+	int trigger;		/* Flush buffer with next frame. */
+	int size;		/* Number of slots in ring. */
+	int head;		/* Index of oldest frame in ring. */
+	int count;		/* Number of frames in ring. */
+	Tcl_WideInt bytes;	/* Bytes held in ring. */
+	uvc_frame_t **frames;	/* Ring of (compressed) frames. */
+    } pre;			/* Pre-event buffer. */
+    struct {
+	Tcl_Mutex mutex;	/* Protects the following fields. */
+	int enabled;		/* Motion detection turned on. */
+	int threshold;		/* Luma difference of changed cell. */
+	double minscore;	/* Fraction of changed cells in zone. */
+	int learn;		/* Background adaption rate, power of 2. */
+	int skip;		/* Don't notify frames without motion. */
+	int nzones;		/* Number of zones, 0 is whole frame. */
+	int zones[MD_MAXZONES][4];	/* Zones as x, y, width, height. */
+	Tcl_DString cmd;	/* Motion callback or empty. */
+	int width, height;	/* Size of luma plane. */
+	unsigned char *luma;	/* Luma plane of last frame. */
+	unsigned short *bg;	/* Background model, 8.8 fixed point. */
+	uvc_frame_t *dc;	/* Buffer for MJPEG DC decode. */
+	int motion;		/* Motion in last frame. */
+	int pending;		/* Result not yet reported. */
+	double score;		/* Highest zone score of result. */
+	int nboxes;		/* Number of bounding boxes of result. */
+	int boxes[MD_MAXZONES][4];	/* Bounding boxes of result. */
+    } md;			/* Motion detection. */
+    struct {
+	Tcl_Channel listen;	/* Listening socket or NULL. */
+	int port;		/* Port of listening socket. */
+	int maxclients;		/* Limit of connected clients. */
+	int nclients;		/* Number of connected clients. */
+	int active;		/* Number of streaming clients. */
+	int clientid;		/* Source of client identifiers. */
+	TSCLIENT *clients;	/* List of clients. */
+	struct timeval rate;	/* Minimum frame interval. */
+	struct timeval next;	/* Earliest time of next frame. */
+	uvc_frame_t *enc[SRV_NTIERS];	/* Frames handed over, uvcMutex. */
+	int pending;		/* ServeReady0() queued, uvcMutex. */
+	int sw;			/* Frames are software encoded. */
+	int adapt;		/* Adapt rate and tier per client. */
+	int tiers[SRV_NTIERS];	/* Number of clients per tier. */
+	double size[SRV_NTIERS];	/* Average frame size per tier. */
+	Tcl_WideInt frames;	/* Frames broadcast. */
+    } srv;			/* MJPEG HTTP server. */
 } TUVC;
 
 typedef struct {
     Tcl_Event hdr;		/* Generic event header. */
     TUVC *tuvc;			/* Pointer to control structure. */
     Tcl_HashEntry *hPtr;	/* For invalidating the event. */
+    Tcl_WideInt queued;		/* Time of queueing, FrameReady0(). */
+    int replay;			/* Queued by replay, FrameReady0(). */
 } TUEVT;
 
+/*
+ * Capture group: frames of member devices are kept in short rings
+ * and matched by capture time into sets. All fields but the
+ * immutable ones are protected by uvcMutex.
+ */
+
+#define GRP_MAXDEVS	8	/* Maximum number of group members. */
+#define GRP_RING	4	/* Frames kept per member for matching. */
+
+typedef struct TGRP {
+    Tcl_Interp *interp;		/* Interpreter for this object. */
+    Tcl_ThreadId tid;		/* Thread identifier of interp. */
+    Tcl_HashEntry *hPtr;	/* Entry in TUVCI.groups. */
+    char grpId[32];		/* Group id. */
+    Tcl_Obj *cmdObj;		/* Callback command or NULL. */
+    int tolerance;		/* Maximum skew of a set in microseconds. */
+    int ndevs;			/* Number of members. */
+    TUVC *devs[GRP_MAXDEVS];	/* Member devices. */
+    int nring[GRP_MAXDEVS];	/* Number of frames in ring. */
+    uvc_frame_t *ring[GRP_MAXDEVS][GRP_RING];	/* Oldest first. */
+    TFINFO rinfo[GRP_MAXDEVS][GRP_RING];	/* Timing of ring frames. */
+    uvc_frame_t *set[GRP_MAXDEVS];	/* Matched set to deliver. */
+    TFINFO sinfo[GRP_MAXDEVS];	/* Timing of set frames. */
+    int skew;			/* Skew of set in microseconds. */
+    struct TGEVT *ev;		/* Event in flight or NULL. */
+    Tcl_WideInt sets;		/* Sets matched. */
+    Tcl_WideInt overrun;	/* Sets replaced before delivery. */
+    Tcl_WideInt unmatched[GRP_MAXDEVS];	/* Frames without partners. */
+    double skewsum;		/* Sum of skews for average. */
+    int maxskew;		/* Largest skew seen. */
+} TGRP;
+
+typedef struct TGEVT {
+    Tcl_Event hdr;		/* Generic event header. */
+    TGRP *grp;			/* Group or NULL when invalidated. */
+} TGEVT;
+
 /*
  * Per interpreter control structure.
  */
@@ -338,6 +772,8 @@ typedef struct {
     int checkedTk;			/* Non-zero when Tk availability
 					 * checked. */
     Tcl_HashTable tuvcc;		/* List of active TUVC instances. */
+    int grpCount;			/* Source of group ids. */
+    Tcl_HashTable groups;		/* List of capture groups. */
     Tcl_Encoding enc;			/* UTF-8 encoding. */
 #ifdef HAVE_LIBUDEV
     Tcl_Interp *interp;			/* Interpreter for this object. */
@@ -455,6 +891,22 @@ TCL_DECLARE_MUTEX(uvcMutex)
 static int uvcInitialized = 0;
 static int tip609 = 0;
 
+/*
+ * State of stage tracing, one trace per process, traceMutex.
+ */
+
+TCL_DECLARE_MUTEX(traceMutex)
+static struct {
+    int run;			/* Trace is active. */
+    TUVCI *owner;		/* Interpreter which started trace. */
+    FILE *fp;			/* Output file. */
+    Tcl_ThreadId tid;		/* Flusher thread. */
+    Tcl_Condition cond;		/* Wakes up flusher. */
+    TTRING *rings;		/* Rings of traced devices. */
+    Tcl_WideInt written;	/* Events written. */
+    Tcl_WideInt lost;		/* Events lost. */
+} uvcTrace;
+
 /*
  * Stuff for dynamic linking libusb-1.0.so.0
  */
@@ -558,26 +1010,123 @@ static struct {
  */
 
 static int		CheckForTk(TUVCI *tuvci, Tcl_Interp *interp);
-static void		CloseAVISegment(TUVC *tuvc, int end);
+static void		AddAVIIndex(TSINK *sink, int sizea);
+static void		WriteAVIStdIndex(TSINK *sink, int final);
+static void		WriteAVIXHeader(TSINK *sink);
+static void		CheckpointAVI(TSINK *sink);
+static void		CloseAVISegment(TSINK *sink, int end);
 #ifdef LIBUVC_HAVE_JPEG
-static uvc_frame_t *	FrameToJPEG(uvc_frame_t *in, int greyshift);
+static uvc_frame_t *	FrameToJPEG(TUVC *tuvc, uvc_frame_t *in);
+static uvc_frame_t *	FrameToJPEGEx(TUVC *tuvc, uvc_frame_t *in,
+				      int scale, int quality);
+static uvc_frame_t *	FrameShrink(uvc_frame_t *in, int scale);
 #endif
+static Tcl_Size		WriteVec(TSINK *sink, struct iovec *iov, int iovcnt);
+static int		WriteAt(TSINK *sink, Tcl_WideInt pos,
+				const void *buf, int len);
 static int		WriteFrame(TUVC *tuvc, uvc_frame_t *frame);
+static int		SinkWrite(TSINK *sink, uvc_frame_t *frame,
+				  uvc_frame_t **jpegPtr);
 static int		StartRecording(TUVC *tuvc, Tcl_Interp *interp,
-				       int objc, Tcl_Obj * const objv[]);
-static void		WriteAVIHeader(TUVC *tuvc, int end);
+				       int objc, Tcl_Obj * const objv[],
+				       int add);
+static void		WriteAVIHeader(TSINK *sink, int end);
+static int		RepairAVI(Tcl_Interp *interp, Tcl_Obj *pathPtr);
+static void		StartAVIFile(TSINK *sink, Tcl_WideInt pos0);
+static int		MKVId(unsigned char *p, unsigned int id);
+static int		MKVSize(unsigned char *p, Tcl_WideInt size);
+static int		MKVUint(unsigned char *p, unsigned int id,
+				Tcl_WideInt val);
+static int		MKVData(unsigned char *p, unsigned int id,
+				const void *data, int len);
+static int		MKVMaster(unsigned char *p, unsigned int id,
+				  const unsigned char *body, int len);
+static void		StartMKVFile(TSINK *sink);
+static int		RtpOpen(Tcl_Interp *interp, const char *dest);
+static int		RtpSend(TSINK *sink, uvc_frame_t *frame);
+static void		RotateName(TSINK *sink, time_t t, Tcl_DString *dsPtr);
+static void		RotateCheck(TSINK *sink);
+static void		RotateRequest(TSINK *sink);
+static int		RotateReady0(Tcl_Event *evPtr, int flags);
+static void		RotateOpenNext(TSINK *sink);
+static int		RotateFinish(TSINK *old);
 static void		FinishRecording(TUVC *tuvc, int lock, int final);
+static void		SinkFinish(TSINK *sink);
+static void		SinkResetTime(TUVC *tuvc);
+static Tcl_ThreadCreateType	RecordWriter(ClientData clientData);
+static void		RecordQueueStart(TUVC *tuvc, int size, int policy);
+static void		RecordQueueStop(TUVC *tuvc);
+static void		RecordQueuePut(TUVC *tuvc, uvc_frame_t *frame);
+static void		PreBufferPut(TUVC *tuvc, uvc_frame_t *frame);
+static void		PreBufferFlush(TUVC *tuvc);
+static void		PreBufferFree(TUVC *tuvc);
 static int		RecordFrameFromData(TUVC *tuvc, Tcl_Interp *interp,
 					    int objc, Tcl_Obj * const objv[]);
 static int		DataToPhoto(TUVCI *tuvci, Tcl_Interp *interp,
 				    int objc, Tcl_Obj * const objv[]);
+static int		MotionLuma(TUVC *tuvc, uvc_frame_t *frame);
+static int		MotionDetect(TUVC *tuvc, uvc_frame_t *frame);
+static int		MotionReady0(Tcl_Event *evPtr, int flags);
+static void		MotionReport(TUVC *tuvc);
+static int		MotionConfig(TUVC *tuvc, Tcl_Interp *interp,
+				     int objc, Tcl_Obj * const objv[]);
+static void		MotionFree(TUVC *tuvc);
+static void		ServeFrame(TUVC *tuvc, uvc_frame_t *frame);
+static int		ServeReady0(Tcl_Event *evPtr, int flags);
+static void		ServeAccept(ClientData clientData, Tcl_Channel chan,
+				    SRV_CONST char *host, int port);
+static void		ServeHandler(ClientData clientData, int mask);
+static int		ServeAdapt(TSCLIENT *client, struct timeval *now);
+static int		ServeSend(TSCLIENT *client);
+static void		ServeRelease(TSBUF *buf);
+static void		ServeClose(TSCLIENT *client);
+static void		ServeStop(TUVC *tuvc);
+static int		ServeConfig(TUVC *tuvc, Tcl_Interp *interp,
+				    int objc, Tcl_Obj * const objv[]);
+static Tcl_WideInt	MonoTime(void);
+static void		HistAdd(THIST *h, Tcl_WideInt us);
+static TPSTATS *	StatsShard(TUVC *tuvc);
+static int		GetStats(TUVC *tuvc);
+static int		PayloadLog(TUVC *tuvc, Tcl_Obj *fileObj);
+static void		PayloadLogStop(TUVC *tuvc);
+static int		Replay(TUVC *tuvc, Tcl_Obj *fileObj);
+static int		ThreadRole(TUVC *tuvc);
+static void		TraceEvent(TUVC *tuvc, const char *name,
+			    Tcl_WideInt begin, Tcl_WideInt end,
+			    unsigned int seq, int tid);
+static void		TraceFlush(TTEV *buf);
+static Tcl_ThreadCreateType	TraceFlusher(ClientData clientData);
+static void		TraceStop(TUVCI *tuvci, Tcl_Obj **resultPtr);
+static void		TraceDetach(TUVC *tuvc);
+static int		TraceCmd(TUVCI *tuvci, Tcl_Interp *interp,
+			    int objc, Tcl_Obj * const objv[]);
 static void		FrameCallback(uvc_frame_t *frame, void *arg);
+static void		GroupPut(TGRP *grp, int idx, uvc_frame_t *frame,
+			    const TFINFO *info);
+static int		GroupReady0(Tcl_Event *evPtr, int flags);
+static void		GroupDelete(TGRP *grp);
+static int		GroupCmd(TUVCI *tuvci, Tcl_Interp *interp,
+			    int objc, Tcl_Obj * const objv[]);
+static void		RecordLastFrame(TUVC *tuvc);
 static void		FrameReady(ClientData clientData);
 static int		FrameReady0(Tcl_Event *evPtr, int flags);
 static int		StopCapture(TUVC *tuvc);
 static int		StartCapture(TUVC *tuvc);
-static int		GetImage(TUVCI *tuvci, TUVC *tuvc, Tcl_Obj *arg);
+static int		GetImage(TUVCI *tuvci, TUVC *tuvc, Tcl_Obj *arg,
+			    Tcl_Obj *varName);
+static int		GetJPEG(TUVC *tuvc, Tcl_Obj *fileObj);
+static Tcl_Obj *	FrameMeta(TUVC *tuvc, uvc_frame_t *frame,
+			    const TFINFO *info);
+static int		GetMeta(TUVC *tuvc);
+static uvc_frame_t *	FrameToRGB(TUVC *tuvc, uvc_frame_t *frame);
+static void		MaskBlend(unsigned char *dst, const unsigned char *a,
+			    const unsigned char *b, Tcl_Size len,
+			    const unsigned char m[24]);
+static int		StereoImage(TUVCI *tuvci, Tcl_Interp *interp,
+			    int objc, Tcl_Obj * const objv[]);
+static Tcl_ThreadCreateType	JPEGWriter(ClientData clientData);
 static void		InitControls(TUVC *tuvc);
+static void		SelectColorimetry(TUVC *tuvc);
 static void		GetControls(TUVC *tuvc, Tcl_Obj *list);
 static void		PrintVal(UCTRL *uctrl, unsigned char *data,
 				 Tcl_DString *dsPtr, Tcl_Obj *list);
@@ -956,19 +1505,233 @@ CheckForTk(TUVCI *tuvci, Tcl_Interp *interp)
     return TCL_OK;
 }
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * AddAVIIndex --
+ *
+ *	Recording: add index entries for the AVI chunk just written,
+ *	which has "sizea" bytes of data. The "idx1" index covers
+ *	the first segment only, the standard index the current one.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+AddAVIIndex(TSINK *sink, int sizea)
+{
+    if (sink->avi.totsize == sink->avi.segsize) {
+	if (sink->avi.curr_idx >= sink->avi.num_idx) {
+	    int newsize = sink->avi.num_idx + 512;
+	    struct AVI_IDX *newidx;
+
+	    newidx = attemptckrealloc((char *) sink->avi.idx,
+				      newsize * sizeof(struct AVI_IDX));
+	    if (newidx == NULL) {
+		sink->avi.curr_idx = sink->avi.num_idx = 0;
+		if (sink->avi.idx != NULL) {
+		    ckfree((char *) sink->avi.idx);
+		    sink->avi.idx = NULL;
+		}
+	    } else {
+		sink->avi.num_idx = newsize;
+		sink->avi.idx = newidx;
+	    }
+	}
+	if (sink->avi.idx != NULL) {
+	    struct AVI_IDX *idx = sink->avi.idx + sink->avi.curr_idx;
+
+	    memcpy(idx->id, "00db", 4);
+	    PUT32LE(&idx->flags, 0x10);
+	    /* Offset of chunk header relative to "movi" list type. */
+	    PUT32LE(&idx->offset, sink->avi.segsize - sizea - 4);
+	    PUT32LE(&idx->size, sizea);
+	    sink->avi.curr_idx++;
+	}
+    }
+    if (sink->avi.curr_sidx >= sink->avi.num_sidx) {
+	int newsize = sink->avi.num_sidx + 4096;
+	struct AVI_STDIDX_ENTRY *newidx;
+
+	newidx = attemptckrealloc((char *) sink->avi.sidx,
+				  newsize * sizeof(struct AVI_STDIDX_ENTRY));
+	if (newidx == NULL) {
+	    /* Segment remains without standard index. */
+	    sink->avi.curr_sidx = -1;
+	    return;
+	}
+	sink->avi.num_sidx = newsize;
+	sink->avi.sidx = newidx;
+    }
+    if (sink->avi.curr_sidx >= 0) {
+	struct AVI_STDIDX_ENTRY *sidx = sink->avi.sidx + sink->avi.curr_sidx;
+
+	/* Offset of chunk data relative to start of segment data. */
+	PUT32LE(&sidx->offset, sink->avi.segsize - sizea);
+	PUT32LE(&sidx->size, sizea);
+	sink->avi.curr_sidx++;
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * WriteAVIStdIndex --
+ *
+ *	Recording: write the "ix00" standard index of the current
+ *	segment so far at the end of its "movi" list and enter it
+ *	into the segment's slot of the super index. When "final"
+ *	is false (checkpoint) the index entries are kept for the
+ *	next write, which supersedes this one.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+WriteAVIStdIndex(TSINK *sink, int final)
+{
+    struct AVI_STDIDX ix;
+    struct AVI_SUPERIDX_ENTRY *entry;
+    struct iovec iov[2];
+    Tcl_Size toWrite, written;
+    Tcl_WideInt pos;
+    int n = sink->avi.curr_sidx;
+    static const struct AVI_STDIDX ix0 = {
+	{ 'i', 'x', '0', '0' },
+	0,
+	0,
+	0,
+	1,			/* AVI_INDEX_OF_CHUNKS */
+	0,
+	{ '0', '0', 'd', 'b' },
+	0,
+	0,
+	0
+    };
+
+    if ((n <= 0) || (sink->avi.movistart <= 0)) {
+	if (final) {
+	    if ((int) GET32LE(&sink->avi.superidx.entries) >
+		sink->avi.nsuper) {
+		/* Keep what the last checkpoint indexed. */
+		sink->avi.nsuper++;
+	    }
+	    sink->avi.curr_sidx = 0;
+	}
+	return;
+    }
+    if (sink->avi.nsuper >= AVI_SUPERIDX_MAX) {
+	/* CloseAVISegment() doesn't start a segment without a slot. */
+	sink->error = 1;
+	return;
+    }
+    pos = sink->avi.movistart + sink->avi.segsize;
+    ix = ix0;
+    PUT32LE(&ix.size, sizeof(ix) - sizeof(struct CHUNK_HDR) +
+	    n * sizeof(struct AVI_STDIDX_ENTRY));
+    PUT16LE(&ix.longs_per_entry, 2);
+    PUT32LE(&ix.entries, n);
+    PUT32LE(&ix.base_lo, sink->avi.movistart & 0xFFFFFFFF);
+    PUT32LE(&ix.base_hi, sink->avi.movistart >> 32);
+    iov[0].iov_base = &ix;
+    iov[0].iov_len = sizeof(ix);
+    iov[1].iov_base = sink->avi.sidx;
+    iov[1].iov_len = n * sizeof(struct AVI_STDIDX_ENTRY);
+    toWrite = iov[0].iov_len + iov[1].iov_len;
+    written = WriteVec(sink, iov, 2);
+    if (final) {
+	sink->avi.curr_sidx = 0;
+    }
+    if (written != toWrite) {
+	sink->error = 1;
+	return;
+    }
+    sink->avi.totsize += toWrite;
+    sink->avi.segsize += toWrite;
+
+    entry = sink->avi.superidx.entry + sink->avi.nsuper;
+    PUT32LE(&entry->offset_lo, pos & 0xFFFFFFFF);
+    PUT32LE(&entry->offset_hi, pos >> 32);
+    PUT32LE(&entry->size, toWrite);
+    PUT32LE(&entry->duration, n);
+    PUT32LE(&sink->avi.superidx.entries, sink->avi.nsuper + 1);
+    if (final) {
+	sink->avi.nsuper++;
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * WriteAVIXHeader --
+ *
+ *	Recording: rewrite the "AVIX" header of the current (not
+ *	first) segment with its current size.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+WriteAVIXHeader(TSINK *sink)
+{
+    struct AVIX_HDR xhdr;
+
+    memcpy(xhdr.riff_id, "RIFF", 4);
+    PUT32LE(&xhdr.riff_size, sink->avi.segsize + 16);
+    memcpy(xhdr.riff_type, "AVIX", 4);
+    memcpy(xhdr.data_list_id, "LIST", 4);
+    PUT32LE(&xhdr.data_size, sink->avi.segsize + 4);
+    memcpy(xhdr.data_type, "movi", 4);
+    if (!WriteAt(sink, sink->avi.segstart, &xhdr, sizeof(xhdr))) {
+	sink->error = 1;
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * CheckpointAVI --
+ *
+ *	Recording: make the file written so far a valid AVI file
+ *	without interrupting the recording. The frames of the current
+ *	segment get an interim standard index, then the headers are
+ *	rewritten in place with the current sizes. Frames written
+ *	after this point lie past the end of the RIFF structure
+ *	until the next checkpoint.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+CheckpointAVI(TSINK *sink)
+{
+    WriteAVIStdIndex(sink, 0);
+    if (sink->error) {
+	return;
+    }
+    if (sink->avi.totsize > sink->avi.segsize) {
+	WriteAVIXHeader(sink);
+    } else {
+	sink->avi.nframes0 = sink->avi.nframes;
+	sink->avi.segsize0 = sink->avi.segsize;
+    }
+    WriteAVIHeader(sink, 0);
+}
+
 /*
  *-------------------------------------------------------------------------
  *
  * CloseAVISegment --
  *
  *	Recording: close current and optionally start next 2G AVI
- *	segment in output file.
+ *	segment in output file. The first segment gets the legacy
+ *	"idx1" index, every segment its "ix00" standard index.
  *
  *-------------------------------------------------------------------------
  */
 
 static void
-CloseAVISegment(TUVC *tuvc, int end)
+CloseAVISegment(TSINK *sink, int end)
 {
     Tcl_Size toWrite = 0, written = 0;
     Tcl_WideInt pos;
@@ -982,52 +1745,68 @@ CloseAVISegment(TUVC *tuvc, int end)
 	{ 'm', 'o', 'v', 'i' }
     };
 
-    pos = Tcl_Seek(tuvc->rchan, 0, SEEK_CUR);
-    if (tuvc->avi.totsize > tuvc->avi.segsize) {
-	Tcl_Seek(tuvc->rchan, tuvc->avi.segstart, SEEK_SET);
-	xhdr = xhdr0;
-	PUT32LE(&xhdr.riff_size, tuvc->avi.segsize + 16);
-	PUT32LE(&xhdr.data_size, tuvc->avi.segsize + 4);
-	toWrite = sizeof(xhdr);
-	written = Tcl_WriteRaw(tuvc->rchan, (const char *) &xhdr, toWrite);
-	Tcl_Seek(tuvc->rchan, pos, SEEK_SET);
+    WriteAVIStdIndex(sink, 1);
+    if (sink->error) {
+	return;
+    }
+    if (sink->avi.totsize > sink->avi.segsize) {
+	/* Keep super index in main header current. */
+	WriteAVIXHeader(sink);
+	WriteAVIHeader(sink, 0);
     } else {
-	tuvc->avi.nframes0 = tuvc->avi.nframes;
-	tuvc->avi.segsize0 = tuvc->avi.segsize;
-	WriteAVIHeader(tuvc, 0);
-	if (tuvc->rstate == REC_ERROR) {
-	    return;
-	}
+	sink->avi.nframes0 = sink->avi.nframes;
+	sink->avi.segsize0 = sink->avi.segsize;
+	WriteAVIHeader(sink, 1);
+    }
+    if (sink->error) {
+	return;
+    }
+    if (!end && (sink->avi.nsuper >= AVI_SUPERIDX_MAX)) {
+	/* Super index full, the file ends here. */
+	sink->error = 1;
+	return;
     }
-    tuvc->avi.segsize = 0;
-    tuvc->avi.segstart = pos;
-    if (!end && (written == toWrite)) {
+    pos = Tcl_Seek(sink->rchan, 0, SEEK_CUR);
+    sink->avi.segsize = 0;
+    sink->avi.segstart = pos;
+    sink->avi.movistart = pos + sizeof(xhdr);
+    if (!end) {
 	xhdr = xhdr0;
 	toWrite = sizeof(xhdr);
-	written = Tcl_WriteRaw(tuvc->rchan, (const char *) &xhdr, toWrite);
+	written = Tcl_WriteRaw(sink->rchan, (const char *) &xhdr, toWrite);
     }
     if (written != toWrite) {
-	tuvc->rstate = REC_ERROR;
+	sink->error = 1;
     }
 }
-
+
 #ifdef LIBUVC_HAVE_JPEG
 /*
  *-------------------------------------------------------------------------
  *
- * FrameToJPEG --
+ * FrameToJPEG, FrameToJPEGEx --
  *
  *	Convert frame to JPEG. Input frame must not be JPEG yet.
+ *	The extended version downscales the image by an integer
+ *	factor and sets the JPEG quality (0 is libjpeg's default).
  *	Returns allocated and populated new frame or NULL on error.
+ *	The encode time goes into the statistics of the device.
  *
  *-------------------------------------------------------------------------
  */
 
 static uvc_frame_t *
-FrameToJPEG(uvc_frame_t *in, int greyshift)
+FrameToJPEG(TUVC *tuvc, uvc_frame_t *in)
+{
+    return FrameToJPEGEx(tuvc, in, 1, 0);
+}
+
+static uvc_frame_t *
+FrameToJPEGEx(TUVC *tuvc, uvc_frame_t *in, int scale, int quality)
 {
     uvc_frame_t *out, *tmpFrame = in;
     uvc_error_t uret;
+    Tcl_WideInt t0 = MonoTime();
 
     if (in->frame_format == UVC_FRAME_FORMAT_MJPEG) {
 	return NULL;
@@ -1037,7 +1816,7 @@ FrameToJPEG(uvc_frame_t *in, int greyshift)
 	if (tmpFrame == NULL) {
 	    return NULL;
 	}
-	uret = uvc_gray16to8(in, tmpFrame, greyshift);
+	uret = uvc_gray16to8(in, tmpFrame, tuvc->greyshift);
 	if (uret) {
 	    uvc_free_frame(tmpFrame);
 	    return NULL;
@@ -1048,20 +1827,30 @@ FrameToJPEG(uvc_frame_t *in, int greyshift)
 	if (tmpFrame == NULL) {
 	    return NULL;
 	}
-	uret = uvc_any2rgb(in, tmpFrame);
+	uret = uvc_any2rgb_ex(in, tmpFrame, tuvc->cm);
 	if (uret) {
 	    uvc_free_frame(tmpFrame);
 	    return NULL;
 	}
     }
-    out = uvc_allocate_frame(tmpFrame->data_bytes);
+    if (scale > 1) {
+	out = FrameShrink(tmpFrame, scale);
+	if (tmpFrame != in) {
+	    uvc_free_frame(tmpFrame);
+	}
+	if (out == NULL) {
+	    return NULL;
+	}
+	tmpFrame = out;
+    }
+    out = uvc_allocate_frame(tmpFrame->data_bytes);
     if (out == NULL) {
 	if (tmpFrame != in) {
 	    uvc_free_frame(tmpFrame);
 	}
 	return NULL;
     }
-    uret = uvc_rgb2mjpeg(tmpFrame, out);
+    uret = uvc_rgb2mjpeg_q(tmpFrame, out, quality);
     if (tmpFrame != in) {
 	uvc_free_frame(tmpFrame);
     }
@@ -1069,6 +1858,64 @@ FrameToJPEG(uvc_frame_t *in, int greyshift)
 	uvc_free_frame(out);
 	return NULL;
     }
+    HistAdd(&StatsShard(tuvc)->jpeg, MonoTime() - t0);
+    return out;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * FrameShrink --
+ *
+ *	Downscale RGB or GRAY8 frame by an integer factor averaging
+ *	square blocks of pixels. Returns allocated new frame or NULL.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static uvc_frame_t *
+FrameShrink(uvc_frame_t *in, int scale)
+{
+    uvc_frame_t *out;
+    int x, y, i, j, c, ncomp, width, height, sum, n = scale * scale;
+    unsigned char *src, *dst;
+
+    ncomp = (in->frame_format == UVC_FRAME_FORMAT_RGB) ? 3 : 1;
+    width = in->width / scale;
+    height = in->height / scale;
+    if ((width <= 0) || (height <= 0)) {
+	return NULL;
+    }
+    out = uvc_allocate_frame(width * height * ncomp);
+    if (out == NULL) {
+	return NULL;
+    }
+    out->width = width;
+    out->height = height;
+    out->step = width * ncomp;
+    out->frame_format = in->frame_format;
+    out->sequence = in->sequence;
+    out->capture_time = in->capture_time;
+    out->pts = in->pts;
+    out->scr = in->scr;
+    out->capture_mono = in->capture_mono;
+    out->clock_model = in->clock_model;
+    dst = (unsigned char *) out->data;
+    for (y = 0; y < height; y++) {
+	for (x = 0; x < width; x++) {
+	    for (c = 0; c < ncomp; c++) {
+		src = (unsigned char *) in->data + y * scale * in->step +
+		    x * scale * ncomp + c;
+		sum = 0;
+		for (j = 0; j < scale; j++) {
+		    for (i = 0; i < scale; i++) {
+			sum += src[j * in->step + i * ncomp];
+		    }
+		}
+		*dst++ = (sum + n / 2) / n;
+	    }
+	}
+    }
     return out;
 }
 #endif
@@ -1076,30 +1923,176 @@ FrameToJPEG(uvc_frame_t *in, int greyshift)
 /*
  *-------------------------------------------------------------------------
  *
- * WriteFrame --
+ * WriteVec --
+ *
+ *	Recording: write the given buffers as one unit onto the
+ *	recording output channel. For plain files and sockets
+ *	this is a single writev() system call on the channel's
+ *	OS handle, bypassing the Tcl channel layer, which is safe
+ *	since the channel is unbuffered. Other channel types get
+ *	one Tcl_WriteRaw() per buffer. Returns the number of bytes
+ *	written, which is short of the total on error.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static Tcl_Size
+WriteVec(TSINK *sink, struct iovec *iov, int iovcnt)
+{
+    Tcl_Size total = 0;
+    ssize_t n;
+
+    if (sink->rfd < 0) {
+	while (iovcnt > 0) {
+	    n = Tcl_WriteRaw(sink->rchan, (const char *) iov->iov_base,
+			     iov->iov_len);
+	    if (n > 0) {
+		total += n;
+	    }
+	    if (n != (ssize_t) iov->iov_len) {
+		break;
+	    }
+	    iov++;
+	    iovcnt--;
+	}
+	return total;
+    }
+    while (iovcnt > 0) {
+	n = writev(sink->rfd, iov, iovcnt);
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    break;
+	}
+	total += n;
+	/* Skip what has been written, continue after short write. */
+	while ((iovcnt > 0) && (n >= (ssize_t) iov->iov_len)) {
+	    n -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *) iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+    return total;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * WriteAt --
+ *
+ *	Recording: write a buffer at the given file position without
+ *	moving the current write position, used for (re)writing
+ *	headers and indices. Plain files get a pwrite() on the OS
+ *	handle, other channels seek forth and back. Returns 1 on
+ *	success, 0 on error.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+WriteAt(TSINK *sink, Tcl_WideInt pos, const void *buf, int len)
+{
+    Tcl_WideInt cur;
+    ssize_t n;
+
+    if (sink->rfd >= 0) {
+	while (len > 0) {
+	    n = pwrite(sink->rfd, buf, len, pos);
+	    if (n < 0) {
+		if (errno == EINTR) {
+		    continue;
+		}
+		return 0;
+	    }
+	    buf = (const char *) buf + n;
+	    len -= n;
+	    pos += n;
+	}
+	return 1;
+    }
+    cur = Tcl_Seek(sink->rchan, 0, SEEK_CUR);
+    if ((cur == (Tcl_WideInt) -1) ||
+	(Tcl_Seek(sink->rchan, pos, SEEK_SET) == (Tcl_WideInt) -1)) {
+	return 0;
+    }
+    n = Tcl_WriteRaw(sink->rchan, (const char *) buf, len);
+    if (Tcl_Seek(sink->rchan, cur, SEEK_SET) == (Tcl_WideInt) -1) {
+	return 0;
+    }
+    return n == len;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * WriteFrame, SinkWrite --
  *
- *	Recording: write given frame onto recording output channel.
+ *	Recording: write given frame onto the recording sinks.
  *	When called from the libuvc thread, the TUVC.rmutex should
  *	have been acquired by the caller to ensure the output
- *	channel stays valid. The recording frame rate may differ
- *	from the hardware frame rate. Thus, some time calculation
- *	takes place here to write a frame when time is due to the
- *	configured recording frame rate. The result is 1 if a
- *	frame was written, 0 if skipped due to timing constraints,
- *	or -1 on write error.
+ *	channels stay valid. The recording frame rate of a sink may
+ *	differ from the hardware frame rate. Thus, some time
+ *	calculation takes place in SinkWrite to write a frame when
+ *	time is due to the sink's frame rate. A JPEG transcoding is
+ *	done at most once per frame and shared by all sinks, MJPEG
+ *	frames are passed through without copying. The result is 1
+ *	if a frame was written to any sink, 0 if skipped due to
+ *	timing constraints, or -1 on write error of all sinks.
  *
  *-------------------------------------------------------------------------
  */
 
 static int
 WriteFrame(TUVC *tuvc, uvc_frame_t *frame)
+{
+    int i, n, ret = -1;
+    uvc_frame_t *jpeg = NULL;
+    Tcl_WideInt t0;
+
+    if (tuvc->pre.armed) {
+	if (!tuvc->pre.trigger) {
+	    PreBufferPut(tuvc, frame);
+	    return (tuvc->rstate == REC_ERROR) ? -1 : 0;
+	}
+	PreBufferFlush(tuvc);
+    }
+    t0 = MonoTime();
+    for (i = 0; i < tuvc->nsinks; i++) {
+	n = SinkWrite(tuvc->sinks[i], frame, &jpeg);
+	if (n > ret) {
+	    ret = n;
+	}
+    }
+    if (ret > 0) {
+	HistAdd(&StatsShard(tuvc)->write, MonoTime() - t0);
+    }
+    if (tuvc->trace) {
+	TraceEvent(tuvc, "WriteFrame", t0, 0, frame->sequence, 0);
+    }
+    if (jpeg != NULL) {
+	uvc_free_frame(jpeg);
+    }
+    if (ret < 0) {
+	/* No sink left to write to. */
+	tuvc->rstate = REC_ERROR;
+    }
+    return ret;
+}
+
+static int
+SinkWrite(TSINK *sink, uvc_frame_t *frame, uvc_frame_t **jpegPtr)
 {
     Tcl_Size toWrite, written, fWritten;
     struct timeval now, diff;
-    uvc_frame_t *newFrame = NULL;
+    struct iovec iov[3];
 
-    if (tuvc->rchan == NULL) {
-	tuvc->rstate = REC_ERROR;
+    if ((sink->rchan == NULL) && (sink->rtp.fd < 0)) {
+	sink->error = 1;
     }
     gettimeofday(&now, NULL);
     diff.tv_sec = now.tv_sec - frame->capture_time.tv_sec;
@@ -1113,39 +2106,64 @@ WriteFrame(TUVC *tuvc, uvc_frame_t *frame)
     } else {
 	/* Clock went back. */
     }
-    diff.tv_sec = tuvc->rtv.tv_sec - now.tv_sec;
-    diff.tv_usec = tuvc->rtv.tv_usec - now.tv_usec;
+    diff.tv_sec = sink->rtv.tv_sec - now.tv_sec;
+    diff.tv_usec = sink->rtv.tv_usec - now.tv_usec;
     if (diff.tv_usec < 0) {
 	diff.tv_sec -= 1;
 	diff.tv_usec += 1000000;
     }
     if ((diff.tv_sec > 0) || ((diff.tv_sec == 0) && (diff.tv_usec > 0))) {
-	return (tuvc->rstate == REC_ERROR) ? -1 : 0;
+	return sink->error ? -1 : 0;
     }
-    tuvc->rtv = now;
-    diff.tv_sec = tuvc->rtv.tv_sec - tuvc->ltv.tv_sec;
-    diff.tv_usec = tuvc->rtv.tv_usec - tuvc->ltv.tv_usec;
+    sink->rtv = now;
+    diff.tv_sec = sink->rtv.tv_sec - sink->ltv.tv_sec;
+    diff.tv_usec = sink->rtv.tv_usec - sink->ltv.tv_usec;
     if (diff.tv_usec < 0) {
 	diff.tv_sec -= 1;
 	diff.tv_usec += 1000000;
     }
-    tuvc->ltv = tuvc->rtv;
+    sink->ltv = sink->rtv;
 
-    tuvc->rtv.tv_sec += tuvc->rrate.tv_sec;
-    tuvc->rtv.tv_usec += tuvc->rrate.tv_usec;
-    if (tuvc->rtv.tv_usec > 1000000) {
-	tuvc->rtv.tv_sec += 1;
-	tuvc->rtv.tv_usec -= 1000000;
+    sink->rtv.tv_sec += sink->rrate.tv_sec;
+    sink->rtv.tv_usec += sink->rrate.tv_usec;
+    if (sink->rtv.tv_usec > 1000000) {
+	sink->rtv.tv_sec += 1;
+	sink->rtv.tv_usec -= 1000000;
     }
     if (frame->data_bytes == 0) {
 	return 0;
     }
-    if (tuvc->rstate == REC_ERROR) {
+    if (sink->error) {
 	return -1;
     }
-    if (Tcl_DStringLength(&tuvc->rbdStr) > 0) {
+    if (sink->rfmt == RF_RTP) {
+	int n;
+
+	/*
+	 * RTP/JPEG over UDP, no channel involved.
+	 */
+	if (frame->frame_format != UVC_FRAME_FORMAT_MJPEG) {
+#ifdef LIBUVC_HAVE_JPEG
+	    if (*jpegPtr == NULL) {
+		/* Encoded once for all sinks. */
+		*jpegPtr = FrameToJPEG(sink->tuvc, frame);
+	    }
+#endif
+	    if (*jpegPtr == NULL) {
+		sink->error = 1;
+		return -1;
+	    }
+	    frame = *jpegPtr;
+	}
+	n = RtpSend(sink, frame);
+	if (n < 0) {
+	    sink->error = 1;
+	    return -1;
+	}
+	return n;
+    } else if (Tcl_DStringLength(&sink->rbdStr) > 0) {
 #ifndef LIBUVC_HAVE_JPEG
-	tuvc->rstate = REC_ERROR;
+	sink->error = 1;
 	return -1;
 #else
 	int n;
@@ -1155,27 +2173,175 @@ WriteFrame(TUVC *tuvc, uvc_frame_t *frame)
 	 * HTTP MJPEG streaming webcam mode.
 	 */
 	if (frame->frame_format != UVC_FRAME_FORMAT_MJPEG) {
-	    newFrame = FrameToJPEG(frame, tuvc->greyshift);
-	    if (newFrame == NULL) {
-		tuvc->rstate = REC_ERROR;
+	    if (*jpegPtr == NULL) {
+		/* Encoded once for all sinks. */
+		*jpegPtr = FrameToJPEG(sink->tuvc, frame);
+	    }
+	    if (*jpegPtr == NULL) {
+		sink->error = 1;
 		return -1;
 	    }
-	    frame = newFrame;
+	    frame = *jpegPtr;
 	}
-	n = Tcl_DStringLength(&tuvc->rbdStr);
+	n = Tcl_DStringLength(&sink->rbdStr);
 	sprintf(buffer, "\r\nContent-type: image/jpeg\r\n"
 		"Content-length: %d\r\n\r\n", (int) frame->data_bytes);
-	Tcl_DStringAppend(&tuvc->rbdStr, buffer, -1);
-	toWrite = Tcl_DStringLength(&tuvc->rbdStr);
-	written = Tcl_WriteRaw(tuvc->rchan, Tcl_DStringValue(&tuvc->rbdStr),
-			       toWrite);
-	Tcl_DStringSetLength(&tuvc->rbdStr, n);
-	if (written == toWrite) {
-	    toWrite = frame->data_bytes;
-	    written = Tcl_WriteRaw(tuvc->rchan, (const char *) frame->data,
-				   toWrite);
+	Tcl_DStringAppend(&sink->rbdStr, buffer, -1);
+	iov[0].iov_base = Tcl_DStringValue(&sink->rbdStr);
+	iov[0].iov_len = Tcl_DStringLength(&sink->rbdStr);
+	iov[1].iov_base = frame->data;
+	iov[1].iov_len = frame->data_bytes;
+	toWrite = iov[0].iov_len + iov[1].iov_len;
+	written = WriteVec(sink, iov, 2);
+	Tcl_DStringSetLength(&sink->rbdStr, n);
+#endif
+    } else if (sink->rfmt == RF_MKV) {
+	/*
+	 * Matroska stream, one cluster of unknown size per second.
+	 */
+	int n = 0, size;
+	unsigned char hdr[64];
+	Tcl_WideInt t;
+
+#ifdef LIBUVC_HAVE_JPEG
+	if ((frame->frame_format != UVC_FRAME_FORMAT_MJPEG) &&
+	    sink->jpeg) {
+	    if (*jpegPtr == NULL) {
+		/* Encoded once for all sinks. */
+		*jpegPtr = FrameToJPEG(sink->tuvc, frame);
+	    }
+	    if (*jpegPtr == NULL) {
+		sink->error = 1;
+		return -1;
+	    }
+	    frame = *jpegPtr;
 	}
 #endif
+	if (frame->frame_format == UVC_FRAME_FORMAT_MJPEG) {
+	    size = frame->data_bytes;
+	} else {
+	    size = frame->height * frame->step;
+	}
+	t = ((Tcl_WideInt) sink->ltv.tv_sec * 1000000 +
+	     sink->ltv.tv_usec) / 1000;
+	if (sink->mkv.nframes == 0) {
+	    sink->mkv.start = t;
+	}
+	t -= sink->mkv.start;
+	if ((sink->mkv.cluster < 0) || (t < sink->mkv.cluster) ||
+	    (t - sink->mkv.cluster >= 1000)) {
+	    n += MKVId(hdr + n, 0x1F43B675);		/* Cluster */
+	    n += MKVSize(hdr + n, -1);
+	    n += MKVUint(hdr + n, 0xE7, t);		/* Timecode */
+	    sink->mkv.cluster = t;
+	}
+	n += MKVId(hdr + n, 0xA3);			/* SimpleBlock */
+	n += MKVSize(hdr + n, size + 4);
+	hdr[n++] = 0x81;				/* Track 1 */
+	hdr[n++] = (t - sink->mkv.cluster) >> 8;
+	hdr[n++] = (t - sink->mkv.cluster);
+	hdr[n++] = 0x80;				/* Keyframe */
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = n;
+	iov[1].iov_base = frame->data;
+	iov[1].iov_len = size;
+	toWrite = n + size;
+	written = WriteVec(sink, iov, 2);
+	sink->mkv.nframes++;
+    } else if (sink->rfmt == RF_RAW) {
+	/*
+	 * Bare frames as delivered by the device.
+	 */
+	iov[0].iov_base = frame->data;
+	if (frame->frame_format == UVC_FRAME_FORMAT_MJPEG) {
+	    iov[0].iov_len = frame->data_bytes;
+	} else {
+	    iov[0].iov_len = frame->height * frame->step;
+	}
+	toWrite = iov[0].iov_len;
+	written = WriteVec(sink, iov, 1);
+    } else if (sink->rfmt == RF_Y4M) {
+	/*
+	 * YUV4MPEG2 stream, packed YUV is made planar 4:2:2.
+	 */
+	int n = 0, x, y, w = frame->width, h = frame->height, yo, uo;
+	char hdr[128];
+	const char *cs;
+	unsigned char *src, *dy, *du, *dv;
+	static const char fhdr[] = "FRAME\n";
+
+	switch (frame->frame_format) {
+	case UVC_FRAME_FORMAT_YUYV:
+	    cs = "422";
+	    yo = 0;
+	    uo = 1;
+	    break;
+	case UVC_FRAME_FORMAT_UYVY:
+	    cs = "422";
+	    yo = 1;
+	    uo = 0;
+	    break;
+	case UVC_FRAME_FORMAT_GRAY8:
+	    cs = "mono";
+	    break;
+	case UVC_FRAME_FORMAT_GRAY16:
+	    cs = "mono16";
+	    break;
+	default:
+	    /* No compressed or RGB frames in Y4M. */
+	    sink->error = 1;
+	    return -1;
+	}
+	if (!sink->y4m.header) {
+	    sprintf(hdr, "YUV4MPEG2 W%d H%d F1000000:%d Ip A1:1 C%s\n",
+		    w, h, sink->y4m.uspf, cs);
+	    iov[n].iov_base = hdr;
+	    iov[n].iov_len = strlen(hdr);
+	    n++;
+	    sink->y4m.header = 1;
+	}
+	iov[n].iov_base = (void *) fhdr;
+	iov[n].iov_len = sizeof(fhdr) - 1;
+	n++;
+	if (cs[0] == '4') {
+	    if (sink->y4m.bufsize < w * h * 2) {
+		unsigned char *buf;
+
+		buf = (unsigned char *)
+		    attemptckrealloc((char *) sink->y4m.buf, w * h * 2);
+		if (buf == NULL) {
+		    sink->error = 1;
+		    return -1;
+		}
+		sink->y4m.buf = buf;
+		sink->y4m.bufsize = w * h * 2;
+	    }
+	    dy = sink->y4m.buf;
+	    du = dy + w * h;
+	    dv = du + (w / 2) * h;
+	    for (y = 0; y < h; y++) {
+		src = (unsigned char *) frame->data + y * frame->step;
+		for (x = 0; x < w / 2; x++) {
+		    *dy++ = src[yo];
+		    *dy++ = src[yo + 2];
+		    *du++ = src[uo];
+		    *dv++ = src[uo + 2];
+		    src += 4;
+		}
+	    }
+	    iov[n].iov_base = sink->y4m.buf;
+	    iov[n].iov_len = w * h + 2 * (w / 2) * h;
+	} else {
+	    /* Gray frames are written in place. */
+	    iov[n].iov_base = frame->data;
+	    iov[n].iov_len = h * frame->step;
+	}
+	n++;
+	toWrite = 0;
+	for (x = 0; x < n; x++) {
+	    toWrite += iov[x].iov_len;
+	}
+	written = WriteVec(sink, iov, n);
     } else {
 	/*
 	 * AVI file.
@@ -1186,17 +2352,30 @@ WriteFrame(TUVC *tuvc, uvc_frame_t *frame)
 	    { '0', '0', 'd', 'b' },
 	    0
 	};
+	static const char four0[4] = {
+	    0, 0, 0, 0
+	};
+
+	if ((sink->rot.secs > 0) || (sink->rot.bytes > 0)) {
+	    RotateCheck(sink);
+	    if (sink->error) {
+		return -1;
+	    }
+	}
 
 #ifdef LIBUVC_HAVE_JPEG
 	if (frame->frame_format == UVC_FRAME_FORMAT_MJPEG) {
 	    size = frame->data_bytes;
-	} else if (memcmp(&tuvc->avi.avi_hdrv.strh.handler, "MJPG", 4) == 0) {
-	    newFrame = FrameToJPEG(frame, tuvc->greyshift);
-	    if (newFrame == NULL) {
-		tuvc->rstate = REC_ERROR;
+	} else if (memcmp(&sink->avi.avi_hdrv.strh.handler, "MJPG", 4) == 0) {
+	    if (*jpegPtr == NULL) {
+		/* Encoded once for all sinks. */
+		*jpegPtr = FrameToJPEG(sink->tuvc, frame);
+	    }
+	    if (*jpegPtr == NULL) {
+		sink->error = 1;
 		return -1;
 	    }
-	    frame = newFrame;
+	    frame = *jpegPtr;
 	    size = frame->data_bytes;
 	} else
 #endif
@@ -1206,87 +2385,50 @@ WriteFrame(TUVC *tuvc, uvc_frame_t *frame)
 	sizea = (size + 3) & ~3;
 	hdr = hdr0;
 	PUT32LE(&hdr.size, sizea);
-	fWritten = 0;
-	toWrite = sizeof(hdr);
-	written = Tcl_WriteRaw(tuvc->rchan, (const char *) &hdr, toWrite);
-	if (written == toWrite) {
-	    toWrite = size;
-	    written = Tcl_WriteRaw(tuvc->rchan, (const char *) frame->data,
-				   toWrite);
-	    fWritten = written;
-	}
-
-	/* Align to next 32 bit boundary. */
-	if ((written == toWrite) && (sizea > size)) {
-	    static const char four0[4] = {
-		0, 0, 0, 0
-	    };
-
-	    toWrite = sizea - size;
-	    written = Tcl_WriteRaw(tuvc->rchan, four0, toWrite);
-	}
 
-	tuvc->avi.nframes++;
-	tuvc->avi.totsize += sizea + sizeof(hdr);
-	tuvc->avi.segsize += sizea + sizeof(hdr);
+	/* Chunk header, data, and padding to next 32 bit boundary. */
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = frame->data;
+	iov[1].iov_len = size;
+	iov[2].iov_base = (void *) four0;
+	iov[2].iov_len = sizea - size;
+	toWrite = sizeof(hdr) + sizea;
+	written = WriteVec(sink, iov, (sizea > size) ? 3 : 2);
+	fWritten = (written == toWrite) ? size : 0;
+
+	sink->avi.nframes++;
+	sink->avi.totsize += sizea + sizeof(hdr);
+	sink->avi.segsize += sizea + sizeof(hdr);
 
 	if (fWritten == size) {
-	    if (tuvc->avi.segsize > 0x7F000000) {
-		CloseAVISegment(tuvc, 0);
-		tuvc->avi.curr_idx = tuvc->avi.num_idx = 0;
-		if (tuvc->avi.idx != NULL) {
-		    ckfree((char *) tuvc->avi.idx);
-		    tuvc->avi.idx = NULL;
-		}
-	    } else if (tuvc->avi.totsize == tuvc->avi.segsize) {
-		/* Add index entry. */
-		if (tuvc->avi.curr_idx >= tuvc->avi.num_idx) {
-		    int newsize = tuvc->avi.num_idx + 512;
-		    struct AVI_IDX *newidx;
-
-		    newidx = attemptckrealloc((char *) tuvc->avi.idx,
-					      newsize * sizeof(struct AVI_IDX));
-		    if (newidx == NULL) {
-			tuvc->avi.curr_idx = tuvc->avi.num_idx = 0;
-			if (tuvc->avi.idx != NULL) {
-			    ckfree((char *) tuvc->avi.idx);
-			    tuvc->avi.idx = NULL;
-			}
-		    } else {
-			tuvc->avi.num_idx = newsize;
-			tuvc->avi.idx = newidx;
-		    }
-		}
-		if (tuvc->avi.idx != NULL) {
-		    struct AVI_IDX *idx = tuvc->avi.idx + tuvc->avi.curr_idx;
-
-		    memcpy(idx->id, hdr0.id, sizeof(hdr0.id));
-		    PUT32LE(&idx->flags, 0);
-		    PUT32LE(&idx->offset, tuvc->avi.idx_off);
-		    PUT32LE(&idx->size, sizea);
-		    tuvc->avi.curr_idx++;
-		    tuvc->avi.idx_off += sizea + sizeof(struct CHUNK_HDR);
-		}
+	    AddAVIIndex(sink, sizea);
+	    if (sink->avi.segsize > 0x7F000000) {
+		CloseAVISegment(sink, 0);
+	    } else if ((sink->avi.ckpt > 0) &&
+		       ((sink->ltv.tv_sec > sink->avi.ckptv.tv_sec) ||
+			((sink->ltv.tv_sec == sink->avi.ckptv.tv_sec) &&
+			 (sink->ltv.tv_usec >= sink->avi.ckptv.tv_usec)))) {
+		CheckpointAVI(sink);
+		sink->avi.ckptv = sink->ltv;
+		sink->avi.ckptv.tv_sec += sink->avi.ckpt;
 	    }
 	}
 
 	/* Compute average frame rate. */
-	if (tuvc->avi.nframes == 0) {
-	    tuvc->avi.rate = diff;
+	if (sink->avi.nframes == 0) {
+	    sink->avi.rate = diff;
 	} else {
-	    tuvc->avi.rate.tv_sec += diff.tv_sec;
-	    tuvc->avi.rate.tv_sec /= 2;
-	    tuvc->avi.rate.tv_usec += diff.tv_usec;
-	    tuvc->avi.rate.tv_usec /= 2;
+	    sink->avi.rate.tv_sec += diff.tv_sec;
+	    sink->avi.rate.tv_sec /= 2;
+	    sink->avi.rate.tv_usec += diff.tv_usec;
+	    sink->avi.rate.tv_usec /= 2;
 	}
     }
     if (written != toWrite) {
-	tuvc->rstate = REC_ERROR;
+	sink->error = 1;
     }
-    if (newFrame != NULL) {
-	uvc_free_frame(newFrame);
-    }
-    return (tuvc->rstate == REC_ERROR) ? -1 : 1;
+    return sink->error ? -1 : 1;
 }
 
 /*
@@ -1307,11 +2449,17 @@ WriteFrame(TUVC *tuvc, uvc_frame_t *frame)
 
 static int
 StartRecording(TUVC *tuvc, Tcl_Interp *interp,
-	       int objc, Tcl_Obj * const objv[])
+	       int objc, Tcl_Obj * const objv[], int add)
 {
     int i, mode, doMJPG = 0, doUser = 0;
+    const char *devOpt = NULL;
+    TSINK *sink;
+    int qsize = 16, policy = RQ_DROPOLDEST, ckpt = 0, rsecs = 0;
+    int rfmt = RF_AVI;
     double rate = 0;
-    const char *p, *rbdStr = NULL;
+    Tcl_WideInt rbytes = 0, prebytes = 64 * 1024 * 1024;
+    double presecs = 0;
+    const char *p, *rbdStr = NULL, *pattern = NULL, *rtpDest = NULL;
     Tcl_Channel chan = NULL, stack[2];
     Tcl_HashEntry *hPtr;
     long li;
@@ -1319,7 +2467,8 @@ StartRecording(TUVC *tuvc, Tcl_Interp *interp,
     Tcl_WideInt pos0 = 0;
 
     if (objc < 5) {
-	Tcl_WrongNumArgs(interp, 2, objv, "devid start ...");
+	Tcl_WrongNumArgs(interp, 2, objv, add ? "devid add ..." :
+			 "devid start ...");
 	return TCL_ERROR;
     }
     for (i = 4; i < objc; i++) {
@@ -1333,6 +2482,7 @@ StartRecording(TUVC *tuvc, Tcl_Interp *interp,
 	    doMJPG++;
 #endif
 	} else if (strcmp(p, "-user") == 0) {
+	    devOpt = p;
 	    doMJPG++;
 	    doUser++;
 	} else if (strcmp(p, "-fps") == 0) {
@@ -1357,6 +2507,132 @@ StartRecording(TUVC *tuvc, Tcl_Interp *interp,
 #else
 	    rbdStr = Tcl_GetString(objv[i]);
 #endif
+	} else if (strcmp(p, "-queue") == 0) {
+	    devOpt = p;
+	    if (++i >= objc) {
+		Tcl_SetResult(interp, "-queue option needs a value",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    if (Tcl_GetIntFromObj(interp, objv[i], &qsize) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if ((qsize < 0) || (qsize > 1024)) {
+		Tcl_SetResult(interp, "-queue value out of range",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	} else if (strcmp(p, "-overflow") == 0) {
+	    static const char *policies[] = {
+		"dropoldest", "dropnewest", "block", NULL
+	    };
+
+	    devOpt = p;
+	    if (++i >= objc) {
+		Tcl_SetResult(interp, "-overflow option needs a value",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    if (Tcl_GetIndexFromObj(interp, objv[i], policies, "policy", 0,
+				    &policy) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	} else if (strcmp(p, "-format") == 0) {
+	    static const char *formats[] = {
+		"avi", "mkv", "raw", "y4m", NULL
+	    };
+
+	    if (++i >= objc) {
+		Tcl_SetResult(interp, "-format option needs a value",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    if (Tcl_GetIndexFromObj(interp, objv[i], formats, "format", 0,
+				    &rfmt) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	} else if (strcmp(p, "-checkpoint") == 0) {
+	    if (++i >= objc) {
+		Tcl_SetResult(interp, "-checkpoint option needs a value",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    if (Tcl_GetIntFromObj(interp, objv[i], &ckpt) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (ckpt < 0) {
+		Tcl_SetResult(interp, "-checkpoint value out of range",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	} else if (strcmp(p, "-rotate") == 0) {
+	    char *end;
+	    Tcl_WideInt w;
+
+	    if (++i >= objc) {
+		Tcl_SetResult(interp, "-rotate option needs a value",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    /* Seconds, or bytes when followed by B, K, M, or G. */
+	    p = Tcl_GetString(objv[i]);
+	    w = strtoll(p, &end, 10);
+	    rsecs = 0;
+	    rbytes = 0;
+	    if ((end != p) && (w >= 0) && (*end == '\0') &&
+		(w <= 0x7FFFFFFF)) {
+		rsecs = w;
+	    } else if ((end != p) && (w >= 0) && (*end != '\0') &&
+		       (end[1] == '\0') && (strchr("BKMG", *end) != NULL)) {
+		rbytes = w << (10 * (strchr("BKMG", *end) - "BKMG"));
+	    } else {
+		Tcl_SetResult(interp, "bad -rotate value", TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	} else if (strcmp(p, "-prebuffer") == 0) {
+	    devOpt = p;
+	    if (++i >= objc) {
+		Tcl_SetResult(interp, "-prebuffer option needs a value",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    if (Tcl_GetDoubleFromObj(interp, objv[i], &presecs) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (presecs < 0) {
+		Tcl_SetResult(interp, "-prebuffer value out of range",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	} else if (strcmp(p, "-prebufsize") == 0) {
+	    devOpt = p;
+	    if (++i >= objc) {
+		Tcl_SetResult(interp, "-prebufsize option needs a value",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    if (Tcl_GetWideIntFromObj(interp, objv[i], &prebytes) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (prebytes <= 0) {
+		Tcl_SetResult(interp, "-prebufsize value out of range",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	} else if (strcmp(p, "-pattern") == 0) {
+	    if (++i >= objc) {
+		Tcl_SetResult(interp, "-pattern option needs a value",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    pattern = Tcl_GetString(objv[i]);
+	} else if (strcmp(p, "-rtp") == 0) {
+	    if (++i >= objc) {
+		Tcl_SetResult(interp, "-rtp option needs a value",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    rtpDest = Tcl_GetString(objv[i]);
 	} else if (strcmp(p, "-chan") == 0) {
 	    if (++i >= objc) {
 		Tcl_SetResult(interp, "-chan option needs a value",
@@ -1381,48 +2657,184 @@ StartRecording(TUVC *tuvc, Tcl_Interp *interp,
 	return TCL_ERROR;
     }
     ufmt = (UFMT *) Tcl_GetHashValue(hPtr);
-    if (chan == NULL) {
-	Tcl_SetResult(interp, "no channel given", TCL_STATIC);
-	return TCL_ERROR;
+    if (tuvc->nsinks == 0) {
+	/* Nothing to add to, start new recording. */
+	add = 0;
     }
-    stack[0] = Tcl_GetTopChannel(chan);
-    stack[1] = Tcl_GetStackedChannel(chan);
-    if (((stack[0] != NULL) && (stack[0] != chan)) || (stack[1] != NULL)) {
-	Tcl_SetResult(interp, "stacked channels are not supported", TCL_STATIC);
+    if (add && (devOpt != NULL)) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("option \"%s\" requires start", devOpt));
 	return TCL_ERROR;
     }
-    if ((Tcl_SetChannelOption(interp, chan, "-blocking", "0") != TCL_OK) ||
-	(Tcl_SetChannelOption(interp, chan, "-buffering", "none") != TCL_OK) ||
-	(Tcl_SetChannelOption(interp, chan, "-translation", "binary")
-	 != TCL_OK)) {
+    if (add && (tuvc->nsinks >= REC_MAXSINKS)) {
+	Tcl_SetResult(interp, "too many sinks", TCL_STATIC);
 	return TCL_ERROR;
     }
-    if ((rbdStr == NULL) || (strlen(rbdStr) == 0)) {
-	pos0 = Tcl_Seek(chan, 0, SEEK_CUR);
-	if (pos0 == (Tcl_WideInt) -1) {
-	    Tcl_SetResult(interp, "not a random access channel", TCL_STATIC);
+    if (add && tuvc->ruser) {
+	/* User supplied frames are always transcoded. */
+	doMJPG++;
+    }
+    if (rtpDest != NULL) {
+	if ((chan != NULL) || (pattern != NULL) || (rbdStr != NULL) ||
+	    (rfmt != RF_AVI) || (rsecs > 0) || (rbytes > 0)) {
+	    Tcl_SetResult(interp, "-rtp excludes channel and file options",
+			  TCL_STATIC);
+	    return TCL_ERROR;
+	}
+#ifndef LIBUVC_HAVE_JPEG
+	if (!ufmt->iscomp) {
+	    Tcl_SetResult(interp, "-rtp requires MJPEG frames", TCL_STATIC);
 	    return TCL_ERROR;
 	}
+#endif
+	rfmt = RF_RTP;
     }
-    if (Tcl_DetachChannel(interp, chan) != TCL_OK) {
-	Tcl_SetResult(interp, "cannot detach channel", TCL_STATIC);
-	return TCL_ERROR;
+    if ((rbdStr != NULL) && (strlen(rbdStr) > 0)) {
+	/* Multipart stream, container format doesn't apply. */
+	rfmt = RF_AVI;
+    }
+    if ((rfmt == RF_Y4M) && ufmt->iscomp) {
+	Tcl_SetResult(interp, "-format y4m requires uncompressed frames",
+		      TCL_STATIC);
+	return TCL_ERROR;
+    }
+#ifdef LIBUVC_HAVE_JPEG
+    if (((presecs > 0) || (add && tuvc->pre.armed)) &&
+	(!ufmt->iscomp || doUser || (add && tuvc->ruser)) &&
+	((rbdStr == NULL) || (strlen(rbdStr) == 0)) && (rfmt != RF_RTP) &&
+	(((rfmt != RF_AVI) && (rfmt != RF_MKV)) || !doMJPG)) {
+	/* Pre-event buffer holds JPEG, see PreBufferPut. */
+	Tcl_SetResult(interp, "-prebuffer requires JPEG output",
+		      TCL_STATIC);
+	return TCL_ERROR;
+    }
+#endif
+    if ((rsecs > 0) || (rbytes > 0)) {
+	if (((rbdStr != NULL) && (strlen(rbdStr) > 0)) || (rfmt != RF_AVI)) {
+	    Tcl_SetResult(interp, "-rotate requires AVI output", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	if ((pattern == NULL) || (strlen(pattern) == 0)) {
+	    Tcl_SetResult(interp, "-rotate requires -pattern", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+    }
+    if (rfmt == RF_RTP) {
+	/* Datagram socket instead of channel, see below. */
+	goto mksink;
+    }
+    if ((chan == NULL) && (pattern != NULL) && (strlen(pattern) > 0)) {
+	Tcl_DString ds;
+	char buf[1024];
+	struct tm tm;
+	time_t t = time(NULL);
+
+	/* Open first file from pattern. */
+	localtime_r(&t, &tm);
+	Tcl_DStringInit(&ds);
+	Tcl_DStringAppend(&ds, buf, strftime(buf, sizeof(buf), pattern, &tm));
+	chan = Tcl_OpenFileChannel(interp, Tcl_DStringValue(&ds), "w", 0666);
+	Tcl_DStringFree(&ds);
+	if (chan == NULL) {
+	    return TCL_ERROR;
+	}
+	Tcl_RegisterChannel(interp, chan);
+    }
+    if (chan == NULL) {
+	Tcl_SetResult(interp, "no channel given", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    stack[0] = Tcl_GetTopChannel(chan);
+    stack[1] = Tcl_GetStackedChannel(chan);
+    if (((stack[0] != NULL) && (stack[0] != chan)) || (stack[1] != NULL)) {
+	Tcl_SetResult(interp, "stacked channels are not supported", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if ((Tcl_SetChannelOption(interp, chan, "-blocking", "0") != TCL_OK) ||
+	(Tcl_SetChannelOption(interp, chan, "-buffering", "none") != TCL_OK) ||
+	(Tcl_SetChannelOption(interp, chan, "-translation", "binary")
+	 != TCL_OK)) {
+	return TCL_ERROR;
+    }
+    if (((rbdStr == NULL) || (strlen(rbdStr) == 0)) && (rfmt == RF_AVI)) {
+	pos0 = Tcl_Seek(chan, 0, SEEK_CUR);
+	if (pos0 == (Tcl_WideInt) -1) {
+	    Tcl_SetResult(interp, "not a random access channel", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+    }
+    if (Tcl_DetachChannel(interp, chan) != TCL_OK) {
+	Tcl_SetResult(interp, "cannot detach channel", TCL_STATIC);
+	return TCL_ERROR;
+    }
+mksink:
+    sink = (TSINK *) ckalloc(sizeof(TSINK));
+    memset(sink, 0, sizeof(TSINK));
+    sink->tuvc = tuvc;
+    sink->rchan = chan;
+    sink->rfd = -1;
+    sink->rfmt = rfmt;
+    Tcl_DStringInit(&sink->rbdStr);
+    sink->rot.nextfd = -1;
+    Tcl_DStringInit(&sink->rot.pattern);
+    Tcl_DStringInit(&sink->rot.nextName);
+    sink->rtp.fd = -1;
+    if (rfmt == RF_RTP) {
+	sink->rtp.fd = RtpOpen(interp, rtpDest);
+	if (sink->rtp.fd < 0) {
+	    Tcl_DStringFree(&sink->rbdStr);
+	    Tcl_DStringFree(&sink->rot.pattern);
+	    Tcl_DStringFree(&sink->rot.nextName);
+	    ckfree(sink);
+	    return TCL_ERROR;
+	}
+    } else {
+	p = Tcl_ChannelName(Tcl_GetChannelType(chan));
+	if ((strcmp(p, "file") == 0) || (strcmp(p, "tcp") == 0)) {
+	    ClientData handle;
+
+	    if (Tcl_GetChannelHandle(chan, TCL_WRITABLE, &handle) == TCL_OK) {
+		sink->rfd = (int) (intptr_t) handle;
+	    }
+	}
     }
-    Tcl_MutexLock(&tuvc->rmutex);
-    FinishRecording(tuvc, 0, 0);
-    tuvc->rchan = chan;
     if ((rate > 0.0) && (rate < tuvc->fps)) {
-	tuvc->rrate.tv_sec = 1.0 / rate;
-	tuvc->rrate.tv_usec = 1000000.0 / rate;
+	sink->rrate.tv_sec = 1.0 / rate;
+	sink->rrate.tv_usec = 1000000.0 / rate;
     } else if (tuvc->fps <= 0) {
-	tuvc->rrate.tv_sec = 1;
-	tuvc->rrate.tv_usec = 0;
+	sink->rrate.tv_sec = 1;
+	sink->rrate.tv_usec = 0;
     } else {
-	tuvc->rrate.tv_sec = 1 / tuvc->fps;
-	tuvc->rrate.tv_usec = 1000000 / tuvc->fps;
+	sink->rrate.tv_sec = 1 / tuvc->fps;
+	sink->rrate.tv_usec = 1000000 / tuvc->fps;
     }
     if ((rbdStr != NULL) && (strlen(rbdStr) > 0)) {
-	Tcl_DStringAppend(&tuvc->rbdStr, rbdStr, -1);
+	Tcl_DStringAppend(&sink->rbdStr, rbdStr, -1);
+	sink->jpeg = 1;
+    } else if (rfmt == RF_MKV) {
+	sink->jpeg = ufmt->iscomp || doMJPG;
+	sink->mkv.width = ufmt->width;
+	sink->mkv.height = ufmt->height;
+	memcpy(sink->mkv.fourcc, ufmt->fourcc, 4);
+	sink->mkv.dur = ((Tcl_WideInt) sink->rrate.tv_sec * 1000000 +
+			 sink->rrate.tv_usec) * 1000;
+	StartMKVFile(sink);
+    } else if (rfmt == RF_Y4M) {
+	/* Header is written with first frame. */
+	sink->y4m.uspf = sink->rrate.tv_sec * 1000000 + sink->rrate.tv_usec;
+	sink->y4m.header = 0;
+    } else if (rfmt == RF_RAW) {
+	/* Nothing to setup. */
+    } else if (rfmt == RF_RTP) {
+	/* Random sequence number, timestamp, and source, see RFC 3550. */
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	srandom(tv.tv_sec ^ tv.tv_usec ^ getpid() ^ sink->rtp.fd);
+	sink->jpeg = 1;
+	sink->rtp.seq = random();
+	sink->rtp.ts0 = random();
+	sink->rtp.ssrc = random();
     } else {
 	int n;
 	static const struct AVI_HDR avi_hdr = {
@@ -1464,94 +2876,109 @@ StartRecording(TUVC *tuvc, Tcl_Interp *interp,
 	};
 
 	/* Setup AVI writer. */
-	tuvc->avi.pos0 = pos0;
-	tuvc->avi.avi_hdr = avi_hdr;
-	PUT32LE(&tuvc->avi.avi_hdr.avih_size,
+	sink->avi.avi_hdr = avi_hdr;
+	PUT32LE(&sink->avi.avi_hdr.avih_size,
 		sizeof(struct RIFF_avih));
-	tuvc->avi.avi_hdrv = avi_hdrv;
-	PUT32LE(&tuvc->avi.avi_hdrv.strl_size,
+	sink->avi.avi_hdrv = avi_hdrv;
+	PUT32LE(&sink->avi.avi_hdrv.strl_size,
 		sizeof(struct RIFF_strh) +
-		sizeof(struct RIFF_strf_vids) + 20);
-	PUT32LE(&tuvc->avi.avi_hdrv.strh_size,
+		sizeof(struct RIFF_strf_vids) + 20 +
+		sizeof(struct AVI_SUPERIDX));
+	PUT32LE(&sink->avi.avi_hdrv.strh_size,
 		sizeof(struct RIFF_strh));
-	PUT32LE(&tuvc->avi.avi_hdrv.strf_size,
+	PUT32LE(&sink->avi.avi_hdrv.strf_size,
 		sizeof(struct RIFF_strf_vids));
-	tuvc->avi.avi_hdro = avi_hdro;
-	PUT32LE(&tuvc->avi.avi_hdro.strl_size,
+	sink->avi.avi_hdro = avi_hdro;
+	PUT32LE(&sink->avi.avi_hdro.strl_size,
 		sizeof(unsigned int) + 12);
-	PUT32LE(&tuvc->avi.avi_hdro.strh_size,
+	PUT32LE(&sink->avi.avi_hdro.strh_size,
 		sizeof(unsigned int));
-	tuvc->avi.avi_data = avi_data;
+	sink->avi.avi_data = avi_data;
 
-	PUT32LE(&tuvc->avi.avi_hdr.avih.width, ufmt->width);
-	PUT32LE(&tuvc->avi.avi_hdr.avih.height, ufmt->height);
-	n = tuvc->rrate.tv_sec * 1000000 + tuvc->rrate.tv_usec;
-	PUT32LE(&tuvc->avi.avi_hdr.avih.uspf, n);
+	PUT32LE(&sink->avi.avi_hdr.avih.width, ufmt->width);
+	PUT32LE(&sink->avi.avi_hdr.avih.height, ufmt->height);
+	n = sink->rrate.tv_sec * 1000000 + sink->rrate.tv_usec;
+	PUT32LE(&sink->avi.avi_hdr.avih.uspf, n);
 	if (ufmt->iscomp || doMJPG) {
 	    n = 24 * n / 1000;
 	} else {
 	    n = ufmt->bpp * n / 1000;
 	}
 	n = n * ufmt->width * ufmt->height;
-	PUT32LE(&tuvc->avi.avi_hdr.avih.bps, n);
-	PUT32LE(&tuvc->avi.avi_hdr.avih.nstreams, 1);
-	tuvc->avi.hdrsize = Tcl_WriteRaw(tuvc->rchan,
-					 (const char *) &tuvc->avi.avi_hdr,
-					 sizeof(tuvc->avi.avi_hdr));
-	if (ufmt->iscomp || doMJPG) {
-	    memcpy(&tuvc->avi.avi_hdrv.strh.handler, "MJPG", 4);
-	    memcpy(&tuvc->avi.avi_hdrv.strf.compr, "MJPG", 4);
+	PUT32LE(&sink->avi.avi_hdr.avih.bps, n);
+	PUT32LE(&sink->avi.avi_hdr.avih.nstreams, 1);
+	sink->jpeg = ufmt->iscomp || doMJPG;
+	if (sink->jpeg) {
+	    memcpy(&sink->avi.avi_hdrv.strh.handler, "MJPG", 4);
+	    memcpy(&sink->avi.avi_hdrv.strf.compr, "MJPG", 4);
 	} else {
-	    memcpy(&tuvc->avi.avi_hdrv.strh.handler, ufmt->fourcc, 4);
-	    memcpy(&tuvc->avi.avi_hdrv.strf.compr, ufmt->fourcc, 4);
-	}
-	n = tuvc->rrate.tv_sec * 1000000 + tuvc->rrate.tv_usec;
-	PUT32LE(&tuvc->avi.avi_hdrv.strh.scale, n);
-	PUT32LE(&tuvc->avi.avi_hdrv.strh.rate, 1000000);
-	PUT32LE(&tuvc->avi.avi_hdrv.strf.size, sizeof(tuvc->avi.avi_hdrv.strf));
-	PUT32LE(&tuvc->avi.avi_hdrv.strf.width, ufmt->width);
-	PUT32LE(&tuvc->avi.avi_hdrv.strf.height, ufmt->height);
-	PUT16LE(&tuvc->avi.avi_hdrv.strf.planes, 1);
-	PUT16LE(&tuvc->avi.avi_hdrv.strf.bits, ufmt->bpp);
+	    memcpy(&sink->avi.avi_hdrv.strh.handler, ufmt->fourcc, 4);
+	    memcpy(&sink->avi.avi_hdrv.strf.compr, ufmt->fourcc, 4);
+	}
+	n = sink->rrate.tv_sec * 1000000 + sink->rrate.tv_usec;
+	PUT32LE(&sink->avi.avi_hdrv.strh.scale, n);
+	PUT32LE(&sink->avi.avi_hdrv.strh.rate, 1000000);
+	PUT32LE(&sink->avi.avi_hdrv.strf.size, sizeof(sink->avi.avi_hdrv.strf));
+	PUT32LE(&sink->avi.avi_hdrv.strf.width, ufmt->width);
+	PUT32LE(&sink->avi.avi_hdrv.strf.height, ufmt->height);
+	PUT16LE(&sink->avi.avi_hdrv.strf.planes, 1);
+	PUT16LE(&sink->avi.avi_hdrv.strf.bits, ufmt->bpp);
 	n = ufmt->bpp * ufmt->width * ufmt->height;
-	PUT32LE(&tuvc->avi.avi_hdrv.strf.image_size, n);
-	tuvc->avi.hdrsize += Tcl_WriteRaw(tuvc->rchan,
-					  (const char *) &tuvc->avi.avi_hdrv,
-					  sizeof(tuvc->avi.avi_hdrv));
-	tuvc->avi.hdrsize += Tcl_WriteRaw(tuvc->rchan,
-					  (const char *) &tuvc->avi.avi_hdro,
-					  sizeof(tuvc->avi.avi_hdro));
-	Tcl_WriteRaw(tuvc->rchan, (const char *) &tuvc->avi.avi_data,
-		     sizeof(tuvc->avi.avi_data));
-	tuvc->avi.segsize0 = 4;
-	WriteAVIHeader(tuvc, 0);
-	tuvc->avi.curr_idx = tuvc->avi.num_idx = 0;
-	tuvc->avi.idx_off = 4;
-	if (tuvc->avi.idx != NULL) {
-	    ckfree((char *) tuvc->avi.idx);
-	    tuvc->avi.idx = NULL;
+	PUT32LE(&sink->avi.avi_hdrv.strf.image_size, n);
+	StartAVIFile(sink, pos0);
+	sink->avi.ckpt = ckpt;
+	sink->rot.secs = rsecs;
+	sink->rot.bytes = rbytes;
+	Tcl_DStringSetLength(&sink->rot.pattern, 0);
+	if (pattern != NULL) {
+	    Tcl_DStringAppend(&sink->rot.pattern, pattern, -1);
 	}
     }
     /* Reserve 500us for processing. */
-    tuvc->rrate.tv_usec -= 500;
-    if (tuvc->rrate.tv_usec < 0) {
-	tuvc->rrate.tv_sec -= 1;
-	tuvc->rrate.tv_usec += 1000000;
-    }
-    gettimeofday(&tuvc->ltv, NULL);
-    tuvc->rtv = tuvc->ltv;
-    if (doUser) {
-	tuvc->ruser = 1;
-	tuvc->rstate = tuvc->running ? REC_RECORD : REC_PAUSE;
+    sink->rrate.tv_usec -= 500;
+    if (sink->rrate.tv_usec < 0) {
+	sink->rrate.tv_sec -= 1;
+	sink->rrate.tv_usec += 1000000;
+    }
+    gettimeofday(&sink->ltv, NULL);
+    sink->rtv = sink->ltv;
+    if (add) {
+	Tcl_MutexLock(&tuvc->rmutex);
+	sink->id = ++tuvc->sinkid;
+	tuvc->sinks[tuvc->nsinks++] = sink;
+	Tcl_MutexUnlock(&tuvc->rmutex);
     } else {
-	tuvc->ruser = 0;
-	if (tuvc->running) {
-	    tuvc->rstate = tuvc->conv ? REC_RECPRI : REC_RECORD;
+	RecordQueueStop(tuvc);
+	Tcl_MutexLock(&tuvc->rmutex);
+	FinishRecording(tuvc, 0, 0);
+	sink->id = ++tuvc->sinkid;
+	tuvc->sinks[0] = sink;
+	tuvc->nsinks = 1;
+	if (presecs > 0) {
+	    tuvc->pre.secs = presecs;
+	    tuvc->pre.maxbytes = prebytes;
+	    tuvc->pre.armed = 1;
+	}
+	if (doUser) {
+	    tuvc->ruser = 1;
+	    tuvc->rstate = tuvc->running ? REC_RECORD : REC_PAUSE;
 	} else {
-	    tuvc->rstate = tuvc->conv ? REC_PAUSEPRI : REC_PAUSE;
+	    tuvc->ruser = 0;
+	    if (tuvc->running) {
+		tuvc->rstate = tuvc->conv ? REC_RECPRI : REC_RECORD;
+	    } else {
+		tuvc->rstate = tuvc->conv ? REC_PAUSEPRI : REC_PAUSE;
+	    }
+	}
+	Tcl_MutexUnlock(&tuvc->rmutex);
+	if (!doUser && (qsize > 0)) {
+	    RecordQueueStart(tuvc, qsize, policy);
 	}
     }
-    Tcl_MutexUnlock(&tuvc->rmutex);
+    if ((rsecs > 0) || (rbytes > 0)) {
+	RotateOpenNext(sink);
+    }
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(sink->id));
     return TCL_OK;
 }
 
@@ -1567,73 +2994,73 @@ StartRecording(TUVC *tuvc, Tcl_Interp *interp,
  */
 
 static void
-WriteAVIHeader(TUVC *tuvc, int end)
+WriteAVIHeader(TSINK *sink, int end)
 {
-    int size, idx_size;
+    int size;
     Tcl_WideInt pos;
 
-    if (end && (tuvc->avi.idx != NULL)) {
+    if (end && (sink->avi.idx != NULL)) {
 	/* Write index. */
 	struct CHUNK_HDR idxh;
+	int idx_size;
 	static const struct CHUNK_HDR idxh0 = {
 	    { 'i', 'd', 'x', '1' },
 	    0
 	};
 
 	idxh = idxh0;
-	idx_size = tuvc->avi.curr_idx * sizeof(struct AVI_IDX);
+	idx_size = sink->avi.curr_idx * sizeof(struct AVI_IDX);
 	PUT32LE(&idxh.size, idx_size);
-	Tcl_WriteRaw(tuvc->rchan, (const char *) &idxh, sizeof(idxh));
-	Tcl_WriteRaw(tuvc->rchan, (const char *) tuvc->avi.idx, idx_size);
-
-	/* Mark index present. */
-	PUT32LE(&tuvc->avi.avi_hdr.avih.flags, 0x10);
-	idx_size += sizeof(struct CHUNK_HDR);
-    } else {
-	/* Mark index absent. */
-	PUT32LE(&tuvc->avi.avi_hdr.avih.flags, 0);
-	idx_size = 0;
+	Tcl_WriteRaw(sink->rchan, (const char *) &idxh, sizeof(idxh));
+	Tcl_WriteRaw(sink->rchan, (const char *) sink->avi.idx, idx_size);
+	sink->avi.idx1size = idx_size + sizeof(struct CHUNK_HDR);
     }
 
+    /* Mark index present or absent. */
+    PUT32LE(&sink->avi.avi_hdr.avih.flags, sink->avi.idx1size ? 0x10 : 0);
+
     /* For MJPG use computed average frame rate. */
-    if (memcmp(&tuvc->avi.avi_hdrv.strh.handler, "MJPG", 4) == 0) {
+    if (memcmp(&sink->avi.avi_hdrv.strh.handler, "MJPG", 4) == 0) {
 	int n;
 
-	n = tuvc->avi.rate.tv_sec * 1000000 + tuvc->avi.rate.tv_usec;
-	PUT32LE(&tuvc->avi.avi_hdr.avih.uspf, n);
-	PUT32LE(&tuvc->avi.avi_hdrv.strh.scale, n);
-    }
-    size = tuvc->avi.hdrsize + tuvc->avi.segsize0;
-    PUT32LE(&tuvc->avi.avi_hdr.riff_size, size + idx_size);
-    size = tuvc->avi.hdrsize - 20;
-    PUT32LE(&tuvc->avi.avi_hdr.hdrl_size, size);
-    size = tuvc->avi.nframes0;
-    PUT32LE(&tuvc->avi.avi_hdr.avih.nframes, size);
-    PUT32LE(&tuvc->avi.avi_hdrv.strh.length, size);
-    size = tuvc->avi.segsize0 + 4;
-    PUT32LE(&tuvc->avi.avi_data.data_size, size);
-    size = tuvc->avi.nframes;
-    PUT32LE(&tuvc->avi.avi_hdro.nframes, size);
-
-    pos = Tcl_Seek(tuvc->rchan, 0, SEEK_CUR);
-    Tcl_Seek(tuvc->rchan, tuvc->avi.pos0, SEEK_SET);
-    Tcl_WriteRaw(tuvc->rchan, (const char *) &tuvc->avi.avi_hdr,
-		 sizeof(tuvc->avi.avi_hdr));
-    Tcl_WriteRaw(tuvc->rchan, (const char *) &tuvc->avi.avi_hdrv,
-		 sizeof(tuvc->avi.avi_hdrv));
-    Tcl_WriteRaw(tuvc->rchan, (const char *) &tuvc->avi.avi_hdro,
-		 sizeof(tuvc->avi.avi_hdro));
-    Tcl_WriteRaw(tuvc->rchan, (const char *) &tuvc->avi.avi_data,
-		 sizeof(tuvc->avi.avi_data));
-    if (Tcl_Seek(tuvc->rchan, pos, SEEK_SET) == (Tcl_WideInt) -1) {
-	tuvc->rstate = REC_ERROR;
+	n = sink->avi.rate.tv_sec * 1000000 + sink->avi.rate.tv_usec;
+	PUT32LE(&sink->avi.avi_hdr.avih.uspf, n);
+	PUT32LE(&sink->avi.avi_hdrv.strh.scale, n);
+    }
+    /* Header, "movi" list, and "idx1" index of first segment. */
+    size = sink->avi.hdrsize + sizeof(struct AVI_DATA) - 8 +
+	sink->avi.segsize0 + sink->avi.idx1size;
+    PUT32LE(&sink->avi.avi_hdr.riff_size, size);
+    size = sink->avi.hdrsize - 20;
+    PUT32LE(&sink->avi.avi_hdr.hdrl_size, size);
+    size = sink->avi.nframes0;
+    PUT32LE(&sink->avi.avi_hdr.avih.nframes, size);
+    size = sink->avi.nframes;
+    PUT32LE(&sink->avi.avi_hdrv.strh.length, size);
+    size = sink->avi.segsize0 + 4;
+    PUT32LE(&sink->avi.avi_data.data_size, size);
+    size = sink->avi.nframes;
+    PUT32LE(&sink->avi.avi_hdro.nframes, size);
+
+    pos = sink->avi.pos0;
+    if (!WriteAt(sink, pos, &sink->avi.avi_hdr,
+		 sizeof(sink->avi.avi_hdr)) ||
+	!WriteAt(sink, pos += sizeof(sink->avi.avi_hdr),
+		 &sink->avi.avi_hdrv, sizeof(sink->avi.avi_hdrv)) ||
+	!WriteAt(sink, pos += sizeof(sink->avi.avi_hdrv),
+		 &sink->avi.superidx, sizeof(sink->avi.superidx)) ||
+	!WriteAt(sink, pos += sizeof(sink->avi.superidx),
+		 &sink->avi.avi_hdro, sizeof(sink->avi.avi_hdro)) ||
+	!WriteAt(sink, pos += sizeof(sink->avi.avi_hdro),
+		 &sink->avi.avi_data, sizeof(sink->avi.avi_data))) {
+	sink->error = 1;
     }
 
     if (end) {
-	tuvc->avi.curr_idx = tuvc->avi.num_idx = 0;
-	if (tuvc->avi.idx != NULL) {
-	    ckfree((char *) tuvc->avi.idx);
-	    tuvc->avi.idx = NULL;
+	sink->avi.curr_idx = sink->avi.num_idx = 0;
+	if (sink->avi.idx != NULL) {
+	    ckfree((char *) sink->avi.idx);
+	    sink->avi.idx = NULL;
 	}
     }
 }
@@ -1641,819 +3068,5473 @@ WriteAVIHeader(TUVC *tuvc, int end)
 /*
  *-------------------------------------------------------------------------
  *
- * FinishRecording --
+ * StartAVIFile --
  *
- *	Close recording channel and release resources. Must be
- *	called from the thread which opened the UVC device.
- *	Optionally TUVC.rmutex is locked, optionally it is
- *	finalized when the UVC device gets closed.
+ *	Recording: begin a new AVI file at the current position
+ *	"pos0" of the recording channel using the header templates
+ *	in TUVC.avi, i.e. reset all counters and indices and write
+ *	the initial headers.
  *
  *-------------------------------------------------------------------------
  */
 
 static void
-FinishRecording(TUVC *tuvc, int lock, int final)
+StartAVIFile(TSINK *sink, Tcl_WideInt pos0)
 {
-    if (lock) {
-	Tcl_MutexLock(&tuvc->rmutex);
-    }
-    if ((tuvc->rchan != NULL) &&
-	(Tcl_DStringLength(&tuvc->rbdStr) == 0)) {
-	CloseAVISegment(tuvc, 1);
-	WriteAVIHeader(tuvc, 1);
-    }
-    Tcl_DStringFree(&tuvc->rbdStr);
-    if (tuvc->rchan != NULL) {
-	Tcl_Close(NULL, tuvc->rchan);
-	tuvc->rchan = NULL;
-	memset(&tuvc->avi, 0, sizeof(tuvc->avi));
-    }
-    if (lock) {
-	Tcl_MutexUnlock(&tuvc->rmutex);
-    }
-    if (final) {
-	Tcl_MutexFinalize(&tuvc->rmutex);
+    struct iovec iov[5];
+    Tcl_Size toWrite;
+
+    sink->avi.pos0 = pos0;
+    sink->avi.nframes = sink->avi.nframes0 = 0;
+    sink->avi.totsize = sink->avi.segsize = sink->avi.segsize0 = 0;
+    sink->avi.segstart = 0;
+    sink->avi.idx1size = 0;
+    sink->avi.curr_idx = sink->avi.num_idx = 0;
+    if (sink->avi.idx != NULL) {
+	ckfree((char *) sink->avi.idx);
+	sink->avi.idx = NULL;
+    }
+    sink->avi.curr_sidx = 0;
+    memset(&sink->avi.superidx, 0, sizeof(sink->avi.superidx));
+    memcpy(sink->avi.superidx.id, "indx", 4);
+    PUT32LE(&sink->avi.superidx.size,
+	    sizeof(struct AVI_SUPERIDX) - sizeof(struct CHUNK_HDR));
+    PUT16LE(&sink->avi.superidx.longs_per_entry, 4);
+    memcpy(sink->avi.superidx.chunk_id, "00db", 4);
+    sink->avi.nsuper = 0;
+
+    /* First checkpoint right after the first frame. */
+    sink->avi.ckptv.tv_sec = sink->avi.ckptv.tv_usec = 0;
+
+    iov[0].iov_base = &sink->avi.avi_hdr;
+    iov[0].iov_len = sizeof(sink->avi.avi_hdr);
+    iov[1].iov_base = &sink->avi.avi_hdrv;
+    iov[1].iov_len = sizeof(sink->avi.avi_hdrv);
+    iov[2].iov_base = &sink->avi.superidx;
+    iov[2].iov_len = sizeof(sink->avi.superidx);
+    iov[3].iov_base = &sink->avi.avi_hdro;
+    iov[3].iov_len = sizeof(sink->avi.avi_hdro);
+    iov[4].iov_base = &sink->avi.avi_data;
+    iov[4].iov_len = sizeof(sink->avi.avi_data);
+    sink->avi.hdrsize = iov[0].iov_len + iov[1].iov_len +
+	iov[2].iov_len + iov[3].iov_len;
+    toWrite = sink->avi.hdrsize + iov[4].iov_len;
+    sink->avi.movistart = pos0 + toWrite;
+    if (WriteVec(sink, iov, 5) != toWrite) {
+	sink->error = 1;
+	return;
     }
+    WriteAVIHeader(sink, 0);
 }
-
+
 /*
  *-------------------------------------------------------------------------
  *
- * RecordFrameFromData --
+ * MKVId, MKVSize, MKVUint, MKVData, MKVMaster --
  *
- *	Write single frame from byte array data.
+ *	Helpers to format EBML elements of a Matroska stream into
+ *	a buffer. Sizes are always coded in 8 bytes, a negative
+ *	size is coded as unknown. Each returns the number of bytes
+ *	put into the buffer.
  *
  *-------------------------------------------------------------------------
  */
 
 static int
-RecordFrameFromData(TUVC *tuvc, Tcl_Interp *interp,
-		    int objc, Tcl_Obj * const objv[])
+MKVId(unsigned char *p, unsigned int id)
 {
-    int width, height, bpp, ret;
-    Tcl_Size length;
-    unsigned char *data;
-    long li;
-    Tcl_HashEntry *hPtr;
-    UFMT *ufmt;
-    uvc_frame_t *frame;
+    int i, n = (id > 0xFFFFFF) ? 4 : (id > 0xFFFF) ? 3 : (id > 0xFF) ? 2 : 1;
 
-    if (objc != 8) {
-	Tcl_WrongNumArgs(interp, 2, objv,
-			 "devid width height bpp bytearray");
-	return TCL_ERROR;
+    for (i = 0; i < n; i++) {
+	p[i] = id >> (8 * (n - 1 - i));
     }
-    if (Tcl_GetIntFromObj(interp, objv[4], &width) != TCL_OK) {
-	return TCL_ERROR;
+    return n;
+}
+
+static int
+MKVSize(unsigned char *p, Tcl_WideInt size)
+{
+    int i;
+
+    p[0] = 0x01;
+    for (i = 1; i < 8; i++) {
+	p[i] = (size < 0) ? 0xFF : (size >> (8 * (7 - i)));
     }
-    if (Tcl_GetIntFromObj(interp, objv[5], &height) != TCL_OK) {
-	return TCL_ERROR;
+    return 8;
+}
+
+static int
+MKVUint(unsigned char *p, unsigned int id, Tcl_WideInt val)
+{
+    int i, n = 1, k = MKVId(p, id);
+
+    while ((n < 8) && ((val >> (8 * n)) != 0)) {
+	n++;
     }
-    if (Tcl_GetIntFromObj(interp, objv[6], &bpp) != TCL_OK) {
-	return TCL_ERROR;
+    p[k++] = 0x80 | n;
+    for (i = 0; i < n; i++) {
+	p[k++] = val >> (8 * (n - 1 - i));
     }
-    data = Tcl_GetByteArrayFromObj(objv[7], &length);
-    li = tuvc->usefmt;
-    hPtr = Tcl_FindHashEntry(&tuvc->fmts, li);
-    if (hPtr == NULL) {
-	Tcl_SetResult(interp, "unsupported format", TCL_STATIC);
-	return TCL_ERROR;
+    return k;
+}
+
+static int
+MKVData(unsigned char *p, unsigned int id, const void *data, int len)
+{
+    int k = MKVId(p, id);
+
+    /* Short strings and binaries only. */
+    p[k++] = 0x80 | len;
+    memcpy(p + k, data, len);
+    return k + len;
+}
+
+static int
+MKVMaster(unsigned char *p, unsigned int id, const unsigned char *body,
+	  int len)
+{
+    int k = MKVId(p, id);
+
+    k += MKVSize(p + k, len);
+    memcpy(p + k, body, len);
+    return k + len;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * StartMKVFile --
+ *
+ *	Recording: write EBML header, segment info, and track of a
+ *	Matroska stream. The segment is of unknown size, as are the
+ *	clusters written later, which needs neither seeking nor an
+ *	index in memory, and a truncated stream remains playable.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+StartMKVFile(TSINK *sink)
+{
+    unsigned char hdr[512], body[256], track[256], video[64];
+    int n, m, v;
+    struct iovec iov[1];
+    const char *codec = sink->jpeg ? "V_MJPEG" : "V_UNCOMPRESSED";
+
+    sink->mkv.start = 0;
+    sink->mkv.cluster = -1;
+    sink->mkv.nframes = 0;
+
+    /* EBML header. */
+    m = MKVUint(body, 0x4286, 1);			/* EBMLVersion */
+    m += MKVUint(body + m, 0x42F7, 1);			/* EBMLReadVersion */
+    m += MKVUint(body + m, 0x42F2, 4);			/* EBMLMaxIDLength */
+    m += MKVUint(body + m, 0x42F3, 8);			/* EBMLMaxSizeLength */
+    m += MKVData(body + m, 0x4282, "matroska", 8);	/* DocType */
+    m += MKVUint(body + m, 0x4287, 4);			/* DocTypeVersion */
+    m += MKVUint(body + m, 0x4285, 2);			/* DocTypeReadVersion */
+    n = MKVMaster(hdr, 0x1A45DFA3, body, m);
+
+    /* Segment. */
+    n += MKVId(hdr + n, 0x18538067);
+    n += MKVSize(hdr + n, -1);
+
+    /* Segment info, timestamps in milliseconds. */
+    m = MKVUint(body, 0x2AD7B1, 1000000);		/* TimecodeScale */
+    m += MKVData(body + m, 0x4D80, PACKAGE_NAME,
+		 strlen(PACKAGE_NAME));			/* MuxingApp */
+    m += MKVData(body + m, 0x5741, PACKAGE_NAME,
+		 strlen(PACKAGE_NAME));			/* WritingApp */
+    n += MKVMaster(hdr + n, 0x1549A966, body, m);
+
+    /* Single video track. */
+    v = MKVUint(video, 0xB0, sink->mkv.width);		/* PixelWidth */
+    v += MKVUint(video + v, 0xBA, sink->mkv.height);	/* PixelHeight */
+    if (!sink->jpeg) {
+	v += MKVData(video + v, 0x2EB524, sink->mkv.fourcc, 4);
+							/* ColourSpace */
+    }
+    m = MKVUint(body, 0xD7, 1);				/* TrackNumber */
+    m += MKVUint(body + m, 0x73C5, 1);			/* TrackUID */
+    m += MKVUint(body + m, 0x83, 1);			/* TrackType */
+    m += MKVUint(body + m, 0x9C, 0);			/* FlagLacing */
+    m += MKVData(body + m, 0x86, codec, strlen(codec));	/* CodecID */
+    m += MKVUint(body + m, 0x23E383, sink->mkv.dur);	/* DefaultDuration */
+    m += MKVMaster(body + m, 0xE0, video, v);		/* Video */
+    m = MKVMaster(track, 0xAE, body, m);		/* TrackEntry */
+    n += MKVMaster(hdr + n, 0x1654AE6B, track, m);	/* Tracks */
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = n;
+    if (WriteVec(sink, iov, 1) != n) {
+	sink->error = 1;
     }
-    ufmt = (UFMT *) Tcl_GetHashValue(hPtr);
-    if ((length < width * height * bpp) ||
-	(width != ufmt->width) || (height != ufmt->height)) {
-	Tcl_SetResult(interp, "incompatible frame data", TCL_STATIC);
-	return TCL_ERROR;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * RtpOpen --
+ *
+ *	Recording: create a UDP socket connected to "host:port",
+ *	IPv6 addresses written as "[addr]:port". Returns the OS
+ *	handle or -1 with an error message left in the interpreter.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+RtpOpen(Tcl_Interp *interp, const char *dest)
+{
+    struct addrinfo hints, *res, *ai;
+    Tcl_DString ds;
+    const char *port;
+    char *host;
+    int fd = -1, n;
+
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, dest, -1);
+    host = Tcl_DStringValue(&ds);
+    port = strrchr(host, ':');
+    if ((port == NULL) || (port == host) || (port[1] == '\0')) {
+	Tcl_DStringFree(&ds);
+	Tcl_SetResult(interp, "-rtp needs host:port", TCL_STATIC);
+	return -1;
     }
-    if (!tuvc->ruser ||
-	((tuvc->rstate != REC_RECORD) && (tuvc->rstate != REC_PAUSE))) {
-	Tcl_SetResult(interp, "wrong recording state for frame",
-		      TCL_STATIC);
-	return TCL_ERROR;
+    host[port - host] = '\0';
+    port++;
+    n = strlen(host);
+    if ((host[0] == '[') && (host[n - 1] == ']')) {
+	host[n - 1] = '\0';
+	host++;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    n = getaddrinfo(host, port, &hints, &res);
+    if (n != 0) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("cannot resolve \"%s\": %s", dest, gai_strerror(n)));
+	Tcl_DStringFree(&ds);
+	return -1;
     }
-    frame = uvc_allocate_frame(0);
-    if (frame == NULL) {
-	Tcl_SetResult(interp, "out of memory", TCL_STATIC);
-	return TCL_ERROR;
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+	fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd < 0) {
+	    continue;
+	}
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+	    break;
+	}
+	close(fd);
+	fd = -1;
     }
-    frame->library_owns_data = 0;
-    frame->width = width;
-    frame->height = height;
-    frame->step = width * bpp;
-    frame->sequence = 0;
-    frame->source = 0;
-    frame->data = data;
-    frame->data_bytes = length;
-    switch (bpp) {
-    case 1:
-	frame->frame_format = UVC_FRAME_FORMAT_GRAY8;
-	break;
-    case 2:
-	frame->frame_format = UVC_FRAME_FORMAT_GRAY16;
-	break;
-    default:
-	frame->frame_format = UVC_FRAME_FORMAT_RGB;
-	break;
+    freeaddrinfo(res);
+    Tcl_DStringFree(&ds);
+    if (fd < 0) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("cannot connect to \"%s\": %s", dest,
+			  Tcl_PosixError(interp)));
+	return -1;
     }
-    gettimeofday(&frame->capture_time, NULL);
-    ret = WriteFrame(tuvc, frame);
-    uvc_free_frame(frame);
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(ret));
-    return TCL_OK;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
 }
-
+
 /*
  *-------------------------------------------------------------------------
  *
- * DataToPhoto --
+ * RtpSend --
  *
- *	Put byte array data to a Tk photo image.
+ *	Recording: send a baseline JPEG frame as RTP/JPEG (RFC 2435).
+ *	The JPEG headers are parsed for type (4:2:2 or 4:2:0), size,
+ *	restart interval, and quantization tables, which are sent
+ *	in-band (Q=255) in the first packet of each frame. The scan
+ *	data is split into packets of at most RTP_MTU bytes sent in
+ *	batches by sendmmsg() where available. The RTP timestamp is
+ *	derived from the capture time. Frames RFC 2435 can't carry
+ *	(progressive, gray, 16 bit tables, larger than 2040 pixels)
+ *	are skipped. Returns -1 on send error, 1 when packets were
+ *	sent, 0 otherwise.
  *
  *-------------------------------------------------------------------------
  */
 
 static int
-DataToPhoto(TUVCI *tuvci, Tcl_Interp *interp,
-	    int objc, Tcl_Obj * const objv[])
+RtpSend(TSINK *sink, uvc_frame_t *frame)
 {
-    int width, height, bpp;
-    Tcl_Size length;
-    int rot = 0, mirx = 0, miry = 0, mirror;
-    unsigned char *data;
-    Tk_PhotoHandle photo;
-    char *name;
-    Tk_PhotoImageBlock block;
+    const unsigned char *p = (const unsigned char *) frame->data;
+    const unsigned char *qt[4] = { NULL, NULL, NULL, NULL };
+    const unsigned char *scan = NULL;
+    int len = frame->data_bytes, pos = 2, seglen, type = -1;
+    int width = 0, height = 0, dri = 0, tq[2] = { 0, 0 };
+    int i, k, off, n, npkts, hlen, ret = 0, sent = 0;
+    unsigned int ts;
+    unsigned char *h;
+    struct iovec iov[RTP_BATCH][2];
+#ifdef RTP_HAVE_MMSG
+    struct mmsghdr msgs[RTP_BATCH];
+#else
+    struct msghdr msg;
+#endif
 
-    if (CheckForTk(tuvci, interp) != TCL_OK) {
-	return TCL_ERROR;
+    if ((len < 4) || (p[0] != 0xFF) || (p[1] != 0xD8)) {
+	goto skip;
     }
-    if ((objc < 7) || (objc > 10)) {
-	Tcl_WrongNumArgs(interp, 2, objv,
-			 "photo width height bpp bytearray "
-			 "?rotation mirrorx mirrory?");
-	return TCL_ERROR;
+    while ((scan == NULL) && (pos + 4 <= len)) {
+	if (p[pos] != 0xFF) {
+	    goto skip;
+	}
+	if ((p[pos + 1] == 0xFF) || (p[pos + 1] == 0xD8) ||
+	    ((p[pos + 1] >= 0xD0) && (p[pos + 1] <= 0xD7))) {
+	    /* Fill byte or marker without length. */
+	    pos += (p[pos + 1] == 0xFF) ? 1 : 2;
+	    continue;
+	}
+	seglen = (p[pos + 2] << 8) | p[pos + 3];
+	if ((seglen < 2) || (pos + 2 + seglen > len)) {
+	    goto skip;
+	}
+	switch (p[pos + 1]) {
+	case 0xDB:			/* DQT */
+	    for (k = pos + 4; k < pos + 2 + seglen; k += 65) {
+		if ((p[k] >> 4) || (k + 65 > pos + 2 + seglen)) {
+		    /* 16 bit precision. */
+		    goto skip;
+		}
+		qt[p[k] & 3] = p + k + 1;
+	    }
+	    break;
+	case 0xC0:			/* SOF0 */
+	case 0xC1:			/* SOF1 */
+	    if ((seglen != 17) || (p[pos + 4] != 8) || (p[pos + 9] != 3) ||
+		(p[pos + 14] != 0x11) || (p[pos + 17] != 0x11) ||
+		(p[pos + 15] != p[pos + 18])) {
+		goto skip;
+	    }
+	    height = (p[pos + 5] << 8) | p[pos + 6];
+	    width = (p[pos + 7] << 8) | p[pos + 8];
+	    if (p[pos + 11] == 0x21) {
+		type = 0;
+	    } else if (p[pos + 11] == 0x22) {
+		type = 1;
+	    } else {
+		goto skip;
+	    }
+	    tq[0] = p[pos + 12] & 3;
+	    tq[1] = p[pos + 15] & 3;
+	    break;
+	case 0xDD:			/* DRI */
+	    dri = (p[pos + 4] << 8) | p[pos + 5];
+	    break;
+	case 0xDA:			/* SOS */
+	    scan = p + pos + 2 + seglen;
+	    break;
+	default:
+	    if ((p[pos + 1] >= 0xC2) && (p[pos + 1] <= 0xCF) &&
+		(p[pos + 1] != 0xC4) && (p[pos + 1] != 0xCC)) {
+		/* Progressive, lossless, arithmetic coding. */
+		goto skip;
+	    }
+	    break;
+	}
+	pos += 2 + seglen;
     }
-    if (Tk_MainWindow(interp) == NULL) {
-	Tcl_SetResult(interp, "application has been destroyed",
-		      TCL_STATIC);
-	return TCL_ERROR;
+    if ((scan == NULL) || (type < 0) || (qt[tq[0]] == NULL) ||
+	(qt[tq[1]] == NULL) || (width <= 0) || (height <= 0) ||
+	(width > 2040) || (height > 2040)) {
+	goto skip;
     }
-    name = Tcl_GetString(objv[2]);
-    photo = Tk_FindPhoto(interp, name);
-    if (photo == NULL) {
-	Tcl_SetObjResult(interp,
-	    Tcl_ObjPrintf("can't use \"%s\": not a photo image", name));
-	return TCL_ERROR;
-    }
-    if (Tcl_GetIntFromObj(interp, objv[3], &width) != TCL_OK) {
-	return TCL_ERROR;
-    }
-    if (Tcl_GetIntFromObj(interp, objv[4], &height) != TCL_OK) {
-	return TCL_ERROR;
-    }
-    if (Tcl_GetIntFromObj(interp, objv[5], &bpp) != TCL_OK) {
-	return TCL_ERROR;
+    len -= scan - p;
+    if ((len >= 2) && (scan[len - 2] == 0xFF) && (scan[len - 1] == 0xD9)) {
+	len -= 2;
     }
-    if ((objc > 7) && (Tcl_GetIntFromObj(interp, objv[7], &rot) != TCL_OK)) {
-	return TCL_ERROR;
+    if (dri > 0) {
+	type += 64;
     }
-    if ((objc > 8) &&
-	(Tcl_GetBooleanFromObj(interp, objv[8], &mirx) != TCL_OK)) {
-	return TCL_ERROR;
+
+    ts = sink->rtp.ts0 + (unsigned int) frame->capture_time.tv_sec * 90000U +
+	(unsigned int) frame->capture_time.tv_usec * 9U / 100U;
+    npkts = 0;
+    for (off = 0; off < len; npkts++) {
+	off += RTP_MTU - 8 - ((dri > 0) ? 4 : 0) - ((off == 0) ? 132 : 0);
     }
-    if ((objc > 9) &&
-	(Tcl_GetBooleanFromObj(interp, objv[9], &miry) != TCL_OK)) {
-	return TCL_ERROR;
+    if (npkts > sink->rtp.nhdrs) {
+	h = (unsigned char *)
+	    attemptckrealloc((char *) sink->rtp.hdrs, npkts * RTP_HDRSIZE);
+	if (h == NULL) {
+	    return 0;
+	}
+	sink->rtp.hdrs = h;
+	sink->rtp.nhdrs = npkts;
     }
-    data = Tcl_GetByteArrayFromObj(objv[6], &length);
-    if ((length < width * height * bpp) ||
-	((bpp != 1) && (bpp != 3))) {
-	Tcl_SetResult(interp, "unsupported data format", TCL_STATIC);
-	return TCL_ERROR;
+
+    off = 0;
+    for (i = 0; i < npkts; i += n) {
+	n = npkts - i;
+	if (n > RTP_BATCH) {
+	    n = RTP_BATCH;
+	}
+	for (k = 0; k < n; k++) {
+	    int plen;
+
+	    h = sink->rtp.hdrs + (i + k) * RTP_HDRSIZE;
+	    plen = RTP_MTU - 8 - ((dri > 0) ? 4 : 0) - ((off == 0) ? 132 : 0);
+	    if (plen > len - off) {
+		plen = len - off;
+	    }
+	    /* RTP header, payload type 26, marker on last packet. */
+	    h[0] = 0x80;
+	    h[1] = 26 | ((off + plen >= len) ? 0x80 : 0);
+	    h[2] = sink->rtp.seq >> 8;
+	    h[3] = sink->rtp.seq;
+	    h[4] = ts >> 24;
+	    h[5] = ts >> 16;
+	    h[6] = ts >> 8;
+	    h[7] = ts;
+	    h[8] = sink->rtp.ssrc >> 24;
+	    h[9] = sink->rtp.ssrc >> 16;
+	    h[10] = sink->rtp.ssrc >> 8;
+	    h[11] = sink->rtp.ssrc;
+	    sink->rtp.seq++;
+	    /* JPEG header. */
+	    h[12] = 0;
+	    h[13] = off >> 16;
+	    h[14] = off >> 8;
+	    h[15] = off;
+	    h[16] = type;
+	    h[17] = 255;
+	    h[18] = width / 8;
+	    h[19] = height / 8;
+	    hlen = 20;
+	    if (dri > 0) {
+		/* Restart marker header, F=L=1, count 0x3FFF. */
+		h[hlen++] = dri >> 8;
+		h[hlen++] = dri;
+		h[hlen++] = 0xFF;
+		h[hlen++] = 0xFF;
+	    }
+	    if (off == 0) {
+		/* Quantization table header, luma and chroma table. */
+		h[hlen++] = 0;
+		h[hlen++] = 0;
+		h[hlen++] = 0;
+		h[hlen++] = 128;
+		memcpy(h + hlen, qt[tq[0]], 64);
+		memcpy(h + hlen + 64, qt[tq[1]], 64);
+		hlen += 128;
+	    }
+	    iov[k][0].iov_base = h;
+	    iov[k][0].iov_len = hlen;
+	    iov[k][1].iov_base = (void *) (scan + off);
+	    iov[k][1].iov_len = plen;
+	    off += plen;
+	}
+#ifdef RTP_HAVE_MMSG
+	memset(msgs, 0, n * sizeof(struct mmsghdr));
+	for (k = 0; k < n; k++) {
+	    msgs[k].msg_hdr.msg_iov = iov[k];
+	    msgs[k].msg_hdr.msg_iovlen = 2;
+	}
+	for (k = 0; k < n; ) {
+	    int m = sendmmsg(sink->rtp.fd, msgs + k, n - k, MSG_DONTWAIT);
+
+	    if (m <= 0) {
+		break;
+	    }
+	    k += m;
+	}
+#else
+	memset(&msg, 0, sizeof(msg));
+	for (k = 0; k < n; k++) {
+	    msg.msg_iov = iov[k];
+	    msg.msg_iovlen = 2;
+	    if (sendmsg(sink->rtp.fd, &msg, MSG_DONTWAIT) < 0) {
+		break;
+	    }
+	}
+#endif
+	sink->rtp.packets += k;
+	sent += k;
+	if ((k < n) && (errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+	    (errno != ENOBUFS) && (errno != ECONNREFUSED)) {
+	    /* Receivers coming and going or full buffers are no error. */
+	    ret = -1;
+	    break;
+	}
     }
-    if (bpp == 1) {
-	block.pixelSize = 1;
-	block.offset[0] = 0;
-	block.offset[1] = 0;
-	block.offset[2] = 0;
-	block.offset[3] = 1;
-    } else {
-	block.pixelSize = 3;
-	block.offset[0] = 0;
-	block.offset[1] = 1;
-	block.offset[2] = 2;
-	block.offset[3] = 4;
+    if ((ret == 0) && (sent > 0)) {
+	ret = 1;
     }
-    block.width = width;
-    block.height = height;
-    block.pitch = width * bpp;
-    block.pixelPtr = data;
-    mirror = (mirx ? 1 : 0) | (miry ? 2 : 0);
-    rot = rot % 360;
-    if (rot < 45) {
-	rot = 0;
-    } else if (rot < 135) {
-	rot = 90;
-    } else if (rot < 225) {
-	rot = 180;
-    } else if (rot < 315) {
-	rot = 270;
-    } else {
-	rot = 0;
+    return ret;
+
+skip:
+    sink->rtp.skipped++;
+    return 0;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * RotateName --
+ *
+ *	Recording: append file name made from rotation pattern
+ *	and time "t" to the given DString.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+RotateName(TSINK *sink, time_t t, Tcl_DString *dsPtr)
+{
+    struct tm tm;
+    char buf[1024];
+
+    localtime_r(&t, &tm);
+    Tcl_DStringAppend(dsPtr, buf,
+		      strftime(buf, sizeof(buf),
+			       Tcl_DStringValue(&sink->rot.pattern), &tm));
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * RotateCheck --
+ *
+ *	Recording: called with TUVC.rmutex locked before an AVI
+ *	frame is written. When the current file is due for rotation
+ *	and the next file has been pre-opened, the new one takes
+ *	over, so the frame about to be written is the first of the
+ *	new file. The current file with its AVI writer state goes
+ *	into a copy of the sink, which is finalized and closed later
+ *	by RotateFinish() in the thread which owns the channel, thus
+ *	writing its indices doesn't stall frames. If no next file is
+ *	available yet, recording continues in the current one.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+RotateCheck(TSINK *sink)
+{
+    TSINK *old;
+    Tcl_DString ds, name, native;
+    const char *ext;
+    char suffix[32];
+    int n, found, due = 0;
+
+    if (sink->avi.nframes == 0) {
+	sink->rot.start = sink->ltv;
+	return;
     }
-    if ((mirror & 3) == 3) {
-	rot = (rot + 180) % 360;
+    if (sink->rot.next == NULL) {
+	RotateRequest(sink);
     }
-    switch (rot) {
-    case 270:	/* = 90 CW */
-	block.pitch = block.pixelSize;
-	block.pixelPtr += width * block.pixelSize * (height - 1);
-	block.pixelSize *= -width;
-	block.offset[3] = block.pixelSize + 1;	/* no alpha */
-	block.width = height;
-	block.height = width;
-	break;
-    case 180:	/* = 180 CW */
-	block.pitch = -block.pitch;
-	block.pixelPtr += (width * height - 1) * block.pixelSize;
-	block.pixelSize = -block.pixelSize;
-	block.offset[3] = block.pixelSize + 1;	/* no alpha */
-	break;
-    case 90:	/* = 270 CW */
-	block.pitch = -block.pixelSize;
-	block.pixelPtr += (width - 1) * block.pixelSize;
-	block.pixelSize *= width;
-	block.offset[3] = block.pixelSize + 1;	/* no alpha */
-	block.width = height;
-	block.height = width;
-	break;
+    if ((sink->rot.secs > 0) &&
+	((Tcl_WideInt) (sink->ltv.tv_sec - sink->rot.start.tv_sec) * 1000000 +
+	 (sink->ltv.tv_usec - sink->rot.start.tv_usec) >=
+	 (Tcl_WideInt) sink->rot.secs * 1000000)) {
+	due = 1;
     }
-    if ((mirror & 3) == 2) {
-	/* mirror in X */
-	block.pixelPtr += (block.width - 1) * block.pixelSize;
-	block.pixelSize = -block.pixelSize;
-	block.offset[3] = block.pixelSize + 1;      /* no alpha */
+    if ((sink->rot.bytes > 0) &&
+	(sink->avi.hdrsize + sink->avi.totsize >= sink->rot.bytes)) {
+	due = 1;
     }
-    if ((mirror & 3) == 1) {
-	/* mirror in Y */
-	block.pixelPtr += block.pitch * (block.height - 1);
-	block.pitch = -block.pitch;
+    if (!due || (sink->rot.next == NULL) ||
+	(sink->rot.ndone >= sizeof(sink->rot.done) / sizeof(TSINK *))) {
+	return;
     }
-    if (Tk_PhotoExpand(interp, photo, block.width, block.height) != TCL_OK) {
-	return TCL_ERROR;
+    old = (TSINK *) attemptckalloc(sizeof(TSINK));
+    if (old == NULL) {
+	return;
     }
-    if (Tk_PhotoPutBlock(interp, photo, &block, 0, 0, block.width,
-			 block.height, TK_PHOTO_COMPOSITE_SET) != TCL_OK) {
-	return TCL_ERROR;
+
+    /* Indices of current file now belong to the copy. */
+    memcpy(old, sink, sizeof(TSINK));
+    sink->rot.done[sink->rot.ndone++] = old;
+    sink->avi.idx = NULL;
+    sink->avi.sidx = NULL;
+    sink->avi.num_sidx = 0;
+
+    /*
+     * Give next file its final name. If that is taken, e.g. after
+     * two rotations within the resolution of the pattern, "-1",
+     * "-2", ... is inserted before the extension.
+     */
+    Tcl_DStringInit(&ds);
+    Tcl_DStringInit(&name);
+    RotateName(sink, sink->ltv.tv_sec, &ds);
+    ext = strrchr(Tcl_DStringValue(&ds), '.');
+    if ((ext == NULL) || (strchr(ext, '/') != NULL)) {
+	ext = Tcl_DStringValue(&ds) + Tcl_DStringLength(&ds);
+    }
+    for (n = 0; n < 1000; n++) {
+	Tcl_DStringSetLength(&name, 0);
+	Tcl_DStringAppend(&name, Tcl_DStringValue(&ds),
+			  ext - Tcl_DStringValue(&ds));
+	if (n > 0) {
+	    sprintf(suffix, "-%d", n);
+	    Tcl_DStringAppend(&name, suffix, -1);
+	}
+	Tcl_DStringAppend(&name, ext, -1);
+	Tcl_UtfToExternalDString(NULL, Tcl_DStringValue(&name),
+				 Tcl_DStringLength(&name), &native);
+	found = (access(Tcl_DStringValue(&native), F_OK) != 0);
+	if (found) {
+	    rename(Tcl_DStringValue(&sink->rot.nextName),
+		   Tcl_DStringValue(&native));
+	}
+	Tcl_DStringFree(&native);
+	if (found) {
+	    break;
+	}
     }
-    return TCL_OK;
+    Tcl_DStringFree(&name);
+    Tcl_DStringFree(&ds);
+
+    sink->rchan = sink->rot.next;
+    sink->rfd = sink->rot.nextfd;
+    sink->rot.next = NULL;
+    sink->rot.nextfd = -1;
+    sink->rot.start = sink->ltv;
+    StartAVIFile(sink, 0);
+    RotateRequest(sink);
 }
-
+
 /*
  *-------------------------------------------------------------------------
  *
- * FrameCallback --
+ * RotateRequest, RotateReady0 --
  *
- *	Invoked by a internal libuvc thread to indicate a frame
- *	ready to be processed further. Frame is converted to RGB
- *	and the interpreter associated with the UVC device woken
- *	up by marking a Tcl_AsyncHandler or by queuing an event.
+ *	Recording: ask the thread which started capture to close
+ *	finished files and to pre-open the next file. Called with
+ *	TUVC.rmutex locked. RotateReady0 is the event callback
+ *	running in that thread.
  *
  *-------------------------------------------------------------------------
  */
 
 static void
-FrameCallback(uvc_frame_t *frame, void *arg)
+RotateRequest(TSINK *sink)
 {
-    TUVC *tuvc = (TUVC *) arg;
-    uvc_frame_t *newFrame;
-    uvc_error_t uret;
+    TUVC *tuvc = sink->tuvc;
     TUEVT *event;
+    int isNew;
 
-    if (tuvc->tid == NULL) {
-	/* should never happen */
+    if (sink->rot.pending || (time(NULL) < sink->rot.retry)) {
 	return;
     }
-    if (tuvc->rstate == REC_RECPRI) {
-	Tcl_MutexLock(&tuvc->rmutex);
-	WriteFrame(tuvc, frame);
-	Tcl_MutexUnlock(&tuvc->rmutex);
-    }
-    if (tuvc->conv && (frame->frame_format != UVC_FRAME_FORMAT_GRAY8) &&
-	(frame->frame_format != UVC_FRAME_FORMAT_RGB)) {
-	if (frame->frame_format == UVC_FRAME_FORMAT_GRAY16) {
-	    newFrame = uvc_allocate_frame(frame->data_bytes / 2);
-	    if (newFrame == NULL) {
-		return;
-	    }
-	    uret = uvc_gray16to8(frame, newFrame, tuvc->greyshift);
-	} else {
-	    newFrame = uvc_allocate_frame(frame->data_bytes);
-	    if (newFrame == NULL) {
-		return;
-	    }
-#ifdef LIBUVC_HAVE_JPEG
-	    if (frame->frame_format == UVC_FRAME_FORMAT_MJPEG) {
-		uret = uvc_mjpeg2rgb(frame, newFrame);
-	    } else
-#endif
-	    {
-		uret = uvc_any2rgb(frame, newFrame);
-	    }
-	}
-	if (uret) {
-	    uvc_free_frame(newFrame);
-	    return;
-	}
-    } else {
-	newFrame = frame;
-    }
     Tcl_MutexLock(&uvcMutex);
-    if (tuvc->frame != NULL) {
-	uvc_frame_t *oldFrame = tuvc->frame;
-
-	tuvc->frame = newFrame;
-	newFrame = oldFrame;
-	tuvc->counters[2] += 1;		/* frame dropped */
-    } else {
-	tuvc->frame = newFrame;
-	newFrame = NULL;
-    }
-    tuvc->counters[0] += 1;
-    if ((tuvc->tid != NULL) && (tuvc->numev == 0)) {
-	int isNew;
-
+    if (tuvc->tid != NULL) {
 	event = (TUEVT *) ckalloc(sizeof(TUEVT));
-	event->hdr.proc = FrameReady0;
+	event->hdr.proc = RotateReady0;
 	event->hdr.nextPtr = NULL;
 	event->tuvc = tuvc;
 	event->hPtr =
 	    Tcl_CreateHashEntry(&tuvc->evts, (ClientData) event, &isNew);
-	if (tip609) {
-	    /* TCL_QUEUE_TAIL_ALERT_IF_EMPTY */
-	    Tcl_ThreadQueueEvent(tuvc->tid, &event->hdr, TCL_QUEUE_TAIL | 4);
-	} else {
-	    Tcl_ThreadQueueEvent(tuvc->tid, &event->hdr, TCL_QUEUE_TAIL);
-	    Tcl_ThreadAlert(tuvc->tid);
-	}
-	tuvc->numev++;
+	Tcl_ThreadQueueEvent(tuvc->tid, &event->hdr, TCL_QUEUE_TAIL);
+	Tcl_ThreadAlert(tuvc->tid);
+	sink->rot.pending = 1;
     }
     Tcl_MutexUnlock(&uvcMutex);
-    if (newFrame != NULL) {
-	uvc_free_frame(newFrame);
+}
+
+static int
+RotateReady0(Tcl_Event *evPtr, int flags)
+{
+    TUEVT *tevPtr = (TUEVT *) evPtr;
+    TUVC *tuvc = tevPtr->tuvc;
+    int i;
+
+    if (tuvc == NULL) {
+	return 1;
+    }
+    Tcl_MutexLock(&uvcMutex);
+    if (tevPtr->hPtr != NULL) {
+	Tcl_DeleteHashEntry(tevPtr->hPtr);
     }
+    Tcl_MutexUnlock(&uvcMutex);
+    /* Sink list is changed only in this thread. */
+    for (i = 0; i < tuvc->nsinks; i++) {
+	TSINK *sink = tuvc->sinks[i];
+
+	if ((sink->rot.secs > 0) || (sink->rot.bytes > 0)) {
+	    RotateOpenNext(sink);
+	}
+    }
+    return 1;
 }
-
+
 /*
  *-------------------------------------------------------------------------
  *
- * FrameReady, FrameReady0 --
+ * RotateOpenNext --
  *
- *	A frame became ready. FrameReady is a do-when-idle handler
- *	triggered by FrameReady0 which is an event callback function
- *	triggered by the FrameCallback function which runs in a
- *	different libuvc controlled thread. The top-level function
- *	invokes the Tcl callback procedure which then can retrieve
- *	the frame buffer using the "uvc image ..." command.
+ *	Recording: finalize finished files and pre-open the next file
+ *	for rotation under a temporary name. With size based
+ *	rotation, disk space for the next file is allocated up
+ *	front. Must be called from the thread which opened the UVC
+ *	device, the slow parts run without TUVC.rmutex locked.
  *
  *-------------------------------------------------------------------------
  */
 
 static void
-FrameReady(ClientData clientData)
+RotateOpenNext(TSINK *sink)
 {
-    TUVC *tuvc = (TUVC *) clientData;
-    Tcl_Interp *interp = tuvc->interp;
-    int ret;
-
-    Tcl_MutexLock(&uvcMutex);
-    if (tuvc->idle) {
-	tuvc->numev = 0;
-    }
-    Tcl_MutexUnlock(&uvcMutex);
-    if (!tuvc->ruser && (tuvc->rstate == REC_RECORD)) {
-	uvc_frame_t *frame;
+    TSINK *done[8];
+    Tcl_Channel chan = NULL;
+    Tcl_DString ds, native;
+    Tcl_WideInt bytes;
+    ClientData handle;
+    int i, ndone, fd = -1, failed = 0;
 
-	Tcl_MutexLock(&uvcMutex);
-	frame = tuvc->frame;
-	tuvc->frame = NULL;
-	Tcl_MutexUnlock(&uvcMutex);
-	if (frame != NULL) {
-	    WriteFrame(tuvc, frame);
-	}
-	Tcl_MutexLock(&uvcMutex);
-	if ((frame != NULL) && (tuvc->frame == NULL)) {
-	    /* Put back last frame */
-	    tuvc->frame = frame;
-	    frame = NULL;
-	}
-	Tcl_MutexUnlock(&uvcMutex);
-	if (frame != NULL) {
-	    uvc_free_frame(frame);
+    Tcl_DStringInit(&ds);
+    Tcl_DStringInit(&native);
+    Tcl_MutexLock(&sink->tuvc->rmutex);
+    ndone = sink->rot.ndone;
+    memcpy(done, sink->rot.done, ndone * sizeof(TSINK *));
+    sink->rot.ndone = 0;
+    if ((sink->rchan != NULL) && (sink->rot.next == NULL) &&
+	((sink->rot.secs > 0) || (sink->rot.bytes > 0))) {
+	RotateName(sink, time(NULL), &ds);
+	Tcl_DStringAppend(&ds, ".part", -1);
+    }
+    bytes = sink->rot.bytes;
+    Tcl_MutexUnlock(&sink->tuvc->rmutex);
+
+    for (i = 0; i < ndone; i++) {
+	if (!RotateFinish(done[i])) {
+	    failed = 1;
+	}
+    }
+    if (Tcl_DStringLength(&ds) > 0) {
+	chan = Tcl_OpenFileChannel(NULL, Tcl_DStringValue(&ds), "w", 0666);
+	Tcl_UtfToExternalDString(NULL, Tcl_DStringValue(&ds),
+				 Tcl_DStringLength(&ds), &native);
+    }
+    if (chan != NULL) {
+	if ((Tcl_SetChannelOption(NULL, chan, "-buffering", "none")
+	     != TCL_OK) ||
+	    (Tcl_SetChannelOption(NULL, chan, "-translation", "binary")
+	     != TCL_OK)) {
+	    Tcl_Close(NULL, chan);
+	    unlink(Tcl_DStringValue(&native));
+	    chan = NULL;
+	} else if (Tcl_GetChannelHandle(chan, TCL_WRITABLE, &handle)
+		   == TCL_OK) {
+	    fd = (int) (intptr_t) handle;
+	    if (bytes > 0) {
+		posix_fallocate(fd, 0, bytes);
+	    }
 	}
     }
-    if (tuvc->frame == NULL) {
-	/* should never happen */
-	return;
-    }
-    Tcl_DStringSetLength(&tuvc->cbCmd, tuvc->cbCmdLen);
-    Tcl_DStringAppendElement(&tuvc->cbCmd, tuvc->devId);
-    Tcl_Preserve((ClientData) interp);
-    ret = Tcl_EvalEx(interp, Tcl_DStringValue(&tuvc->cbCmd),
-		     Tcl_DStringLength(&tuvc->cbCmd), TCL_EVAL_GLOBAL);
-    if (ret != TCL_OK) {
-	Tcl_AddErrorInfo(interp, "\n    (uvc event handler)");
-	Tcl_BackgroundException(interp, ret);
-	StopCapture(tuvc);
-    }
-    Tcl_Release((ClientData) interp);
-}
-
-static int
-FrameReady0(Tcl_Event *evPtr, int flags)
-{
-    TUEVT *tevPtr = (TUEVT *) evPtr;
-    TUVC *tuvc = tevPtr->tuvc;
-    int doit = 0;
 
-    if (tuvc == NULL) {
-	return 1;
-    }
-    Tcl_MutexLock(&uvcMutex);
-    if (tevPtr->hPtr != NULL) {
-	Tcl_DeleteHashEntry(tevPtr->hPtr);
+    Tcl_MutexLock(&sink->tuvc->rmutex);
+    if (failed) {
+	sink->error = 1;
     }
-    if (tuvc->tid != NULL) {
-	if (!tuvc->idle) {
-	    tuvc->numev--;
-	}
-	doit = 1;
-    } else {
-	tuvc->numev = 0;
+    if ((chan != NULL) && (sink->rchan != NULL) &&
+	(sink->rot.next == NULL)) {
+	sink->rot.next = chan;
+	sink->rot.nextfd = fd;
+	Tcl_DStringFree(&sink->rot.nextName);
+	Tcl_DStringAppend(&sink->rot.nextName, Tcl_DStringValue(&native),
+			  Tcl_DStringLength(&native));
+	chan = NULL;
+    } else if ((chan == NULL) && (Tcl_DStringLength(&ds) > 0)) {
+	/* Open failed, try again later. */
+	sink->rot.retry = time(NULL) + 5;
     }
-    Tcl_MutexUnlock(&uvcMutex);
-    if (doit) {
-	if (tuvc->idle) {
-	    Tcl_CancelIdleCall(FrameReady, (ClientData) tuvc);
-	    Tcl_DoWhenIdle(FrameReady, (ClientData) tuvc);
-	} else {
-	    FrameReady((ClientData) tuvc);
-	}
+    sink->rot.pending = 0;
+    Tcl_MutexUnlock(&sink->tuvc->rmutex);
+    if (chan != NULL) {
+	Tcl_Close(NULL, chan);
+	unlink(Tcl_DStringValue(&native));
     }
-    return 1;
+    Tcl_DStringFree(&native);
+    Tcl_DStringFree(&ds);
 }
-
+
 /*
  *-------------------------------------------------------------------------
  *
- * StopCapture --
+ * RotateFinish --
  *
- *	Stop capture if running. UVC streaming is turned off.
- *	A pending idle call to FrameReady is cancelled, too.
- *	The thread id to which further events would be queued
- *	has to be cleared, events in flight are invalidated.
+ *	Recording: finalize a file handed over by RotateCheck(),
+ *	i.e. write its last index and headers, drop pre-allocated
+ *	space, close the channel, and release the copy of the sink
+ *	holding its AVI writer state. Must be called from the thread
+ *	which owns the channel. The copy isn't shared, thus
+ *	TUVC.rmutex needn't be locked. Returns 0 on write error.
  *
  *-------------------------------------------------------------------------
  */
 
 static int
-StopCapture(TUVC *tuvc)
+RotateFinish(TSINK *old)
 {
-    Tcl_HashEntry *hPtr;
-    Tcl_HashSearch search;
+    Tcl_WideInt pos;
+    int ok;
 
-    if (tuvc->running > 0) {
-	uvc_stop_streaming(tuvc->devh);
-	tuvc->tid = NULL;
-	Tcl_CancelIdleCall(FrameReady, (ClientData) tuvc);
-	tuvc->running = 0;
-	if (tuvc->rstate == REC_RECPRI) {
-	    tuvc->rstate = REC_PAUSEPRI;
-	} else if (tuvc->rstate == REC_RECORD) {
-	    tuvc->rstate = REC_PAUSE;
+    CloseAVISegment(old, 1);
+    if (!old->error && (old->rfd >= 0)) {
+	pos = Tcl_Seek(old->rchan, 0, SEEK_CUR);
+	if ((pos == (Tcl_WideInt) -1) || (ftruncate(old->rfd, pos) != 0)) {
+	    old->error = 1;
 	}
     }
-    Tcl_MutexLock(&uvcMutex);
-    hPtr = Tcl_FirstHashEntry(&tuvc->evts, &search);
-    while (hPtr != NULL) {
-	TUEVT *event = (TUEVT *) Tcl_GetHashKey(&tuvc->evts, hPtr);
-
-	event->tuvc = NULL;
-	event->hPtr = NULL;
-	Tcl_DeleteHashEntry(hPtr);
-	hPtr = Tcl_NextHashEntry(&search);
+    ok = !old->error;
+    Tcl_Close(NULL, old->rchan);
+    if (old->avi.sidx != NULL) {
+	ckfree((char *) old->avi.sidx);
     }
-    Tcl_MutexUnlock(&uvcMutex);
-    return TCL_OK;
+    if (old->avi.idx != NULL) {
+	ckfree((char *) old->avi.idx);
+    }
+    ckfree((char *) old);
+    return ok;
 }
-
+
 /*
  *-------------------------------------------------------------------------
  *
- * StartCapture --
+ * RepairAVI --
  *
- *	Setup image acquisition:
- *	  - set capture format and size
- *	  - estabilsh async handler for FrameReady callback
- *	  - start UVC streaming
+ *	Rebuild headers and indices of an AVI file written by
+ *	"uvc record" which wasn't properly finished, e.g. due to a
+ *	crash or power loss. The chunks of all segments are walked
+ *	in one pass, the file is cut after the last complete chunk,
+ *	the last segment gets a standard index of all its frames
+ *	unless its last one covers them, and the headers are
+ *	rewritten. Leaves the number of frames in the
+ *	interpreter result.
  *
  *-------------------------------------------------------------------------
  */
 
+typedef struct {
+    struct AVI_HDR avi_hdr;
+    struct AVI_HDR_VIDEO avi_hdrv;
+    struct AVI_SUPERIDX superidx;
+    struct AVI_HDR_ODML avi_hdro;
+    struct AVI_DATA avi_data;
+} AVI_HEAD;
+
 static int
-StartCapture(TUVC *tuvc)
+RepairAVI(Tcl_Interp *interp, Tcl_Obj *pathPtr)
 {
-    Tcl_Interp *interp = tuvc->interp;
-    uvc_stream_ctrl_t ctrl;
-    uvc_error_t uret;
-    int i;
-    static const struct {
-	enum uvc_frame_format fmt;
-	int iscomp;
-    } tryfmts[] = {
-#ifdef LIBUVC_HAVE_JPEG
-	{ UVC_FRAME_FORMAT_MJPEG, 1 },
-#endif
-	{ UVC_FRAME_FORMAT_YUYV, 0 },
-	{ UVC_FRAME_FORMAT_UYVY, 0 },
-	{ UVC_FRAME_FORMAT_GRAY16, 0 },
-	{ UVC_FRAME_FORMAT_GRAY8, 0 },
-	{ UVC_FRAME_FORMAT_RGB, 0 }
-    };
-
-    if (tuvc->running > 0) {
-	return TCL_OK;
+    Tcl_Channel chan;
+    AVI_HEAD *head = NULL;
+    struct CHUNK_HDR ch;
+    struct AVI_IDX *idx = NULL;
+    struct AVI_STDIDX_ENTRY *sidx = NULL;
+    Tcl_WideInt pos, end, fsize, movistart, segstart = 0;
+    Tcl_WideInt nframes = 0, nframes0 = -1, segsize0 = 0;
+    int size, segno = 0, nsuper = 0, idx1size = 0;
+    int curr_idx = 0, num_idx = 0, curr_sidx = 0, num_sidx = 0;
+    int covered = 0;
+    const char *errMsg = NULL;
+
+    chan = Tcl_FSOpenFileChannel(interp, pathPtr, "r+", 0);
+    if (chan == NULL) {
+	return TCL_ERROR;
+    }
+    if (Tcl_SetChannelOption(interp, chan, "-translation", "binary")
+	!= TCL_OK) {
+	Tcl_Close(NULL, chan);
+	return TCL_ERROR;
+    }
+    head = (AVI_HEAD *) ckalloc(sizeof(AVI_HEAD));
+    fsize = Tcl_Seek(chan, 0, SEEK_END);
+    Tcl_Seek(chan, 0, SEEK_SET);
+    if ((Tcl_Read(chan, (char *) head, sizeof(AVI_HEAD)) != sizeof(AVI_HEAD))
+	|| (memcmp(head->avi_hdr.riff_id, "RIFF", 4) != 0)
+	|| (memcmp(head->avi_hdr.riff_type, "AVI ", 4) != 0)
+	|| (memcmp(head->avi_hdrv.strl_type, "strl", 4) != 0)
+	|| (memcmp(head->superidx.id, "indx", 4) != 0)
+	|| (memcmp(head->avi_hdro.strl_type, "odml", 4) != 0)
+	|| (memcmp(head->avi_data.data_type, "movi", 4) != 0)) {
+	errMsg = "unsupported AVI file layout";
+	goto done;
     }
 
-    /* set format/size */
-    uret = UVC_ERROR_INVALID_MODE;
-    for (i = 0;  i < sizeof(tryfmts) / sizeof(tryfmts[0]); i++) {
-	if (!tuvc->iscomp && tryfmts[i].iscomp) {
+    /* Single pass over all chunks. */
+    pos = movistart = sizeof(AVI_HEAD);
+    for (;;) {
+	if (Tcl_Read(chan, (char *) &ch, sizeof(ch)) != sizeof(ch)) {
+	    break;
+	}
+	size = GET32LE(&ch.size);
+	end = pos + sizeof(ch) + size + (size & 1);
+	if (memcmp(ch.id, "RIFF", 4) == 0) {
+	    struct AVIX_HDR xhdr;
+
+	    memcpy(&xhdr, &ch, sizeof(ch));
+	    if ((Tcl_Read(chan, (char *) &xhdr + sizeof(ch),
+			  sizeof(xhdr) - sizeof(ch))
+		 != sizeof(xhdr) - sizeof(ch)) ||
+		(memcmp(xhdr.riff_type, "AVIX", 4) != 0) ||
+		(memcmp(xhdr.data_type, "movi", 4) != 0)) {
+		break;
+	    }
+	    if (segno == 0 && nframes0 < 0) {
+		nframes0 = nframes;
+		segsize0 = pos - movistart;
+	    }
+	    if (covered > 0) {
+		/* Previous segment's slot in super index. */
+		nsuper++;
+	    }
+	    segno++;
+	    segstart = pos;
+	    pos = movistart = pos + sizeof(xhdr);
+	    curr_sidx = covered = 0;
 	    continue;
 	}
-	uret = uvc_get_stream_ctrl_format_size(tuvc->devh, &ctrl,
-					       tryfmts[i].fmt,
-					       tuvc->width, tuvc->height,
-					       tuvc->fps);
-	if (uret == UVC_SUCCESS) {
+	if (end > fsize) {
+	    /* Truncated chunk. */
+	    break;
+	}
+	if ((ch.id[0] == '0') && (ch.id[1] == '0') &&
+	    (ch.id[2] == 'd') && (ch.id[3] == 'b')) {
+	    if (segno == 0) {
+		if (curr_idx >= num_idx) {
+		    num_idx += 4096;
+		    idx = (struct AVI_IDX *)
+			ckrealloc((char *) idx,
+				  num_idx * sizeof(struct AVI_IDX));
+		}
+		memcpy(idx[curr_idx].id, ch.id, 4);
+		PUT32LE(&idx[curr_idx].flags, 0x10);
+		PUT32LE(&idx[curr_idx].offset, pos - movistart + 4);
+		PUT32LE(&idx[curr_idx].size, size);
+		curr_idx++;
+	    }
+	    if (curr_sidx >= num_sidx) {
+		num_sidx += 4096;
+		sidx = (struct AVI_STDIDX_ENTRY *)
+		    ckrealloc((char *) sidx,
+			      num_sidx * sizeof(struct AVI_STDIDX_ENTRY));
+	    }
+	    PUT32LE(&sidx[curr_sidx].offset, pos + sizeof(ch) - movistart);
+	    PUT32LE(&sidx[curr_sidx].size, size);
+	    curr_sidx++;
+	    nframes++;
+	} else if (memcmp(ch.id, "ix00", 4) == 0) {
+	    struct AVI_STDIDX ix;
+
+	    /*
+	     * Existing standard index covers the segment's frames
+	     * before it, a later one supersedes it.
+	     */
+	    memcpy(&ix, &ch, sizeof(ch));
+	    if (Tcl_Read(chan, (char *) &ix + sizeof(ch),
+			 sizeof(ix) - sizeof(ch)) != sizeof(ix) - sizeof(ch)) {
+		break;
+	    }
+	    if (nsuper < AVI_SUPERIDX_MAX) {
+		struct AVI_SUPERIDX_ENTRY *entry = head->superidx.entry + nsuper;
+
+		PUT32LE(&entry->offset_lo, pos & 0xFFFFFFFF);
+		PUT32LE(&entry->offset_hi, pos >> 32);
+		PUT32LE(&entry->size, size + sizeof(ch));
+		PUT32LE(&entry->duration, GET32LE(&ix.entries));
+		covered = curr_sidx;
+	    }
+	} else if (memcmp(ch.id, "idx1", 4) == 0) {
+	    if (segno == 0) {
+		/* First segment was properly closed. */
+		nframes0 = nframes;
+		segsize0 = pos - movistart;
+		idx1size = end - pos;
+	    }
+	} else if (memcmp(ch.id, "JUNK", 4) != 0) {
+	    /* Garbage after last valid chunk. */
+	    break;
+	}
+	pos = end;
+	if (Tcl_Seek(chan, pos, SEEK_SET) == (Tcl_WideInt) -1) {
 	    break;
 	}
-	i++;
     }
-    if (uret < 0) {
-	Tcl_SetObjResult(interp,
-			 Tcl_ObjPrintf("error setting format: %s",
-				       uvc_strerror(uret)));
-	return TCL_ERROR;
+
+    /* Cut off incomplete data, append standard index of the rest. */
+    if ((Tcl_Seek(chan, pos, SEEK_SET) == (Tcl_WideInt) -1) ||
+	(Tcl_TruncateChannel(chan, pos) != TCL_OK)) {
+	errMsg = "cannot truncate file";
+	goto done;
+    }
+    if ((curr_sidx > covered) && (nsuper < AVI_SUPERIDX_MAX)) {
+	struct AVI_STDIDX ix;
+	struct AVI_SUPERIDX_ENTRY *entry = head->superidx.entry + nsuper;
+
+	memset(&ix, 0, sizeof(ix));
+	memcpy(ix.id, "ix00", 4);
+	size = sizeof(ix) - sizeof(ch) +
+	    curr_sidx * sizeof(struct AVI_STDIDX_ENTRY);
+	PUT32LE(&ix.size, size);
+	PUT16LE(&ix.longs_per_entry, 2);
+	ix.type = 1;
+	PUT32LE(&ix.entries, curr_sidx);
+	memcpy(ix.chunk_id, "00db", 4);
+	PUT32LE(&ix.base_lo, movistart & 0xFFFFFFFF);
+	PUT32LE(&ix.base_hi, movistart >> 32);
+	if ((Tcl_Write(chan, (const char *) &ix, sizeof(ix)) != sizeof(ix)) ||
+	    (Tcl_Write(chan, (const char *) sidx,
+		       curr_sidx * sizeof(struct AVI_STDIDX_ENTRY))
+	     != curr_sidx * sizeof(struct AVI_STDIDX_ENTRY))) {
+	    errMsg = "error writing index";
+	    goto done;
+	}
+	PUT32LE(&entry->offset_lo, pos & 0xFFFFFFFF);
+	PUT32LE(&entry->offset_hi, pos >> 32);
+	PUT32LE(&entry->size, size + sizeof(ch));
+	PUT32LE(&entry->duration, curr_sidx);
+	covered = curr_sidx;
+	pos += size + sizeof(ch);
+    }
+    if (covered > 0) {
+	nsuper++;
+    }
+    if (segno == 0) {
+	if (nframes0 < 0) {
+	    struct CHUNK_HDR idxh;
+
+	    nframes0 = nframes;
+	    segsize0 = pos - movistart;
+	    memcpy(idxh.id, "idx1", 4);
+	    size = curr_idx * sizeof(struct AVI_IDX);
+	    PUT32LE(&idxh.size, size);
+	    if ((Tcl_Write(chan, (const char *) &idxh, sizeof(idxh))
+		 != sizeof(idxh)) ||
+		(Tcl_Write(chan, (const char *) idx, size) != size)) {
+		errMsg = "error writing index";
+		goto done;
+	    }
+	    idx1size = size + sizeof(idxh);
+	}
+    } else {
+	struct AVIX_HDR xhdr;
+
+	memcpy(xhdr.riff_id, "RIFF", 4);
+	PUT32LE(&xhdr.riff_size, pos - movistart + 16);
+	memcpy(xhdr.riff_type, "AVIX", 4);
+	memcpy(xhdr.data_list_id, "LIST", 4);
+	PUT32LE(&xhdr.data_size, pos - movistart + 4);
+	memcpy(xhdr.data_type, "movi", 4);
+	Tcl_Seek(chan, segstart, SEEK_SET);
+	if (Tcl_Write(chan, (const char *) &xhdr, sizeof(xhdr))
+	    != sizeof(xhdr)) {
+	    errMsg = "error writing header";
+	    goto done;
+	}
     }
 
-    /* start capture */
-    tuvc->running = 1;
-    tuvc->counters[0] = tuvc->counters[1] = tuvc->counters[2] = 0;
-    tuvc->tid = Tcl_GetCurrentThread();
-    tuvc->numev = 0;
-    uret = uvc_start_streaming(tuvc->devh, &ctrl, FrameCallback, tuvc, 0);
-    if (uret < 0) {
-	tuvc->running = 0;
-	tuvc->tid = NULL;
-	Tcl_SetObjResult(interp,
-			 Tcl_ObjPrintf("error starting streaming: %s",
-				       uvc_strerror(uret)));
+    /* Main header. */
+    PUT32LE(&head->avi_hdr.riff_size,
+	    sizeof(AVI_HEAD) - 8 + segsize0 + idx1size);
+    PUT32LE(&head->avi_hdr.avih.flags, idx1size ? 0x10 : 0);
+    PUT32LE(&head->avi_hdr.avih.nframes, nframes0);
+    PUT32LE(&head->avi_hdrv.strh.length, nframes);
+    PUT32LE(&head->superidx.entries, nsuper);
+    memset(head->superidx.entry + nsuper, 0,
+	   (AVI_SUPERIDX_MAX - nsuper) * sizeof(struct AVI_SUPERIDX_ENTRY));
+    PUT32LE(&head->avi_hdro.nframes, nframes);
+    PUT32LE(&head->avi_data.data_size, segsize0 + 4);
+    Tcl_Seek(chan, 0, SEEK_SET);
+    if (Tcl_Write(chan, (const char *) head, sizeof(AVI_HEAD))
+	!= sizeof(AVI_HEAD)) {
+	errMsg = "error writing header";
+    }
+
+done:
+    if (idx != NULL) {
+	ckfree((char *) idx);
+    }
+    if (sidx != NULL) {
+	ckfree((char *) sidx);
+    }
+    ckfree((char *) head);
+    if (Tcl_Close(interp, chan) != TCL_OK) {
 	return TCL_ERROR;
     }
-    if (tuvc->rstate == REC_PAUSEPRI) {
-	gettimeofday(&tuvc->ltv, NULL);
-	tuvc->rtv = tuvc->ltv;
-	tuvc->rstate = REC_RECPRI;
-    } else if (tuvc->rstate == REC_PAUSE) {
-	gettimeofday(&tuvc->ltv, NULL);
-	tuvc->rtv = tuvc->ltv;
-	tuvc->rstate = REC_RECORD;
+    if (errMsg != NULL) {
+	Tcl_SetResult(interp, (char *) errMsg, TCL_STATIC);
+	return TCL_ERROR;
     }
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(nframes));
     return TCL_OK;
 }
-
+
 /*
  *-------------------------------------------------------------------------
  *
- * GetImage --
+ * SinkFinish --
  *
- *	Retrieve last captured frame as photo image or byte array.
+ *	Finalize container of a recording sink, close its channel
+ *	and release the sink. TUVC.rmutex must be locked or the
+ *	sink must have been removed from the device's sink list.
  *
  *-------------------------------------------------------------------------
  */
 
-static int
-GetImage(TUVCI *tuvci, TUVC *tuvc, Tcl_Obj *arg)
+static void
+SinkFinish(TSINK *sink)
 {
-    Tcl_Interp *interp = tuvc->interp;
-    uvc_frame_t *frame;
-    Tk_PhotoHandle photo = NULL;
-    int result = TCL_OK, done = 0;
-    char *name;
-
-    if (arg != NULL) {
-	if (CheckForTk(tuvci, tuvc->interp) != TCL_OK) {
-	    return TCL_ERROR;
-	}
-	if (Tk_MainWindow(interp) == NULL) {
-	    Tcl_SetResult(interp, "application has been destroyed",
-			  TCL_STATIC);
-	    return TCL_ERROR;
-	}
-	name = Tcl_GetString(arg);
-	photo = Tk_FindPhoto(interp, name);
-	if (photo == NULL) {
-	    Tcl_SetObjResult(interp,
-		Tcl_ObjPrintf("can't use \"%s\": not a photo image", name));
-	    return TCL_ERROR;
+    if ((Tcl_DStringLength(&sink->rbdStr) == 0) && (sink->rfmt == RF_AVI)) {
+	CloseAVISegment(sink, 1);
+	WriteAVIHeader(sink, 1);
+	if ((sink->rot.bytes > 0) && (sink->rfd >= 0)) {
+	    Tcl_WideInt pos = Tcl_Seek(sink->rchan, 0, SEEK_CUR);
+
+	    /* Drop pre-allocated space. */
+	    if ((pos == (Tcl_WideInt) -1) ||
+		(ftruncate(sink->rfd, pos) != 0)) {
+		sink->error = 1;
+	    }
 	}
     }
-
-    /* Temporarily take out last frame. */
-    Tcl_MutexLock(&uvcMutex);
-    frame = tuvc->frame;
-    tuvc->frame = NULL;
-    Tcl_MutexUnlock(&uvcMutex);
-    if (frame == NULL) {
-	/* no image available */
-noImage:
-	if (photo != NULL) {
-	    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
-	} else {
-	    Tcl_SetResult(interp, "no image available", TCL_STATIC);
-	    result = TCL_ERROR;
-	}
-	goto done;
+    Tcl_DStringFree(&sink->rbdStr);
+    while (sink->rot.ndone > 0) {
+	RotateFinish(sink->rot.done[--sink->rot.ndone]);
     }
-    if ((photo == NULL) && (frame->frame_format == UVC_FRAME_FORMAT_GRAY16)) {
-	goto doByteArray;
+    if (sink->rot.next != NULL) {
+	/* Remove unused pre-opened file. */
+	Tcl_Close(NULL, sink->rot.next);
+	unlink(Tcl_DStringValue(&sink->rot.nextName));
     }
-    if ((frame->frame_format != UVC_FRAME_FORMAT_RGB) &&
-	(frame->frame_format != UVC_FRAME_FORMAT_GRAY8)) {
-	uvc_frame_t *newFrame;
-	uvc_error_t uret;
-	int frameSize;
+    Tcl_DStringFree(&sink->rot.nextName);
+    Tcl_DStringFree(&sink->rot.pattern);
+    if (sink->rchan != NULL) {
+	Tcl_Close(NULL, sink->rchan);
+    }
+    if (sink->rtp.fd >= 0) {
+	close(sink->rtp.fd);
+    }
+    if (sink->rtp.hdrs != NULL) {
+	ckfree((char *) sink->rtp.hdrs);
+    }
+    if (sink->avi.sidx != NULL) {
+	ckfree((char *) sink->avi.sidx);
+    }
+    if (sink->avi.idx != NULL) {
+	ckfree((char *) sink->avi.idx);
+    }
+    if (sink->y4m.buf != NULL) {
+	ckfree((char *) sink->y4m.buf);
+    }
+    ckfree((char *) sink);
+}
 
-	switch (frame->frame_format) {
-	case UVC_FRAME_FORMAT_YUYV:
-	case UVC_FRAME_FORMAT_UYVY:
-	case UVC_FRAME_FORMAT_MJPEG:
-	    frameSize = frame->width * frame->height * 3;
-	    break;
-	case UVC_FRAME_FORMAT_GRAY16:
-	    frameSize = frame->width * frame->height;
-	    break;
-	default:
-	    goto noImage;
-	}
-	newFrame = uvc_allocate_frame(frameSize);
-	if (newFrame == NULL) {
-	    goto noImage;
+/*
+ *-------------------------------------------------------------------------
+ *
+ * SinkResetTime --
+ *
+ *	Restart frame rate timing of all recording sinks, e.g.
+ *	when recording resumes after a pause.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+SinkResetTime(TUVC *tuvc)
+{
+    struct timeval now;
+    int i;
+
+    gettimeofday(&now, NULL);
+    for (i = 0; i < tuvc->nsinks; i++) {
+	tuvc->sinks[i]->ltv = now;
+	tuvc->sinks[i]->rtv = now;
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * FinishRecording --
+ *
+ *	Close all recording sinks and release resources. Must be
+ *	called from the thread which opened the UVC device.
+ *	Optionally TUVC.rmutex is locked, optionally it is
+ *	finalized when the UVC device gets closed.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+FinishRecording(TUVC *tuvc, int lock, int final)
+{
+    RecordQueueStop(tuvc);
+    if (lock) {
+	Tcl_MutexLock(&tuvc->rmutex);
+    }
+    while (tuvc->nsinks > 0) {
+	SinkFinish(tuvc->sinks[--tuvc->nsinks]);
+	tuvc->sinks[tuvc->nsinks] = NULL;
+    }
+    PreBufferFree(tuvc);
+    if (lock) {
+	Tcl_MutexUnlock(&tuvc->rmutex);
+    }
+    if (final) {
+	Tcl_MutexFinalize(&tuvc->rmutex);
+	Tcl_ConditionFinalize(&tuvc->rq.cond);
+	Tcl_MutexFinalize(&tuvc->rq.mutex);
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * RecordWriter --
+ *
+ *	Recording writer thread. Takes frames from the recording
+ *	queue and writes them to the recording channel, thus disk
+ *	or network stalls don't hold up the libuvc thread. When
+ *	told to stop, frames still queued are written before the
+ *	thread exits.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static Tcl_ThreadCreateType
+RecordWriter(ClientData clientData)
+{
+    TUVC *tuvc = (TUVC *) clientData;
+    uvc_frame_t *frame;
+
+    Tcl_MutexLock(&tuvc->rq.mutex);
+    for (;;) {
+	while (tuvc->rq.run && (tuvc->rq.count == 0)) {
+	    Tcl_ConditionWait(&tuvc->rq.cond, &tuvc->rq.mutex, NULL);
 	}
-	switch (frame->frame_format) {
-	case UVC_FRAME_FORMAT_YUYV:
-	    uret = uvc_yuyv2rgb(frame, newFrame);
-	    break;
-	case UVC_FRAME_FORMAT_UYVY:
-	    uret = uvc_uyvy2rgb(frame, newFrame);
-	    break;
-#ifdef LIBUVC_HAVE_JPEG
-	case UVC_FRAME_FORMAT_MJPEG:
-	    uret = uvc_mjpeg2rgb(frame, newFrame);
-	    break;
-#endif
-	case UVC_FRAME_FORMAT_GRAY16:
-	    uret = uvc_gray16to8(frame, newFrame, tuvc->greyshift);
-	    break;
-	default:
-	    uret = UVC_ERROR_NOT_SUPPORTED;
+	if (tuvc->rq.count == 0) {
 	    break;
 	}
-	if (uret) {
-	    uvc_free_frame(newFrame);
-	    goto noImage;
+	frame = tuvc->rq.frames[tuvc->rq.head];
+	tuvc->rq.frames[tuvc->rq.head] = NULL;
+	tuvc->rq.head = (tuvc->rq.head + 1) % tuvc->rq.size;
+	tuvc->rq.count--;
+	/* Wake up producer waiting for a free slot. */
+	Tcl_ConditionNotify(&tuvc->rq.cond);
+	Tcl_MutexUnlock(&tuvc->rq.mutex);
+	Tcl_MutexLock(&tuvc->rmutex);
+	if (tuvc->rstate != REC_ERROR) {
+	    WriteFrame(tuvc, frame);
 	}
+	Tcl_MutexUnlock(&tuvc->rmutex);
 	uvc_free_frame(frame);
-	frame = newFrame;
+	Tcl_MutexLock(&tuvc->rq.mutex);
     }
-    if (photo != NULL) {
-	Tk_PhotoImageBlock block;
-	int rot = tuvc->rotate;
-	int width = frame->width;
-	int height = frame->height;
+    Tcl_MutexUnlock(&tuvc->rq.mutex);
+    TCL_THREAD_CREATE_RETURN;
+}
 
-	if (frame->frame_format == UVC_FRAME_FORMAT_GRAY8) {
-	    block.pixelSize = 1;
-	    block.offset[0] = 0;
-	    block.offset[1] = 0;
-	    block.offset[2] = 0;
-	    block.offset[3] = 1;
+/*
+ *-------------------------------------------------------------------------
+ *
+ * RecordQueueStart, RecordQueueStop --
+ *
+ *	Create/destroy recording queue and its writer thread. If
+ *	the thread cannot be created, frames are written directly
+ *	as before. RecordQueueStop must not be called with the
+ *	TUVC.rmutex held, since the writer thread needs it to drain
+ *	the queue. Statistics are kept until the next start.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+RecordQueueStart(TUVC *tuvc, int size, int policy)
+{
+    Tcl_ThreadId tid;
+
+    RecordQueueStop(tuvc);
+    Tcl_MutexLock(&tuvc->rq.mutex);
+    tuvc->rq.frames =
+	(uvc_frame_t **) ckalloc(size * sizeof(uvc_frame_t *));
+    memset(tuvc->rq.frames, 0, size * sizeof(uvc_frame_t *));
+    tuvc->rq.size = size;
+    tuvc->rq.policy = policy;
+    tuvc->rq.head = tuvc->rq.count = 0;
+    tuvc->rq.highwater = 0;
+    tuvc->rq.dropped = 0;
+    tuvc->rq.run = 1;
+    Tcl_MutexUnlock(&tuvc->rq.mutex);
+    if (Tcl_CreateThread(&tid, RecordWriter, (ClientData) tuvc,
+			 TCL_THREAD_STACK_DEFAULT,
+			 TCL_THREAD_JOINABLE) != TCL_OK) {
+	Tcl_MutexLock(&tuvc->rq.mutex);
+	tuvc->rq.run = 0;
+	ckfree((char *) tuvc->rq.frames);
+	tuvc->rq.frames = NULL;
+	tuvc->rq.size = 0;
+	Tcl_MutexUnlock(&tuvc->rq.mutex);
+	return;
+    }
+    tuvc->rq.tid = tid;
+}
+
+static void
+RecordQueueStop(TUVC *tuvc)
+{
+    int result;
+
+    if (tuvc->rq.tid == NULL) {
+	return;
+    }
+    Tcl_MutexLock(&tuvc->rq.mutex);
+    tuvc->rq.run = 0;
+    Tcl_ConditionNotify(&tuvc->rq.cond);
+    Tcl_MutexUnlock(&tuvc->rq.mutex);
+    Tcl_JoinThread(tuvc->rq.tid, &result);
+    tuvc->rq.tid = NULL;
+    Tcl_MutexLock(&tuvc->rq.mutex);
+    while (tuvc->rq.count > 0) {
+	uvc_free_frame(tuvc->rq.frames[tuvc->rq.head]);
+	tuvc->rq.head = (tuvc->rq.head + 1) % tuvc->rq.size;
+	tuvc->rq.count--;
+    }
+    ckfree((char *) tuvc->rq.frames);
+    tuvc->rq.frames = NULL;
+    tuvc->rq.size = 0;
+    Tcl_MutexUnlock(&tuvc->rq.mutex);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * RecordQueuePut --
+ *
+ *	Put a copy of given frame into the recording queue. When
+ *	the queue is full, the overflow policy decides whether the
+ *	oldest queued frame or the given frame is dropped, or if
+ *	the caller waits for the writer thread to make room.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+RecordQueuePut(TUVC *tuvc, uvc_frame_t *frame)
+{
+    uvc_frame_t *copy, *drop = NULL;
+
+    copy = uvc_allocate_frame(0);
+    if (copy == NULL) {
+	return;
+    }
+    if (uvc_duplicate_frame(frame, copy) != UVC_SUCCESS) {
+	uvc_free_frame(copy);
+	return;
+    }
+    Tcl_MutexLock(&tuvc->rq.mutex);
+    if (tuvc->rq.policy == RQ_BLOCK) {
+	while (tuvc->rq.run && (tuvc->rq.count >= tuvc->rq.size)) {
+	    Tcl_ConditionWait(&tuvc->rq.cond, &tuvc->rq.mutex, NULL);
+	}
+    }
+    if (!tuvc->rq.run) {
+	drop = copy;
+    } else if (tuvc->rq.count >= tuvc->rq.size) {
+	tuvc->rq.dropped++;
+	if (tuvc->rq.policy == RQ_DROPNEWEST) {
+	    drop = copy;
 	} else {
-	    block.pixelSize = 3;
-	    block.offset[0] = 0;
-	    block.offset[1] = 1;
-	    block.offset[2] = 2;
-	    block.offset[3] = 4;
+	    drop = tuvc->rq.frames[tuvc->rq.head];
+	    tuvc->rq.frames[tuvc->rq.head] = NULL;
+	    tuvc->rq.head = (tuvc->rq.head + 1) % tuvc->rq.size;
+	    tuvc->rq.count--;
 	}
-	block.width = width;
-	block.height = height;
-	block.pitch = frame->step;
-	block.pixelPtr = frame->data;
+    }
+    if (drop != copy) {
+	tuvc->rq.frames[(tuvc->rq.head + tuvc->rq.count) % tuvc->rq.size] =
+	    copy;
+	tuvc->rq.count++;
+	if (tuvc->rq.count > tuvc->rq.highwater) {
+	    tuvc->rq.highwater = tuvc->rq.count;
+	}
+	Tcl_ConditionNotify(&tuvc->rq.cond);
+    }
+    Tcl_MutexUnlock(&tuvc->rq.mutex);
+    if (drop != NULL) {
+	uvc_free_frame(drop);
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * PreBufferPut, PreBufferFlush, PreBufferFree --
+ *
+ *	Pre-event buffer: while recording is armed, frames are kept
+ *	in a ring as JPEG, uncompressed frames are encoded on entry
+ *	to keep memory low. StartRecording refuses sinks which don't
+ *	write JPEG from uncompressed input while the buffer is in
+ *	use, thus the ring can be written as is. Frames older than the
+ *	buffer length or beyond the memory limit are dropped. On
+ *	trigger, the ring is written through WriteFrame with its
+ *	original capture times, after that recording goes live.
+ *	Called with TUVC.rmutex locked.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-	if ((tuvc->mirror & 3) == 3) {
-	    rot = (rot + 180) % 360;
+static void
+PreBufferPut(TUVC *tuvc, uvc_frame_t *frame)
+{
+    uvc_frame_t *copy = NULL, *old;
+    double age;
+
+#ifdef LIBUVC_HAVE_JPEG
+    if (frame->frame_format != UVC_FRAME_FORMAT_MJPEG) {
+	copy = FrameToJPEG(tuvc, frame);
+	if (copy == NULL) {
+	    return;
 	}
-	switch (rot) {
-	case 270:	/* = 90 CW */
-	    block.pitch = block.pixelSize;
-	    block.pixelPtr += width * block.pixelSize * (height - 1);
-	    block.pixelSize *= -width;
-	    block.offset[3] = block.pixelSize + 1;	/* no alpha */
-	    block.width = height;
-	    block.height = width;
-	    break;
-	case 180:	/* = 180 CW */
-	    block.pitch = -block.pitch;
-	    block.pixelPtr += (width * height - 1) * block.pixelSize;
-	    block.pixelSize = -block.pixelSize;
-	    block.offset[3] = block.pixelSize + 1;	/* no alpha */
-	    break;
-	case 90:	/* = 270 CW */
-	    block.pitch = -block.pixelSize;
-	    block.pixelPtr += (width - 1) * block.pixelSize;
-	    block.pixelSize *= width;
-	    block.offset[3] = block.pixelSize + 1;	/* no alpha */
-	    block.width = height;
-	    block.height = width;
+	copy->capture_time = frame->capture_time;
+	copy->sequence = frame->sequence;
+	copy->pts = frame->pts;
+	copy->scr = frame->scr;
+	copy->capture_mono = frame->capture_mono;
+	copy->clock_model = frame->clock_model;
+    } else
+#endif
+    {
+	copy = uvc_allocate_frame(0);
+	if (copy == NULL) {
+	    return;
+	}
+	if (uvc_duplicate_frame(frame, copy) != UVC_SUCCESS) {
+	    uvc_free_frame(copy);
+	    return;
+	}
+    }
+    while (tuvc->pre.count > 0) {
+	old = tuvc->pre.frames[tuvc->pre.head];
+	age = (copy->capture_time.tv_sec - old->capture_time.tv_sec) +
+	    (copy->capture_time.tv_usec - old->capture_time.tv_usec) * 1.0e-6;
+	if ((age <= tuvc->pre.secs) &&
+	    (tuvc->pre.bytes + copy->data_bytes <= tuvc->pre.maxbytes)) {
 	    break;
 	}
-	if ((tuvc->mirror & 3) == 2) {
-	    /* mirror in X */
-	    block.pixelPtr += (block.width - 1) * block.pixelSize;
-	    block.pixelSize = -block.pixelSize;
-	    block.offset[3] = block.pixelSize + 1;      /* no alpha */
+	tuvc->pre.frames[tuvc->pre.head] = NULL;
+	tuvc->pre.head = (tuvc->pre.head + 1) % tuvc->pre.size;
+	tuvc->pre.count--;
+	tuvc->pre.bytes -= old->data_bytes;
+	uvc_free_frame(old);
+    }
+    if (copy->data_bytes > tuvc->pre.maxbytes) {
+	uvc_free_frame(copy);
+	return;
+    }
+    if (tuvc->pre.count >= tuvc->pre.size) {
+	int i, newsize = tuvc->pre.size ? tuvc->pre.size * 2 : 64;
+	uvc_frame_t **frames;
+
+	frames = (uvc_frame_t **)
+	    attemptckalloc(newsize * sizeof(uvc_frame_t *));
+	if (frames == NULL) {
+	    uvc_free_frame(copy);
+	    return;
 	}
-	if ((tuvc->mirror & 3) == 1) {
-	    /* mirror in Y */
-	    block.pixelPtr += block.pitch * (block.height - 1);
-	    block.pitch = -block.pitch;
+	for (i = 0; i < tuvc->pre.count; i++) {
+	    frames[i] =
+		tuvc->pre.frames[(tuvc->pre.head + i) % tuvc->pre.size];
+	}
+	if (tuvc->pre.frames != NULL) {
+	    ckfree((char *) tuvc->pre.frames);
 	}
+	tuvc->pre.frames = frames;
+	tuvc->pre.size = newsize;
+	tuvc->pre.head = 0;
+    }
+    tuvc->pre.frames[(tuvc->pre.head + tuvc->pre.count) % tuvc->pre.size] =
+	copy;
+    tuvc->pre.count++;
+    tuvc->pre.bytes += copy->data_bytes;
+}
 
-	if (Tk_PhotoExpand(interp, photo, block.width, block.height)
-	    != TCL_OK) {
-	    result = TCL_ERROR;
-	    goto done;
+static void
+PreBufferFlush(TUVC *tuvc)
+{
+    uvc_frame_t *frame;
+    int i;
+
+    tuvc->pre.armed = tuvc->pre.trigger = 0;
+    if (tuvc->pre.count > 0) {
+	/* Pretend the previous frame came one frame interval earlier. */
+	frame = tuvc->pre.frames[tuvc->pre.head];
+	for (i = 0; i < tuvc->nsinks; i++) {
+	    TSINK *sink = tuvc->sinks[i];
+
+	    sink->rtv = frame->capture_time;
+	    sink->ltv.tv_sec = sink->rtv.tv_sec - sink->rrate.tv_sec;
+	    sink->ltv.tv_usec = sink->rtv.tv_usec - sink->rrate.tv_usec;
+	    if (sink->ltv.tv_usec < 0) {
+		sink->ltv.tv_sec -= 1;
+		sink->ltv.tv_usec += 1000000;
+	    }
 	}
-	if (Tk_PhotoPutBlock(interp, photo, &block, 0, 0,
-			     block.width, block.height,
-			     TK_PHOTO_COMPOSITE_SET) != TCL_OK) {
-	    result = TCL_ERROR;
-	} else {
-	    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
-	    done = 1;
+    }
+    while (tuvc->pre.count > 0) {
+	frame = tuvc->pre.frames[tuvc->pre.head];
+	tuvc->pre.frames[tuvc->pre.head] = NULL;
+	tuvc->pre.head = (tuvc->pre.head + 1) % tuvc->pre.size;
+	tuvc->pre.count--;
+	tuvc->pre.bytes -= frame->data_bytes;
+	if (tuvc->rstate != REC_ERROR) {
+	    WriteFrame(tuvc, frame);
 	}
+	uvc_free_frame(frame);
     }
-doByteArray:
-    if (photo == NULL) {
-	unsigned char *rawPtr;
-	Tcl_Size rawSize;
-	Tcl_Obj *list[4];
+}
+
+static void
+PreBufferFree(TUVC *tuvc)
+{
+    while (tuvc->pre.count > 0) {
+	uvc_free_frame(tuvc->pre.frames[tuvc->pre.head]);
+	tuvc->pre.head = (tuvc->pre.head + 1) % tuvc->pre.size;
+	tuvc->pre.count--;
+    }
+    if (tuvc->pre.frames != NULL) {
+	ckfree((char *) tuvc->pre.frames);
+    }
+    memset(&tuvc->pre, 0, sizeof(tuvc->pre));
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * RecordFrameFromData --
+ *
+ *	Write single frame from byte array data.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+RecordFrameFromData(TUVC *tuvc, Tcl_Interp *interp,
+		    int objc, Tcl_Obj * const objv[])
+{
+    int width, height, bpp, ret;
+    Tcl_Size length;
+    unsigned char *data;
+    long li;
+    Tcl_HashEntry *hPtr;
+    UFMT *ufmt;
+    uvc_frame_t *frame;
+
+    if (objc != 8) {
+	Tcl_WrongNumArgs(interp, 2, objv,
+			 "devid width height bpp bytearray");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIntFromObj(interp, objv[4], &width) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIntFromObj(interp, objv[5], &height) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIntFromObj(interp, objv[6], &bpp) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    data = Tcl_GetByteArrayFromObj(objv[7], &length);
+    li = tuvc->usefmt;
+    hPtr = Tcl_FindHashEntry(&tuvc->fmts, li);
+    if (hPtr == NULL) {
+	Tcl_SetResult(interp, "unsupported format", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    ufmt = (UFMT *) Tcl_GetHashValue(hPtr);
+    if ((length < width * height * bpp) ||
+	(width != ufmt->width) || (height != ufmt->height)) {
+	Tcl_SetResult(interp, "incompatible frame data", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (!tuvc->ruser ||
+	((tuvc->rstate != REC_RECORD) && (tuvc->rstate != REC_PAUSE))) {
+	Tcl_SetResult(interp, "wrong recording state for frame",
+		      TCL_STATIC);
+	return TCL_ERROR;
+    }
+    frame = uvc_allocate_frame(0);
+    if (frame == NULL) {
+	Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    frame->library_owns_data = 0;
+    frame->width = width;
+    frame->height = height;
+    frame->step = width * bpp;
+    frame->sequence = 0;
+    frame->source = 0;
+    frame->data = data;
+    frame->data_bytes = length;
+    switch (bpp) {
+    case 1:
+	frame->frame_format = UVC_FRAME_FORMAT_GRAY8;
+	break;
+    case 2:
+	frame->frame_format = UVC_FRAME_FORMAT_GRAY16;
+	break;
+    default:
+	frame->frame_format = UVC_FRAME_FORMAT_RGB;
+	break;
+    }
+    gettimeofday(&frame->capture_time, NULL);
+    ret = WriteFrame(tuvc, frame);
+    uvc_free_frame(frame);
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(ret));
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * DataToPhoto --
+ *
+ *	Put byte array data to a Tk photo image.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+DataToPhoto(TUVCI *tuvci, Tcl_Interp *interp,
+	    int objc, Tcl_Obj * const objv[])
+{
+    int width, height, bpp;
+    Tcl_Size length;
+    int rot = 0, mirx = 0, miry = 0, mirror;
+    unsigned char *data;
+    Tk_PhotoHandle photo;
+    char *name;
+    Tk_PhotoImageBlock block;
+
+    if (CheckForTk(tuvci, interp) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if ((objc < 7) || (objc > 10)) {
+	Tcl_WrongNumArgs(interp, 2, objv,
+			 "photo width height bpp bytearray "
+			 "?rotation mirrorx mirrory?");
+	return TCL_ERROR;
+    }
+    if (Tk_MainWindow(interp) == NULL) {
+	Tcl_SetResult(interp, "application has been destroyed",
+		      TCL_STATIC);
+	return TCL_ERROR;
+    }
+    name = Tcl_GetString(objv[2]);
+    photo = Tk_FindPhoto(interp, name);
+    if (photo == NULL) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("can't use \"%s\": not a photo image", name));
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIntFromObj(interp, objv[3], &width) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIntFromObj(interp, objv[4], &height) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIntFromObj(interp, objv[5], &bpp) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if ((objc > 7) && (Tcl_GetIntFromObj(interp, objv[7], &rot) != TCL_OK)) {
+	return TCL_ERROR;
+    }
+    if ((objc > 8) &&
+	(Tcl_GetBooleanFromObj(interp, objv[8], &mirx) != TCL_OK)) {
+	return TCL_ERROR;
+    }
+    if ((objc > 9) &&
+	(Tcl_GetBooleanFromObj(interp, objv[9], &miry) != TCL_OK)) {
+	return TCL_ERROR;
+    }
+    data = Tcl_GetByteArrayFromObj(objv[6], &length);
+    if ((length < width * height * bpp) ||
+	((bpp != 1) && (bpp != 3))) {
+	Tcl_SetResult(interp, "unsupported data format", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (bpp == 1) {
+	block.pixelSize = 1;
+	block.offset[0] = 0;
+	block.offset[1] = 0;
+	block.offset[2] = 0;
+	block.offset[3] = 1;
+    } else {
+	block.pixelSize = 3;
+	block.offset[0] = 0;
+	block.offset[1] = 1;
+	block.offset[2] = 2;
+	block.offset[3] = 4;
+    }
+    block.width = width;
+    block.height = height;
+    block.pitch = width * bpp;
+    block.pixelPtr = data;
+    mirror = (mirx ? 1 : 0) | (miry ? 2 : 0);
+    rot = rot % 360;
+    if (rot < 45) {
+	rot = 0;
+    } else if (rot < 135) {
+	rot = 90;
+    } else if (rot < 225) {
+	rot = 180;
+    } else if (rot < 315) {
+	rot = 270;
+    } else {
+	rot = 0;
+    }
+    if ((mirror & 3) == 3) {
+	rot = (rot + 180) % 360;
+    }
+    switch (rot) {
+    case 270:	/* = 90 CW */
+	block.pitch = block.pixelSize;
+	block.pixelPtr += width * block.pixelSize * (height - 1);
+	block.pixelSize *= -width;
+	block.offset[3] = block.pixelSize + 1;	/* no alpha */
+	block.width = height;
+	block.height = width;
+	break;
+    case 180:	/* = 180 CW */
+	block.pitch = -block.pitch;
+	block.pixelPtr += (width * height - 1) * block.pixelSize;
+	block.pixelSize = -block.pixelSize;
+	block.offset[3] = block.pixelSize + 1;	/* no alpha */
+	break;
+    case 90:	/* = 270 CW */
+	block.pitch = -block.pixelSize;
+	block.pixelPtr += (width - 1) * block.pixelSize;
+	block.pixelSize *= width;
+	block.offset[3] = block.pixelSize + 1;	/* no alpha */
+	block.width = height;
+	block.height = width;
+	break;
+    }
+    if ((mirror & 3) == 2) {
+	/* mirror in X */
+	block.pixelPtr += (block.width - 1) * block.pixelSize;
+	block.pixelSize = -block.pixelSize;
+	block.offset[3] = block.pixelSize + 1;      /* no alpha */
+    }
+    if ((mirror & 3) == 1) {
+	/* mirror in Y */
+	block.pixelPtr += block.pitch * (block.height - 1);
+	block.pitch = -block.pitch;
+    }
+    if (Tk_PhotoExpand(interp, photo, block.width, block.height) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (Tk_PhotoPutBlock(interp, photo, &block, 0, 0, block.width,
+			 block.height, TK_PHOTO_COMPOSITE_SET) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * MotionLuma --
+ *
+ *	Motion detection: make the downscaled luma plane of a frame,
+ *	each cell being the average of a MD_SCALE by MD_SCALE block.
+ *	Luma is taken directly from YUYV/UYVY/GRAY data, green is
+ *	used for RGB/BGR, and MJPEG is decoded from DC coefficients
+ *	only. Returns -1 for unsupported formats. Called with
+ *	TUVC.md.mutex locked.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+MotionLuma(TUVC *tuvc, uvc_frame_t *frame)
+{
+    int w, h, x, y, i, j, n, v, bpp = 1, off = 0, step;
+    unsigned int sum;
+    unsigned char *src, *dst;
+
+    w = (frame->width + MD_SCALE - 1) / MD_SCALE;
+    h = (frame->height + MD_SCALE - 1) / MD_SCALE;
+    if ((w <= 0) || (h <= 0)) {
+	return -1;
+    }
+    if ((w != tuvc->md.width) || (h != tuvc->md.height) ||
+	(tuvc->md.luma == NULL)) {
+	if (tuvc->md.luma != NULL) {
+	    ckfree((char *) tuvc->md.luma);
+	}
+	if (tuvc->md.bg != NULL) {
+	    ckfree((char *) tuvc->md.bg);
+	    tuvc->md.bg = NULL;
+	}
+	tuvc->md.luma = (unsigned char *) attemptckalloc(w * h);
+	if (tuvc->md.luma == NULL) {
+	    tuvc->md.width = tuvc->md.height = 0;
+	    return -1;
+	}
+	tuvc->md.width = w;
+	tuvc->md.height = h;
+    }
+    switch (frame->frame_format) {
+    case UVC_FRAME_FORMAT_YUYV:
+	bpp = 2;
+	break;
+    case UVC_FRAME_FORMAT_UYVY:
+	bpp = 2;
+	off = 1;
+	break;
+    case UVC_FRAME_FORMAT_GRAY8:
+	break;
+    case UVC_FRAME_FORMAT_GRAY16:
+	bpp = 2;
+	break;
+    case UVC_FRAME_FORMAT_RGB:
+    case UVC_FRAME_FORMAT_BGR:
+	bpp = 3;
+	off = 1;
+	break;
+#ifdef LIBUVC_HAVE_JPEG
+    case UVC_FRAME_FORMAT_MJPEG:
+	if (tuvc->md.dc == NULL) {
+	    tuvc->md.dc = uvc_allocate_frame(w * h);
+	    if (tuvc->md.dc == NULL) {
+		return -1;
+	    }
+	}
+	if ((uvc_mjpeg2gray_dc(frame, tuvc->md.dc) != UVC_SUCCESS) ||
+	    (tuvc->md.dc->width != w) || (tuvc->md.dc->height != h)) {
+	    return -1;
+	}
+	memcpy(tuvc->md.luma, tuvc->md.dc->data, w * h);
+	return 0;
+#endif
+    default:
+	return -1;
+    }
+    step = frame->step ? frame->step : frame->width * bpp;
+    if (frame->data_bytes < (size_t) step * frame->height) {
+	return -1;
+    }
+
+    /* Every other pixel in both directions is good enough. */
+    dst = tuvc->md.luma;
+    for (j = 0; j < h; j++) {
+	for (i = 0; i < w; i++) {
+	    sum = n = 0;
+	    for (y = j * MD_SCALE;
+		 (y < (j + 1) * MD_SCALE) && (y < frame->height); y += 2) {
+		src = (unsigned char *) frame->data + y * step +
+		    i * MD_SCALE * bpp + off;
+		for (x = i * MD_SCALE;
+		     (x < (i + 1) * MD_SCALE) && (x < frame->width); x += 2) {
+		    if (frame->frame_format == UVC_FRAME_FORMAT_GRAY16) {
+			v = (src[0] | (src[1] << 8)) >> tuvc->greyshift;
+			sum += (v > 255) ? 255 : v;
+		    } else {
+			sum += src[0];
+		    }
+		    src += 2 * bpp;
+		    n++;
+		}
+	    }
+	    *dst++ = n ? sum / n : 0;
+	}
+    }
+    return 0;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * MotionDetect --
+ *
+ *	Motion detection: compare the luma plane of a frame with
+ *	the background model. A cell is changed when it differs by
+ *	more than the threshold, a zone has motion when the fraction
+ *	of its changed cells reaches the minimum score, and then the
+ *	bounding box of these cells is reported. The background
+ *	follows slow changes at a rate of 1/2^learn per frame. Runs
+ *	in the libuvc thread. Returns 0 when the frame has no motion
+ *	and nothing is to be reported, i.e. may be skipped, else 1.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+MotionDetect(TUVC *tuvc, uvc_frame_t *frame)
+{
+    int i, x, y, d, w, h, nz, changed, cells, nboxes = 0, ret;
+    int zone[4], box[4], boxes[MD_MAXZONES][4];
+    double score, maxscore = 0;
+    unsigned char *luma;
+    unsigned short *bg;
+
+    Tcl_MutexLock(&tuvc->md.mutex);
+    if (!tuvc->md.enabled || (MotionLuma(tuvc, frame) != 0)) {
+	Tcl_MutexUnlock(&tuvc->md.mutex);
+	return 1;
+    }
+    w = tuvc->md.width;
+    h = tuvc->md.height;
+    luma = tuvc->md.luma;
+    if (tuvc->md.bg == NULL) {
+	tuvc->md.bg = (unsigned short *)
+	    attemptckalloc(w * h * sizeof(unsigned short));
+	if (tuvc->md.bg != NULL) {
+	    for (i = 0; i < w * h; i++) {
+		tuvc->md.bg[i] = luma[i] << 8;
+	    }
+	}
+	Tcl_MutexUnlock(&tuvc->md.mutex);
+	return 1;
+    }
+    bg = tuvc->md.bg;
+    nz = (tuvc->md.nzones > 0) ? tuvc->md.nzones : 1;
+    for (i = 0; i < nz; i++) {
+	if (tuvc->md.nzones > 0) {
+	    int *z = tuvc->md.zones[i];
+
+	    zone[0] = z[0] / MD_SCALE;
+	    zone[1] = z[1] / MD_SCALE;
+	    zone[2] = (z[0] + z[2] + MD_SCALE - 1) / MD_SCALE;
+	    zone[3] = (z[1] + z[3] + MD_SCALE - 1) / MD_SCALE;
+	    if (zone[2] > w) {
+		zone[2] = w;
+	    }
+	    if (zone[3] > h) {
+		zone[3] = h;
+	    }
+	} else {
+	    zone[0] = zone[1] = 0;
+	    zone[2] = w;
+	    zone[3] = h;
+	}
+	cells = (zone[2] - zone[0]) * (zone[3] - zone[1]);
+	if ((zone[2] <= zone[0]) || (zone[3] <= zone[1])) {
+	    continue;
+	}
+	changed = 0;
+	box[0] = w;
+	box[1] = h;
+	box[2] = box[3] = -1;
+	for (y = zone[1]; y < zone[3]; y++) {
+	    for (x = zone[0]; x < zone[2]; x++) {
+		d = luma[y * w + x] - (bg[y * w + x] >> 8);
+		if ((d > tuvc->md.threshold) || (-d > tuvc->md.threshold)) {
+		    changed++;
+		    if (x < box[0]) {
+			box[0] = x;
+		    }
+		    if (x > box[2]) {
+			box[2] = x;
+		    }
+		    if (y < box[1]) {
+			box[1] = y;
+		    }
+		    box[3] = y;
+		}
+	    }
+	}
+	score = (double) changed / cells;
+	if (score > maxscore) {
+	    maxscore = score;
+	}
+	if ((changed > 0) && (score >= tuvc->md.minscore)) {
+	    boxes[nboxes][0] = box[0] * MD_SCALE;
+	    boxes[nboxes][1] = box[1] * MD_SCALE;
+	    boxes[nboxes][2] = (box[2] + 1) * MD_SCALE;
+	    boxes[nboxes][3] = (box[3] + 1) * MD_SCALE;
+	    if (boxes[nboxes][2] > frame->width) {
+		boxes[nboxes][2] = frame->width;
+	    }
+	    if (boxes[nboxes][3] > frame->height) {
+		boxes[nboxes][3] = frame->height;
+	    }
+	    boxes[nboxes][2] -= boxes[nboxes][0];
+	    boxes[nboxes][3] -= boxes[nboxes][1];
+	    nboxes++;
+	}
+    }
+
+    /* Background adapts to slow changes. */
+    for (i = 0; i < w * h; i++) {
+	d = (luma[i] << 8) - bg[i];
+	bg[i] += d / (1 << tuvc->md.learn);
+    }
+
+    /* Report motion and the end of motion. */
+    ret = nboxes > 0;
+    if (ret || tuvc->md.motion) {
+	tuvc->md.score = maxscore;
+	tuvc->md.nboxes = nboxes;
+	memcpy(tuvc->md.boxes, boxes, nboxes * sizeof(boxes[0]));
+	if (!tuvc->md.pending) {
+	    TUEVT *event;
+	    int isNew;
+
+	    Tcl_MutexLock(&uvcMutex);
+	    if (tuvc->tid != NULL) {
+		event = (TUEVT *) ckalloc(sizeof(TUEVT));
+		event->hdr.proc = MotionReady0;
+		event->hdr.nextPtr = NULL;
+		event->tuvc = tuvc;
+		event->hPtr =
+		    Tcl_CreateHashEntry(&tuvc->evts, (ClientData) event,
+					&isNew);
+		Tcl_ThreadQueueEvent(tuvc->tid, &event->hdr, TCL_QUEUE_TAIL);
+		Tcl_ThreadAlert(tuvc->tid);
+		tuvc->md.pending = 1;
+	    }
+	    Tcl_MutexUnlock(&uvcMutex);
+	}
+    }
+    tuvc->md.motion = ret;
+    ret = ret || tuvc->md.pending;
+    Tcl_MutexUnlock(&tuvc->md.mutex);
+    return ret;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * MotionReady0, MotionReport --
+ *
+ *	Motion detection: MotionReady0 is the event callback function
+ *	queued by MotionDetect. MotionReport invokes the motion
+ *	callback with device identifier, score, and list of bounding
+ *	boxes of the most recent result not yet reported.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+MotionReady0(Tcl_Event *evPtr, int flags)
+{
+    TUEVT *tevPtr = (TUEVT *) evPtr;
+    TUVC *tuvc = tevPtr->tuvc;
+
+    if (tuvc == NULL) {
+	return 1;
+    }
+    Tcl_MutexLock(&uvcMutex);
+    if (tevPtr->hPtr != NULL) {
+	Tcl_DeleteHashEntry(tevPtr->hPtr);
+    }
+    Tcl_MutexUnlock(&uvcMutex);
+    MotionReport(tuvc);
+    return 1;
+}
+
+static void
+MotionReport(TUVC *tuvc)
+{
+    Tcl_Interp *interp = tuvc->interp;
+    Tcl_DString ds;
+    char buffer[64];
+    int i, k, ret;
+
+    Tcl_MutexLock(&tuvc->md.mutex);
+    if (!tuvc->md.pending) {
+	Tcl_MutexUnlock(&tuvc->md.mutex);
+	return;
+    }
+    tuvc->md.pending = 0;
+    if (Tcl_DStringLength(&tuvc->md.cmd) == 0) {
+	Tcl_MutexUnlock(&tuvc->md.mutex);
+	return;
+    }
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, Tcl_DStringValue(&tuvc->md.cmd),
+		      Tcl_DStringLength(&tuvc->md.cmd));
+    Tcl_DStringAppendElement(&ds, tuvc->devId);
+    sprintf(buffer, "%g", tuvc->md.score);
+    Tcl_DStringAppendElement(&ds, buffer);
+    Tcl_DStringStartSublist(&ds);
+    for (i = 0; i < tuvc->md.nboxes; i++) {
+	Tcl_DStringStartSublist(&ds);
+	for (k = 0; k < 4; k++) {
+	    sprintf(buffer, "%d", tuvc->md.boxes[i][k]);
+	    Tcl_DStringAppendElement(&ds, buffer);
+	}
+	Tcl_DStringEndSublist(&ds);
+    }
+    Tcl_DStringEndSublist(&ds);
+    Tcl_MutexUnlock(&tuvc->md.mutex);
+    Tcl_Preserve((ClientData) interp);
+    ret = Tcl_EvalEx(interp, Tcl_DStringValue(&ds), Tcl_DStringLength(&ds),
+		     TCL_EVAL_GLOBAL);
+    if (ret != TCL_OK) {
+	Tcl_AddErrorInfo(interp, "\n    (uvc motion handler)");
+	Tcl_BackgroundException(interp, ret);
+    }
+    Tcl_Release((ClientData) interp);
+    Tcl_DStringFree(&ds);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * MotionConfig --
+ *
+ *	Motion detection: process options of "uvc motion ..." and
+ *	leave the current configuration as list in the result.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+MotionConfig(TUVC *tuvc, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[])
+{
+    static const char *optNames[] = {
+	"-command", "-enable", "-learn", "-minscore", "-skip", "-threshold",
+	"-zones", NULL
+    };
+    enum optCode {
+	OPT_command, OPT_enable, OPT_learn, OPT_minscore, OPT_skip,
+	OPT_threshold, OPT_zones
+    };
+    int i, k, opt, enabled, learn, skip, threshold, nzones;
+    int zones[MD_MAXZONES][4];
+    double minscore;
+    const char *cmd = NULL;
+    Tcl_Size nz, nv;
+    Tcl_Obj **zv, **vv, *list;
+
+    if (objc % 2) {
+	Tcl_SetResult(interp, "option without value", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    Tcl_MutexLock(&tuvc->md.mutex);
+    enabled = tuvc->md.enabled;
+    learn = tuvc->md.learn;
+    skip = tuvc->md.skip;
+    threshold = tuvc->md.threshold;
+    minscore = tuvc->md.minscore;
+    nzones = tuvc->md.nzones;
+    memcpy(zones, tuvc->md.zones, sizeof(zones));
+    Tcl_MutexUnlock(&tuvc->md.mutex);
+    for (i = 0; i < objc; i += 2) {
+	if (Tcl_GetIndexFromObj(interp, objv[i], optNames, "option", 0,
+				&opt) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	switch ((enum optCode) opt) {
+	case OPT_command:
+	    cmd = Tcl_GetString(objv[i + 1]);
+	    break;
+	case OPT_enable:
+	    if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &enabled)
+		!= TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    break;
+	case OPT_learn:
+	    if (Tcl_GetIntFromObj(interp, objv[i + 1], &learn) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if ((learn < 0) || (learn > 15)) {
+		Tcl_SetResult(interp, "-learn value out of range",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    break;
+	case OPT_minscore:
+	    if (Tcl_GetDoubleFromObj(interp, objv[i + 1], &minscore)
+		!= TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if ((minscore < 0) || (minscore > 1)) {
+		Tcl_SetResult(interp, "-minscore value out of range",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    break;
+	case OPT_skip:
+	    if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &skip)
+		!= TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    break;
+	case OPT_threshold:
+	    if (Tcl_GetIntFromObj(interp, objv[i + 1], &threshold)
+		!= TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if ((threshold < 0) || (threshold > 255)) {
+		Tcl_SetResult(interp, "-threshold value out of range",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    break;
+	case OPT_zones:
+	    if (Tcl_ListObjGetElements(interp, objv[i + 1], &nz, &zv)
+		!= TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (nz > MD_MAXZONES) {
+		Tcl_SetResult(interp, "too many zones", TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    for (k = 0; k < nz; k++) {
+		if (Tcl_ListObjGetElements(interp, zv[k], &nv, &vv)
+		    != TCL_OK) {
+		    return TCL_ERROR;
+		}
+		if ((nv != 4) ||
+		    (Tcl_GetIntFromObj(NULL, vv[0], &zones[k][0]) != TCL_OK) ||
+		    (Tcl_GetIntFromObj(NULL, vv[1], &zones[k][1]) != TCL_OK) ||
+		    (Tcl_GetIntFromObj(NULL, vv[2], &zones[k][2]) != TCL_OK) ||
+		    (Tcl_GetIntFromObj(NULL, vv[3], &zones[k][3]) != TCL_OK) ||
+		    (zones[k][0] < 0) || (zones[k][1] < 0) ||
+		    (zones[k][2] <= 0) || (zones[k][3] <= 0)) {
+		    Tcl_SetResult(interp, "zone must be x y width height",
+				  TCL_STATIC);
+		    return TCL_ERROR;
+		}
+	    }
+	    nzones = nz;
+	    break;
+	}
+    }
+    Tcl_MutexLock(&tuvc->md.mutex);
+    if (enabled != tuvc->md.enabled) {
+	/* Relearn background when turned on again. */
+	if (tuvc->md.bg != NULL) {
+	    ckfree((char *) tuvc->md.bg);
+	    tuvc->md.bg = NULL;
+	}
+	tuvc->md.motion = tuvc->md.pending = 0;
+    }
+    tuvc->md.enabled = enabled;
+    tuvc->md.learn = learn;
+    tuvc->md.skip = skip;
+    tuvc->md.threshold = threshold;
+    tuvc->md.minscore = minscore;
+    tuvc->md.nzones = nzones;
+    memcpy(tuvc->md.zones, zones, sizeof(zones));
+    if (cmd != NULL) {
+	Tcl_DStringSetLength(&tuvc->md.cmd, 0);
+	Tcl_DStringAppend(&tuvc->md.cmd, cmd, -1);
+    }
+    list = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("-command", -1));
+    Tcl_ListObjAppendElement(NULL, list,
+	Tcl_NewStringObj(Tcl_DStringValue(&tuvc->md.cmd),
+			 Tcl_DStringLength(&tuvc->md.cmd)));
+    Tcl_MutexUnlock(&tuvc->md.mutex);
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("-enable", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewBooleanObj(enabled));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("-learn", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(learn));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("-minscore", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewDoubleObj(minscore));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("-skip", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewBooleanObj(skip));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("-threshold", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(threshold));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("-zones", -1));
+    zv = (Tcl_Obj **) ckalloc((nzones + 1) * sizeof(Tcl_Obj *));
+    for (k = 0; k < nzones; k++) {
+	Tcl_Obj *v[4];
+
+	v[0] = Tcl_NewIntObj(zones[k][0]);
+	v[1] = Tcl_NewIntObj(zones[k][1]);
+	v[2] = Tcl_NewIntObj(zones[k][2]);
+	v[3] = Tcl_NewIntObj(zones[k][3]);
+	zv[k] = Tcl_NewListObj(4, v);
+    }
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewListObj(nzones, zv));
+    ckfree((char *) zv);
+    Tcl_SetObjResult(interp, list);
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * MotionFree --
+ *
+ *	Motion detection: release resources when device is closed.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+MotionFree(TUVC *tuvc)
+{
+    Tcl_MutexLock(&tuvc->md.mutex);
+    tuvc->md.enabled = 0;
+    if (tuvc->md.luma != NULL) {
+	ckfree((char *) tuvc->md.luma);
+	tuvc->md.luma = NULL;
+    }
+    if (tuvc->md.bg != NULL) {
+	ckfree((char *) tuvc->md.bg);
+	tuvc->md.bg = NULL;
+    }
+    if (tuvc->md.dc != NULL) {
+	uvc_free_frame(tuvc->md.dc);
+	tuvc->md.dc = NULL;
+    }
+    Tcl_DStringFree(&tuvc->md.cmd);
+    Tcl_MutexUnlock(&tuvc->md.mutex);
+    Tcl_MutexFinalize(&tuvc->md.mutex);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * ServeFrame --
+ *
+ *	MJPEG HTTP server: called in the libuvc thread for each
+ *	frame while clients are streaming. Obeys the frame rate
+ *	limit, encodes the frame to JPEG for each quality tier in
+ *	use unless the device delivers JPEG already, and hands the
+ *	result over to the thread which opened the UVC device.
+ *	Frames not yet picked up are replaced.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+ServeFrame(TUVC *tuvc, uvc_frame_t *frame)
+{
+    uvc_frame_t *jpeg[SRV_NTIERS], *old[SRV_NTIERS];
+    struct timeval *next = &tuvc->srv.next;
+    TUEVT *event;
+    int i, isNew, sw = 0, any = 0;
+
+    if ((frame->capture_time.tv_sec < next->tv_sec) ||
+	((frame->capture_time.tv_sec == next->tv_sec) &&
+	 (frame->capture_time.tv_usec < next->tv_usec))) {
+	return;
+    }
+    next->tv_sec = frame->capture_time.tv_sec + tuvc->srv.rate.tv_sec;
+    next->tv_usec = frame->capture_time.tv_usec + tuvc->srv.rate.tv_usec;
+    if (next->tv_usec >= 1000000) {
+	next->tv_sec += 1;
+	next->tv_usec -= 1000000;
+    }
+    memset(jpeg, 0, sizeof(jpeg));
+    if (frame->frame_format == UVC_FRAME_FORMAT_MJPEG) {
+	jpeg[0] = uvc_allocate_frame(0);
+	if ((jpeg[0] != NULL) &&
+	    (uvc_duplicate_frame(frame, jpeg[0]) != UVC_SUCCESS)) {
+	    uvc_free_frame(jpeg[0]);
+	    jpeg[0] = NULL;
+	}
+	any = jpeg[0] != NULL;
+    }
+#ifdef LIBUVC_HAVE_JPEG
+    else {
+	sw = 1;
+	for (i = 0; i < SRV_NTIERS; i++) {
+	    if ((i == 0) || (tuvc->srv.tiers[i] > 0)) {
+		jpeg[i] = FrameToJPEGEx(tuvc, frame, serveTiers[i].scale,
+					serveTiers[i].quality);
+		any = any || (jpeg[i] != NULL);
+	    }
+	}
+    }
+#endif
+    if (!any) {
+	return;
+    }
+    Tcl_MutexLock(&uvcMutex);
+    memcpy(old, tuvc->srv.enc, sizeof(old));
+    memcpy(tuvc->srv.enc, jpeg, sizeof(jpeg));
+    tuvc->srv.sw = sw;
+    if ((tuvc->tid != NULL) && !tuvc->srv.pending) {
+	event = (TUEVT *) ckalloc(sizeof(TUEVT));
+	event->hdr.proc = ServeReady0;
+	event->hdr.nextPtr = NULL;
+	event->tuvc = tuvc;
+	event->hPtr =
+	    Tcl_CreateHashEntry(&tuvc->evts, (ClientData) event, &isNew);
+	Tcl_ThreadQueueEvent(tuvc->tid, &event->hdr, TCL_QUEUE_TAIL);
+	Tcl_ThreadAlert(tuvc->tid);
+	tuvc->srv.pending = 1;
+    }
+    Tcl_MutexUnlock(&uvcMutex);
+    for (i = 0; i < SRV_NTIERS; i++) {
+	if (old[i] != NULL) {
+	    uvc_free_frame(old[i]);
+	}
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * ServeReady0 --
+ *
+ *	MJPEG HTTP server: event callback which picks up the last
+ *	encoded frame and offers it to all streaming clients.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+ServeReady0(Tcl_Event *evPtr, int flags)
+{
+    TUEVT *tevPtr = (TUEVT *) evPtr;
+    TUVC *tuvc = tevPtr->tuvc;
+    TSCLIENT *client, *next;
+    TSBUF *bufs[SRV_NTIERS];
+    uvc_frame_t *frames[SRV_NTIERS];
+    struct timeval now;
+    int i, t, any = 0;
+
+    if (tuvc == NULL) {
+	return 1;
+    }
+    Tcl_MutexLock(&uvcMutex);
+    if (tevPtr->hPtr != NULL) {
+	Tcl_DeleteHashEntry(tevPtr->hPtr);
+    }
+    memcpy(frames, tuvc->srv.enc, sizeof(frames));
+    memset(tuvc->srv.enc, 0, sizeof(tuvc->srv.enc));
+    tuvc->srv.pending = 0;
+    Tcl_MutexUnlock(&uvcMutex);
+    for (i = 0; i < SRV_NTIERS; i++) {
+	bufs[i] = NULL;
+	if (frames[i] == NULL) {
+	    continue;
+	}
+	bufs[i] = (TSBUF *) ckalloc(sizeof(TSBUF));
+	bufs[i]->refcnt = 1;
+	bufs[i]->frame = frames[i];
+	if (tuvc->srv.size[i] > 0) {
+	    tuvc->srv.size[i] = 0.875 * tuvc->srv.size[i] +
+		0.125 * frames[i]->data_bytes;
+	} else {
+	    tuvc->srv.size[i] = frames[i]->data_bytes;
+	}
+	any = 1;
+    }
+    if (!any) {
+	return 1;
+    }
+    tuvc->srv.frames++;
+    gettimeofday(&now, NULL);
+    for (client = tuvc->srv.clients; client != NULL; client = next) {
+	next = client->next;
+	if (!client->streaming || !ServeAdapt(client, &now)) {
+	    continue;
+	}
+	/* Nearest tier encoded, prefer lower quality. */
+	for (i = 0; i < SRV_NTIERS; i++) {
+	    t = client->tier + ((i & 1) ? -(i + 1) / 2 : (i + 1) / 2);
+	    if ((t >= 0) && (t < SRV_NTIERS) && (bufs[t] != NULL)) {
+		break;
+	    }
+	    t = client->tier + ((i & 1) ? (i + 1) / 2 : -(i + 1) / 2);
+	    if ((t >= 0) && (t < SRV_NTIERS) && (bufs[t] != NULL)) {
+		break;
+	    }
+	}
+	if (i >= SRV_NTIERS) {
+	    continue;
+	}
+	if (client->pend != NULL) {
+	    /* Stale frame, never started. */
+	    ServeRelease(client->pend);
+	    client->dropped++;
+	}
+	client->pend = bufs[t];
+	bufs[t]->refcnt++;
+	ServeSend(client);
+    }
+    for (i = 0; i < SRV_NTIERS; i++) {
+	if (bufs[i] != NULL) {
+	    ServeRelease(bufs[i]);
+	}
+    }
+    return 1;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * ServeAdapt --
+ *
+ *	MJPEG HTTP server: estimate the drain rate of a client from
+ *	the bytes leaving its socket send buffer since the previous
+ *	frame, then adapt frame interval and quality tier. Returns
+ *	true when the client shall get the current frame.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+ServeAdapt(TSCLIENT *client, struct timeval *now)
+{
+    TUVC *tuvc = client->tuvc;
+    Tcl_WideInt backlog = 0;
+    double dt, size;
+    int t, outq = 0;
+
+#ifdef TIOCOUTQ
+    if ((client->fd < 0) || (ioctl(client->fd, TIOCOUTQ, &outq) < 0)) {
+	outq = 0;
+    }
+#endif
+    backlog = outq;
+    if (client->cur != NULL) {
+	backlog += client->partlen + client->cur->frame->data_bytes + 2 -
+	    client->off;
+    }
+    if (client->pend != NULL) {
+	backlog += client->pend->frame->data_bytes;
+    }
+    dt = (now->tv_sec - client->sampled.tv_sec) +
+	(now->tv_usec - client->sampled.tv_usec) * 1.0e-6;
+    if ((client->backlog > 0) && (dt > 0.001)) {
+	double rate = (client->backlog + client->added - backlog) / dt;
+
+	/* Only a busy socket tells its drain rate. */
+	if (rate < 0) {
+	    rate = 0;
+	}
+	client->drain = (client->drain > 0) ?
+	    0.75 * client->drain + 0.25 * rate : rate;
+    }
+    client->backlog = backlog;
+    client->added = 0;
+    client->sampled = *now;
+    if (!tuvc->srv.adapt) {
+	return 1;
+    }
+    t = client->tier;
+    size = tuvc->srv.size[t];
+    if (backlog > 0) {
+	client->busy = *now;
+	if ((client->drain > 0) && (size > 0)) {
+	    client->ival = size / client->drain;
+	}
+	dt = (now->tv_sec - client->changed.tv_sec) +
+	    (now->tv_usec - client->changed.tv_usec) * 1.0e-6;
+	if (tuvc->srv.sw && (client->ival > 1.0 / SRV_MINFPS) &&
+	    (t < SRV_NTIERS - 1) && (dt > 1.0)) {
+	    t++;
+	}
+    } else {
+	client->ival *= 0.5;
+	if (client->ival < 0.001) {
+	    client->ival = 0;
+	}
+	dt = (now->tv_sec - client->changed.tv_sec) +
+	    (now->tv_usec - client->changed.tv_usec) * 1.0e-6;
+	if (tuvc->srv.sw && (t > 0) && (dt > SRV_CALM) &&
+	    (now->tv_sec - client->busy.tv_sec > SRV_CALM)) {
+	    t--;
+	}
+    }
+    if (t != client->tier) {
+	tuvc->srv.tiers[client->tier]--;
+	tuvc->srv.tiers[t]++;
+	client->tier = t;
+	client->changed = *now;
+	if ((size > 0) && (tuvc->srv.size[t] > 0)) {
+	    client->ival *= tuvc->srv.size[t] / size;
+	}
+    }
+    if ((now->tv_sec < client->due.tv_sec) ||
+	((now->tv_sec == client->due.tv_sec) &&
+	 (now->tv_usec < client->due.tv_usec))) {
+	client->skipped++;
+	return 0;
+    }
+    client->due.tv_sec = now->tv_sec + (int) client->ival;
+    client->due.tv_usec = now->tv_usec +
+	(int) ((client->ival - (int) client->ival) * 1000000.0);
+    if (client->due.tv_usec >= 1000000) {
+	client->due.tv_sec += 1;
+	client->due.tv_usec -= 1000000;
+    }
+    return 1;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * ServeAccept, ServeHandler --
+ *
+ *	MJPEG HTTP server: accept a connection and handle channel
+ *	events of a client. The request header is read up to the
+ *	empty line, a GET request is answered with a multipart
+ *	stream, anything else with an error. Later input is
+ *	discarded, end of file closes the client.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+ServeAccept(ClientData clientData, Tcl_Channel chan, SRV_CONST char *host,
+	    int port)
+{
+    TUVC *tuvc = (TUVC *) clientData;
+    TSCLIENT *client;
+    ClientData handle;
+
+    if ((tuvc->srv.nclients >= tuvc->srv.maxclients) ||
+	(Tcl_SetChannelOption(NULL, chan, "-blocking", "0") != TCL_OK) ||
+	(Tcl_SetChannelOption(NULL, chan, "-buffering", "none") != TCL_OK) ||
+	(Tcl_SetChannelOption(NULL, chan, "-translation", "binary")
+	 != TCL_OK)) {
+	static const char busy[] =
+	    "HTTP/1.0 503 Service Unavailable\r\n"
+	    "Connection: close\r\n\r\n";
+
+	Tcl_SetChannelOption(NULL, chan, "-translation", "binary");
+	Tcl_WriteRaw(chan, busy, sizeof(busy) - 1);
+	Tcl_Close(NULL, chan);
+	return;
+    }
+    client = (TSCLIENT *) ckalloc(sizeof(TSCLIENT));
+    memset(client, 0, sizeof(TSCLIENT));
+    client->tuvc = tuvc;
+    client->id = ++tuvc->srv.clientid;
+    gettimeofday(&client->sampled, NULL);
+    client->chan = chan;
+    strncpy(client->host, host, sizeof(client->host) - 1);
+    client->port = port;
+    client->fd = -1;
+    if (Tcl_GetChannelHandle(chan, TCL_WRITABLE, &handle) == TCL_OK) {
+	client->fd = (int) (intptr_t) handle;
+    }
+    client->changed = client->busy = client->sampled;
+    Tcl_DStringInit(&client->req);
+    client->next = tuvc->srv.clients;
+    tuvc->srv.clients = client;
+    tuvc->srv.nclients++;
+    client->mask = TCL_READABLE;
+    Tcl_CreateChannelHandler(chan, client->mask, ServeHandler,
+			     (ClientData) client);
+}
+
+static void
+ServeHandler(ClientData clientData, int mask)
+{
+    TSCLIENT *client = (TSCLIENT *) clientData;
+    TUVC *tuvc = client->tuvc;
+    char buf[1024];
+    int n;
+
+    if (mask & TCL_READABLE) {
+	n = Tcl_ReadRaw(client->chan, buf, sizeof(buf));
+	if ((n < 0) && (Tcl_GetErrno() != EAGAIN)) {
+	    ServeClose(client);
+	    return;
+	}
+	if ((n == 0) && Tcl_Eof(client->chan)) {
+	    ServeClose(client);
+	    return;
+	}
+	if (!client->streaming && (n > 0)) {
+	    static const char bad[] =
+		"HTTP/1.0 405 Method Not Allowed\r\n"
+		"Connection: close\r\n\r\n";
+	    static const char hdr[] =
+		"HTTP/1.0 200 OK\r\n"
+		"Connection: close\r\n"
+		"Cache-Control: no-cache, no-store\r\n"
+		"Pragma: no-cache\r\n"
+		"Content-Type: multipart/x-mixed-replace; boundary="
+		SRV_BOUNDARY "\r\n\r\n";
+	    const char *req;
+
+	    Tcl_DStringAppend(&client->req, buf, n);
+	    req = Tcl_DStringValue(&client->req);
+	    if (strstr(req, "\r\n\r\n") == NULL) {
+		if (Tcl_DStringLength(&client->req) > SRV_MAXREQ) {
+		    ServeClose(client);
+		}
+		return;
+	    }
+	    if (strncmp(req, "GET ", 4) != 0) {
+		Tcl_WriteRaw(client->chan, bad, sizeof(bad) - 1);
+		ServeClose(client);
+		return;
+	    }
+	    Tcl_DStringFree(&client->req);
+	    if (Tcl_WriteRaw(client->chan, hdr, sizeof(hdr) - 1) !=
+		sizeof(hdr) - 1) {
+		ServeClose(client);
+		return;
+	    }
+	    client->streaming = 1;
+	    tuvc->srv.active++;
+	    tuvc->srv.tiers[client->tier]++;
+	}
+    }
+    if (mask & TCL_WRITABLE) {
+	ServeSend(client);
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * ServeSend --
+ *
+ *	MJPEG HTTP server: write as much of the current and pending
+ *	frame to a client as its socket takes without blocking. The
+ *	writable handler is set while data is left. Returns -1 when
+ *	the client was closed due to an error, 0 otherwise.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+ServeSend(TSCLIENT *client)
+{
+    Tcl_WideInt size;
+    const char *p;
+    int n, len, mask;
+
+    for (;;) {
+	if (client->cur == NULL) {
+	    if (client->pend == NULL) {
+		break;
+	    }
+	    client->cur = client->pend;
+	    client->pend = NULL;
+	    client->partlen = sprintf(client->part, "--" SRV_BOUNDARY "\r\n"
+		"Content-Type: image/jpeg\r\n"
+		"Content-Length: %d\r\n\r\n",
+		(int) client->cur->frame->data_bytes);
+	    client->off = 0;
+	    client->added += client->partlen +
+		client->cur->frame->data_bytes + 2;
+	}
+	size = client->cur->frame->data_bytes;
+	if (client->off < client->partlen) {
+	    p = client->part + client->off;
+	    len = client->partlen - client->off;
+	} else if (client->off < client->partlen + size) {
+	    p = (const char *) client->cur->frame->data +
+		(client->off - client->partlen);
+	    len = client->partlen + size - client->off;
+	} else {
+	    p = "\r\n" + (client->off - client->partlen - size);
+	    len = client->partlen + size + 2 - client->off;
+	}
+	n = Tcl_WriteRaw(client->chan, p, len);
+	if (n < 0) {
+	    if (Tcl_GetErrno() == EAGAIN) {
+		break;
+	    }
+	    ServeClose(client);
+	    return -1;
+	}
+	client->off += n;
+	client->bytes += n;
+	if (n < len) {
+	    break;
+	}
+	if (client->off >= client->partlen + size + 2) {
+	    ServeRelease(client->cur);
+	    client->cur = NULL;
+	    client->sent++;
+	}
+    }
+    mask = TCL_READABLE;
+    if (client->cur != NULL) {
+	mask |= TCL_WRITABLE;
+    }
+    if (mask != client->mask) {
+	Tcl_CreateChannelHandler(client->chan, mask, ServeHandler,
+				 (ClientData) client);
+	client->mask = mask;
+    }
+    return 0;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * ServeRelease, ServeClose, ServeStop --
+ *
+ *	MJPEG HTTP server: drop a reference of a shared frame, close
+ *	a client, or close the listening socket and all clients.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+ServeRelease(TSBUF *buf)
+{
+    if (--buf->refcnt <= 0) {
+	uvc_free_frame(buf->frame);
+	ckfree((char *) buf);
+    }
+}
+
+static void
+ServeClose(TSCLIENT *client)
+{
+    TUVC *tuvc = client->tuvc;
+    TSCLIENT **pp;
+
+    for (pp = &tuvc->srv.clients; *pp != NULL; pp = &(*pp)->next) {
+	if (*pp == client) {
+	    *pp = client->next;
+	    break;
+	}
+    }
+    tuvc->srv.nclients--;
+    if (client->streaming) {
+	tuvc->srv.active--;
+	tuvc->srv.tiers[client->tier]--;
+    }
+    Tcl_DeleteChannelHandler(client->chan, ServeHandler,
+			     (ClientData) client);
+    Tcl_Close(NULL, client->chan);
+    if (client->cur != NULL) {
+	ServeRelease(client->cur);
+    }
+    if (client->pend != NULL) {
+	ServeRelease(client->pend);
+    }
+    Tcl_DStringFree(&client->req);
+    ckfree((char *) client);
+}
+
+static void
+ServeStop(TUVC *tuvc)
+{
+    uvc_frame_t *frames[SRV_NTIERS];
+    int i;
+
+    while (tuvc->srv.clients != NULL) {
+	ServeClose(tuvc->srv.clients);
+    }
+    if (tuvc->srv.listen != NULL) {
+	Tcl_Close(NULL, tuvc->srv.listen);
+	tuvc->srv.listen = NULL;
+    }
+    tuvc->srv.port = 0;
+    Tcl_MutexLock(&uvcMutex);
+    memcpy(frames, tuvc->srv.enc, sizeof(frames));
+    memset(tuvc->srv.enc, 0, sizeof(tuvc->srv.enc));
+    Tcl_MutexUnlock(&uvcMutex);
+    for (i = 0; i < SRV_NTIERS; i++) {
+	if (frames[i] != NULL) {
+	    uvc_free_frame(frames[i]);
+	}
+	tuvc->srv.size[i] = 0;
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * ServeConfig --
+ *
+ *	MJPEG HTTP server: implements "uvc serve devid ...". With
+ *	"-port" the server is (re)started, "stop" closes it. The
+ *	result is the configuration, counters, and client list.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+ServeConfig(TUVC *tuvc, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[])
+{
+    static const char *optNames[] = {
+	"-adapt", "-bind", "-fps", "-maxclients", "-port", NULL
+    };
+    enum optCode {
+	OPT_adapt, OPT_bind, OPT_fps, OPT_maxclients, OPT_port
+    };
+    int i, opt, port = -1, maxclients = tuvc->srv.maxclients;
+    int adapt = tuvc->srv.adapt;
+    double fps = -1;
+    const char *bind = NULL;
+    Tcl_Obj *list, *clist;
+    TSCLIENT *client;
+
+    if ((objc == 1) && (strcmp(Tcl_GetString(objv[0]), "stop") == 0)) {
+	ServeStop(tuvc);
+	return TCL_OK;
+    }
+    if (objc % 2) {
+	Tcl_SetResult(interp, "option without value", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    for (i = 0; i < objc; i += 2) {
+	if (Tcl_GetIndexFromObj(interp, objv[i], optNames, "option", 0,
+				&opt) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	switch ((enum optCode) opt) {
+	case OPT_adapt:
+	    if (Tcl_GetBooleanFromObj(interp, objv[i + 1], &adapt)
+		!= TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    break;
+	case OPT_bind:
+	    bind = Tcl_GetString(objv[i + 1]);
+	    break;
+	case OPT_fps:
+	    if (Tcl_GetDoubleFromObj(interp, objv[i + 1], &fps) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (fps < 0) {
+		Tcl_SetResult(interp, "-fps value out of range", TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    break;
+	case OPT_maxclients:
+	    if (Tcl_GetIntFromObj(interp, objv[i + 1], &maxclients)
+		!= TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if (maxclients < 1) {
+		Tcl_SetResult(interp, "-maxclients value out of range",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    break;
+	case OPT_port:
+	    if (Tcl_GetIntFromObj(interp, objv[i + 1], &port) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if ((port < 0) || (port > 65535)) {
+		Tcl_SetResult(interp, "-port value out of range", TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    break;
+	}
+    }
+    if ((bind != NULL) && (port < 0)) {
+	Tcl_SetResult(interp, "-bind requires -port", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    if (port >= 0) {
+	Tcl_Channel chan;
+
+	ServeStop(tuvc);
+	chan = Tcl_OpenTcpServer(interp, port,
+				 ((bind != NULL) && (bind[0] != '\0')) ?
+				 bind : NULL, ServeAccept, (ClientData) tuvc);
+	if (chan == NULL) {
+	    return TCL_ERROR;
+	}
+	if (port == 0) {
+	    Tcl_DString ds;
+	    Tcl_Size nv;
+	    Tcl_Obj *sock, **vv;
+
+	    /* Find out ephemeral port. */
+	    Tcl_DStringInit(&ds);
+	    Tcl_GetChannelOption(NULL, chan, "-sockname", &ds);
+	    sock = Tcl_NewStringObj(Tcl_DStringValue(&ds),
+				    Tcl_DStringLength(&ds));
+	    Tcl_IncrRefCount(sock);
+	    Tcl_DStringFree(&ds);
+	    if ((Tcl_ListObjGetElements(NULL, sock, &nv, &vv) == TCL_OK) &&
+		(nv >= 3)) {
+		Tcl_GetIntFromObj(NULL, vv[2], &port);
+	    }
+	    Tcl_DecrRefCount(sock);
+	}
+	tuvc->srv.listen = chan;
+	tuvc->srv.port = port;
+    }
+    if (fps >= 0) {
+	if (fps > 0) {
+	    tuvc->srv.rate.tv_sec = 1.0 / fps;
+	    tuvc->srv.rate.tv_usec =
+		(1.0 / fps - tuvc->srv.rate.tv_sec) * 1000000.0;
+	} else {
+	    tuvc->srv.rate.tv_sec = tuvc->srv.rate.tv_usec = 0;
+	}
+	tuvc->srv.next.tv_sec = tuvc->srv.next.tv_usec = 0;
+    }
+    tuvc->srv.maxclients = maxclients;
+    if (adapt != tuvc->srv.adapt) {
+	/* Start over at full rate and quality. */
+	for (client = tuvc->srv.clients; client != NULL;
+	     client = client->next) {
+	    if (client->streaming) {
+		tuvc->srv.tiers[client->tier]--;
+		tuvc->srv.tiers[0]++;
+	    }
+	    client->tier = 0;
+	    client->ival = 0;
+	    client->due.tv_sec = client->due.tv_usec = 0;
+	}
+	tuvc->srv.adapt = adapt;
+    }
+    list = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("adapt", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewBooleanObj(adapt));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("port", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(tuvc->srv.port));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("fps", -1));
+    i = tuvc->srv.rate.tv_sec * 1000000 + tuvc->srv.rate.tv_usec;
+    Tcl_ListObjAppendElement(NULL, list,
+			     Tcl_NewDoubleObj(i ? 1000000.0 / i : 0));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("maxclients", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(maxclients));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("frames", -1));
+    Tcl_ListObjAppendElement(NULL, list,
+			     Tcl_NewWideIntObj(tuvc->srv.frames));
+    clist = Tcl_NewListObj(0, NULL);
+    for (client = tuvc->srv.clients; client != NULL; client = client->next) {
+	Tcl_Obj *v[20];
+
+	v[0] = Tcl_NewStringObj("id", -1);
+	v[1] = Tcl_NewIntObj(client->id);
+	v[2] = Tcl_NewStringObj("host", -1);
+	v[3] = Tcl_NewStringObj(client->host, -1);
+	v[4] = Tcl_NewStringObj("port", -1);
+	v[5] = Tcl_NewIntObj(client->port);
+	v[6] = Tcl_NewStringObj("streaming", -1);
+	v[7] = Tcl_NewBooleanObj(client->streaming);
+	v[8] = Tcl_NewStringObj("sent", -1);
+	v[9] = Tcl_NewWideIntObj(client->sent);
+	v[10] = Tcl_NewStringObj("dropped", -1);
+	v[11] = Tcl_NewWideIntObj(client->dropped);
+	v[12] = Tcl_NewStringObj("skipped", -1);
+	v[13] = Tcl_NewWideIntObj(client->skipped);
+	v[14] = Tcl_NewStringObj("bytes", -1);
+	v[15] = Tcl_NewWideIntObj(client->bytes);
+	v[16] = Tcl_NewStringObj("tier", -1);
+	v[17] = Tcl_NewIntObj(client->tier);
+	v[18] = Tcl_NewStringObj("drain", -1);
+	v[19] = Tcl_NewWideIntObj((Tcl_WideInt) client->drain);
+	Tcl_ListObjAppendElement(NULL, clist, Tcl_NewListObj(20, v));
+    }
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("clients", -1));
+    Tcl_ListObjAppendElement(NULL, list, clist);
+    Tcl_SetObjResult(interp, list);
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * MonoTime --
+ *
+ *	Return the monotonic clock in microseconds, the same clock
+ *	libuvc uses for the capture time of frames.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static Tcl_WideInt
+MonoTime(void)
+{
+#if _POSIX_TIMERS > 0
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (Tcl_WideInt) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (Tcl_WideInt) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * HistAdd, ThreadRole, StatsShard --
+ *
+ *	Add a duration in microseconds to a histogram. ThreadRole
+ *	tells which of the threads of a device the caller is (PS_*),
+ *	StatsShard returns the pipeline statistics of the calling
+ *	thread, which is the only one to update them.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+HistAdd(THIST *h, Tcl_WideInt us)
+{
+    int k = 0;
+
+    while ((k < ST_NBUCKETS - 1) && (((Tcl_WideInt) 1 << k) <= us)) {
+	k++;
+    }
+    h->buckets[k] += 1;
+    h->count += 1;
+    h->sum += us;
+    if (us > h->max) {
+	h->max = us;
+    }
+}
+
+static int
+ThreadRole(TUVC *tuvc)
+{
+    Tcl_ThreadId me = Tcl_GetCurrentThread();
+
+    if ((tuvc->rq.tid != NULL) && (me == tuvc->rq.tid)) {
+	return PS_WRITER;
+    }
+    if ((tuvc->tid != NULL) && (me != tuvc->tid)) {
+	return PS_CALLBACK;
+    }
+    return PS_INTERP;
+}
+
+static TPSTATS *
+StatsShard(TUVC *tuvc)
+{
+    return &tuvc->pstats[ThreadRole(tuvc)];
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * TraceEvent --
+ *
+ *	Record a complete event of a pipeline stage, times in
+ *	monotonic microseconds, "end" zero for now. The event goes
+ *	to the ring of the calling thread's role and shows up in the
+ *	trace on that thread, or on "tid" if that is non-zero. When
+ *	the ring is full, the event is lost. Callers check the
+ *	TUVC.trace flag first, thus tracing costs nothing when off.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+TraceEvent(TUVC *tuvc, const char *name, Tcl_WideInt begin,
+	   Tcl_WideInt end, unsigned int seq, int tid)
+{
+    int role = ThreadRole(tuvc);
+    TTRING *ring = tuvc->trings[role];
+    TTEV *ev;
+
+    if (ring == NULL) {
+	return;
+    }
+    if (end == 0) {
+	end = MonoTime();
+    }
+    if (tid == 0) {
+	tid = (role == PS_INTERP) ? 1 : (tuvc->ttid + role);
+    }
+    Tcl_MutexLock(&ring->mutex);
+    if (ring->count >= TR_RING) {
+	ring->lost += 1;
+    } else {
+	ev = &ring->ev[(ring->head + ring->count) % TR_RING];
+	ev->name = name;
+	ev->ts = begin;
+	ev->dur = end - begin;
+	ev->tid = tid;
+	ev->seq = seq;
+	ring->count += 1;
+    }
+    Tcl_MutexUnlock(&ring->mutex);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * TraceFlush, TraceFlusher --
+ *
+ *	TraceFlush writes the events of all rings of the trace as
+ *	Chrome trace JSON using "buf" to copy out events of a ring.
+ *	Called with traceMutex held. TraceFlusher is the thread
+ *	doing this periodically while the trace runs, and once more
+ *	when the trace stops.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+TraceFlush(TTEV *buf)
+{
+    TTRING *ring;
+    int i, n;
+    int pid = (int) getpid();
+
+    for (ring = uvcTrace.rings; ring != NULL; ring = ring->next) {
+	Tcl_MutexLock(&ring->mutex);
+	n = ring->count;
+	for (i = 0; i < n; i++) {
+	    buf[i] = ring->ev[(ring->head + i) % TR_RING];
+	}
+	ring->head = (ring->head + n) % TR_RING;
+	ring->count = 0;
+	uvcTrace.lost += ring->lost;
+	ring->lost = 0;
+	Tcl_MutexUnlock(&ring->mutex);
+	for (i = 0; i < n; i++) {
+	    fprintf(uvcTrace.fp, ",\n{\"name\":\"%s\",\"ph\":\"X\","
+		    "\"pid\":%d,\"tid\":%d,\"ts\":%" TCL_LL_MODIFIER "d,"
+		    "\"dur\":%" TCL_LL_MODIFIER "d,"
+		    "\"args\":{\"dev\":\"%s\",\"seq\":%u}}",
+		    buf[i].name, pid, buf[i].tid, (Tcl_WideInt) buf[i].ts,
+		    (Tcl_WideInt) buf[i].dur, ring->dev, buf[i].seq);
+	}
+	uvcTrace.written += n;
+    }
+    fflush(uvcTrace.fp);
+}
+
+static Tcl_ThreadCreateType
+TraceFlusher(ClientData clientData)
+{
+    TTEV *buf = (TTEV *) clientData;
+    Tcl_Time interval = { 0, 100000 };
+
+    Tcl_MutexLock(&traceMutex);
+    while (uvcTrace.run) {
+	Tcl_ConditionWait(&uvcTrace.cond, &traceMutex, &interval);
+	TraceFlush(buf);
+    }
+    TraceFlush(buf);
+    Tcl_MutexUnlock(&traceMutex);
+    ckfree((char *) buf);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * TraceStop, TraceDetach --
+ *
+ *	TraceStop ends the trace, if any, writes the remaining events
+ *	and closes the file. When "resultPtr" is not NULL, it is set
+ *	to a list of the number of events written and lost. The rings
+ *	stay with the devices for reuse, since their threads may
+ *	still be about to record. TraceDetach removes the rings of
+ *	a device which is closed, and frees them.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+TraceStop(TUVCI *tuvci, Tcl_Obj **resultPtr)
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    TUVC *tuvc;
+    int result;
+
+    if (!uvcTrace.run || (uvcTrace.owner != tuvci)) {
+	return;
+    }
+    hPtr = Tcl_FirstHashEntry(&tuvci->tuvcc, &search);
+    while (hPtr != NULL) {
+	tuvc = (TUVC *) Tcl_GetHashValue(hPtr);
+	tuvc->trace = 0;
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+    Tcl_MutexLock(&traceMutex);
+    uvcTrace.run = 0;
+    Tcl_ConditionNotify(&uvcTrace.cond);
+    Tcl_MutexUnlock(&traceMutex);
+    Tcl_JoinThread(uvcTrace.tid, &result);
+    Tcl_MutexLock(&traceMutex);
+    fprintf(uvcTrace.fp, "\n]}\n");
+    fclose(uvcTrace.fp);
+    uvcTrace.fp = NULL;
+    uvcTrace.tid = NULL;
+    uvcTrace.owner = NULL;
+    uvcTrace.rings = NULL;
+    if (resultPtr != NULL) {
+	Tcl_Obj *r[2];
+
+	r[0] = Tcl_NewWideIntObj(uvcTrace.written);
+	r[1] = Tcl_NewWideIntObj(uvcTrace.lost);
+	*resultPtr = Tcl_NewListObj(2, r);
+    }
+    Tcl_MutexUnlock(&traceMutex);
+}
+
+static void
+TraceDetach(TUVC *tuvc)
+{
+    TTRING **prev;
+    int i;
+
+    tuvc->trace = 0;
+    Tcl_MutexLock(&traceMutex);
+    for (i = 0; i < PS_NSHARDS; i++) {
+	if (tuvc->trings[i] == NULL) {
+	    continue;
+	}
+	for (prev = &uvcTrace.rings; *prev != NULL; prev = &(*prev)->next) {
+	    if (*prev == tuvc->trings[i]) {
+		*prev = tuvc->trings[i]->next;
+		break;
+	    }
+	}
+    }
+    Tcl_MutexUnlock(&traceMutex);
+    for (i = 0; i < PS_NSHARDS; i++) {
+	if (tuvc->trings[i] != NULL) {
+	    Tcl_MutexFinalize(&tuvc->trings[i]->mutex);
+	    ckfree((char *) tuvc->trings[i]);
+	    tuvc->trings[i] = NULL;
+	}
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * TraceCmd --
+ *
+ *	Implements "uvc trace start file ?-devices devid ...?" and
+ *	"uvc trace stop". Starting opens the file, names the threads
+ *	of the traced devices in it, attaches their rings, and starts
+ *	the flusher thread. Devices opened later aren't traced.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+TraceCmd(TUVCI *tuvci, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[])
+{
+    static const char *roleNames[PS_NSHARDS] = {
+	"libuvc", "Tcl", "writer"
+    };
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    TUVC *tuvc, **devs;
+    const char *native;
+    Tcl_Obj *result = NULL;
+    TTEV *buf;
+    FILE *fp;
+    int i, k, ndevs = 0, pid = (int) getpid();
+
+    if ((objc == 3) && (strcmp(Tcl_GetString(objv[2]), "stop") == 0)) {
+	if (uvcTrace.run && (uvcTrace.owner != tuvci)) {
+	    Tcl_SetResult(interp, "trace not started by this interpreter",
+			  TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	TraceStop(tuvci, &result);
+	if (result != NULL) {
+	    Tcl_SetObjResult(interp, result);
+	}
+	return TCL_OK;
+    }
+    if ((objc < 4) || (strcmp(Tcl_GetString(objv[2]), "start") != 0) ||
+	((objc > 4) && (strcmp(Tcl_GetString(objv[4]), "-devices") != 0))) {
+	Tcl_WrongNumArgs(interp, 2, objv,
+			 "start file ?-devices devid ...? | stop");
+	return TCL_ERROR;
+    }
+    if (uvcTrace.run) {
+	Tcl_SetResult(interp, "trace already running", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    devs = (TUVC **) ckalloc(sizeof(TUVC *) *
+			     (objc + tuvci->tuvcc.numEntries));
+    if (objc > 5) {
+	for (i = 5; i < objc; i++) {
+	    hPtr = Tcl_FindHashEntry(&tuvci->tuvcc, Tcl_GetString(objv[i]));
+	    if (hPtr == NULL) {
+		Tcl_SetObjResult(interp,
+		    Tcl_ObjPrintf("device \"%s\" not found",
+				  Tcl_GetString(objv[i])));
+		ckfree((char *) devs);
+		return TCL_ERROR;
+	    }
+	    tuvc = (TUVC *) Tcl_GetHashValue(hPtr);
+	    for (k = 0; k < ndevs; k++) {
+		if (devs[k] == tuvc) {
+		    break;
+		}
+	    }
+	    if (k >= ndevs) {
+		devs[ndevs++] = tuvc;
+	    }
+	}
+    } else {
+	hPtr = Tcl_FirstHashEntry(&tuvci->tuvcc, &search);
+	while (hPtr != NULL) {
+	    devs[ndevs++] = (TUVC *) Tcl_GetHashValue(hPtr);
+	    hPtr = Tcl_NextHashEntry(&search);
+	}
+    }
+    native = Tcl_FSGetNativePath(objv[3]);
+    fp = (native != NULL) ? fopen(native, "w") : NULL;
+    if (fp == NULL) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("couldn't open \"%s\": %s",
+			  Tcl_GetString(objv[3]), Tcl_PosixError(interp)));
+	ckfree((char *) devs);
+	return TCL_ERROR;
+    }
+    fcntl(fileno(fp), F_SETFD, FD_CLOEXEC);
+    buf = (TTEV *) attemptckalloc(TR_RING * sizeof(TTEV));
+    if (buf == NULL) {
+	fclose(fp);
+	ckfree((char *) devs);
+	Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    fprintf(fp, "{\"traceEvents\":[\n{\"name\":\"thread_name\","
+	    "\"ph\":\"M\",\"pid\":%d,\"tid\":1,"
+	    "\"args\":{\"name\":\"Tcl\"}}", pid);
+    Tcl_MutexLock(&traceMutex);
+    for (k = 0; k < ndevs; k++) {
+	tuvc = devs[k];
+	tuvc->ttid = 100 * (k + 1);
+	for (i = 0; i < PS_NSHARDS; i++) {
+	    if (tuvc->trings[i] == NULL) {
+		tuvc->trings[i] = (TTRING *) attemptckalloc(sizeof(TTRING));
+		if (tuvc->trings[i] == NULL) {
+		    continue;
+		}
+		memset(tuvc->trings[i], 0, sizeof(TTRING));
+		strcpy(tuvc->trings[i]->dev, tuvc->devId);
+	    }
+	    Tcl_MutexLock(&tuvc->trings[i]->mutex);
+	    tuvc->trings[i]->head = tuvc->trings[i]->count = 0;
+	    tuvc->trings[i]->lost = 0;
+	    Tcl_MutexUnlock(&tuvc->trings[i]->mutex);
+	    tuvc->trings[i]->next = uvcTrace.rings;
+	    uvcTrace.rings = tuvc->trings[i];
+	    if (i != PS_INTERP) {
+		fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+			"\"pid\":%d,\"tid\":%d,"
+			"\"args\":{\"name\":\"%s %s\"}}",
+			pid, tuvc->ttid + i, roleNames[i], tuvc->devId);
+	    }
+	}
+	/* Pseudo thread for frame reassembly in the USB layer. */
+	fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+		"\"pid\":%d,\"tid\":%d,"
+		"\"args\":{\"name\":\"usb %s\"}}",
+		pid, tuvc->ttid + PS_NSHARDS, tuvc->devId);
+    }
+    uvcTrace.fp = fp;
+    uvcTrace.owner = tuvci;
+    uvcTrace.written = uvcTrace.lost = 0;
+    uvcTrace.run = 1;
+    if (Tcl_CreateThread(&uvcTrace.tid, TraceFlusher, (ClientData) buf,
+			 TCL_THREAD_STACK_DEFAULT,
+			 TCL_THREAD_JOINABLE) != TCL_OK) {
+	uvcTrace.run = 0;
+	uvcTrace.fp = NULL;
+	uvcTrace.owner = NULL;
+	uvcTrace.rings = NULL;
+	Tcl_MutexUnlock(&traceMutex);
+	fclose(fp);
+	ckfree((char *) buf);
+	ckfree((char *) devs);
+	Tcl_SetResult(interp, "can't create flusher thread", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    Tcl_MutexUnlock(&traceMutex);
+    for (k = 0; k < ndevs; k++) {
+	devs[k]->trace = 1;
+    }
+    ckfree((char *) devs);
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * FrameCallback --
+ *
+ *	Invoked by a internal libuvc thread to indicate a frame
+ *	ready to be processed further. Frame is converted to RGB
+ *	and the interpreter associated with the UVC device woken
+ *	up by marking a Tcl_AsyncHandler or by queuing an event.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+FrameCallback(uvc_frame_t *frame, void *arg)
+{
+    TUVC *tuvc = (TUVC *) arg;
+    uvc_frame_t *newFrame, *jFrame = NULL;
+    uvc_error_t uret;
+    TUEVT *event;
+    TFINFO info;
+    Tcl_WideInt t0;
+    int damaged, lossy;
+#ifdef LIBUVC_HAVE_JPEG
+    uint32_t nconc = 0;
+#endif
+
+    if (tuvc->tid == NULL) {
+	/* should never happen */
+	return;
+    }
+    /*
+     * MJPEG frames with lost or missing data can be partially
+     * decoded when converting. Truncated ones are otherwise usable
+     * as is with the EOI libuvc appended, those with lost data are
+     * dropped like other corrupt frames, also when converting and
+     * the camera doesn't use restart markers, see conceal.failed.
+     * libuvc counts these per kind.
+     */
+    lossy = (frame->num_gaps > 0);
+    damaged = lossy || (frame->status == UVC_FRAME_NO_EOI);
+#ifdef LIBUVC_HAVE_JPEG
+    if (damaged && tuvc->conv &&
+	(frame->frame_format == UVC_FRAME_FORMAT_MJPEG)) {
+	/* Partially decoded below. */
+    } else
+#endif
+    if (lossy || ((frame->status != UVC_FRAME_OK) &&
+		  (frame->status != UVC_FRAME_NO_EOI))) {
+	Tcl_MutexLock(&uvcMutex);
+	tuvc->counters[0] += 1;
+	tuvc->counters[2] += 1;
+	Tcl_MutexUnlock(&uvcMutex);
+	return;
+    }
+    info.entry = MonoTime();
+    info.converted = 0;
+    info.inbytes = frame->data_bytes;
+    if (tuvc->trace && (frame->sof_mono > 0)) {
+	/* Reassembly of payloads in the USB layer. */
+	TraceEvent(tuvc, "assemble", frame->sof_mono / 1000,
+		   frame->eof_mono / 1000, frame->sequence,
+		   tuvc->ttid + PS_NSHARDS);
+    }
+    if (!lossy && (tuvc->rstate == REC_RECPRI)) {
+	if (tuvc->rq.tid != NULL) {
+	    RecordQueuePut(tuvc, frame);
+	} else {
+	    Tcl_MutexLock(&tuvc->rmutex);
+	    WriteFrame(tuvc, frame);
+	    Tcl_MutexUnlock(&tuvc->rmutex);
+	}
+    }
+    if (!lossy && (tuvc->srv.active > 0)) {
+	ServeFrame(tuvc, frame);
+    }
+    if (!lossy && tuvc->md.enabled && !MotionDetect(tuvc, frame) &&
+	tuvc->md.skip &&
+	(tuvc->ruser || (tuvc->rstate != REC_RECORD))) {
+	/* Static scene, nothing to notify. */
+	Tcl_MutexLock(&uvcMutex);
+	tuvc->counters[0] += 1;
+	Tcl_MutexUnlock(&uvcMutex);
+	return;
+    }
+    if (tuvc->conv && (frame->frame_format != UVC_FRAME_FORMAT_GRAY8) &&
+	(frame->frame_format != UVC_FRAME_FORMAT_RGB)) {
+	t0 = MonoTime();
+	if (frame->frame_format == UVC_FRAME_FORMAT_GRAY16) {
+	    newFrame = uvc_allocate_frame(frame->data_bytes / 2);
+	    if (newFrame == NULL) {
+		return;
+	    }
+	    uret = uvc_gray16to8(frame, newFrame, tuvc->greyshift);
+	} else {
+	    newFrame = uvc_allocate_frame(frame->data_bytes);
+	    if (newFrame == NULL) {
+		return;
+	    }
+#ifdef LIBUVC_HAVE_JPEG
+	    if (damaged) {
+		uret = uvc_mjpeg2rgb_conceal(frame, newFrame, tuvc->lastgood,
+					     &nconc);
+	    } else if (frame->frame_format == UVC_FRAME_FORMAT_MJPEG) {
+		uret = uvc_mjpeg2rgb(frame, newFrame);
+	    } else
+#endif
+	    {
+		uret = uvc_any2rgb_ex(frame, newFrame, tuvc->cm);
+	    }
+	}
+	if (uret) {
+	    uvc_free_frame(newFrame);
+	    if (damaged) {
+		tuvc->conceal.failed++;
+		Tcl_MutexLock(&uvcMutex);
+		tuvc->counters[0] += 1;
+		tuvc->counters[2] += 1;
+		Tcl_MutexUnlock(&uvcMutex);
+	    }
+	    return;
+	}
+#ifdef LIBUVC_HAVE_JPEG
+	if (nconc > 0) {
+	    tuvc->conceal.frames++;
+	    tuvc->conceal.intervals += nconc;
+	}
+	if (!damaged && (frame->frame_format == UVC_FRAME_FORMAT_MJPEG)) {
+	    /* Keep compressed original for "uvc image -jpeg". */
+	    jFrame = uvc_allocate_frame(frame->data_bytes);
+	    if ((jFrame != NULL) &&
+		(uvc_duplicate_frame(frame, jFrame) != UVC_SUCCESS)) {
+		uvc_free_frame(jFrame);
+		jFrame = NULL;
+	    }
+	}
+	if ((damaged || (tuvc->lastgood != NULL)) &&
+	    (frame->frame_format == UVC_FRAME_FORMAT_MJPEG)) {
+	    /* Reference for concealing, kept once damage was seen. */
+	    if (tuvc->lastgood == NULL) {
+		tuvc->lastgood = uvc_allocate_frame(newFrame->data_bytes);
+	    }
+	    if ((tuvc->lastgood != NULL) &&
+		(uvc_duplicate_frame(newFrame, tuvc->lastgood) !=
+		 UVC_SUCCESS)) {
+		uvc_free_frame(tuvc->lastgood);
+		tuvc->lastgood = NULL;
+	    }
+	}
+#endif
+	info.converted = MonoTime();
+	HistAdd(&tuvc->pstats[PS_CALLBACK].convert, info.converted - t0);
+	if (tuvc->trace) {
+	    TraceEvent(tuvc, "convert", t0, info.converted, frame->sequence, 0);
+	}
+    } else {
+	/* Frame is kept beyond this call, take a copy. */
+	newFrame = uvc_allocate_frame(frame->data_bytes);
+	if (newFrame == NULL) {
+	    return;
+	}
+	if (uvc_duplicate_frame(frame, newFrame) != UVC_SUCCESS) {
+	    uvc_free_frame(newFrame);
+	    return;
+	}
+    }
+    Tcl_MutexLock(&uvcMutex);
+    if (tuvc->grp != NULL) {
+	/* Group member, the group reports matched sets. */
+	GroupPut(tuvc->grp, tuvc->grpIdx, newFrame, &info);
+	tuvc->counters[0] += 1;
+	Tcl_MutexUnlock(&uvcMutex);
+	if (jFrame != NULL) {
+	    uvc_free_frame(jFrame);
+	}
+	return;
+    }
+    if (tuvc->frame != NULL) {
+	uvc_frame_t *oldFrame = tuvc->frame;
+
+	tuvc->frame = newFrame;
+	newFrame = oldFrame;
+	tuvc->counters[2] += 1;		/* frame dropped */
+    } else {
+	tuvc->frame = newFrame;
+	newFrame = NULL;
+    }
+    if (tuvc->jframe != NULL) {
+	uvc_frame_t *oldFrame = tuvc->jframe;
+
+	tuvc->jframe = jFrame;
+	jFrame = oldFrame;
+    } else {
+	tuvc->jframe = jFrame;
+	jFrame = NULL;
+    }
+    tuvc->finfo = info;
+    tuvc->counters[0] += 1;
+    if ((tuvc->tid != NULL) && (tuvc->numev == 0)) {
+	int isNew;
+
+	event = (TUEVT *) ckalloc(sizeof(TUEVT));
+	event->hdr.proc = FrameReady0;
+	event->hdr.nextPtr = NULL;
+	event->tuvc = tuvc;
+	event->queued = MonoTime();
+	event->replay = tuvc->replay;
+	event->hPtr =
+	    Tcl_CreateHashEntry(&tuvc->evts, (ClientData) event, &isNew);
+	if (tip609) {
+	    /* TCL_QUEUE_TAIL_ALERT_IF_EMPTY */
+	    Tcl_ThreadQueueEvent(tuvc->tid, &event->hdr, TCL_QUEUE_TAIL | 4);
+	} else {
+	    Tcl_ThreadQueueEvent(tuvc->tid, &event->hdr, TCL_QUEUE_TAIL);
+	    Tcl_ThreadAlert(tuvc->tid);
+	}
+	if (tuvc->trace) {
+	    TraceEvent(tuvc, "queue event", event->queued, 0,
+		       frame->sequence, 0);
+	}
+	tuvc->numev++;
+    }
+    Tcl_MutexUnlock(&uvcMutex);
+    if (newFrame != NULL) {
+	uvc_free_frame(newFrame);
+    }
+    if (jFrame != NULL) {
+	uvc_free_frame(jFrame);
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * FrameReady, FrameReady0 --
+ *
+ *	A frame became ready. FrameReady is a do-when-idle handler
+ *	triggered by FrameReady0 which is an event callback function
+ *	triggered by the FrameCallback function which runs in a
+ *	different libuvc controlled thread. The top-level function
+ *	invokes the Tcl callback procedure which then can retrieve
+ *	the frame buffer using the "uvc image ..." command.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+FrameReady(ClientData clientData)
+{
+    TUVC *tuvc = (TUVC *) clientData;
+    Tcl_Interp *interp = tuvc->interp;
+    int ret;
+    unsigned int seq;
+    Tcl_WideInt t0 = tuvc->trace ? MonoTime() : 0;
+
+    Tcl_MutexLock(&uvcMutex);
+    if (tuvc->idle) {
+	tuvc->numev = 0;
+    }
+    Tcl_MutexUnlock(&uvcMutex);
+    RecordLastFrame(tuvc);
+    if (tuvc->frame == NULL) {
+	/* should never happen */
+	return;
+    }
+    seq = tuvc->frame->sequence;
+    Tcl_DStringSetLength(&tuvc->cbCmd, tuvc->cbCmdLen);
+    Tcl_DStringAppendElement(&tuvc->cbCmd, tuvc->devId);
+    Tcl_Preserve((ClientData) interp);
+    Tcl_Preserve((ClientData) tuvc);
+    ret = Tcl_EvalEx(interp, Tcl_DStringValue(&tuvc->cbCmd),
+		     Tcl_DStringLength(&tuvc->cbCmd), TCL_EVAL_GLOBAL);
+    if (ret != TCL_OK) {
+	Tcl_AddErrorInfo(interp, "\n    (uvc event handler)");
+	Tcl_BackgroundException(interp, ret);
+	StopCapture(tuvc);
+    }
+    if (t0 && tuvc->trace) {
+	TraceEvent(tuvc, "FrameReady", t0, 0, seq, 0);
+    }
+    Tcl_Release((ClientData) tuvc);
+    Tcl_Release((ClientData) interp);
+}
+
+static int
+FrameReady0(Tcl_Event *evPtr, int flags)
+{
+    TUEVT *tevPtr = (TUEVT *) evPtr;
+    TUVC *tuvc = tevPtr->tuvc;
+    int doit = 0;
+
+    if (tuvc == NULL) {
+	return 1;
+    }
+    HistAdd(&tuvc->pstats[PS_INTERP].queue, MonoTime() - tevPtr->queued);
+    Tcl_MutexLock(&uvcMutex);
+    if (tevPtr->hPtr != NULL) {
+	Tcl_DeleteHashEntry(tevPtr->hPtr);
+    }
+    if ((tuvc->tid != NULL) || tevPtr->replay) {
+	/* Replay frames are delivered after the replay ended. */
+	if (!tuvc->idle) {
+	    tuvc->numev--;
+	}
+	doit = 1;
+    } else {
+	tuvc->numev = 0;
+    }
+    Tcl_MutexUnlock(&uvcMutex);
+    if (doit) {
+	if (tuvc->idle) {
+	    Tcl_CancelIdleCall(FrameReady, (ClientData) tuvc);
+	    Tcl_DoWhenIdle(FrameReady, (ClientData) tuvc);
+	} else {
+	    FrameReady((ClientData) tuvc);
+	}
+    }
+    return 1;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * RecordLastFrame --
+ *
+ *	Write the last captured frame to the recording, unless the
+ *	recording is done in the libuvc thread or by the user.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+RecordLastFrame(TUVC *tuvc)
+{
+    uvc_frame_t *frame;
+
+    if (tuvc->ruser || (tuvc->rstate != REC_RECORD)) {
+	return;
+    }
+    Tcl_MutexLock(&uvcMutex);
+    frame = tuvc->frame;
+    tuvc->frame = NULL;
+    Tcl_MutexUnlock(&uvcMutex);
+    if (frame != NULL) {
+	if (tuvc->rq.tid != NULL) {
+	    RecordQueuePut(tuvc, frame);
+	} else {
+	    WriteFrame(tuvc, frame);
+	}
+    }
+    Tcl_MutexLock(&uvcMutex);
+    if ((frame != NULL) && (tuvc->frame == NULL)) {
+	/* Put back last frame */
+	tuvc->frame = frame;
+	frame = NULL;
+    }
+    Tcl_MutexUnlock(&uvcMutex);
+    if (frame != NULL) {
+	uvc_free_frame(frame);
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * GroupPut --
+ *
+ *	Add a frame of a group member to its ring and try to match
+ *	a set: for every other member the frame closest in capture
+ *	time to the new one is picked. When the spread of the picked
+ *	frames is within the tolerance, they become the set to be
+ *	reported, older frames in the rings are counted as unmatched.
+ *	Called with uvcMutex held, takes ownership of the frame.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+GroupPut(TGRP *grp, int idx, uvc_frame_t *frame, const TFINFO *info)
+{
+    int i, k, n, pos[GRP_MAXDEVS];
+    Tcl_WideInt t, t0, tmin, tmax, d, best = 0;
+    TGEVT *event;
+
+    if (grp->nring[idx] >= GRP_RING) {
+	/* Oldest frame found no partners. */
+	uvc_free_frame(grp->ring[idx][0]);
+	memmove(&grp->ring[idx][0], &grp->ring[idx][1],
+		(GRP_RING - 1) * sizeof(uvc_frame_t *));
+	memmove(&grp->rinfo[idx][0], &grp->rinfo[idx][1],
+		(GRP_RING - 1) * sizeof(TFINFO));
+	grp->nring[idx] -= 1;
+	grp->unmatched[idx] += 1;
+    }
+    grp->rinfo[idx][grp->nring[idx]] = *info;
+    grp->ring[idx][grp->nring[idx]++] = frame;
+    t0 = (Tcl_WideInt) frame->capture_time.tv_sec * 1000000 +
+	frame->capture_time.tv_usec;
+    for (i = 0; i < grp->ndevs; i++) {
+	pos[i] = -1;
+	if (i == idx) {
+	    pos[i] = grp->nring[i] - 1;
+	    continue;
+	}
+	for (k = 0; k < grp->nring[i]; k++) {
+	    frame = grp->ring[i][k];
+	    t = (Tcl_WideInt) frame->capture_time.tv_sec * 1000000 +
+		frame->capture_time.tv_usec;
+	    d = (t > t0) ? (t - t0) : (t0 - t);
+	    if ((pos[i] < 0) || (d < best)) {
+		pos[i] = k;
+		best = d;
+	    }
+	}
+	if (pos[i] < 0) {
+	    /* Nothing yet from this member. */
+	    return;
+	}
+    }
+    tmin = tmax = t0;
+    for (i = 0; i < grp->ndevs; i++) {
+	frame = grp->ring[i][pos[i]];
+	t = (Tcl_WideInt) frame->capture_time.tv_sec * 1000000 +
+	    frame->capture_time.tv_usec;
+	if (t < tmin) {
+	    tmin = t;
+	}
+	if (t > tmax) {
+	    tmax = t;
+	}
+    }
+    if (tmax - tmin > grp->tolerance) {
+	return;
+    }
+    if (grp->set[0] != NULL) {
+	grp->overrun += 1;
+    }
+    for (i = 0; i < grp->ndevs; i++) {
+	for (k = 0; k < pos[i]; k++) {
+	    uvc_free_frame(grp->ring[i][k]);
+	    grp->unmatched[i] += 1;
+	}
+	if (grp->set[i] != NULL) {
+	    uvc_free_frame(grp->set[i]);
+	}
+	grp->set[i] = grp->ring[i][pos[i]];
+	grp->sinfo[i] = grp->rinfo[i][pos[i]];
+	n = grp->nring[i] - pos[i] - 1;
+	memmove(&grp->ring[i][0], &grp->ring[i][pos[i] + 1],
+		n * sizeof(uvc_frame_t *));
+	memmove(&grp->rinfo[i][0], &grp->rinfo[i][pos[i] + 1],
+		n * sizeof(TFINFO));
+	grp->nring[i] = n;
+    }
+    grp->skew = tmax - tmin;
+    grp->sets += 1;
+    grp->skewsum += grp->skew;
+    if (grp->skew > grp->maxskew) {
+	grp->maxskew = grp->skew;
+    }
+    if ((grp->ev == NULL) && (grp->tid != NULL)) {
+	event = (TGEVT *) ckalloc(sizeof(TGEVT));
+	event->hdr.proc = GroupReady0;
+	event->hdr.nextPtr = NULL;
+	event->grp = grp;
+	grp->ev = event;
+	if (tip609) {
+	    /* TCL_QUEUE_TAIL_ALERT_IF_EMPTY */
+	    Tcl_ThreadQueueEvent(grp->tid, &event->hdr, TCL_QUEUE_TAIL | 4);
+	} else {
+	    Tcl_ThreadQueueEvent(grp->tid, &event->hdr, TCL_QUEUE_TAIL);
+	    Tcl_ThreadAlert(grp->tid);
+	}
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * GroupReady0 --
+ *
+ *	Event callback reporting a matched set: the frames of the
+ *	set become the last captured frames of the members, thus
+ *	"uvc image" etc. retrieve them, and the group callback is
+ *	invoked with the group id and the skew in microseconds.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+GroupReady0(Tcl_Event *evPtr, int flags)
+{
+    TGEVT *gevPtr = (TGEVT *) evPtr;
+    TGRP *grp;
+    Tcl_Interp *interp;
+    Tcl_Obj *cmdObj;
+    uvc_frame_t *old[GRP_MAXDEVS], *oldj[GRP_MAXDEVS];
+    int i, n, skew, ret;
+
+    Tcl_MutexLock(&uvcMutex);
+    grp = gevPtr->grp;
+    if (grp == NULL) {
+	Tcl_MutexUnlock(&uvcMutex);
+	return 1;
+    }
+    grp->ev = NULL;
+    n = grp->ndevs;
+    for (i = 0; i < n; i++) {
+	old[i] = oldj[i] = NULL;
+	if (grp->set[i] != NULL) {
+	    old[i] = grp->devs[i]->frame;
+	    oldj[i] = grp->devs[i]->jframe;
+	    grp->devs[i]->frame = grp->set[i];
+	    grp->devs[i]->jframe = NULL;
+	    grp->devs[i]->finfo = grp->sinfo[i];
+	    grp->set[i] = NULL;
+	}
+    }
+    skew = grp->skew;
+    Tcl_MutexUnlock(&uvcMutex);
+    for (i = 0; i < n; i++) {
+	if (old[i] != NULL) {
+	    uvc_free_frame(old[i]);
+	}
+	if (oldj[i] != NULL) {
+	    uvc_free_frame(oldj[i]);
+	}
+	RecordLastFrame(grp->devs[i]);
+    }
+    if (grp->cmdObj == NULL) {
+	return 1;
+    }
+    interp = grp->interp;
+    cmdObj = Tcl_DuplicateObj(grp->cmdObj);
+    Tcl_IncrRefCount(cmdObj);
+    Tcl_ListObjAppendElement(NULL, cmdObj, Tcl_NewStringObj(grp->grpId, -1));
+    Tcl_ListObjAppendElement(NULL, cmdObj, Tcl_NewIntObj(skew));
+    Tcl_Preserve((ClientData) interp);
+    ret = Tcl_EvalObjEx(interp, cmdObj, TCL_EVAL_GLOBAL);
+    Tcl_DecrRefCount(cmdObj);
+    if (ret != TCL_OK) {
+	Tcl_AddErrorInfo(interp, "\n    (uvc group handler)");
+	Tcl_BackgroundException(interp, ret);
+    }
+    Tcl_Release((ClientData) interp);
+    return 1;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * GroupDelete --
+ *
+ *	Dissolve a capture group. The members report their frames
+ *	individually again, an event in flight is invalidated.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+GroupDelete(TGRP *grp)
+{
+    int i, k;
+
+    Tcl_MutexLock(&uvcMutex);
+    for (i = 0; i < grp->ndevs; i++) {
+	grp->devs[i]->grp = NULL;
+	for (k = 0; k < grp->nring[i]; k++) {
+	    uvc_free_frame(grp->ring[i][k]);
+	}
+	if (grp->set[i] != NULL) {
+	    uvc_free_frame(grp->set[i]);
+	}
+    }
+    if (grp->ev != NULL) {
+	grp->ev->grp = NULL;
+    }
+    Tcl_MutexUnlock(&uvcMutex);
+    if (grp->hPtr != NULL) {
+	Tcl_DeleteHashEntry(grp->hPtr);
+    }
+    if (grp->cmdObj != NULL) {
+	Tcl_DecrRefCount(grp->cmdObj);
+    }
+    ckfree((char *) grp);
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * GroupCmd --
+ *
+ *	Implements the "uvc group" subcommands create, delete,
+ *	names, and stats.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+GroupCmd(TUVCI *tuvci, Tcl_Interp *interp, int objc, Tcl_Obj * const objv[])
+{
+    static const char *grpNames[] = {
+	"create", "delete", "names", "stats", NULL
+    };
+    enum grpCode {
+	GRP_create, GRP_delete, GRP_names, GRP_stats
+    };
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    TGRP *grp;
+    TUVC *tuvc;
+    Tcl_Obj *list, *sub;
+    Tcl_Size len = 0;
+    int i, k, command, isNew;
+
+    if (objc < 3) {
+	Tcl_WrongNumArgs(interp, 2, objv, "option ...");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[2], grpNames, "option", 0,
+			    &command) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    switch ((enum grpCode) command) {
+    case GRP_create: {
+	TUVC *devs[GRP_MAXDEVS];
+	Tcl_Obj *cmdObj = NULL;
+	int ndevs = 0, tolerance = -1, fps = 0;
+	const char *p;
+
+	for (i = 3; i < objc; i++) {
+	    p = Tcl_GetString(objv[i]);
+	    if (strcmp(p, "-tolerance") == 0) {
+		if (++i >= objc) {
+		    Tcl_SetResult(interp, "-tolerance option needs a value",
+				  TCL_STATIC);
+		    return TCL_ERROR;
+		}
+		if (Tcl_GetIntFromObj(interp, objv[i], &tolerance) != TCL_OK) {
+		    return TCL_ERROR;
+		}
+		if (tolerance < 0) {
+		    Tcl_SetResult(interp, "-tolerance value out of range",
+				  TCL_STATIC);
+		    return TCL_ERROR;
+		}
+		continue;
+	    } else if (strcmp(p, "-callback") == 0) {
+		if (++i >= objc) {
+		    Tcl_SetResult(interp, "-callback option needs a value",
+				  TCL_STATIC);
+		    return TCL_ERROR;
+		}
+		cmdObj = objv[i];
+		continue;
+	    }
+	    hPtr = Tcl_FindHashEntry(&tuvci->tuvcc, p);
+	    if (hPtr == NULL) {
+		Tcl_SetObjResult(interp,
+		    Tcl_ObjPrintf("device \"%s\" not found", p));
+		return TCL_ERROR;
+	    }
+	    tuvc = (TUVC *) Tcl_GetHashValue(hPtr);
+	    if (tuvc->grp != NULL) {
+		Tcl_SetObjResult(interp,
+		    Tcl_ObjPrintf("device \"%s\" is already in a group", p));
+		return TCL_ERROR;
+	    }
+	    for (k = 0; k < ndevs; k++) {
+		if (devs[k] == tuvc) {
+		    Tcl_SetObjResult(interp,
+			Tcl_ObjPrintf("device \"%s\" given twice", p));
+		    return TCL_ERROR;
+		}
+	    }
+	    if (ndevs >= GRP_MAXDEVS) {
+		Tcl_SetResult(interp, "too many devices", TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    devs[ndevs++] = tuvc;
+	    if ((fps == 0) || ((tuvc->fps > 0) && (tuvc->fps < fps))) {
+		fps = tuvc->fps;
+	    }
+	}
+	if (ndevs < 2) {
+	    Tcl_SetResult(interp, "need at least two devices", TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	if ((cmdObj != NULL) &&
+	    (Tcl_ListObjLength(interp, cmdObj, &len) != TCL_OK)) {
+	    return TCL_ERROR;
+	}
+	if (tolerance < 0) {
+	    /* Half the frame interval of the slowest member. */
+	    tolerance = (fps > 0) ? (500000 / fps) : 16000;
+	}
+	grp = (TGRP *) ckalloc(sizeof(TGRP));
+	memset(grp, 0, sizeof(TGRP));
+	grp->interp = interp;
+	grp->tid = Tcl_GetCurrentThread();
+	grp->tolerance = tolerance;
+	if ((cmdObj != NULL) && (len > 0)) {
+	    grp->cmdObj = Tcl_DuplicateObj(cmdObj);
+	    Tcl_IncrRefCount(grp->cmdObj);
+	}
+	sprintf(grp->grpId, "group%d", tuvci->grpCount++);
+	grp->hPtr = Tcl_CreateHashEntry(&tuvci->groups, grp->grpId, &isNew);
+	Tcl_SetHashValue(grp->hPtr, (ClientData) grp);
+	grp->ndevs = ndevs;
+	Tcl_MutexLock(&uvcMutex);
+	for (i = 0; i < ndevs; i++) {
+	    grp->devs[i] = devs[i];
+	    devs[i]->grpIdx = i;
+	    devs[i]->grp = grp;
+	}
+	Tcl_MutexUnlock(&uvcMutex);
+	Tcl_SetObjResult(interp, Tcl_NewStringObj(grp->grpId, -1));
+	break;
+    }
+    case GRP_delete:
+    case GRP_stats:
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 3, objv, "grpid");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&tuvci->groups, Tcl_GetString(objv[3]));
+	if (hPtr == NULL) {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("group \"%s\" not found",
+			      Tcl_GetString(objv[3])));
+	    return TCL_ERROR;
+	}
+	grp = (TGRP *) Tcl_GetHashValue(hPtr);
+	if (command == GRP_delete) {
+	    GroupDelete(grp);
+	    break;
+	}
+	list = Tcl_NewListObj(0, NULL);
+	sub = Tcl_NewListObj(0, NULL);
+	for (i = 0; i < grp->ndevs; i++) {
+	    Tcl_ListObjAppendElement(NULL, sub,
+		Tcl_NewStringObj(grp->devs[i]->devId, -1));
+	}
+	Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("devices", -1));
+	Tcl_ListObjAppendElement(NULL, list, sub);
+	Tcl_ListObjAppendElement(NULL, list,
+	    Tcl_NewStringObj("tolerance", -1));
+	Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(grp->tolerance));
+	Tcl_MutexLock(&uvcMutex);
+	Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("sets", -1));
+	Tcl_ListObjAppendElement(NULL, list, Tcl_NewWideIntObj(grp->sets));
+	Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("overrun", -1));
+	Tcl_ListObjAppendElement(NULL, list, Tcl_NewWideIntObj(grp->overrun));
+	Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("skew", -1));
+	Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(grp->skew));
+	Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("avgskew", -1));
+	Tcl_ListObjAppendElement(NULL, list,
+	    Tcl_NewDoubleObj((grp->sets > 0) ?
+			     (grp->skewsum / grp->sets) : 0.0));
+	Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("maxskew", -1));
+	Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(grp->maxskew));
+	sub = Tcl_NewListObj(0, NULL);
+	for (i = 0; i < grp->ndevs; i++) {
+	    Tcl_ListObjAppendElement(NULL, sub,
+		Tcl_NewWideIntObj(grp->unmatched[i]));
+	}
+	Tcl_MutexUnlock(&uvcMutex);
+	Tcl_ListObjAppendElement(NULL, list,
+	    Tcl_NewStringObj("unmatched", -1));
+	Tcl_ListObjAppendElement(NULL, list, sub);
+	Tcl_SetObjResult(interp, list);
+	break;
+    case GRP_names:
+	if (objc != 3) {
+	    Tcl_WrongNumArgs(interp, 3, objv, NULL);
+	    return TCL_ERROR;
+	}
+	list = Tcl_NewListObj(0, NULL);
+	hPtr = Tcl_FirstHashEntry(&tuvci->groups, &search);
+	while (hPtr != NULL) {
+	    Tcl_ListObjAppendElement(NULL, list,
+		Tcl_NewStringObj(Tcl_GetHashKey(&tuvci->groups, hPtr), -1));
+	    hPtr = Tcl_NextHashEntry(&search);
+	}
+	Tcl_SetObjResult(interp, list);
+	break;
+    }
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * StopCapture --
+ *
+ *	Stop capture if running. UVC streaming is turned off.
+ *	A pending idle call to FrameReady is cancelled, too.
+ *	The thread id to which further events would be queued
+ *	has to be cleared, events in flight are invalidated.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+StopCapture(TUVC *tuvc)
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    int i;
+
+    if (tuvc->running > 0) {
+	/* Keep USB counters, they vanish with the stream. */
+	uvc_get_stream_stats(tuvc->devh, &tuvc->usb);
+	uvc_stop_streaming(tuvc->devh);
+	tuvc->tid = NULL;
+	Tcl_CancelIdleCall(FrameReady, (ClientData) tuvc);
+	tuvc->running = 0;
+	if (tuvc->rstate == REC_RECPRI) {
+	    tuvc->rstate = REC_PAUSEPRI;
+	} else if (tuvc->rstate == REC_RECORD) {
+	    tuvc->rstate = REC_PAUSE;
+	}
+    }
+    Tcl_MutexLock(&uvcMutex);
+    hPtr = Tcl_FirstHashEntry(&tuvc->evts, &search);
+    while (hPtr != NULL) {
+	TUEVT *event = (TUEVT *) Tcl_GetHashKey(&tuvc->evts, hPtr);
+
+	event->tuvc = NULL;
+	event->hPtr = NULL;
+	Tcl_DeleteHashEntry(hPtr);
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+    /* Rotation requests in flight are gone, too. */
+    for (i = 0; i < tuvc->nsinks; i++) {
+	tuvc->sinks[i]->rot.pending = 0;
+    }
+    tuvc->srv.pending = 0;
+    Tcl_MutexUnlock(&uvcMutex);
+    Tcl_MutexLock(&tuvc->md.mutex);
+    tuvc->md.pending = tuvc->md.motion = 0;
+    Tcl_MutexUnlock(&tuvc->md.mutex);
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * StartCapture --
+ *
+ *	Setup image acquisition:
+ *	  - set capture format and size
+ *	  - estabilsh async handler for FrameReady callback
+ *	  - start UVC streaming
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+StartCapture(TUVC *tuvc)
+{
+    Tcl_Interp *interp = tuvc->interp;
+    uvc_stream_ctrl_t ctrl;
+    uvc_error_t uret;
+    int i;
+    static const struct {
+	enum uvc_frame_format fmt;
+	int iscomp;
+    } tryfmts[] = {
+#ifdef LIBUVC_HAVE_JPEG
+	{ UVC_FRAME_FORMAT_MJPEG, 1 },
+#endif
+	{ UVC_FRAME_FORMAT_YUYV, 0 },
+	{ UVC_FRAME_FORMAT_UYVY, 0 },
+	{ UVC_FRAME_FORMAT_GRAY16, 0 },
+	{ UVC_FRAME_FORMAT_GRAY8, 0 },
+	{ UVC_FRAME_FORMAT_RGB, 0 }
+    };
+
+    if (tuvc->running > 0) {
+	return TCL_OK;
+    }
+
+    /* set format/size */
+    uret = UVC_ERROR_INVALID_MODE;
+    for (i = 0;  i < sizeof(tryfmts) / sizeof(tryfmts[0]); i++) {
+	if (!tuvc->iscomp && tryfmts[i].iscomp) {
+	    continue;
+	}
+	uret = uvc_get_stream_ctrl_format_size(tuvc->devh, &ctrl,
+					       tryfmts[i].fmt,
+					       tuvc->width, tuvc->height,
+					       tuvc->fps);
+	if (uret == UVC_SUCCESS) {
+	    break;
+	}
+	i++;
+    }
+    if (uret < 0) {
+	Tcl_SetObjResult(interp,
+			 Tcl_ObjPrintf("error setting format: %s",
+				       uvc_strerror(uret)));
+	return TCL_ERROR;
+    }
+
+    /* start capture */
+    tuvc->running = 1;
+    tuvc->counters[0] = tuvc->counters[1] = tuvc->counters[2] = 0;
+    tuvc->lastseq = -1;		/* libuvc restarts sequence numbers */
+    memset(tuvc->pstats, 0, sizeof(tuvc->pstats));
+    memset(&tuvc->conceal, 0, sizeof(tuvc->conceal));
+    if (tuvc->lastgood != NULL) {
+	uvc_free_frame(tuvc->lastgood);
+	tuvc->lastgood = NULL;
+    }
+    memset(&tuvc->usb, 0, sizeof(tuvc->usb));
+    tuvc->tid = Tcl_GetCurrentThread();
+    tuvc->numev = 0;
+    uret = uvc_start_streaming(tuvc->devh, &ctrl, FrameCallback, tuvc, 0);
+    if (uret < 0) {
+	tuvc->running = 0;
+	tuvc->tid = NULL;
+	Tcl_SetObjResult(interp,
+			 Tcl_ObjPrintf("error starting streaming: %s",
+				       uvc_strerror(uret)));
+	return TCL_ERROR;
+    }
+    if (tuvc->rstate == REC_PAUSEPRI) {
+	SinkResetTime(tuvc);
+	tuvc->rstate = REC_RECPRI;
+    } else if (tuvc->rstate == REC_PAUSE) {
+	SinkResetTime(tuvc);
+	tuvc->rstate = REC_RECORD;
+    }
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * FrameToRGB --
+ *
+ *	Convert frame to RGB, or GRAY16 to GRAY8, for display.
+ *	Returns newly allocated frame or NULL when the format can't
+ *	be converted.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static uvc_frame_t *
+FrameToRGB(TUVC *tuvc, uvc_frame_t *frame)
+{
+    uvc_frame_t *newFrame;
+    uvc_error_t uret;
+    int frameSize;
+    Tcl_WideInt t0 = MonoTime();
+
+    switch (frame->frame_format) {
+    case UVC_FRAME_FORMAT_YUYV:
+    case UVC_FRAME_FORMAT_UYVY:
+    case UVC_FRAME_FORMAT_MJPEG:
+	frameSize = frame->width * frame->height * 3;
+	break;
+    case UVC_FRAME_FORMAT_GRAY16:
+	frameSize = frame->width * frame->height;
+	break;
+    default:
+	return NULL;
+    }
+    newFrame = uvc_allocate_frame(frameSize);
+    if (newFrame == NULL) {
+	return NULL;
+    }
+    switch (frame->frame_format) {
+    case UVC_FRAME_FORMAT_YUYV:
+	uret = uvc_yuyv2rgb_ex(frame, newFrame, tuvc->cm);
+	break;
+    case UVC_FRAME_FORMAT_UYVY:
+	uret = uvc_uyvy2rgb_ex(frame, newFrame, tuvc->cm);
+	break;
+#ifdef LIBUVC_HAVE_JPEG
+    case UVC_FRAME_FORMAT_MJPEG:
+	uret = uvc_mjpeg2rgb(frame, newFrame);
+	break;
+#endif
+    case UVC_FRAME_FORMAT_GRAY16:
+	uret = uvc_gray16to8(frame, newFrame, tuvc->greyshift);
+	break;
+    default:
+	uret = UVC_ERROR_NOT_SUPPORTED;
+	break;
+    }
+    if (uret) {
+	uvc_free_frame(newFrame);
+	return NULL;
+    }
+    HistAdd(&StatsShard(tuvc)->convert, MonoTime() - t0);
+    return newFrame;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * MaskBlend --
+ *
+ *	Blend "len" bytes as dst = (a & ~m) | (b & m) where the mask
+ *	pattern "m" of 24 bytes repeats, i.e. holds 8 RGB or 6 RGBA
+ *	pixels. Working on fixed size chunks lets the compiler use
+ *	vector instructions. The "dst" may be the same as "a".
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+MaskBlend(unsigned char *dst, const unsigned char *a, const unsigned char *b,
+	  Tcl_Size len, const unsigned char m[24])
+{
+    Tcl_Size i;
+    int k;
+
+    for (i = 0; i + 24 <= len; i += 24) {
+	for (k = 0; k < 24; k++) {
+	    dst[i + k] = (a[i + k] & ~m[k]) | (b[i + k] & m[k]);
+	}
+    }
+    for (k = 0; i < len; i++, k++) {
+	dst[i] = (a[i] & ~m[k]) | (b[i] & m[k]);
+    }
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * GetImage --
+ *
+ *	Retrieve last captured frame as photo image or byte array.
+ *	When "varName" is given, the variable is set to the meta
+ *	data of the frame, see FrameMeta.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+GetImage(TUVCI *tuvci, TUVC *tuvc, Tcl_Obj *arg, Tcl_Obj *varName)
+{
+    Tcl_Interp *interp = tuvc->interp;
+    uvc_frame_t *frame;
+    Tk_PhotoHandle photo = NULL;
+    int result = TCL_OK, done = 0;
+    Tcl_Obj *meta = NULL;
+    TFINFO info;
+    Tcl_WideInt t0;
+    char *name;
+
+    if (arg != NULL) {
+	if (CheckForTk(tuvci, tuvc->interp) != TCL_OK) {
+	    return TCL_ERROR;
+	}
+	if (Tk_MainWindow(interp) == NULL) {
+	    Tcl_SetResult(interp, "application has been destroyed",
+			  TCL_STATIC);
+	    return TCL_ERROR;
+	}
+	name = Tcl_GetString(arg);
+	photo = Tk_FindPhoto(interp, name);
+	if (photo == NULL) {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("can't use \"%s\": not a photo image", name));
+	    return TCL_ERROR;
+	}
+    }
+
+    /* Temporarily take out last frame. */
+    Tcl_MutexLock(&uvcMutex);
+    frame = tuvc->frame;
+    tuvc->frame = NULL;
+    info = tuvc->finfo;
+    Tcl_MutexUnlock(&uvcMutex);
+    if (frame == NULL) {
+	/* no image available */
+noImage:
+	if (photo != NULL) {
+	    Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+	} else {
+	    Tcl_SetResult(interp, "no image available", TCL_STATIC);
+	    result = TCL_ERROR;
+	}
+	goto done;
+    }
+    if ((photo == NULL) && (frame->frame_format == UVC_FRAME_FORMAT_GRAY16)) {
+	goto doByteArray;
+    }
+    if ((frame->frame_format != UVC_FRAME_FORMAT_RGB) &&
+	(frame->frame_format != UVC_FRAME_FORMAT_GRAY8)) {
+	uvc_frame_t *newFrame;
+
+	t0 = MonoTime();
+	newFrame = FrameToRGB(tuvc, frame);
+
+	if (newFrame == NULL) {
+	    goto noImage;
+	}
+	uvc_free_frame(frame);
+	frame = newFrame;
+	info.converted = MonoTime();
+	if (tuvc->trace) {
+	    TraceEvent(tuvc, "GetImage convert", t0, info.converted,
+		       frame->sequence, 0);
+	}
+    }
+    if (photo != NULL) {
+	Tk_PhotoImageBlock block;
+	int rot = tuvc->rotate;
+	int width = frame->width;
+	int height = frame->height;
+
+	if (frame->frame_format == UVC_FRAME_FORMAT_GRAY8) {
+	    block.pixelSize = 1;
+	    block.offset[0] = 0;
+	    block.offset[1] = 0;
+	    block.offset[2] = 0;
+	    block.offset[3] = 1;
+	} else {
+	    block.pixelSize = 3;
+	    block.offset[0] = 0;
+	    block.offset[1] = 1;
+	    block.offset[2] = 2;
+	    block.offset[3] = 4;
+	}
+	block.width = width;
+	block.height = height;
+	block.pitch = frame->step;
+	block.pixelPtr = frame->data;
+
+	if ((tuvc->mirror & 3) == 3) {
+	    rot = (rot + 180) % 360;
+	}
+	switch (rot) {
+	case 270:	/* = 90 CW */
+	    block.pitch = block.pixelSize;
+	    block.pixelPtr += width * block.pixelSize * (height - 1);
+	    block.pixelSize *= -width;
+	    block.offset[3] = block.pixelSize + 1;	/* no alpha */
+	    block.width = height;
+	    block.height = width;
+	    break;
+	case 180:	/* = 180 CW */
+	    block.pitch = -block.pitch;
+	    block.pixelPtr += (width * height - 1) * block.pixelSize;
+	    block.pixelSize = -block.pixelSize;
+	    block.offset[3] = block.pixelSize + 1;	/* no alpha */
+	    break;
+	case 90:	/* = 270 CW */
+	    block.pitch = -block.pixelSize;
+	    block.pixelPtr += (width - 1) * block.pixelSize;
+	    block.pixelSize *= width;
+	    block.offset[3] = block.pixelSize + 1;	/* no alpha */
+	    block.width = height;
+	    block.height = width;
+	    break;
+	}
+	if ((tuvc->mirror & 3) == 2) {
+	    /* mirror in X */
+	    block.pixelPtr += (block.width - 1) * block.pixelSize;
+	    block.pixelSize = -block.pixelSize;
+	    block.offset[3] = block.pixelSize + 1;      /* no alpha */
+	}
+	if ((tuvc->mirror & 3) == 1) {
+	    /* mirror in Y */
+	    block.pixelPtr += block.pitch * (block.height - 1);
+	    block.pitch = -block.pitch;
+	}
+
+	t0 = tuvc->trace ? MonoTime() : 0;
+	if (Tk_PhotoExpand(interp, photo, block.width, block.height)
+	    != TCL_OK) {
+	    result = TCL_ERROR;
+	    goto done;
+	}
+	if (Tk_PhotoPutBlock(interp, photo, &block, 0, 0,
+			     block.width, block.height,
+			     TK_PHOTO_COMPOSITE_SET) != TCL_OK) {
+	    result = TCL_ERROR;
+	} else {
+	    Tcl_SetObjResult(interp, Tcl_NewIntObj(1));
+	    done = 1;
+	}
+	if (t0 && tuvc->trace) {
+	    TraceEvent(tuvc, "Tk_PhotoPutBlock", t0, 0, frame->sequence, 0);
+	}
+    }
+doByteArray:
+    if (photo == NULL) {
+	unsigned char *rawPtr;
+	Tcl_Size rawSize;
+	Tcl_Obj *list[4];
+
+	list[0] = Tcl_NewIntObj(frame->width);
+	list[1] = Tcl_NewIntObj(frame->height);
+	if (frame->frame_format == UVC_FRAME_FORMAT_GRAY16) {
+	    rawSize = frame->width * frame->height * 2;
+	    list[2] = Tcl_NewIntObj(2);
+	} else if (frame->frame_format == UVC_FRAME_FORMAT_GRAY8) {
+	    rawSize = frame->width * frame->height;
+	    list[2] = Tcl_NewIntObj(1);
+	} else {
+	    rawSize = frame->width * frame->height * 3;
+	    list[2] = Tcl_NewIntObj(3);
+	}
+	rawPtr = frame->data;
+	list[3] = Tcl_NewByteArrayObj(rawPtr, rawSize);
+	Tcl_SetObjResult(interp, Tcl_NewListObj(4, list));
+	done = 1;
+    }
+    if (done) {
+	if (varName != NULL) {
+	    meta = FrameMeta(tuvc, frame, &info);
+	}
+	tuvc->lastseq = frame->sequence;
+    }
+done:
+    Tcl_MutexLock(&uvcMutex);
+    if ((frame != NULL) && (tuvc->frame == NULL)) {
+	/* Put back last frame */
+	tuvc->frame = frame;
+	frame = NULL;
+    }
+    if (done) {
+	tuvc->counters[1] += 1;
+    }
+    Tcl_MutexUnlock(&uvcMutex);
+    if (frame != NULL) {
+	uvc_free_frame(frame);
+    }
+    if ((meta != NULL) &&
+	(Tcl_ObjSetVar2(interp, varName, NULL, meta,
+			TCL_LEAVE_ERR_MSG) == NULL)) {
+	result = TCL_ERROR;
+    }
+    return result;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * StereoImage --
+ *
+ *	Compose the most recent frames of two devices into a photo
+ *	image: as anaglyph where the mask selects the bits of the
+ *	right image per colour channel (like "uvc mcopy"), or side
+ *	by side, or top and bottom. The frames are paired by capture
+ *	time, optionally rejecting pairs further apart than -maxskew
+ *	milliseconds. The composite is built in one pass into a
+ *	buffer and written to the photo once. Returns 1 when the
+ *	photo was updated, 0 otherwise.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+StereoImage(TUVCI *tuvci, Tcl_Interp *interp, int objc,
+	    Tcl_Obj * const objv[])
+{
+    static const char *modes[] = {
+	"anaglyph", "sbs", "tb", NULL
+    };
+    enum { ST_ANAGLYPH, ST_SBS, ST_TB };
+    TUVC *tuvc[2];
+    uvc_frame_t *frame[2] = { NULL, NULL };
+    Tcl_HashEntry *hPtr;
+    Tk_PhotoHandle photo;
+    Tk_PhotoImageBlock block;
+    unsigned char *buf = NULL, m[24];
+    int i, k, x, y, mode = ST_ANAGLYPH, mask = 0x00FFFF, width, height;
+    int psize, result = TCL_OK, done = 0;
+    double maxskew = 0, skew;
+    char *name;
+
+    if ((objc < 5) || ((objc - 5) % 2)) {
+	Tcl_WrongNumArgs(interp, 2, objv,
+			 "leftdev rightdev photo ?option value ...?");
+	return TCL_ERROR;
+    }
+    for (i = 0; i < 2; i++) {
+	hPtr = Tcl_FindHashEntry(&tuvci->tuvcc, Tcl_GetString(objv[2 + i]));
+	if (hPtr == NULL) {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("device \"%s\" not found",
+			      Tcl_GetString(objv[2 + i])));
+	    return TCL_ERROR;
+	}
+	tuvc[i] = (TUVC *) Tcl_GetHashValue(hPtr);
+    }
+    if (tuvc[0] == tuvc[1]) {
+	Tcl_SetResult(interp, "need two different devices", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    for (i = 5; i < objc; i += 2) {
+	name = Tcl_GetString(objv[i]);
+	if (strcmp(name, "-mode") == 0) {
+	    if (Tcl_GetIndexFromObj(interp, objv[i + 1], modes, "mode", 0,
+				    &mode) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	} else if (strcmp(name, "-mask") == 0) {
+	    if (Tcl_GetIntFromObj(interp, objv[i + 1], &mask) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	} else if (strcmp(name, "-maxskew") == 0) {
+	    if (Tcl_GetDoubleFromObj(interp, objv[i + 1], &maxskew)
+		!= TCL_OK) {
+		return TCL_ERROR;
+	    }
+	} else {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("bad option \"%s\": must be -mask, -maxskew, "
+			      "or -mode", name));
+	    return TCL_ERROR;
+	}
+    }
+    if (CheckForTk(tuvci, interp) != TCL_OK) {
+	return TCL_ERROR;
+    }
+    if (Tk_MainWindow(interp) == NULL) {
+	Tcl_SetResult(interp, "application has been destroyed", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    name = Tcl_GetString(objv[4]);
+    photo = Tk_FindPhoto(interp, name);
+    if (photo == NULL) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("can't use \"%s\": not a photo image", name));
+	return TCL_ERROR;
+    }
+
+    /* Temporarily take out last frames. */
+    Tcl_MutexLock(&uvcMutex);
+    for (i = 0; i < 2; i++) {
+	frame[i] = tuvc[i]->frame;
+	tuvc[i]->frame = NULL;
+    }
+    Tcl_MutexUnlock(&uvcMutex);
+    if ((frame[0] == NULL) || (frame[1] == NULL)) {
+	goto done;
+    }
+    skew = (frame[0]->capture_time.tv_sec -
+	    frame[1]->capture_time.tv_sec) * 1000.0 +
+	(frame[0]->capture_time.tv_usec -
+	 frame[1]->capture_time.tv_usec) / 1000.0;
+    if ((maxskew > 0) && ((skew > maxskew) || (-skew > maxskew))) {
+	goto done;
+    }
+    for (i = 0; i < 2; i++) {
+	if ((frame[i]->frame_format != UVC_FRAME_FORMAT_RGB) &&
+	    (frame[i]->frame_format != UVC_FRAME_FORMAT_GRAY8)) {
+	    uvc_frame_t *newFrame = FrameToRGB(tuvc[i], frame[i]);
+
+	    if (newFrame == NULL) {
+		goto done;
+	    }
+	    uvc_free_frame(frame[i]);
+	    frame[i] = newFrame;
+	}
+    }
+    width = frame[0]->width;
+    height = frame[0]->height;
+    if ((frame[1]->width != width) || (frame[1]->height != height) ||
+	(frame[0]->frame_format != frame[1]->frame_format)) {
+	Tcl_SetResult(interp, "incompatible frames", TCL_STATIC);
+	result = TCL_ERROR;
+	goto done;
+    }
+    psize = (frame[0]->frame_format == UVC_FRAME_FORMAT_GRAY8) ? 1 : 3;
+    if (mode == ST_ANAGLYPH) {
+	/* Output is always RGB. */
+	buf = (unsigned char *) attemptckalloc(width * height * 3);
+    } else {
+	buf = (unsigned char *) attemptckalloc(width * height * psize * 2);
+    }
+    if (buf == NULL) {
+	Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+	result = TCL_ERROR;
+	goto done;
+    }
+    block.pixelPtr = buf;
+    block.offset[0] = 0;
+    block.offset[1] = (psize == 1) ? 0 : 1;
+    block.offset[2] = (psize == 1) ? 0 : 2;
+    block.offset[3] = psize + 1;	/* no alpha */
+    block.pixelSize = psize;
+    block.width = width;
+    block.height = height;
+    block.pitch = width * psize;
+    if (mode == ST_ANAGLYPH) {
+	const unsigned char *l, *r;
+	unsigned char *d;
+
+	/* Mask pattern of 24 bytes = 8 pixels = 3 words. */
+	for (k = 0; k < 24; k++) {
+	    m[k] = mask >> (8 * (2 - k % 3));
+	}
+	block.pixelSize = 3;
+	block.offset[1] = 1;
+	block.offset[2] = 2;
+	block.offset[3] = 4;
+	block.pitch = width * 3;
+	for (y = 0; y < height; y++) {
+	    l = (const unsigned char *) frame[0]->data + y * frame[0]->step;
+	    r = (const unsigned char *) frame[1]->data + y * frame[1]->step;
+	    d = buf + y * block.pitch;
+	    if (psize == 1) {
+		for (x = 0; x < width; x++) {
+		    d[0] = (l[x] & ~m[0]) | (r[x] & m[0]);
+		    d[1] = (l[x] & ~m[1]) | (r[x] & m[1]);
+		    d[2] = (l[x] & ~m[2]) | (r[x] & m[2]);
+		    d += 3;
+		}
+		continue;
+	    }
+	    MaskBlend(d, l, r, width * 3, m);
+	}
+    } else {
+	int len = width * psize;
+
+	if (mode == ST_SBS) {
+	    block.width = width * 2;
+	    block.pitch = len * 2;
+	} else {
+	    block.height = height * 2;
+	}
+	for (i = 0; i < 2; i++) {
+	    for (y = 0; y < height; y++) {
+		unsigned char *d = buf + y * block.pitch;
+
+		if (mode == ST_SBS) {
+		    d += i * len;
+		} else {
+		    d += i * height * block.pitch;
+		}
+		memcpy(d, (unsigned char *) frame[i]->data +
+		       y * frame[i]->step, len);
+	    }
+	}
+    }
+    if (Tk_PhotoExpand(interp, photo, block.width, block.height)
+	!= TCL_OK) {
+	result = TCL_ERROR;
+	goto done;
+    }
+    if (Tk_PhotoPutBlock(interp, photo, &block, 0, 0,
+			 block.width, block.height,
+			 TK_PHOTO_COMPOSITE_SET) != TCL_OK) {
+	result = TCL_ERROR;
+	goto done;
+    }
+    for (i = 0; i < 2; i++) {
+	tuvc[i]->lastseq = frame[i]->sequence;
+    }
+    done = 1;
+done:
+    if (buf != NULL) {
+	ckfree((char *) buf);
+    }
+    Tcl_MutexLock(&uvcMutex);
+    for (i = 0; i < 2; i++) {
+	if ((frame[i] != NULL) && (tuvc[i]->frame == NULL)) {
+	    /* Put back last frame */
+	    tuvc[i]->frame = frame[i];
+	    frame[i] = NULL;
+	}
+	if (done) {
+	    tuvc[i]->counters[1] += 1;
+	}
+    }
+    Tcl_MutexUnlock(&uvcMutex);
+    for (i = 0; i < 2; i++) {
+	if (frame[i] != NULL) {
+	    uvc_free_frame(frame[i]);
+	}
+    }
+    if (result == TCL_OK) {
+	Tcl_SetObjResult(interp, Tcl_NewIntObj(done));
+    }
+    return result;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * GetJPEG --
+ *
+ *	Retrieve last captured frame as JPEG without decoding. MJPEG
+ *	frames are returned as delivered by the device, also when
+ *	converted to RGB by FrameCallback, which keeps the original
+ *	of intact frames next to the converted one. Others, and
+ *	damaged MJPEG frames, are encoded from the last captured
+ *	frame. Without file name the result is a byte array, else
+ *	the file is created and written by a background thread and
+ *	the result is the number of bytes.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+typedef struct {
+    int fd;			/* File to write. */
+    Tcl_Size size;		/* Number of bytes in data. */
+    unsigned char data[1];	/* JPEG data, allocated with struct. */
+} TJPGW;
+
+static int
+GetJPEG(TUVC *tuvc, Tcl_Obj *fileObj)
+{
+    Tcl_Interp *interp = tuvc->interp;
+    uvc_frame_t *frame, *jframe, *jpeg = NULL;
+    int result = TCL_OK, done = 0;
+
+    /* Temporarily take out last frame. */
+    Tcl_MutexLock(&uvcMutex);
+    frame = tuvc->frame;
+    jframe = tuvc->jframe;
+    tuvc->frame = NULL;
+    tuvc->jframe = NULL;
+    Tcl_MutexUnlock(&uvcMutex);
+    if (frame == NULL) {
+	Tcl_SetResult(interp, "no image available", TCL_STATIC);
+	result = TCL_ERROR;
+	goto done;
+    }
+    if (jframe != NULL) {
+	jpeg = jframe;
+    } else if (frame->frame_format == UVC_FRAME_FORMAT_MJPEG) {
+	jpeg = frame;
+    } else {
+#ifdef LIBUVC_HAVE_JPEG
+	jpeg = FrameToJPEG(tuvc, frame);
+#endif
+	if (jpeg == NULL) {
+	    Tcl_SetResult(interp, "cannot encode JPEG", TCL_STATIC);
+	    result = TCL_ERROR;
+	    goto done;
+	}
+    }
+    if (fileObj == NULL) {
+	Tcl_SetObjResult(interp,
+	    Tcl_NewByteArrayObj(jpeg->data, jpeg->data_bytes));
+    } else {
+	const char *native = Tcl_FSGetNativePath(fileObj);
+	Tcl_ThreadId tid;
+	TJPGW *w;
+	int fd = -1;
+
+	if (native != NULL) {
+	    fd = open(native, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	}
+	if (fd < 0) {
+	    Tcl_SetObjResult(interp,
+		Tcl_ObjPrintf("couldn't open \"%s\": %s",
+			      Tcl_GetString(fileObj), Tcl_PosixError(interp)));
+	    result = TCL_ERROR;
+	    goto done;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	w = (TJPGW *) attemptckalloc(sizeof(TJPGW) + jpeg->data_bytes);
+	if (w == NULL) {
+	    close(fd);
+	    Tcl_SetResult(interp, "out of memory", TCL_STATIC);
+	    result = TCL_ERROR;
+	    goto done;
+	}
+	w->fd = fd;
+	w->size = jpeg->data_bytes;
+	memcpy(w->data, jpeg->data, jpeg->data_bytes);
+	if (Tcl_CreateThread(&tid, JPEGWriter, (ClientData) w,
+			     TCL_THREAD_STACK_DEFAULT,
+			     TCL_THREAD_NOFLAGS) != TCL_OK) {
+	    /* Write it ourselves. */
+	    JPEGWriter((ClientData) w);
+	}
+	Tcl_SetObjResult(interp, Tcl_NewWideIntObj(jpeg->data_bytes));
+    }
+    tuvc->lastseq = frame->sequence;
+    done = 1;
+done:
+    if ((jpeg != NULL) && (jpeg != frame) && (jpeg != jframe)) {
+	uvc_free_frame(jpeg);
+    }
+    Tcl_MutexLock(&uvcMutex);
+    if ((frame != NULL) && (tuvc->frame == NULL)) {
+	/* Put back last frame */
+	tuvc->frame = frame;
+	tuvc->jframe = jframe;
+	frame = jframe = NULL;
+    }
+    if (done) {
+	tuvc->counters[1] += 1;
+    }
+    Tcl_MutexUnlock(&uvcMutex);
+    if (frame != NULL) {
+	uvc_free_frame(frame);
+    }
+    if (jframe != NULL) {
+	uvc_free_frame(jframe);
+    }
+    return result;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * FrameMeta, GetMeta --
+ *
+ *	FrameMeta returns meta data of a frame as key value list:
+ *	sequence number, device clock PTS and SCR, capture time on
+ *	the realtime and monotonic host clocks, the source of the
+ *	capture time (device clock model or payload arrival), host
+ *	times of FrameCallback() entry and of the end of conversion,
+ *	size as delivered and as converted, and the number of frames
+ *	not retrieved since the last retrieval by "uvc image" (also
+ *	with -jpeg) or "uvc stereo". GetMeta reports the
+ *	last captured frame without retrieving it.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+FrameMeta(TUVC *tuvc, uvc_frame_t *frame, const TFINFO *info)
+{
+    Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+    Tcl_WideInt dropped = 0;
+
+    if ((tuvc->lastseq >= 0) && (frame->sequence > tuvc->lastseq)) {
+	dropped = frame->sequence - tuvc->lastseq - 1;
+    }
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("sequence", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewWideIntObj(frame->sequence));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("pts", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewWideIntObj(frame->pts));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("scr", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewWideIntObj(frame->scr));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("time", -1));
+    Tcl_ListObjAppendElement(NULL, list,
+	Tcl_NewDoubleObj(frame->capture_time.tv_sec +
+			 frame->capture_time.tv_usec / 1000000.0));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("mono", -1));
+    Tcl_ListObjAppendElement(NULL, list,
+	Tcl_NewWideIntObj(frame->capture_mono / 1000));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("clock", -1));
+    Tcl_ListObjAppendElement(NULL, list,
+	Tcl_NewStringObj(frame->clock_model ? "device" : "arrival", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("callback", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewWideIntObj(info->entry));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("converted", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewWideIntObj(info->converted));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("width", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(frame->width));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("height", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(frame->height));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("inbytes", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewWideIntObj(info->inbytes));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("bytes", -1));
+    Tcl_ListObjAppendElement(NULL, list,
+	Tcl_NewWideIntObj(frame->data_bytes));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("dropped", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewWideIntObj(dropped));
+    return list;
+}
+
+static int
+GetMeta(TUVC *tuvc)
+{
+    Tcl_Interp *interp = tuvc->interp;
+    Tcl_Obj *list;
+
+    Tcl_MutexLock(&uvcMutex);
+    if (tuvc->frame == NULL) {
+	Tcl_MutexUnlock(&uvcMutex);
+	Tcl_SetResult(interp, "no image available", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    list = FrameMeta(tuvc, tuvc->frame, &tuvc->finfo);
+    Tcl_MutexUnlock(&uvcMutex);
+    Tcl_SetObjResult(interp, list);
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * GetStats --
+ *
+ *	Retrieve statistics of capture as key value list: the USB
+ *	transfer, payload, and corrupt frame counters of libuvc, the
+ *	counters of partially decoded MJPEG frames, and for conversion,
+ *	JPEG encoding, writing to recording sinks, and the delay of
+ *	frame events in the Tcl event queue a list of number of
+ *	samples, mean and maximum duration in microseconds, and the
+ *	histogram as pairs of bucket limit and count of non-empty
+ *	buckets. The shards of the pipeline statistics are read
+ *	without locking, thus may be a little behind.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+GetStats(TUVC *tuvc)
+{
+    static const struct {
+	const char *name;
+	size_t offset;
+    } hists[] = {
+	{ "convert", offsetof(TPSTATS, convert) },
+	{ "jpeg", offsetof(TPSTATS, jpeg) },
+	{ "write", offsetof(TPSTATS, write) },
+	{ "queue", offsetof(TPSTATS, queue) }
+    };
+    Tcl_Interp *interp = tuvc->interp;
+    Tcl_Obj *list, *sub, *buckets;
+    uvc_stream_stats_t usb;
+    THIST h, *hp;
+    int i, k, n;
+
+    if ((tuvc->running <= 0) ||
+	(uvc_get_stream_stats(tuvc->devh, &usb) != UVC_SUCCESS)) {
+	usb = tuvc->usb;
+    }
+    list = Tcl_NewListObj(0, NULL);
+    sub = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("transfers", -1));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewWideIntObj(usb.transfers));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("retried", -1));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewWideIntObj(usb.retried));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("badpackets", -1));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewWideIntObj(usb.bad_packets));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("errorbit", -1));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewWideIntObj(usb.error_bit));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("bogus", -1));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewWideIntObj(usb.bogus));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("fidnoeof", -1));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewWideIntObj(usb.fid_no_eof));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("empty", -1));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewWideIntObj(usb.empty));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("frames", -1));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewWideIntObj(usb.frames));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("bytes", -1));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewWideIntObj(usb.bytes));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("badsize", -1));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewWideIntObj(usb.bad_size));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("nosoi", -1));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewWideIntObj(usb.no_soi));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("nosof", -1));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewWideIntObj(usb.no_sof));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("noeoi", -1));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewWideIntObj(usb.no_eoi));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("badmarker", -1));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewWideIntObj(usb.bad_marker));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("usb", -1));
+    Tcl_ListObjAppendElement(NULL, list, sub);
+    sub = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("frames", -1));
+    Tcl_ListObjAppendElement(NULL, sub,
+	Tcl_NewWideIntObj(tuvc->conceal.frames));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("intervals", -1));
+    Tcl_ListObjAppendElement(NULL, sub,
+	Tcl_NewWideIntObj(tuvc->conceal.intervals));
+    Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("failed", -1));
+    Tcl_ListObjAppendElement(NULL, sub,
+	Tcl_NewWideIntObj(tuvc->conceal.failed));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("conceal", -1));
+    Tcl_ListObjAppendElement(NULL, list, sub);
+    for (i = 0; i < sizeof(hists) / sizeof(hists[0]); i++) {
+	memset(&h, 0, sizeof(h));
+	for (n = 0; n < PS_NSHARDS; n++) {
+	    hp = (THIST *) ((char *) &tuvc->pstats[n] + hists[i].offset);
+	    h.count += hp->count;
+	    h.sum += hp->sum;
+	    if (hp->max > h.max) {
+		h.max = hp->max;
+	    }
+	    for (k = 0; k < ST_NBUCKETS; k++) {
+		h.buckets[k] += hp->buckets[k];
+	    }
+	}
+	sub = Tcl_NewListObj(0, NULL);
+	Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("count", -1));
+	Tcl_ListObjAppendElement(NULL, sub, Tcl_NewWideIntObj(h.count));
+	Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("mean", -1));
+	Tcl_ListObjAppendElement(NULL, sub,
+	    Tcl_NewWideIntObj(h.count ? (h.sum / h.count) : 0));
+	Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("max", -1));
+	Tcl_ListObjAppendElement(NULL, sub, Tcl_NewWideIntObj(h.max));
+	buckets = Tcl_NewListObj(0, NULL);
+	for (k = 0; k < ST_NBUCKETS; k++) {
+	    if (h.buckets[k] == 0) {
+		continue;
+	    }
+	    if (k < ST_NBUCKETS - 1) {
+		Tcl_ListObjAppendElement(NULL, buckets,
+		    Tcl_NewWideIntObj((Tcl_WideInt) 1 << k));
+	    } else {
+		Tcl_ListObjAppendElement(NULL, buckets,
+		    Tcl_NewStringObj("inf", -1));
+	    }
+	    Tcl_ListObjAppendElement(NULL, buckets,
+		Tcl_NewWideIntObj(h.buckets[k]));
+	}
+	Tcl_ListObjAppendElement(NULL, sub, Tcl_NewStringObj("hist", -1));
+	Tcl_ListObjAppendElement(NULL, sub, buckets);
+	Tcl_ListObjAppendElement(NULL, list,
+	    Tcl_NewStringObj(hists[i].name, -1));
+	Tcl_ListObjAppendElement(NULL, list, sub);
+    }
+    Tcl_SetObjResult(interp, list);
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * PayloadLog, PayloadLogStop --
+ *
+ *	Start or stop logging the raw USB payloads of a device into
+ *	a file which can be fed back by Replay. Without file name the
+ *	current log file is returned, an empty file name stops it.
+ *	The log stays attached over restarts of capture.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static int
+PayloadLog(TUVC *tuvc, Tcl_Obj *fileObj)
+{
+    Tcl_Interp *interp = tuvc->interp;
+    uvc_payload_log_t *plog;
+    const char *native;
+
+    if (fileObj == NULL) {
+	if (tuvc->plogName != NULL) {
+	    Tcl_SetObjResult(interp, tuvc->plogName);
+	}
+	return TCL_OK;
+    }
+    PayloadLogStop(tuvc);
+    if (Tcl_GetCharLength(fileObj) == 0) {
+	return TCL_OK;
+    }
+    native = Tcl_FSGetNativePath(fileObj);
+    if ((native == NULL) ||
+	(uvc_payload_log_open(native, &plog) != UVC_SUCCESS)) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("couldn't open \"%s\": %s",
+			  Tcl_GetString(fileObj), Tcl_PosixError(interp)));
+	return TCL_ERROR;
+    }
+    uvc_set_payload_log(tuvc->devh, plog);
+    tuvc->plog = plog;
+    tuvc->plogName = fileObj;
+    Tcl_IncrRefCount(tuvc->plogName);
+    return TCL_OK;
+}
+
+static void
+PayloadLogStop(TUVC *tuvc)
+{
+    if (tuvc->plog == NULL) {
+	return;
+    }
+    uvc_set_payload_log(tuvc->devh, NULL);
+    uvc_payload_log_close(tuvc->plog);
+    tuvc->plog = NULL;
+    Tcl_DecrRefCount(tuvc->plogName);
+    tuvc->plogName = NULL;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * Replay --
+ *
+ *	Feed a payload log through the frame assembly of libuvc and
+ *	the frame processing of a device which is not capturing, as
+ *	fast as possible. Frames are handled like captured ones,
+ *	i.e. converted, recorded, and reported to the callback, which
+ *	sees the last frame only. Counters and statistics are reset
+ *	like on start of capture. Returns a key value list of the
+ *	number of frames and the elapsed time in microseconds.
+ *
+ *-------------------------------------------------------------------------
+ */
 
-	list[0] = Tcl_NewIntObj(frame->width);
-	list[1] = Tcl_NewIntObj(frame->height);
-	if (frame->frame_format == UVC_FRAME_FORMAT_GRAY16) {
-	    rawSize = frame->width * frame->height * 2;
-	    list[2] = Tcl_NewIntObj(2);
-	} else if (frame->frame_format == UVC_FRAME_FORMAT_GRAY8) {
-	    rawSize = frame->width * frame->height;
-	    list[2] = Tcl_NewIntObj(1);
-	} else {
-	    rawSize = frame->width * frame->height * 3;
-	    list[2] = Tcl_NewIntObj(3);
-	}
-	rawPtr = frame->data;
-	list[3] = Tcl_NewByteArrayObj(rawPtr, rawSize);
-	Tcl_SetObjResult(interp, Tcl_NewListObj(4, list));
-	done = 1;
+static int
+Replay(TUVC *tuvc, Tcl_Obj *fileObj)
+{
+    Tcl_Interp *interp = tuvc->interp;
+    const char *native;
+    uvc_error_t uret;
+    Tcl_WideInt t0;
+    Tcl_Obj *list;
+
+    if (tuvc->running > 0) {
+	Tcl_SetResult(interp, "device is capturing", TCL_STATIC);
+	return TCL_ERROR;
     }
-done:
-    Tcl_MutexLock(&uvcMutex);
-    if ((frame != NULL) && (tuvc->frame == NULL)) {
-	/* Put back last frame */
-	tuvc->frame = frame;
-	frame = NULL;
+    native = Tcl_FSGetNativePath(fileObj);
+    if (native == NULL) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("couldn't open \"%s\": %s",
+			  Tcl_GetString(fileObj), Tcl_PosixError(interp)));
+	return TCL_ERROR;
     }
-    if (done) {
-	tuvc->counters[1] += 1;
+    tuvc->counters[0] = tuvc->counters[1] = tuvc->counters[2] = 0;
+    tuvc->lastseq = -1;
+    memset(tuvc->pstats, 0, sizeof(tuvc->pstats));
+    memset(&tuvc->conceal, 0, sizeof(tuvc->conceal));
+    if (tuvc->lastgood != NULL) {
+	uvc_free_frame(tuvc->lastgood);
+	tuvc->lastgood = NULL;
+    }
+    /*
+     * FrameCallback() queues frame events to this thread, which
+     * are marked to be handled after the device is idle again.
+     */
+    tuvc->tid = Tcl_GetCurrentThread();
+    tuvc->replay = 1;
+    tuvc->numev = 0;
+    t0 = MonoTime();
+    uret = uvc_replay_payloads(native, FrameCallback, tuvc, &tuvc->usb);
+    t0 = MonoTime() - t0;
+    tuvc->replay = 0;
+    tuvc->tid = NULL;
+    if (uret == UVC_ERROR_IO) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("couldn't read \"%s\": %s",
+			  Tcl_GetString(fileObj), Tcl_PosixError(interp)));
+	return TCL_ERROR;
+    } else if (uret == UVC_ERROR_INVALID_PARAM) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("\"%s\" is not a payload log",
+			  Tcl_GetString(fileObj)));
+	return TCL_ERROR;
+    } else if (uret < 0) {
+	Tcl_SetObjResult(interp,
+	    Tcl_ObjPrintf("error replaying \"%s\": %s",
+			  Tcl_GetString(fileObj), uvc_strerror(uret)));
+	return TCL_ERROR;
     }
-    Tcl_MutexUnlock(&uvcMutex);
-    if (frame != NULL) {
-	uvc_free_frame(frame);
+    list = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("frames", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewWideIntObj(tuvc->usb.frames));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewStringObj("time", -1));
+    Tcl_ListObjAppendElement(NULL, list, Tcl_NewWideIntObj(t0));
+    Tcl_SetObjResult(interp, list);
+    return TCL_OK;
+}
+
+/*
+ *-------------------------------------------------------------------------
+ *
+ * JPEGWriter --
+ *
+ *	Thread writing a JPEG file for GetJPEG. Write errors can't
+ *	be reported and leave a truncated file.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static Tcl_ThreadCreateType
+JPEGWriter(ClientData clientData)
+{
+    TJPGW *w = (TJPGW *) clientData;
+    Tcl_Size off = 0;
+    ssize_t n;
+
+    while (off < w->size) {
+	n = write(w->fd, w->data + off, w->size - off);
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    break;
+	}
+	off += n;
     }
-    return result;
+    close(w->fd);
+    ckfree((char *) w);
+    TCL_THREAD_CREATE_RETURN;
 }
-
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -2608,6 +8689,7 @@ InitControls(TUVC *tuvc)
 			ufmt->height = fd->wHeight;
 			ufmt->bpp = k ? 24 : fm->bBitsPerPixel;
 			memcpy(&ufmt->fourcc, &fm->fourccFormat, 4);
+			ufmt->cm = uvc_format_colorimetry(fm);
 			memset(ufmt->fpsList, 0, sizeof(ufmt->fpsList));
 			Tcl_DStringInit(&ufmt->str);
 			Tcl_DStringAppendElement(&ufmt->str, "frame-size");
@@ -2674,10 +8756,44 @@ InitControls(TUVC *tuvc)
 	    tuvc->fps = ufmt0->fps;
 	    tuvc->usefmt = 0;
 	    tuvc->iscomp = ufmt0->iscomp;
+	    SelectColorimetry(tuvc);
 	}
     }
 }
 
+/*
+ *-------------------------------------------------------------------------
+ *
+ * SelectColorimetry --
+ *
+ *	Determine colorimetry for YUV to RGB conversions of the current
+ *	format, either the one requested by the user or the one reported
+ *	by the format's color matching descriptor. Done once on format
+ *	selection, the conversion kernels use precomputed tables.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+static void
+SelectColorimetry(TUVC *tuvc)
+{
+    Tcl_HashEntry *hPtr;
+    long index = tuvc->usefmt;
+
+    if (tuvc->colorimetry >= 0) {
+	tuvc->cm = tuvc->colorimetry;
+	return;
+    }
+    hPtr = Tcl_FindHashEntry(&tuvc->fmts, (ClientData) index);
+    if (hPtr != NULL) {
+	UFMT *ufmt = (UFMT *) Tcl_GetHashValue(hPtr);
+
+	tuvc->cm = ufmt->cm;
+    } else {
+	tuvc->cm = UVC_COLORIMETRY_BT601_FULL;
+    }
+}
+
 /*
  *-------------------------------------------------------------------------
  *
@@ -2936,10 +9052,24 @@ UvcObjCmdDeleted(ClientData clientData)
     Tcl_HashSearch search;
     TUVC *tuvc;
 
+    TraceStop(tuvci, NULL);
+    hPtr = Tcl_FirstHashEntry(&tuvci->groups, &search);
+    while (hPtr != NULL) {
+	GroupDelete((TGRP *) Tcl_GetHashValue(hPtr));
+	hPtr = Tcl_NextHashEntry(&search);
+    }
+    Tcl_DeleteHashTable(&tuvci->groups);
     hPtr = Tcl_FirstHashEntry(&tuvci->tuvcc, &search);
     while (hPtr != NULL) {
 	tuvc = (TUVC *) Tcl_GetHashValue(hPtr);
 	StopCapture(tuvc);
+	PayloadLogStop(tuvc);
+	if (tuvc->lastgood != NULL) {
+	    uvc_free_frame(tuvc->lastgood);
+	}
+	if (tuvc->jframe != NULL) {
+	    uvc_free_frame(tuvc->jframe);
+	}
 	uvc_close(tuvc->devh);
 	tuvc->devh = NULL;
 	uvc_unref_device(tuvc->dev);
@@ -2949,9 +9079,12 @@ UvcObjCmdDeleted(ClientData clientData)
 	Tcl_DStringFree(&tuvc->devName);
 	Tcl_DStringFree(&tuvc->cbCmd);
 	FinishRecording(tuvc, 1, 1);
+	MotionFree(tuvc);
+	ServeStop(tuvc);
+	TraceDetach(tuvc);
 	InitControls(tuvc);
 	Tcl_DeleteHashTable(&tuvc->evts);
-	ckfree((char *) tuvc);
+	Tcl_EventuallyFree((ClientData) tuvc, TCL_DYNAMIC);
 	hPtr = Tcl_NextHashEntry(&search);
     }
     Tcl_DeleteHashTable(&tuvci->tuvcc);
@@ -3009,24 +9142,30 @@ UvcObjCmd(ClientData clientData, Tcl_Interp *interp,
     uvc_error_t uret;
 
     static const char *cmdNames[] = {
-	"close", "convmode", "counters", "devices",
-	"format", "greyshift", "image", "info", "listen",
-	"listformats", "mbcopy", "mcopy", "mirror", "open",
-	"orientation", "parameters", "record", "start",
-	"state", "stop", "tophoto", NULL
+	"close", "colorimetry", "convmode", "counters", "devices",
+	"format", "greyshift", "group", "image", "info", "listen",
+	"listformats", "mbcopy", "mcopy", "mirror", "motion", "open",
+	"orientation", "parameters", "payloadlog", "record", "replay",
+	"serve", "start", "state", "stats", "stereo", "stop", "tophoto",
+	"trace", NULL
     };
     enum cmdCode {
-	CMD_close, CMD_convmode, CMD_counters, CMD_devices,
-	CMD_format, CMD_greyshift, CMD_image, CMD_info, CMD_listen,
-	CMD_listformats, CMD_mbcopy, CMD_mcopy, CMD_mirror, CMD_open,
-	CMD_orientation, CMD_parameters, CMD_record, CMD_start,
-	CMD_state, CMD_stop, CMD_tophoto
+	CMD_close, CMD_colorimetry, CMD_convmode, CMD_counters, CMD_devices,
+	CMD_format, CMD_greyshift, CMD_group, CMD_image, CMD_info,
+	CMD_listen,
+	CMD_listformats, CMD_mbcopy, CMD_mcopy, CMD_mirror, CMD_motion,
+	CMD_open,
+	CMD_orientation, CMD_parameters, CMD_payloadlog, CMD_record,
+	CMD_replay, CMD_serve, CMD_start,
+	CMD_state, CMD_stats, CMD_stereo, CMD_stop, CMD_tophoto, CMD_trace
     };
     static const char *recNames[] = {
-	"frame", "pause", "resume", "start", "state", "stop", NULL
+	"add", "frame", "pause", "queue", "remove", "resume", "sinks",
+	"start", "state", "stop", "trigger", NULL
     };
     enum recCode {
-	REC_frame, REC_pause, REC_resume, REC_start, REC_state, REC_stop
+	REC_add, REC_frame, REC_pause, REC_queue, REC_remove, REC_resume,
+	REC_sinks, REC_start, REC_state, REC_stop, REC_trigger
     };
 
     if (objc < 2) {
@@ -3049,7 +9188,17 @@ UvcObjCmd(ClientData clientData, Tcl_Interp *interp,
 	if (hPtr != NULL) {
 	    tuvc = (TUVC *) Tcl_GetHashValue(hPtr);
 	    Tcl_DeleteHashEntry(hPtr);
+	    if (tuvc->grp != NULL) {
+		GroupDelete(tuvc->grp);
+	    }
 	    StopCapture(tuvc);
+	    PayloadLogStop(tuvc);
+	    if (tuvc->lastgood != NULL) {
+		uvc_free_frame(tuvc->lastgood);
+	    }
+	    if (tuvc->jframe != NULL) {
+		uvc_free_frame(tuvc->jframe);
+	    }
 	    uvc_close(tuvc->devh);
 	    tuvc->devh = NULL;
 	    uvc_unref_device(tuvc->dev);
@@ -3059,9 +9208,13 @@ UvcObjCmd(ClientData clientData, Tcl_Interp *interp,
 	    Tcl_DStringFree(&tuvc->devName);
 	    Tcl_DStringFree(&tuvc->cbCmd);
 	    FinishRecording(tuvc, 1, 1);
+	    MotionFree(tuvc);
+	    ServeStop(tuvc);
+	    TraceDetach(tuvc);
 	    InitControls(tuvc);
 	    Tcl_DeleteHashTable(&tuvc->evts);
-	    ckfree((char *) tuvc);
+	    /* Kept while FrameReady() is active. */
+	    Tcl_EventuallyFree((ClientData) tuvc, TCL_DYNAMIC);
 	} else {
 devNotFound:
 	    Tcl_SetObjResult(interp,
@@ -3071,6 +9224,67 @@ devNotFound:
 	}
 	break;
 
+    case CMD_colorimetry: {
+	static const char *cmNames[] = {
+	    "auto", "bt601", "bt709", NULL
+	};
+	static const char *rangeNames[] = {
+	    "full", "limited", NULL
+	};
+	int cm, range = 1;
+
+	if ((objc < 3) || (objc > 5)) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "devid ?matrix ?range??");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&tuvci->tuvcc, Tcl_GetString(objv[2]));
+	if (hPtr == NULL) {
+	    goto devNotFound;
+	}
+	tuvc = (TUVC *) Tcl_GetHashValue(hPtr);
+	if (objc > 3) {
+	    if (Tcl_GetIndexFromObj(interp, objv[3], cmNames, "matrix", 0,
+				    &cm) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    if ((cm == 0) && (objc > 4)) {
+		Tcl_SetResult(interp, "range can't be given with auto",
+			      TCL_STATIC);
+		return TCL_ERROR;
+	    }
+	    if ((objc > 4) &&
+		(Tcl_GetIndexFromObj(interp, objv[4], rangeNames, "range", 0,
+				     &range) != TCL_OK)) {
+		return TCL_ERROR;
+	    }
+	    if (cm == 0) {
+		tuvc->colorimetry = -1;
+	    } else if (cm == 1) {
+		tuvc->colorimetry = range ? UVC_COLORIMETRY_BT601_LIMITED :
+		    UVC_COLORIMETRY_BT601_FULL;
+	    } else {
+		tuvc->colorimetry = range ? UVC_COLORIMETRY_BT709_LIMITED :
+		    UVC_COLORIMETRY_BT709_FULL;
+	    }
+	    SelectColorimetry(tuvc);
+	} else {
+	    Tcl_Obj *list[3];
+
+	    cm = tuvc->cm;
+	    list[0] = Tcl_NewBooleanObj(tuvc->colorimetry < 0);
+	    list[1] = Tcl_NewStringObj(
+		((cm == UVC_COLORIMETRY_BT709_FULL) ||
+		 (cm == UVC_COLORIMETRY_BT709_LIMITED)) ? "bt709" : "bt601",
+		-1);
+	    list[2] = Tcl_NewStringObj(
+		((cm == UVC_COLORIMETRY_BT601_LIMITED) ||
+		 (cm == UVC_COLORIMETRY_BT709_LIMITED)) ? "limited" : "full",
+		-1);
+	    Tcl_SetObjResult(interp, Tcl_NewListObj(3, list));
+	}
+	break;
+    }
+
     case CMD_convmode:
 	if (objc != 3 && objc != 4) {
 	    Tcl_WrongNumArgs(interp, 2, objv, "devid ?flag?");
@@ -3247,6 +9461,7 @@ devNotFound:
 	    tuvc->usefmt = k;
 	    tuvc->fps = ufmt->fps;
 	    tuvc->iscomp = ufmt->iscomp;
+	    SelectColorimetry(tuvc);
 	    if ((fps > 0) && (ufmt->fpsList[0] > 0)) {
 		k = 0;
 		while (ufmt->fpsList[k] > fps) {
@@ -3291,19 +9506,56 @@ devNotFound:
 	}
 	break;
 
-    case CMD_image:
-	if ((objc < 3) || (objc > 4)) {
-	    Tcl_WrongNumArgs(interp, 2, objv, "devid ?photoImage?");
+    case CMD_group:
+	ret = GroupCmd(tuvci, interp, objc, objv);
+	break;
+
+    case CMD_image: {
+	int mode = 0;		/* 0 = image, 1 = JPEG, 2 = meta data */
+	Tcl_Obj *varName = NULL, *photoObj = NULL;
+
+	if ((objc == 4) && (strcmp(Tcl_GetString(objv[3]), "-meta") == 0)) {
+	    mode = 2;
+	} else if ((objc > 4) &&
+		   (strcmp(Tcl_GetString(objv[3]), "-meta") == 0)) {
+	    if (objc > 6) {
+		Tcl_WrongNumArgs(interp, 2, objv,
+				 "devid -meta varName ?photoImage?");
+		return TCL_ERROR;
+	    }
+	    varName = objv[4];
+	    photoObj = (objc > 5) ? objv[5] : NULL;
+	} else if ((objc > 3) &&
+		   (strcmp(Tcl_GetString(objv[3]), "-jpeg") == 0)) {
+	    mode = 1;
+	    if ((objc != 4) && ((objc != 6) ||
+		(strcmp(Tcl_GetString(objv[4]), "-file") != 0))) {
+		Tcl_WrongNumArgs(interp, 2, objv, "devid -jpeg ?-file path?");
+		return TCL_ERROR;
+	    }
+	} else if ((objc < 3) || (objc > 4)) {
+	    Tcl_WrongNumArgs(interp, 2, objv,
+			     "devid ?-meta varName? ?photoImage? | "
+			     "devid -jpeg ?-file path? | devid -meta");
 	    return TCL_ERROR;
+	} else if (objc > 3) {
+	    photoObj = objv[3];
 	}
 	hPtr = Tcl_FindHashEntry(&tuvci->tuvcc, Tcl_GetString(objv[2]));
 	if (hPtr != NULL) {
 	    tuvc = (TUVC *) Tcl_GetHashValue(hPtr);
-	    ret = GetImage(tuvci, tuvc, (objc > 3) ? objv[3] : NULL);
+	    if (mode == 2) {
+		ret = GetMeta(tuvc);
+	    } else if (mode == 1) {
+		ret = GetJPEG(tuvc, (objc > 5) ? objv[5] : NULL);
+	    } else {
+		ret = GetImage(tuvci, tuvc, photoObj, varName);
+	    }
 	} else {
 	    goto devNotFound;
 	}
 	break;
+    }
 
     case CMD_info:
 	if (objc > 3) {
@@ -3389,9 +9641,9 @@ devNotFound:
 	break;
 
     case CMD_mbcopy: {
-	int mask0, mask;
+	int mask0;
 	Tcl_Size i, srcLen, dstLen;
-	unsigned char *src, *dst;
+	unsigned char *src, *dst, m[24];
 
 	if (objc != 5) {
 	    Tcl_WrongNumArgs(interp, 2, objv, "bytearray1 bytearray2 mask");
@@ -3406,23 +9658,12 @@ devNotFound:
 	    Tcl_SetResult(interp, "incompatible bytearrays", TCL_STATIC);
 	    return TCL_ERROR;
 	}
-	mask = (mask0 >> 16) & 0xff;	/* red */
-	if (mask != 0) {
-	    for (i = 0; i < srcLen; i += 3) {
-		dst[i] = (dst[i] & (~mask)) | (src[i] & mask);
-	    }
-	}
-	mask = (mask0 >> 8) & 0xff;	/* green */
-	if (mask != 0) {
-	    for (i = 1; i < srcLen; i += 3) {
-		dst[i] = (dst[i] & (~mask)) | (src[i] & mask);
-	    }
-	}
-	mask = mask0 & 0xff;		/* blue */
-	if (mask != 0) {
-	    for (i = 2; i < srcLen; i += 3) {
-		dst[i] = (dst[i] & (~mask)) | (src[i] & mask);
+	if ((mask0 & 0xffffff) != 0) {
+	    /* Red, green, blue mask bytes tiled to 8 pixels. */
+	    for (i = 0; i < 24; i++) {
+		m[i] = mask0 >> (8 * (2 - i % 3));
 	    }
+	    MaskBlend(dst, dst, src, srcLen, m);
 	}
 	break;
     }
@@ -3430,9 +9671,9 @@ devNotFound:
     case CMD_mcopy: {
 	char *name;
 	Tk_PhotoHandle ph1, ph2;
-	int mask0, mask, nops = 0, x, y;
+	int mask0, c, x, y;
 	Tk_PhotoImageBlock block1, block2;
-	unsigned char *src, *dst;
+	unsigned char *src, *dst, mb[4], m[24];
 
 	if (objc != 5) {
 	    Tcl_WrongNumArgs(interp, 2, objv, "photo1 photo2 mask");
@@ -3467,71 +9708,48 @@ devNotFound:
 	    Tcl_SetResult(interp, "incompatible photo images", TCL_STATIC);
 	    return TCL_ERROR;
 	}
-	mask = (mask0 >> 24) & 0xff;	/* alpha */
-	if (mask != 0) {
-	    for (y = 0; y < block1.height; y++) {
-		dst = block1.pixelPtr + y * block1.pitch;
-		src = block2.pixelPtr + y * block2.pitch;
-		dst += block1.offset[3];
-		src += block2.offset[3];
-		for (x = 0; x < block1.width; x++) {
-		    *dst = (*dst & (~mask)) | (*src & mask);
-		    dst += block1.pixelSize;
-		    src += block2.pixelSize;
-		}
-	    }
-	    ++nops;
+	if (mask0 == 0) {
+	    break;
 	}
-	mask = (mask0 >> 16) & 0xff;	/* red */
-	if (mask != 0) {
-	    for (y = 0; y < block1.height; y++) {
-		dst = block1.pixelPtr + y * block1.pitch;
-		src = block2.pixelPtr + y * block2.pitch;
-		dst += block1.offset[0];
-		src += block2.offset[0];
-		for (x = 0; x < block1.width; x++) {
-		    *dst = (*dst & (~mask)) | (*src & mask);
-		    dst += block1.pixelSize;
-		    src += block2.pixelSize;
+	/* Mask bytes in red, green, blue, alpha order of offset[]. */
+	mb[0] = mask0 >> 16;
+	mb[1] = mask0 >> 8;
+	mb[2] = mask0;
+	mb[3] = mask0 >> 24;
+	if ((block1.offset[0] == block2.offset[0]) &&
+	    (block1.offset[1] == block2.offset[1]) &&
+	    (block1.offset[2] == block2.offset[2]) &&
+	    (block1.offset[3] == block2.offset[3])) {
+	    /* Same layout, blend whole rows. */
+	    memset(m, 0, sizeof(m));
+	    for (c = 0; c < 4; c++) {
+		for (x = block1.offset[c] & 3; x < 24; x += 4) {
+		    m[x] = mb[c];
 		}
 	    }
-	    ++nops;
-	}
-	mask = (mask0 >> 8) & 0xff;	/* green */
-	if (mask != 0) {
 	    for (y = 0; y < block1.height; y++) {
 		dst = block1.pixelPtr + y * block1.pitch;
 		src = block2.pixelPtr + y * block2.pitch;
-		dst += block1.offset[1];
-		src += block2.offset[1];
-		for (x = 0; x < block1.width; x++) {
-		    *dst = (*dst & (~mask)) | (*src & mask);
-		    dst += block1.pixelSize;
-		    src += block2.pixelSize;
-		}
+		MaskBlend(dst, dst, src, block1.width * 4, m);
 	    }
-	    ++nops;
-	}
-	mask = mask0 & 0xff;		/* blue */
-	if (mask != 0) {
+	} else {
 	    for (y = 0; y < block1.height; y++) {
 		dst = block1.pixelPtr + y * block1.pitch;
 		src = block2.pixelPtr + y * block2.pitch;
-		dst += block1.offset[2];
-		src += block2.offset[2];
 		for (x = 0; x < block1.width; x++) {
-		    *dst = (*dst & (~mask)) | (*src & mask);
-		    dst += block1.pixelSize;
-		    src += block2.pixelSize;
+		    for (c = 0; c < 4; c++) {
+			unsigned char *d = dst + block1.offset[c];
+
+			*d = (*d & ~mb[c]) | (src[block2.offset[c]] & mb[c]);
+		    }
+		    dst += 4;
+		    src += 4;
 		}
 	    }
-	    ++nops;
-	}
-	if (nops) {
-	    ret = Tk_PhotoPutBlock(interp, ph1, &block1, 0, 0,
-				   block1.width, block1.height,
-				   TK_PHOTO_COMPOSITE_SET);
 	}
+	ret = Tk_PhotoPutBlock(interp, ph1, &block1, 0, 0,
+			       block1.width, block1.height,
+			       TK_PHOTO_COMPOSITE_SET);
 	break;
     }
 
@@ -3564,6 +9782,19 @@ devNotFound:
 	break;
     }
 
+    case CMD_motion:
+	if (objc < 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "devid ?option value ...?");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&tuvci->tuvcc, Tcl_GetString(objv[2]));
+	if (hPtr == NULL) {
+	    goto devNotFound;
+	}
+	tuvc = (TUVC *) Tcl_GetHashValue(hPtr);
+	ret = MotionConfig(tuvc, interp, objc - 3, objv + 3);
+	break;
+
     case CMD_open: {
 	char *devName, *p;
 	uvc_context_t *ctx;
@@ -3628,7 +9859,9 @@ devNotFound:
 	tuvc->width = 640;
 	tuvc->height = 480;
 	tuvc->conv = 1;
+	tuvc->lastseq = -1;
 	tuvc->greyshift = 4;	/* preset for 12 bit sensors */
+	tuvc->colorimetry = -1;	/* from color matching descriptor */
 	tuvc->fps = 30;
 	tuvc->interp = interp;
 	tuvc->tid = NULL;
@@ -3655,8 +9888,12 @@ devNotFound:
 	uvc_free_device_descriptor(desc);
 	InitControls(tuvc);
 	tuvc->rstate = REC_STOP;
-	tuvc->rchan = NULL;
-	Tcl_DStringInit(&tuvc->rbdStr);
+	tuvc->md.threshold = 20;
+	tuvc->srv.maxclients = 16;
+	tuvc->srv.adapt = 1;
+	tuvc->md.minscore = 0.01;
+	tuvc->md.learn = 5;
+	Tcl_DStringInit(&tuvc->md.cmd);
 	Tcl_MutexLock(&tuvc->rmutex);
 	Tcl_MutexUnlock(&tuvc->rmutex);
 	break;
@@ -3723,11 +9960,29 @@ devNotFound:
 	}
 	break;
 
+    case CMD_payloadlog:
+	if ((objc < 3) || (objc > 4)) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "devid ?filename?");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&tuvci->tuvcc, Tcl_GetString(objv[2]));
+	if (hPtr != NULL) {
+	    tuvc = (TUVC *) Tcl_GetHashValue(hPtr);
+	    ret = PayloadLog(tuvc, (objc > 3) ? objv[3] : NULL);
+	} else {
+	    goto devNotFound;
+	}
+	break;
+
     case CMD_record:
 	if (objc < 4) {
 	    Tcl_WrongNumArgs(interp, 2, objv, "devid cmd ...");
 	    return TCL_ERROR;
 	}
+	if ((objc == 4) &&
+	    (strcmp(Tcl_GetString(objv[2]), "repair") == 0)) {
+	    return RepairAVI(interp, objv[3]);
+	}
 	hPtr = Tcl_FindHashEntry(&tuvci->tuvcc, Tcl_GetString(objv[2]));
 	if (hPtr != NULL) {
 	    tuvc = (TUVC *) Tcl_GetHashValue(hPtr);
@@ -3744,6 +9999,11 @@ devNotFound:
 		return TCL_ERROR;
 	    }
 	    break;
+	case REC_add:
+	    if (StartRecording(tuvc, interp, objc, objv, 1) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    break;
 	case REC_pause:
 	    if (objc != 4) {
 		Tcl_WrongNumArgs(interp, 2, objv, "devid pause");
@@ -3760,6 +10020,71 @@ devNotFound:
 		return TCL_ERROR;
 	    }
 	    break;
+	case REC_queue: {
+	    static const char *policies[] = {
+		"dropoldest", "dropnewest", "block"
+	    };
+	    Tcl_Obj *list[10];
+
+	    if (objc != 4) {
+		Tcl_WrongNumArgs(interp, 2, objv, "devid queue");
+		return TCL_ERROR;
+	    }
+	    Tcl_MutexLock(&tuvc->rq.mutex);
+	    list[0] = Tcl_NewStringObj("size", -1);
+	    list[1] = Tcl_NewIntObj(tuvc->rq.size);
+	    list[2] = Tcl_NewStringObj("length", -1);
+	    list[3] = Tcl_NewIntObj(tuvc->rq.count);
+	    list[4] = Tcl_NewStringObj("highwater", -1);
+	    list[5] = Tcl_NewIntObj(tuvc->rq.highwater);
+	    list[6] = Tcl_NewStringObj("dropped", -1);
+	    list[7] = Tcl_NewWideIntObj(tuvc->rq.dropped);
+	    list[8] = Tcl_NewStringObj("overflow", -1);
+	    list[9] = Tcl_NewStringObj(policies[tuvc->rq.policy], -1);
+	    Tcl_MutexUnlock(&tuvc->rq.mutex);
+	    Tcl_SetObjResult(interp, Tcl_NewListObj(10, list));
+	    break;
+	}
+	case REC_remove: {
+	    int i, id;
+	    TSINK *sink = NULL;
+
+	    if (objc != 5) {
+		Tcl_WrongNumArgs(interp, 2, objv, "devid remove sinkid");
+		return TCL_ERROR;
+	    }
+	    if (Tcl_GetIntFromObj(interp, objv[4], &id) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    for (i = 0; i < tuvc->nsinks; i++) {
+		if (tuvc->sinks[i]->id == id) {
+		    break;
+		}
+	    }
+	    if (i >= tuvc->nsinks) {
+		Tcl_SetObjResult(interp,
+		    Tcl_ObjPrintf("sink \"%d\" not found", id));
+		return TCL_ERROR;
+	    }
+	    if (tuvc->nsinks == 1) {
+		/* Last sink, same as stop. */
+		if (tuvc->rstate > REC_STOP) {
+		    tuvc->rstate = REC_STOP;
+		}
+		FinishRecording(tuvc, 1, 0);
+		break;
+	    }
+	    Tcl_MutexLock(&tuvc->rmutex);
+	    sink = tuvc->sinks[i];
+	    tuvc->nsinks--;
+	    for (; i < tuvc->nsinks; i++) {
+		tuvc->sinks[i] = tuvc->sinks[i + 1];
+	    }
+	    tuvc->sinks[tuvc->nsinks] = NULL;
+	    Tcl_MutexUnlock(&tuvc->rmutex);
+	    SinkFinish(sink);
+	    break;
+	}
 	case REC_resume:
 	    if (objc != 4) {
 		Tcl_WrongNumArgs(interp, 2, objv, "devid resume");
@@ -3767,14 +10092,12 @@ devNotFound:
 	    }
 	    if (tuvc->rstate == REC_PAUSEPRI) {
 		if (tuvc->running) {
-		    gettimeofday(&tuvc->ltv, NULL);
-		    tuvc->rtv = tuvc->ltv;
+		    SinkResetTime(tuvc);
 		    tuvc->rstate = REC_RECPRI;
 		}
 	    } else if (tuvc->rstate == REC_PAUSE) {
 		if (tuvc->running) {
-		    gettimeofday(&tuvc->ltv, NULL);
-		    tuvc->rtv = tuvc->ltv;
+		    SinkResetTime(tuvc);
 		    tuvc->rstate = REC_RECORD;
 		}
 	    } else if ((tuvc->rstate != REC_RECPRI) &&
@@ -3785,10 +10108,36 @@ devNotFound:
 	    }
 	    break;
 	case REC_start:
-	    if (StartRecording(tuvc, interp, objc, objv) != TCL_OK) {
+	    if (StartRecording(tuvc, interp, objc, objv, 0) != TCL_OK) {
+		return TCL_ERROR;
+	    }
+	    break;
+	case REC_sinks: {
+	    static const char *formats[] = {
+		"avi", "mkv", "raw", "y4m", "rtp"
+	    };
+	    Tcl_Obj *list = Tcl_NewListObj(0, NULL), *elem[3];
+	    int i;
+
+	    if (objc != 4) {
+		Tcl_WrongNumArgs(interp, 2, objv, "devid sinks");
 		return TCL_ERROR;
 	    }
+	    Tcl_MutexLock(&tuvc->rmutex);
+	    for (i = 0; i < tuvc->nsinks; i++) {
+		TSINK *sink = tuvc->sinks[i];
+
+		elem[0] = Tcl_NewIntObj(sink->id);
+		elem[1] = Tcl_NewStringObj(
+		    (Tcl_DStringLength(&sink->rbdStr) > 0) ? "multipart" :
+		    formats[sink->rfmt], -1);
+		elem[2] = Tcl_NewStringObj(sink->error ? "error" : "ok", -1);
+		Tcl_ListObjAppendElement(NULL, list, Tcl_NewListObj(3, elem));
+	    }
+	    Tcl_MutexUnlock(&tuvc->rmutex);
+	    Tcl_SetObjResult(interp, list);
 	    break;
+	}
 	case REC_state:
 	    if (objc != 4) {
 		Tcl_WrongNumArgs(interp, 2, objv, "devid state");
@@ -3801,7 +10150,11 @@ devNotFound:
 		break;
 	    case REC_RECPRI:
 	    case REC_RECORD:
-		Tcl_SetResult(interp, "recording", TCL_STATIC);
+		if (tuvc->pre.armed) {
+		    Tcl_SetResult(interp, "armed", TCL_STATIC);
+		} else {
+		    Tcl_SetResult(interp, "recording", TCL_STATIC);
+		}
 		break;
 	    case REC_PAUSEPRI:
 	    case REC_PAUSE:
@@ -3822,7 +10175,45 @@ devNotFound:
 	    }
 	    FinishRecording(tuvc, 1, 0);
 	    break;
+	case REC_trigger:
+	    if (objc != 4) {
+		Tcl_WrongNumArgs(interp, 2, objv, "devid trigger");
+		return TCL_ERROR;
+	    }
+	    Tcl_MutexLock(&tuvc->rmutex);
+	    if (tuvc->pre.armed) {
+		tuvc->pre.trigger = 1;
+	    }
+	    Tcl_MutexUnlock(&tuvc->rmutex);
+	    break;
+	}
+	break;
+
+    case CMD_replay:
+	if (objc != 4) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "devid filename");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&tuvci->tuvcc, Tcl_GetString(objv[2]));
+	if (hPtr != NULL) {
+	    tuvc = (TUVC *) Tcl_GetHashValue(hPtr);
+	    ret = Replay(tuvc, objv[3]);
+	} else {
+	    goto devNotFound;
+	}
+	break;
+
+    case CMD_serve:
+	if (objc < 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "devid ?option value ...?");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&tuvci->tuvcc, Tcl_GetString(objv[2]));
+	if (hPtr == NULL) {
+	    goto devNotFound;
 	}
+	tuvc = (TUVC *) Tcl_GetHashValue(hPtr);
+	ret = ServeConfig(tuvc, interp, objc - 3, objv + 3);
 	break;
 
     case CMD_start:
@@ -3855,6 +10246,24 @@ devNotFound:
 	}
 	break;
 
+    case CMD_stats:
+	if (objc != 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "devid");
+	    return TCL_ERROR;
+	}
+	hPtr = Tcl_FindHashEntry(&tuvci->tuvcc, Tcl_GetString(objv[2]));
+	if (hPtr != NULL) {
+	    tuvc = (TUVC *) Tcl_GetHashValue(hPtr);
+	    ret = GetStats(tuvc);
+	} else {
+	    goto devNotFound;
+	}
+	break;
+
+    case CMD_stereo:
+	ret = StereoImage(tuvci, interp, objc, objv);
+	break;
+
     case CMD_stop:
 	if (objc != 3) {
 	    Tcl_WrongNumArgs(interp, 2, objv, "devid");
@@ -3875,6 +10284,10 @@ devNotFound:
 	}
 	break;
 
+    case CMD_trace:
+	ret = TraceCmd(tuvci, interp, objc, objv);
+	break;
+
     }
 
     return ret;
@@ -4103,6 +10516,7 @@ doInit:
     tuvci->ctx = ctx;
     tuvci->enc = Tcl_GetEncoding(NULL, "utf-8");
     Tcl_InitHashTable(&tuvci->tuvcc, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&tuvci->groups, TCL_STRING_KEYS);
 
 #ifdef HAVE_LIBUDEV
     /* setup udev */